@@ -0,0 +1,242 @@
+/**
+ * Connect latency under a chat flood
+ *
+ * Starts ./chat_server, connects a few flooding clients that send chat lines
+ * to the server queue as fast as it takes them, then times joins: from the
+ * CONNECT msgsnd() to the welcome arriving on the new client's queue. Joins
+ * are timed once through the server queue, where clients without a control
+ * queue send CONNECT and have to wait for room behind the flood, and once
+ * through the control queue.
+ *
+ * Run from the directory holding server.key.
+ *
+ * Usage: ./bench_connect [joins] [flooders]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include "chat_protocol.h"
+
+#define MAX_FLOODERS 64
+#define FLOOD_WARMUP_MS 200     /* Let the server queue fill before timing */
+#define WELCOME_TIMEOUT_MS 10000
+
+static int server_queue_id;
+static int control_queue_id;
+static atomic_int flooding = 1;
+static atomic_long flooded = 0;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Send CONNECT for username to via_queue and wait for the welcome on a
+ * fresh queue. Returns the queue and the latency in ms, or -1. */
+static int join(const char *username, int via_queue, double *latency_ms) {
+    int queue_id = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+    if (queue_id == -1) {
+        perror("msgget");
+        return -1;
+    }
+
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.mtype = MSG_TYPE_CONNECT;
+    snprintf(msg.username, MAX_USERNAME, "%s", username);
+    snprintf(msg.content, MSG_SIZE, "%d %d", queue_id, getpid());
+    msg.timestamp = time(NULL);
+
+    double start = now_ms();
+    while (msgsnd(via_queue, &msg, FIXED_MSG_BYTES, 0) == -1) {
+        if (errno != EINTR) {
+            perror("msgsnd connect");
+            msgctl(queue_id, IPC_RMID, NULL);
+            return -1;
+        }
+    }
+
+    /* Only the welcome counts; broadcasts may already be arriving */
+    Message reply;
+    double sent = now_ms();
+    while (msgrcv(queue_id, &reply, FIXED_MSG_BYTES, MSG_TYPE_ACK, IPC_NOWAIT) == -1) {
+        if (now_ms() - sent > WELCOME_TIMEOUT_MS) {
+            fprintf(stderr, "No welcome for %s\n", username);
+            msgctl(queue_id, IPC_RMID, NULL);
+            return -1;
+        }
+        usleep(50);
+    }
+    *latency_ms = now_ms() - start;
+    return queue_id;
+}
+
+/* Leave without waiting for room on the server queue. If the DISCONNECT
+ * does not fit, the server drops the client once its queue is gone. */
+static void leave(const char *username, int queue_id) {
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.mtype = MSG_TYPE_DISCONNECT;
+    snprintf(msg.username, MAX_USERNAME, "%s", username);
+    msg.timestamp = time(NULL);
+    msgsnd(server_queue_id, &msg, FIXED_MSG_BYTES, IPC_NOWAIT);
+    msgctl(queue_id, IPC_RMID, NULL);
+}
+
+static void *flooder(void *arg) {
+    const char *username = (const char *)arg;
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.mtype = MSG_TYPE_CHAT;
+    snprintf(msg.username, MAX_USERNAME, "%s", username);
+
+    for (long n = 0; atomic_load(&flooding); n++) {
+        snprintf(msg.content, MSG_SIZE, "flood line %ld", n);
+        msg.timestamp = time(NULL);
+        if (msgsnd(server_queue_id, &msg, FIXED_MSG_BYTES, 0) == 0) {
+            atomic_fetch_add(&flooded, 1);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Time 'joins' joins through via_queue and print their latency spread */
+static int run_round(const char *label, const char *prefix, int via_queue, int joins) {
+    double *latency = malloc(sizeof(double) * joins);
+    if (latency == NULL) {
+        return -1;
+    }
+
+    long flooded_before = atomic_load(&flooded);
+    double start = now_ms();
+    for (int i = 0; i < joins; i++) {
+        char username[MAX_USERNAME];
+        snprintf(username, sizeof(username), "%s%d", prefix, i);
+        int queue_id = join(username, via_queue, &latency[i]);
+        if (queue_id == -1) {
+            free(latency);
+            return -1;
+        }
+        leave(username, queue_id);
+    }
+    double elapsed = now_ms() - start;
+    double flood_rate = (atomic_load(&flooded) - flooded_before) / (elapsed / 1e3);
+
+    qsort(latency, joins, sizeof(double), compare_doubles);
+    printf("%-14s %9.3f %9.3f %9.3f %9.3f %14.0f\n", label, latency[0], latency[joins / 2],
+           latency[(int)(joins * 0.99)], latency[joins - 1], flood_rate);
+    fflush(stdout);
+    free(latency);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int joins = argc > 1 ? atoi(argv[1]) : 100;
+    int flooders = argc > 2 ? atoi(argv[2]) : 16;
+
+    if (joins < 1 || flooders < 1 || flooders > MAX_FLOODERS) {
+        fprintf(stderr, "Usage: %s [joins] [flooders<=%d]\n", argv[0], MAX_FLOODERS);
+        return 1;
+    }
+
+    key_t server_key = ftok("server.key", 'S');
+    key_t control_key = ftok("server.key", CONTROL_QUEUE_PROJ);
+    if (server_key == -1 || control_key == -1) {
+        perror("ftok server.key (run make setup)");
+        return 1;
+    }
+
+    /* A leftover control queue would look like the server is up */
+    msgctl(msgget(control_key, 0666), IPC_RMID, NULL);
+
+    /* The server runs until its stdin closes; its chatter goes nowhere */
+    int command_pipe[2];
+    if (pipe(command_pipe) == -1) {
+        perror("pipe");
+        return 1;
+    }
+    pid_t server_pid = fork();
+    if (server_pid == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (server_pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(command_pipe[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        close(command_pipe[0]);
+        close(command_pipe[1]);
+        execl("./chat_server", "chat_server", "-H", "0", (char *)NULL);
+        perror("exec ./chat_server");
+        _exit(1);
+    }
+    close(command_pipe[0]);
+
+    double deadline = now_ms() + 5000;
+    while ((control_queue_id = msgget(control_key, 0666)) == -1) {
+        if (now_ms() > deadline || waitpid(server_pid, NULL, WNOHANG) != 0) {
+            fprintf(stderr, "Server did not start\n");
+            return 1;
+        }
+        usleep(1000);
+    }
+    server_queue_id = msgget(server_key, 0666);
+
+    /* Flooders join first, while the server queue is still quiet */
+    static char names[MAX_FLOODERS][MAX_USERNAME];
+    int flood_queues[MAX_FLOODERS];
+    pthread_t threads[MAX_FLOODERS];
+    for (int i = 0; i < flooders; i++) {
+        double ignored;
+        snprintf(names[i], MAX_USERNAME, "flood%d", i);
+        flood_queues[i] = join(names[i], server_queue_id, &ignored);
+        if (flood_queues[i] == -1) {
+            kill(server_pid, SIGTERM);
+            return 1;
+        }
+    }
+    for (int i = 0; i < flooders; i++) {
+        pthread_create(&threads[i], NULL, flooder, names[i]);
+    }
+    usleep(FLOOD_WARMUP_MS * 1000);
+
+    printf("=== Connect latency benchmark ===\n");
+    printf("%d joins per lane, %d flooding client(s)\n\n", joins, flooders);
+    printf("%-14s %9s %9s %9s %9s %14s\n", "CONNECT via", "min ms", "p50 ms", "p99 ms", "max ms",
+           "chat msgs/sec");
+    fflush(stdout);
+
+    int failed = run_round("server queue", "late", server_queue_id, joins) != 0 ||
+                 run_round("control queue", "quick", control_queue_id, joins) != 0;
+
+    atomic_store(&flooding, 0);
+    for (int i = 0; i < flooders; i++) {
+        leave(names[i], flood_queues[i]);
+    }
+    /* Senders blocked on a full queue return once the server is gone */
+    close(command_pipe[1]);
+    waitpid(server_pid, NULL, 0);
+    for (int i = 0; i < flooders; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return failed;
+}
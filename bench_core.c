@@ -0,0 +1,389 @@
+/**
+ * Server hot-path microbenchmarks
+ *
+ * Runs the functions every chat line goes through, straight from
+ * chat_core.c, in this process: no server, no receiver thread and no
+ * dispatch pool, just private client queues, an in-memory log ring and
+ * the registry.
+ *
+ *   registry_find  - username lookup under the read lock, hit and miss,
+ *                    by client count
+ *   broadcast      - broadcast_message() to every client, by client count
+ *                    and message size
+ *   handle_message - one CHAT line end to end: rate limit, history, log
+ *                    append and fan-out to everyone but the sender
+ *   add_to_log     - formatting and appending, by message size and how
+ *                    much of the ring is waiting for the log writer; at
+ *                    100% every entry is dropped. The wrap rows use a ring
+ *                    two and a half records long, so every other append
+ *                    runs off the end and all of them reclaim space.
+ *
+ * Each row reports ns/op and allocations/op: malloc(), calloc() and
+ * realloc() calls made from the chat code (the bench is linked with
+ * --wrap for them; the C library's own allocations are not counted).
+ * Clients are compact and sequenced, like chat_client. Their queues are
+ * drained between rounds, outside the timed part, so nothing is spooled.
+ * The log writer thread is not run: each case moves the ring's flushed
+ * mark itself, the way the writer would.
+ *
+ * Server chatter on stdout goes to /dev/null; results go to the original
+ * stdout.
+ *
+ * Usage: ./bench_core [ops] [max_clients]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include "chat_core.h"
+#include "chat_format.h"
+
+#define MAX_BENCH_CLIENTS 4096
+#define MAX_SIZES 3
+
+static FILE *out;
+static int queues[MAX_BENCH_CLIENTS];
+static int num_clients = 0;
+static int round_ops = 16;        /* Broadcasts that fit in a client queue */
+static atomic_ulong allocations = 0;
+
+/* Allocation counting, see the Makefile's --wrap flags */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+static void print_row(const char *name, const char *params, long ops, int64_t ns,
+                      unsigned long allocs) {
+    fprintf(out, "%-16s %-26s %10ld %12.1f %10.2f\n", name, params, ops, (double)ns / ops,
+            (double)allocs / ops);
+    fflush(out);
+}
+
+/* Register a client the way add_client() does, minus the welcome, the
+ * history replay and the join announcement */
+static int connect_client(const char *username) {
+    int queue_id = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+    if (queue_id == -1) {
+        perror("msgget");
+        return -1;
+    }
+    ClientSpool *spool = spool_create(&spool_pool, spool_bytes, spool_policy);
+
+    pthread_rwlock_wrlock(&registry.lock);
+    int id = registry_add(&registry, username, queue_id, getpid());
+    if (id >= 0) {
+        Client *client = &registry.slots[id];
+        client->pidfd = -1;
+        client->ring_reader = 0;
+        client->compact = 1;
+        client->sequenced = 1;
+        client->traced = 0;
+        client->spool = spool;
+        ratelimit_init(&client->bucket, &rate_limit, monotonic_ns());
+        stats_client_add(stats, id, queue_id, getpid(), username);
+    }
+    pthread_rwlock_unlock(&registry.lock);
+
+    if (id < 0 || spool == NULL) {
+        fprintf(stderr, "Could not register %s\n", username);
+        msgctl(queue_id, IPC_RMID, NULL);
+        return -1;
+    }
+    queues[num_clients++] = queue_id;
+    return 0;
+}
+
+/* Grow or shrink the registry to exactly count clients named user0.. */
+static int set_clients(int count) {
+    char username[MAX_USERNAME];
+    while (num_clients < count) {
+        snprintf(username, sizeof(username), "user%d", num_clients);
+        if (connect_client(username) != 0) {
+            return -1;
+        }
+    }
+    while (num_clients > count) {
+        snprintf(username, sizeof(username), "user%d", --num_clients);
+        pthread_rwlock_wrlock(&registry.lock);
+        int id = registry_find(&registry, username);
+        release_client_locked(id);
+        pthread_rwlock_unlock(&registry.lock);
+        msgctl(queues[num_clients], IPC_RMID, NULL);
+    }
+    return 0;
+}
+
+/* Empty every client queue; not timed */
+static void drain_queues() {
+    WireBuffer buf;
+    for (int i = 0; i < num_clients; i++) {
+        while (msgrcv(queues[i], &buf, WIRE_MAX_BYTES, 0, IPC_NOWAIT) != -1) {
+        }
+    }
+}
+
+/* The log writer keeping up: everything appended so far is on disk */
+static void flush_all(LogBuffer *log) {
+    atomic_store_explicit(&log->flushed, atomic_load_explicit(&log->tail, memory_order_relaxed),
+                          memory_order_release);
+}
+
+/* Ring space one add_to_log() of make_chat()'s message takes */
+static uint32_t log_record_for(int size) {
+    char entry[MAX_USERNAME + MSG_SIZE + 64];
+    return log_record_size(format_log_entry(entry, sizeof(entry), time(NULL), "user0", "") +
+                           (size_t)size);
+}
+
+static void make_chat(Message *msg, const char *username, int size) {
+    memset(msg, 0, sizeof(*msg));
+    msg->mtype = MSG_TYPE_CHAT;
+    snprintf(msg->username, MAX_USERNAME, "%s", username);
+    memset(msg->content, 'x', (size_t)size);
+    msg->content[size] = '\0';
+    msg->timestamp = time(NULL);
+}
+
+static void bench_lookup(long ops) {
+    char (*names)[MAX_USERNAME] = malloc(sizeof(*names) * num_clients);
+    char missing[MAX_USERNAME];
+    char params[64];
+    long found = 0;
+
+    for (int i = 0; i < num_clients; i++) {
+        snprintf(names[i], MAX_USERNAME, "user%d", i);
+    }
+    snprintf(missing, sizeof(missing), "nobody");
+
+    for (int miss = 0; miss <= 1; miss++) {
+        unsigned long allocs = atomic_load(&allocations);
+        int64_t start = monotonic_ns();
+        pthread_rwlock_rdlock(&registry.lock);
+        for (long i = 0; i < ops; i++) {
+            found += registry_find(&registry, miss ? missing : names[i % num_clients]) != -1;
+        }
+        pthread_rwlock_unlock(&registry.lock);
+        int64_t elapsed = monotonic_ns() - start;
+        snprintf(params, sizeof(params), "%d clients, %s", num_clients, miss ? "miss" : "hit");
+        print_row("registry_find", params, ops, elapsed, atomic_load(&allocations) - allocs);
+    }
+
+    free(names);
+    if (found != ops) {
+        fprintf(stderr, "registry_find found %ld of %ld\n", found, ops);
+    }
+}
+
+/* Fan-out rows run whole rounds */
+static long rounded_ops(long ops) {
+    return (ops + round_ops - 1) / round_ops * round_ops;
+}
+
+/* Fan-out in rounds that fit in the client queues */
+static void bench_broadcast(long ops, int size) {
+    Message msg;
+    char params[64];
+    int64_t elapsed = 0;
+    unsigned long allocs = 0;
+
+    make_chat(&msg, "sender", size);
+    for (long done = 0; done < ops; done += round_ops) {
+        unsigned long before = atomic_load(&allocations);
+        int64_t start = monotonic_ns();
+        for (int i = 0; i < round_ops; i++) {
+            msg.seq = done + i + 1;
+            broadcast_message(&msg, -1);
+        }
+        elapsed += monotonic_ns() - start;
+        allocs += atomic_load(&allocations) - before;
+        drain_queues();
+    }
+    snprintf(params, sizeof(params), "%d clients, %d bytes", num_clients, size);
+    print_row("broadcast", params, rounded_ops(ops), elapsed, allocs);
+}
+
+static void bench_handle(long ops, int size) {
+    Message msg;
+    char params[64];
+    int64_t elapsed = 0;
+    unsigned long allocs = 0;
+
+    make_chat(&msg, "user0", size);
+    for (long done = 0; done < ops; done += round_ops) {
+        unsigned long before = atomic_load(&allocations);
+        int64_t start = monotonic_ns();
+        for (int i = 0; i < round_ops; i++) {
+            handle_message(&msg);
+            flush_all(log_buffer);
+        }
+        elapsed += monotonic_ns() - start;
+        allocs += atomic_load(&allocations) - before;
+        drain_queues();
+    }
+    snprintf(params, sizeof(params), "%d clients, %d bytes", num_clients, size);
+    print_row("handle_message", params, rounded_ops(ops), elapsed, allocs);
+}
+
+/*
+ * add_to_log() on a ring of ring_bytes with backlog_pct of it waiting for
+ * the writer: after each append the flushed mark is moved to that far
+ * behind tail, at a record boundary. A full lap is appended first so head
+ * is reclaiming space throughout.
+ */
+static void bench_log_append(long ops, int size, size_t ring_bytes, int backlog_pct,
+                             const char *label) {
+    LogBuffer *log = malloc(sizeof(LogBuffer) + ring_bytes);
+    LogBuffer *saved = log_buffer;
+    Message msg;
+    char params[64];
+    uint64_t end = 0;
+
+    log_init(log, ring_bytes, 0);
+    log_buffer = log;
+    log_writer.log = log;
+    make_chat(&msg, "user0", size);
+
+    /* Every record is the same size, so the backlog is a record count */
+    uint32_t record = log_record_for(size);
+    long lag = backlog_pct >= 100 ? -1 : (long)(ring_bytes / 100 * backlog_pct / record);
+    uint64_t *ends = calloc((size_t)(lag > 0 ? lag : 0) + 1, sizeof(*ends));
+    long warmup = 2 * (long)(ring_bytes / record) + 2;
+
+    unsigned long allocs = 0;
+    int64_t start = 0;
+    for (long i = 0; i < warmup + ops; i++) {
+        if (i == warmup) {
+            allocs = atomic_load(&allocations);
+            start = monotonic_ns();
+        }
+        end = add_to_log(&msg);
+        if (lag >= 0) {
+            ends[i % (lag + 1)] = end;
+            if (i >= lag) {
+                atomic_store_explicit(&log->flushed, ends[(i - lag) % (lag + 1)],
+                                      memory_order_release);
+            }
+        }
+    }
+    int64_t elapsed = monotonic_ns() - start;
+    allocs = atomic_load(&allocations) - allocs;
+
+    if (label) {
+        snprintf(params, sizeof(params), "%d bytes, %s", size, label);
+    } else {
+        snprintf(params, sizeof(params), "%d bytes, %d%% unflushed", size, backlog_pct);
+    }
+    print_row("add_to_log", params, ops, elapsed, allocs);
+
+    log_buffer = saved;
+    log_writer.log = saved;
+    free(ends);
+    free(log);
+}
+
+int main(int argc, char *argv[]) {
+    long ops = argc > 1 ? atol(argv[1]) : 200000;
+    int max_clients = argc > 2 ? atoi(argv[2]) : 1024;
+    const int sizes[MAX_SIZES] = {16, 128, MSG_SIZE - 1};
+
+    if (ops < 1 || max_clients < 1 || max_clients > MAX_BENCH_CLIENTS) {
+        fprintf(stderr, "Usage: %s [ops] [max_clients<=%d]\n", argv[0], MAX_BENCH_CLIENTS);
+        return 1;
+    }
+
+    /* Keep our results, send handle_message()'s chatter nowhere */
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("redirect stdout");
+        return 1;
+    }
+
+    /* The state initialize_server() would set up, without the IPC */
+    stats = calloc(1, sizeof(ServerStats));
+    log_buffer = malloc(sizeof(LogBuffer) + LOG_SIZE);
+    if (stats == NULL || log_buffer == NULL ||
+        registry_init(&registry, 16, MAX_BENCH_CLIENTS) != 0 ||
+        history_init(&history, DEFAULT_HISTORY_SLOTS, 1) != 0) {
+        fprintf(stderr, "Setup failed\n");
+        return 1;
+    }
+    for (int i = 0; i < STATS_MAX_CLIENTS; i++) {
+        stats->clients[i].queue_id = -1;
+    }
+    spool_pool_init(&spool_pool, &stats->spool);
+    log_init(log_buffer, LOG_SIZE, 0);
+    memset(&log_writer, 0, sizeof(log_writer));
+    log_writer.log = log_buffer;
+    log_writer.durability = LOG_DURABILITY_NONE;
+    log_writer.batch_bytes = SIZE_MAX;  /* Never wake a writer that is not there */
+
+    /* Size fan-out rounds from the first queue's capacity */
+    if (set_clients(1) != 0) {
+        return 1;
+    }
+    struct msqid_ds info;
+    if (msgctl(queues[0], IPC_STAT, &info) == 0) {
+        round_ops = (int)(info.msg_qbytes / 2 / sizeof(WireMessage));
+        round_ops = round_ops < 1 ? 1 : round_ops;
+    }
+
+    fprintf(out, "=== Server hot-path benchmark ===\n");
+    fprintf(out, "%ld ops per row (fan-out rows: ops / clients, at least %d), up to %d clients\n\n",
+            ops, round_ops, max_clients);
+    fprintf(out, "%-16s %-26s %10s %12s %10s\n", "function", "case", "ops", "ns/op", "allocs/op");
+
+    int failed = 0;
+    for (int clients = 1; clients <= max_clients && !failed; clients *= 4) {
+        failed = set_clients(clients) != 0;
+        if (!failed) {
+            bench_lookup(ops);
+        }
+    }
+    for (int clients = 1; clients <= max_clients && !failed; clients *= 4) {
+        failed = set_clients(clients) != 0;
+        long fanout_ops = ops / clients > round_ops ? ops / clients : round_ops;
+        for (int s = 0; s < MAX_SIZES && !failed; s++) {
+            bench_broadcast(fanout_ops, sizes[s]);
+        }
+        for (int s = 0; s < MAX_SIZES && !failed; s++) {
+            bench_handle(fanout_ops, sizes[s]);
+        }
+    }
+    for (int s = 0; s < MAX_SIZES && !failed; s++) {
+        const int levels[] = {0, 50, 90, 100};
+        for (int l = 0; l < 4; l++) {
+            bench_log_append(ops, sizes[s], LOG_SIZE, levels[l], NULL);
+        }
+        /* Two and a half records: appends alternate between wrapping and not */
+        bench_log_append(ops, sizes[s], (size_t)log_record_for(sizes[s]) * 5 / 2, 0,
+                         "wrap every 2nd");
+    }
+
+    set_clients(0);
+    if (stats->spool.queued > 0) {
+        fprintf(out, "\n%llu message(s) were spooled; the fan-out rows include spooling\n",
+                (unsigned long long)stats->spool.queued);
+    }
+    return failed;
+}
@@ -0,0 +1,155 @@
+/**
+ * Dispatch pool throughput benchmark
+ *
+ * Feeds synthetic chat messages from a single producer thread (playing the
+ * role of the server's receiver thread) into the sharded dispatch pool and
+ * measures messages per second for 1..N workers. The handler does the same
+ * kind of work as handle_message(): format a timestamped log line and copy
+ * the message once per simulated recipient. It also checks that every
+ * sender's messages are handled in the order they were submitted.
+ *
+ * Usage: ./bench_dispatch [max_workers] [messages] [senders] [recipients]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "chat_dispatch.h"
+
+#define MAX_USERNAME 32
+#define MSG_SIZE 256
+#define MAX_SENDERS 4096
+
+typedef struct {
+    long mtype;
+    char username[MAX_USERNAME];
+    char content[MSG_SIZE];
+    time_t timestamp;
+    int sender;
+    long seq;
+} BenchMessage;
+
+typedef struct {
+    int recipients;
+    long last_seq[MAX_SENDERS];  /* Only touched by the sender's own worker */
+    long out_of_order;           /* Summed after the pool is joined */
+    pthread_mutex_t mutex;
+} BenchContext;
+
+/* Simulated handle_message(): log formatting plus fan-out copies */
+static void bench_handler(void *item, void *ctx) {
+    BenchMessage *msg = (BenchMessage *)item;
+    BenchContext *bench = (BenchContext *)ctx;
+    char log_entry[MAX_USERNAME + MSG_SIZE + 64];
+    BenchMessage copy;
+    struct tm timeinfo;
+
+    if (msg->seq != bench->last_seq[msg->sender] + 1) {
+        pthread_mutex_lock(&bench->mutex);
+        bench->out_of_order++;
+        pthread_mutex_unlock(&bench->mutex);
+    }
+    bench->last_seq[msg->sender] = msg->seq;
+
+    localtime_r(&msg->timestamp, &timeinfo);
+    snprintf(log_entry, sizeof(log_entry), "[%02d:%02d:%02d] <%s>: %s\n",
+             timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec,
+             msg->username, msg->content);
+
+    for (int i = 0; i < bench->recipients; i++) {
+        memcpy(&copy, msg, sizeof(copy));
+        __asm__ __volatile__("" : : "r"(&copy) : "memory");  /* Keep the copy */
+    }
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run one configuration and return messages per second */
+static double run_round(int workers, long messages, int senders, int recipients, long *out_of_order) {
+    static BenchContext bench;
+    DispatchPool pool;
+    BenchMessage msg;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.recipients = recipients;
+    pthread_mutex_init(&bench.mutex, NULL);
+
+    if (dispatch_pool_init(&pool, workers, sizeof(BenchMessage), bench_handler, &bench) != 0) {
+        exit(1);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.mtype = 3;
+    memset(msg.content, 'x', 64);
+    msg.timestamp = time(NULL);
+
+    unsigned int keys[MAX_SENDERS];
+    long next_seq[MAX_SENDERS];
+    for (int s = 0; s < senders; s++) {
+        snprintf(msg.username, MAX_USERNAME, "user%d", s);
+        keys[s] = dispatch_hash(msg.username);
+        next_seq[s] = 1;
+    }
+
+    double start = now_seconds();
+    for (long i = 0; i < messages; i++) {
+        int s = (int)(i % senders);
+        snprintf(msg.username, MAX_USERNAME, "user%d", s);
+        msg.sender = s;
+        msg.seq = next_seq[s]++;
+        dispatch_submit(&pool, keys[s], &msg);
+    }
+    dispatch_pool_shutdown(&pool);
+    double elapsed = now_seconds() - start;
+
+    *out_of_order = bench.out_of_order;
+    pthread_mutex_destroy(&bench.mutex);
+    return messages / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_workers = argc > 1 ? atoi(argv[1]) : (cpus > 0 ? (int)cpus : 1);
+    long messages = argc > 2 ? atol(argv[2]) : 200000;
+    int senders = argc > 3 ? atoi(argv[3]) : 64;
+    int recipients = argc > 4 ? atoi(argv[4]) : 10;
+
+    if (max_workers < 1 || max_workers > DISPATCH_MAX_WORKERS ||
+        senders < 1 || senders > MAX_SENDERS || messages < 1 || recipients < 0) {
+        fprintf(stderr, "Usage: %s [max_workers<=%d] [messages] [senders<=%d] [recipients]\n",
+                argv[0], DISPATCH_MAX_WORKERS, MAX_SENDERS);
+        return 1;
+    }
+
+    printf("=== Dispatch pool benchmark ===\n");
+    printf("%ld messages, %d senders, %d recipients, %ld online CPUs\n\n",
+           messages, senders, recipients, cpus);
+    printf("%8s %14s %9s %13s\n", "workers", "msgs/sec", "speedup", "out-of-order");
+
+    double base = 0;
+    int failed = 0;
+    for (int w = 1; w <= max_workers; w++) {
+        long out_of_order = 0;
+        double rate = run_round(w, messages, senders, recipients, &out_of_order);
+        if (w == 1) {
+            base = rate;
+        }
+        printf("%8d %14.0f %8.2fx %13ld\n", w, rate, rate / base, out_of_order);
+        if (out_of_order != 0) {
+            failed = 1;
+        }
+    }
+
+    if (failed) {
+        printf("\nPer-sender ordering was violated!\n");
+        return 1;
+    }
+    return 0;
+}
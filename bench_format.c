@@ -0,0 +1,78 @@
+/**
+ * Log line formatting microbenchmark
+ *
+ * Compares the per-message cost of building a log line the old way
+ * (localtime() plus sprintf(), as add_to_log() and the client's receiver
+ * did) with the per-thread cached timestamp and hand-written formatter from
+ * chat_format.c. Timestamps advance one second every 'per_second' messages
+ * to mimic a busy server.
+ *
+ * Usage: ./bench_format [messages] [per_second]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat_protocol.h"
+#include "chat_format.h"
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t format_old(char *buf, time_t t, const char *username, const char *content) {
+    struct tm *timeinfo = localtime(&t);
+    return sprintf(buf, "[%02d:%02d:%02d] <%s>: %s\n",
+                   timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec, username, content);
+}
+
+static size_t format_new(char *buf, time_t t, const char *username, const char *content) {
+    return format_log_entry(buf, MAX_USERNAME + MSG_SIZE + 64, t, username, content);
+}
+
+/* Returns ns per message; checksum keeps the output live */
+static double run(size_t (*format)(char *, time_t, const char *, const char *),
+                  long messages, long per_second, unsigned long *checksum) {
+    char entry[MAX_USERNAME + MSG_SIZE + 64];
+    const char *content = "the quick brown fox jumps over the lazy dog";
+    time_t base = time(NULL);
+
+    double start = now_seconds();
+    for (long i = 0; i < messages; i++) {
+        size_t len = format(entry, base + i / per_second, "alice", content);
+        *checksum += len + (unsigned char)entry[8];
+    }
+    return (now_seconds() - start) * 1e9 / messages;
+}
+
+int main(int argc, char *argv[]) {
+    long messages = argc > 1 ? atol(argv[1]) : 2000000;
+    long per_second = argc > 2 ? atol(argv[2]) : 1000;
+    unsigned long checksum = 0;
+
+    if (messages < 1 || per_second < 1) {
+        fprintf(stderr, "Usage: %s [messages] [per_second]\n", argv[0]);
+        return 1;
+    }
+
+    /* Same output from both, or the comparison means nothing */
+    char a[MAX_USERNAME + MSG_SIZE + 64], b[MAX_USERNAME + MSG_SIZE + 64];
+    format_old(a, time(NULL), "alice", "check");
+    format_new(b, time(NULL), "alice", "check");
+    if (strcmp(a, b) != 0) {
+        fprintf(stderr, "Formatters disagree:\n  %s  %s", a, b);
+        return 1;
+    }
+
+    printf("=== Log line formatting benchmark ===\n");
+    printf("%ld messages, %ld per second of timestamps\n\n", messages, per_second);
+    double old_ns = run(format_old, messages, per_second, &checksum);
+    double new_ns = run(format_new, messages, per_second, &checksum);
+    printf("%-28s %8.1f ns/message\n", "localtime + sprintf", old_ns);
+    printf("%-28s %8.1f ns/message\n", "cached timestamp + manual", new_ns);
+    printf("%-28s %8.2fx\n", "speedup", old_ns / new_ns);
+    return checksum == 0;
+}
@@ -0,0 +1,474 @@
+/**
+ * Multi-client load generator
+ *
+ * Connects N simulated clients to a chat_server with the real protocol
+ * (CONNECT on the control queue, compact CHAT lines on the server queue,
+ * DISCONNECT at the end), has every client send lines of a given size at a
+ * fixed rate, and times every delivery to every other client.
+ *
+ * Latency is measured from when each line was due to be sent, not from
+ * when the sender managed to send it. A sender held up by a full server
+ * queue sends late, and those lines carry the wait in their latency
+ * instead of quietly lowering the offered load (coordinated omission). The
+ * naive send-to-receive figures are printed alongside for comparison.
+ *
+ * Every line carries its sender, number and both times in its text, read
+ * with CLOCK_MONOTONIC, which all processes on the host share.
+ *
+ * Run from the directory holding server.key, against a running server, or
+ * with -S to start ./chat_server for the run.
+ *
+ * Usage: ./bench_load [-c clients] [-r msgs_per_s] [-s bytes] [-d seconds] [-S]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "chat_protocol.h"
+
+#define MAX_CLIENTS 256
+#define DRAIN_MS 2000                 /* How long to wait for stragglers after sending stops */
+#define WELCOME_TIMEOUT_MS 5000
+#define SPIN_NS 30000                 /* Spun rather than slept before a line is due */
+
+/* Log-linear histogram: exact below 128 ns, then 128 buckets per power of
+ * two, so every value is within 1% of its bucket */
+#define SUB_BITS 7
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct {
+    int index;
+    char username[MAX_USERNAME];
+    int queue_id;
+    pthread_t sender;
+    pthread_t receiver;
+    uint64_t sent;
+    uint64_t send_waits;              /* Lines sent more than an interval late */
+    _Atomic uint64_t received;
+    Histogram corrected;              /* From the due time */
+    Histogram naive;                  /* From the actual send */
+} LoadClient;
+
+static int server_queue_id;
+static int connect_queue_id;
+static int num_clients = 8;
+static int rate = 100;
+static int line_bytes = 64;
+static int duration_s = 5;
+static LoadClient *clients;
+static int64_t start_ns;
+static atomic_int sending = 1;
+static atomic_int receiving = 1;
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Sleep until shortly before when_ns and spin the rest, so waking up late
+ * does not count as server latency */
+static void sleep_until(int64_t when_ns) {
+    int64_t wake_ns = when_ns - SPIN_NS;
+    struct timespec ts = { wake_ns / 1000000000LL, wake_ns % 1000000000LL };
+    while (now_ns() < wake_ns &&
+           clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+    while (now_ns() < when_ns) {
+    }
+}
+
+static int bucket_of(uint64_t value) {
+    if (value < SUB_COUNT) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return (shift + 1) * SUB_COUNT + (int)((value >> shift) - SUB_COUNT);
+}
+
+/* Largest value that lands in bucket b */
+static uint64_t bucket_top(int b) {
+    if (b < SUB_COUNT) {
+        return (uint64_t)b;
+    }
+    int shift = b / SUB_COUNT - 1;
+    uint64_t top = SUB_COUNT + (uint64_t)(b % SUB_COUNT);
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_record(Histogram *hist, int64_t ns) {
+    uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+    hist->buckets[bucket_of(value)]++;
+    hist->count++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+static void hist_merge(Histogram *into, const Histogram *from) {
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        into->buckets[b] += from->buckets[b];
+    }
+    into->count += from->count;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static uint64_t hist_percentile(const Histogram *hist, double q) {
+    uint64_t wanted = (uint64_t)(q * hist->count);
+    if (wanted < q * hist->count || wanted < 1) {
+        wanted++;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= wanted) {
+            uint64_t top = bucket_top(b);
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/* Connect one client and wait for its welcome */
+static int join(LoadClient *client) {
+    client->queue_id = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+    if (client->queue_id == -1) {
+        perror("msgget");
+        return -1;
+    }
+
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.mtype = MSG_TYPE_CONNECT;
+    snprintf(msg.username, MAX_USERNAME, "%s", client->username);
+    snprintf(msg.content, MSG_SIZE, "%d %d compact", client->queue_id, getpid());
+    msg.timestamp = time(NULL);
+    if (msgsnd(connect_queue_id, &msg, FIXED_MSG_BYTES, 0) == -1) {
+        perror("msgsnd connect");
+        msgctl(client->queue_id, IPC_RMID, NULL);
+        return -1;
+    }
+
+    WireBuffer buf;
+    ssize_t got;
+    int64_t deadline = now_ns() + WELCOME_TIMEOUT_MS * 1000000LL;
+    while ((got = msgrcv(client->queue_id, &buf, WIRE_MAX_BYTES, MSG_TYPE_ACK, IPC_NOWAIT)) == -1) {
+        if (now_ns() > deadline) {
+            fprintf(stderr, "No welcome for %s\n", client->username);
+            msgctl(client->queue_id, IPC_RMID, NULL);
+            return -1;
+        }
+        usleep(100);
+    }
+    Message welcome;
+    if (wire_decode(&buf, (size_t)got, &welcome) != -1 &&
+        strncmp(welcome.content, "Welcome", 7) != 0) {
+        fprintf(stderr, "%s was turned away: %s\n", client->username, welcome.content);
+        msgctl(client->queue_id, IPC_RMID, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+static void leave(LoadClient *client) {
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.mtype = MSG_TYPE_DISCONNECT;
+    snprintf(msg.username, MAX_USERNAME, "%s", client->username);
+    snprintf(msg.content, MSG_SIZE, "%d", client->queue_id);
+    msg.timestamp = time(NULL);
+    msgsnd(server_queue_id, &msg, FIXED_MSG_BYTES, IPC_NOWAIT);
+    msgctl(client->queue_id, IPC_RMID, NULL);
+}
+
+/* Send rate lines per second on a fixed schedule. Line n is due at
+ * start + n / rate whether or not line n - 1 went out on time. */
+static void *sender(void *arg) {
+    LoadClient *client = (LoadClient *)arg;
+    int64_t interval_ns = 1000000000LL / rate;
+    int64_t end_ns = start_ns + (int64_t)duration_s * 1000000000LL;
+    /* Stagger the clients across one interval so they do not all fire at once */
+    int64_t first_ns = start_ns + interval_ns * client->index / num_clients;
+
+    /* The default 50 us of timer slack would outlast the spin in
+     * sleep_until() */
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    Message msg;
+    WireMessage wire;
+    memset(&msg, 0, sizeof(msg));
+    msg.mtype = MSG_TYPE_CHAT;
+    snprintf(msg.username, MAX_USERNAME, "%s", client->username);
+
+    for (uint64_t n = 0; atomic_load(&sending); n++) {
+        int64_t due_ns = first_ns + (int64_t)n * interval_ns;
+        if (due_ns >= end_ns) {
+            break;
+        }
+        int64_t now = now_ns();
+        if (now < due_ns) {
+            sleep_until(due_ns);
+            now = now_ns();
+        } else if (now - due_ns > interval_ns) {
+            client->send_waits++;
+        }
+
+        int len = snprintf(msg.content, MSG_SIZE, "%d %llu %lld %lld ", client->index,
+                           (unsigned long long)n, (long long)due_ns, (long long)now);
+        if (len < line_bytes) {
+            memset(msg.content + len, 'x', (size_t)(line_bytes - len));
+            len = line_bytes;
+        }
+        msg.content[len] = '\0';
+        msg.timestamp = time(NULL);
+
+        size_t size = wire_encode(&msg, &wire);
+        while (msgsnd(server_queue_id, &wire, size, 0) == -1) {
+            if (errno != EINTR) {
+                perror("msgsnd chat");
+                return NULL;
+            }
+        }
+        client->sent++;
+    }
+    return NULL;
+}
+
+/* Time every line from another load client; everything else is ignored */
+static void *receiver(void *arg) {
+    LoadClient *client = (LoadClient *)arg;
+    WireBuffer buf;
+    Message msg;
+
+    while (atomic_load(&receiving)) {
+        ssize_t got = msgrcv(client->queue_id, &buf, WIRE_MAX_BYTES, 0, 0);
+        int64_t now = now_ns();
+        if (got == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  /* Queue removed: we are done */
+        }
+        if (buf.mtype != MSG_TYPE_CHAT || wire_decode(&buf, (size_t)got, &msg) == -1) {
+            continue;
+        }
+        int from;
+        unsigned long long n;
+        long long due_ns, sent_ns;
+        if (sscanf(msg.content, "%d %llu %lld %lld", &from, &n, &due_ns, &sent_ns) != 4 ||
+            from < 0 || from >= num_clients || strcmp(msg.username, clients[from].username) != 0) {
+            continue;
+        }
+        hist_record(&client->corrected, now - due_ns);
+        hist_record(&client->naive, now - sent_ns);
+        atomic_fetch_add_explicit(&client->received, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void print_latency(const char *label, const Histogram *hist) {
+    printf("%-22s %10.1f %10.1f %10.1f %10.1f %10.1f\n", label,
+           hist_percentile(hist, 0.5) / 1e3, hist_percentile(hist, 0.9) / 1e3,
+           hist_percentile(hist, 0.99) / 1e3, hist_percentile(hist, 0.999) / 1e3, hist->max / 1e3);
+}
+
+/* Start ./chat_server with its output discarded; it runs until the
+ * returned pipe is closed */
+static pid_t spawn_server(int *command_fd) {
+    int command_pipe[2];
+    if (pipe(command_pipe) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(command_pipe[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        close(command_pipe[0]);
+        close(command_pipe[1]);
+        execl("./chat_server", "chat_server", "-H", "0", (char *)NULL);
+        perror("exec ./chat_server");
+        _exit(1);
+    }
+    close(command_pipe[0]);
+    *command_fd = command_pipe[1];
+    return pid;
+}
+
+int main(int argc, char *argv[]) {
+    int spawn = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:s:d:S")) != -1) {
+        switch (opt) {
+            case 'c': num_clients = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 's': line_bytes = atoi(optarg); break;
+            case 'd': duration_s = atoi(optarg); break;
+            case 'S': spawn = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-r msgs_per_s] [-s bytes] [-d seconds] [-S]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (num_clients < 2 || num_clients > MAX_CLIENTS || rate < 1 || rate > 1000000 ||
+        line_bytes < 1 || line_bytes > MSG_SIZE - 1 || duration_s < 1) {
+        fprintf(stderr, "Need 2-%d clients, 1-1000000 msgs/s, 1-%d byte lines and at least 1 s\n",
+                MAX_CLIENTS, MSG_SIZE - 1);
+        return 1;
+    }
+
+    key_t server_key = ftok("server.key", 'S');
+    key_t control_key = ftok("server.key", CONTROL_QUEUE_PROJ);
+    if (server_key == -1 || control_key == -1) {
+        perror("ftok server.key (run make setup)");
+        return 1;
+    }
+
+    pid_t server_pid = -1;
+    int command_fd = -1;
+    if (spawn) {
+        /* A leftover control queue would look like the server is up */
+        msgctl(msgget(control_key, 0666), IPC_RMID, NULL);
+        server_pid = spawn_server(&command_fd);
+        if (server_pid == -1) {
+            return 1;
+        }
+        int64_t deadline = now_ns() + 5000000000LL;
+        while (msgget(control_key, 0666) == -1) {
+            if (now_ns() > deadline || waitpid(server_pid, NULL, WNOHANG) != 0) {
+                fprintf(stderr, "Server did not start\n");
+                return 1;
+            }
+            usleep(1000);
+        }
+    }
+    server_queue_id = msgget(server_key, 0666);
+    if (server_queue_id == -1) {
+        fprintf(stderr, "No chat_server is running here (start one, or pass -S)\n");
+        return 1;
+    }
+    connect_queue_id = msgget(control_key, 0666);
+    if (connect_queue_id == -1) {
+        connect_queue_id = server_queue_id;  /* Older servers take joins there */
+    }
+
+    clients = calloc((size_t)num_clients, sizeof(LoadClient));
+    if (clients == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    int joined = 0;
+    int failed = 0;
+    for (; joined < num_clients; joined++) {
+        LoadClient *client = &clients[joined];
+        client->index = joined;
+        snprintf(client->username, MAX_USERNAME, "load%d_%d", (int)(getpid() % 100000), joined);
+        if (join(client) != 0) {
+            failed = 1;
+            break;
+        }
+        pthread_create(&client->receiver, NULL, receiver, client);
+    }
+
+    printf("=== Load benchmark ===\n");
+    printf("%d clients x %d msgs/s, %d byte lines, %d s\n", num_clients, rate, line_bytes,
+           duration_s);
+    fflush(stdout);
+
+    if (!failed) {
+        /* Everyone starts sending from the same moment */
+        start_ns = now_ns() + 10000000LL;
+        for (int i = 0; i < num_clients; i++) {
+            pthread_create(&clients[i].sender, NULL, sender, &clients[i]);
+        }
+        for (int i = 0; i < num_clients; i++) {
+            pthread_join(clients[i].sender, NULL);
+        }
+    }
+    int64_t sent_ns = now_ns() - start_ns;
+
+    /* Every line goes to every client but its sender */
+    uint64_t sent = 0;
+    uint64_t late = 0;
+    for (int i = 0; i < num_clients; i++) {
+        sent += clients[i].sent;
+        late += clients[i].send_waits;
+    }
+    uint64_t expected = sent * (uint64_t)(num_clients - 1);
+    int64_t drain_deadline = now_ns() + DRAIN_MS * 1000000LL;
+    uint64_t received = 0;
+    while (!failed) {
+        received = 0;
+        for (int i = 0; i < num_clients; i++) {
+            received += atomic_load_explicit(&clients[i].received, memory_order_relaxed);
+        }
+        if (received >= expected || now_ns() > drain_deadline) {
+            break;
+        }
+        usleep(1000);
+    }
+    int64_t delivered_ns = now_ns() - start_ns;
+
+    /* Removing the queues wakes the receivers */
+    atomic_store(&receiving, 0);
+    for (int i = 0; i < joined; i++) {
+        leave(&clients[i]);
+        pthread_join(clients[i].receiver, NULL);
+    }
+
+    if (!failed) {
+        Histogram *corrected = calloc(1, sizeof(Histogram));
+        Histogram *naive = calloc(1, sizeof(Histogram));
+        received = 0;
+        for (int i = 0; i < num_clients; i++) {
+            hist_merge(corrected, &clients[i].corrected);
+            hist_merge(naive, &clients[i].naive);
+            received += atomic_load(&clients[i].received);
+        }
+        printf("Sent %llu line(s), %.0f/s; %llu sent more than an interval late\n",
+               (unsigned long long)sent, sent / (sent_ns / 1e9), (unsigned long long)late);
+        printf("Delivered %llu of %llu, %.0f/s; %llu dropped or still queued after %d ms\n\n",
+               (unsigned long long)received, (unsigned long long)expected,
+               received / (delivered_ns / 1e9),
+               (unsigned long long)(expected > received ? expected - received : 0), DRAIN_MS);
+        printf("%-22s %10s %10s %10s %10s %10s\n", "Delivery latency (us)", "p50", "p90", "p99",
+               "p999", "max");
+        print_latency("from due time", corrected);
+        print_latency("from send (naive)", naive);
+        free(corrected);
+        free(naive);
+    }
+
+    if (spawn) {
+        close(command_fd);
+        waitpid(server_pid, NULL, 0);
+    }
+    free(clients);
+    return failed;
+}
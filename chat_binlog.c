@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "chat_binlog.h"
+
+void binlog_index_path(const char *path, char *out, size_t size) {
+    size_t len = strlen(path);
+    if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+        len -= 3;
+    }
+    snprintf(out, size, "%.*s%s", (int)len, path, BINLOG_INDEX_SUFFIX);
+}
+
+static int read_exact(int fd, void *buf, size_t len, off_t offset) {
+    ssize_t got = pread(fd, buf, len, offset);
+    return got == (ssize_t)len ? 0 : -1;
+}
+
+static int write_exact(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/* Open the index, creating its header, and drop entries that point at or
+ * past end. Returns the fd or -1. */
+static int open_index(const char *path, uint32_t interval, uint64_t end) {
+    char index_path[4096];
+    binlog_index_path(path, index_path, sizeof(index_path));
+
+    int fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    BinlogIndexHeader header;
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size < (off_t)sizeof(header) || read_exact(fd, &header, sizeof(header), 0) != 0 ||
+        memcmp(header.magic, BINLOG_INDEX_MAGIC, 8) != 0 || header.interval != interval) {
+        /* Missing, damaged or built with another interval: start afresh.
+         * Readers fall back to scanning for anything not indexed. */
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINLOG_INDEX_MAGIC, 8);
+        header.version = BINLOG_VERSION;
+        header.interval = interval;
+        if (ftruncate(fd, 0) != 0 || write_exact(fd, &header, sizeof(header)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        /* Keep whole entries that point inside the log */
+        off_t pos = sizeof(header);
+        BinlogIndexEntry entry;
+        while (read_exact(fd, &entry, sizeof(entry), pos) == 0 && entry.offset < end) {
+            pos += sizeof(entry);
+        }
+        if (ftruncate(fd, pos) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    lseek(fd, 0, SEEK_END);
+    return fd;
+}
+
+int binlog_open_append(const char *path, int *fd_out, int *index_fd_out, uint32_t interval,
+                       uint64_t first_seq, uint64_t *next_seq, uint64_t *end) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    BinlogFileHeader header;
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t pos = sizeof(header);
+    uint64_t last_seq = 0;
+
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINLOG_MAGIC, 8);
+        header.version = BINLOG_VERSION;
+        header.header_size = sizeof(header);
+        header.first_seq = first_seq ? first_seq : 1;
+        if (write_exact(fd, &header, sizeof(header)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        if (read_exact(fd, &header, sizeof(header), 0) != 0 ||
+            memcmp(header.magic, BINLOG_MAGIC, 8) != 0 || header.version != BINLOG_VERSION) {
+            close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* Start from the last index entry, if it looks right, and walk to
+         * the last complete record */
+        char index_path[4096];
+        binlog_index_path(path, index_path, sizeof(index_path));
+        int index_fd = open(index_path, O_RDONLY | O_CLOEXEC);
+        if (index_fd != -1) {
+            struct stat ist;
+            BinlogIndexEntry entry;
+            BinlogRecord rec;
+            fstat(index_fd, &ist);
+            if (ist.st_size >= (off_t)(sizeof(BinlogIndexHeader) + sizeof(entry))) {
+                off_t last = sizeof(BinlogIndexHeader) +
+                             ((ist.st_size - sizeof(BinlogIndexHeader)) / sizeof(entry) - 1) * sizeof(entry);
+                if (read_exact(index_fd, &entry, sizeof(entry), last) == 0 &&
+                    read_exact(fd, &rec, sizeof(rec), entry.offset) == 0 &&
+                    rec.magic == BINLOG_RECORD_MAGIC && rec.seq == entry.seq) {
+                    pos = entry.offset;
+                }
+            }
+            close(index_fd);
+        }
+
+        BinlogRecord rec;
+        while (pos + sizeof(rec) <= (uint64_t)st.st_size &&
+               read_exact(fd, &rec, sizeof(rec), pos) == 0 &&
+               rec.magic == BINLOG_RECORD_MAGIC &&
+               rec.length == sizeof(rec) + rec.text_len &&
+               pos + rec.length <= (uint64_t)st.st_size) {
+            last_seq = rec.seq;
+            pos += rec.length;
+        }
+        if (pos < (uint64_t)st.st_size && ftruncate(fd, pos) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    int index_fd = open_index(path, interval, pos);
+    if (index_fd == -1) {
+        close(fd);
+        return -1;
+    }
+    lseek(fd, pos, SEEK_SET);
+
+    *fd_out = fd;
+    *index_fd_out = index_fd;
+    *next_seq = last_seq ? last_seq + 1 : (header.first_seq ? header.first_seq : 1);
+    *end = pos;
+    return 0;
+}
+
+int binlog_reader_open(BinlogReader *reader, const char *path) {
+    BinlogFileHeader header;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->file = gzopen(path, "rb");
+    if (!reader->file) {
+        return -1;
+    }
+    gzbuffer(reader->file, 64 * 1024);
+    if (gzread(reader->file, &header, sizeof(header)) != (int)sizeof(header) ||
+        memcmp(header.magic, BINLOG_MAGIC, 8) != 0 || header.version != BINLOG_VERSION) {
+        gzclose(reader->file);
+        reader->file = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    reader->offset = header.header_size;
+    reader->need_seek = 1;
+
+    /* The index is small (one entry per interval records): load it whole */
+    char index_path[4096];
+    binlog_index_path(path, index_path, sizeof(index_path));
+    FILE *index = fopen(index_path, "rb");
+    if (index) {
+        BinlogIndexHeader index_header;
+        if (fread(&index_header, sizeof(index_header), 1, index) == 1 &&
+            memcmp(index_header.magic, BINLOG_INDEX_MAGIC, 8) == 0) {
+            size_t capacity = 0;
+            BinlogIndexEntry entry;
+            while (fread(&entry, sizeof(entry), 1, index) == 1) {
+                if (reader->index_count == capacity) {
+                    capacity = capacity ? capacity * 2 : 256;
+                    BinlogIndexEntry *grown = realloc(reader->index, capacity * sizeof(entry));
+                    if (!grown) {
+                        break;
+                    }
+                    reader->index = grown;
+                }
+                reader->index[reader->index_count++] = entry;
+            }
+        }
+        fclose(index);
+    }
+    return 0;
+}
+
+void binlog_reader_close(BinlogReader *reader) {
+    if (reader->file) {
+        gzclose(reader->file);
+    }
+    free(reader->index);
+    memset(reader, 0, sizeof(*reader));
+}
+
+/* Binary search: number of index entries whose key is <= target */
+static size_t search_index(BinlogReader *reader, int by_time, int64_t target) {
+    size_t lo = 0, hi = reader->index_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int64_t key = by_time ? reader->index[mid].timestamp_ns : (int64_t)reader->index[mid].seq;
+        if (key <= target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void seek_entry(BinlogReader *reader, size_t entry) {
+    reader->offset = entry < reader->index_count ? reader->index[entry].offset
+                                                 : sizeof(BinlogFileHeader);
+    reader->need_seek = 1;
+}
+
+void binlog_seek_seq(BinlogReader *reader, uint64_t seq) {
+    size_t count = search_index(reader, 0, (int64_t)seq);
+    seek_entry(reader, count > 0 ? count - 1 : reader->index_count);
+}
+
+void binlog_seek_time(BinlogReader *reader, int64_t timestamp_ns) {
+    /* Entries from concurrent writers can be a little out of time order,
+     * so start one index entry early */
+    size_t count = search_index(reader, 1, timestamp_ns);
+    seek_entry(reader, count > 1 ? count - 2 : reader->index_count);
+}
+
+int binlog_read(BinlogReader *reader, BinlogRecord *rec, char *text) {
+    if (reader->need_seek) {
+        /* Cheap on a plain file; a compressed one is decompressed up to here */
+        if (gzseek(reader->file, (z_off_t)reader->offset, SEEK_SET) == -1) {
+            return -1;
+        }
+        reader->need_seek = 0;
+    }
+    int got = gzread(reader->file, rec, sizeof(*rec));
+    if (got == 0) {
+        return 0;
+    }
+    if (got != (int)sizeof(*rec) || rec->magic != BINLOG_RECORD_MAGIC ||
+        rec->length != sizeof(*rec) + rec->text_len) {
+        return -1;
+    }
+    if (gzread(reader->file, text, rec->text_len) != (int)rec->text_len) {
+        return -1;
+    }
+    text[rec->text_len] = '\0';
+    reader->offset += rec->length;
+    return 1;
+}
@@ -0,0 +1,99 @@
+#ifndef CHAT_BINLOG_H
+#define CHAT_BINLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#define BINLOG_FILE "chat_server.blog"
+#define BINLOG_INDEX_SUFFIX ".idx"
+#define BINLOG_MAGIC "CHATBLG1"
+#define BINLOG_INDEX_MAGIC "CHATIDX1"
+#define BINLOG_VERSION 1
+#define BINLOG_RECORD_MAGIC 0x31524c43u    /* "CLR1" */
+#define DEFAULT_INDEX_INTERVAL 256         /* Records per index entry (-n) */
+#define BINLOG_MAX_TEXT 65535
+
+/*
+ * Binary log layout:
+ *
+ *   chat_server.blog      BinlogFileHeader, then BinlogRecord + text, ...
+ *   chat_server.blog.idx  BinlogIndexHeader, then one BinlogIndexEntry for
+ *                         every interval-th record (seq 1, 1 + interval, ...)
+ *
+ * Sequence numbers count records in file order and carry on across server
+ * restarts and log segments. Both files are written in host byte order.
+ * The index is only an accelerator: it can be rebuilt from the log, and a
+ * reader without one simply scans from the start. Closed segments may be
+ * gzip-compressed (name.gz, index still name.idx); readers handle both.
+ */
+typedef struct {
+    char magic[8];              /* BINLOG_MAGIC */
+    uint32_t version;
+    uint32_t header_size;       /* sizeof(BinlogFileHeader) */
+    uint64_t first_seq;         /* Sequence number of the first record in this file */
+    uint64_t reserved;
+} BinlogFileHeader;
+
+typedef struct {
+    uint32_t magic;             /* BINLOG_RECORD_MAGIC, to spot torn writes */
+    uint32_t length;            /* Header plus text */
+    uint64_t seq;
+    int64_t timestamp_ns;       /* CLOCK_REALTIME when the entry was appended */
+    uint16_t type;              /* LOG_REC_TEXT */
+    uint16_t text_len;
+    uint32_t reserved;
+} BinlogRecord;                 /* Followed by text_len bytes of the text line */
+
+typedef struct {
+    char magic[8];              /* BINLOG_INDEX_MAGIC */
+    uint32_t version;
+    uint32_t interval;          /* Records between entries */
+    uint64_t reserved[2];
+} BinlogIndexHeader;
+
+typedef struct {
+    uint64_t seq;
+    int64_t timestamp_ns;
+    uint64_t offset;            /* Of the record in the log file */
+} BinlogIndexEntry;
+
+/* Index file name for a log file: path + BINLOG_INDEX_SUFFIX, with any
+ * ".gz" left off first */
+void binlog_index_path(const char *path, char *out, size_t size);
+
+/*
+ * Open (creating if needed) a binary log and its index for appending. A
+ * new file starts numbering at first_seq. An existing log is checked, any
+ * torn record at its end is cut off, and index entries past the end are
+ * dropped. *next_seq and *end receive the next sequence number and the
+ * file offset to append at.
+ * Returns 0, or -1 with errno set (EINVAL for a file that is not a binary log).
+ */
+int binlog_open_append(const char *path, int *fd, int *index_fd, uint32_t interval,
+                       uint64_t first_seq, uint64_t *next_seq, uint64_t *end);
+
+/* Reader */
+typedef struct {
+    gzFile file;                /* Reads plain and compressed logs alike */
+    BinlogIndexEntry *index;
+    size_t index_count;
+    uint64_t offset;            /* Of the next record */
+    int need_seek;              /* offset was moved since the last read */
+} BinlogReader;
+
+/* Open a binary log (and its index if there is one). Returns 0 or -1. */
+int binlog_reader_open(BinlogReader *reader, const char *path);
+void binlog_reader_close(BinlogReader *reader);
+
+/* Jump to the last indexed record at or before a sequence number or a
+ * time; the caller reads forward from there */
+void binlog_seek_seq(BinlogReader *reader, uint64_t seq);
+void binlog_seek_time(BinlogReader *reader, int64_t timestamp_ns);
+
+/* Read the next record; text gets up to BINLOG_MAX_TEXT bytes plus a NUL.
+ * Returns 1, 0 at the end, or -1 for a damaged record. */
+int binlog_read(BinlogReader *reader, BinlogRecord *rec, char *text);
+
+#endif /* CHAT_BINLOG_H */
@@ -9,63 +9,134 @@
 #include <sys/msg.h>
 #include <sys/shm.h>
 #include <errno.h>
-
-#define MAX_USERNAME 32
-#define MSG_SIZE 256
-
-/* Message types */
-#define MSG_TYPE_CONNECT 1
-#define MSG_TYPE_DISCONNECT 2
-#define MSG_TYPE_CHAT 3
-#define MSG_TYPE_ACK 4
-
-/* Message structure */
+#include <poll.h>
+#include <time.h>
+#include "chat_protocol.h"
+#include "chat_ring.h"
+#include "chat_log.h"
+#include "chat_format.h"
+#include "chat_stats.h"
+
+#define DEFAULT_FLUSH_MS 5   /* Lines closer together than this are batched */
+#define LINE_BUFFER_SIZE 4096
+#define LOG_TEXT_MAX (MAX_USERNAME + MSG_SIZE + 64)  /* Longest formatted log entry */
+#define SEQ_WINDOW 256       /* Recent sequence numbers remembered to drop repeats */
+#define SEQ_PATH_MAX (MAX_USERNAME + 32)
+#define WELCOME_WAIT_MS 2000 /* How long lines are held back waiting for the welcome */
+
+/* Hops of a traced message, as measured by its recipient */
+#define HOP_TO_SERVER 0      /* Sender's msgsnd() to the server's msgrcv() */
+#define HOP_IN_SERVER 1      /* Dispatch, logging and history, up to the fan-out */
+#define HOP_TO_CLIENT 2      /* Fan-out to our msgrcv(), backlog included */
+#define HOP_TOTAL 3
+#define NUM_HOPS 4
+
+/* read_line() results */
+#define LINE_OK 0
+#define LINE_TIMEOUT 1
+#define LINE_EOF 2
+#define LINE_INTR 3
+
+/* Buffered reader for stdin that can tell whether more input is waiting,
+ * which stdio's fgets() cannot */
 typedef struct {
-    long mtype;
-    char username[MAX_USERNAME];
-    char content[MSG_SIZE];
-    time_t timestamp;
-} Message;
-
-/* Log buffer structure */
-typedef struct {
-    size_t total_size;
-    size_t used_size;
-    int write_position;
-    pthread_mutex_t mutex;
-    char data[];
-} LogBuffer;
+    char data[LINE_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+    int eof;
+} LineReader;
 
 /* Global variables */
 int server_queue_id;
+int control_queue_id = -1;                /* Where CONNECT goes, if the server has one */
 int client_queue_id;
 char username[MAX_USERNAME];
-int running = 1;
+volatile sig_atomic_t running = 1;
 pthread_t receiver_tid; /* Thread ID for message receiver */
+BroadcastRing *broadcast_ring = NULL; /* Set when the server runs with -b */
+RingReader ring_reader;
+pthread_t ring_tid;
+volatile sig_atomic_t server_compact = 0; /* Server has sent us a compact message */
+volatile sig_atomic_t server_alive = 1;   /* Cleared once the server is gone */
+int flush_interval_ms = DEFAULT_FLUSH_MS;
+BatchMessage pending_batch;               /* Lines waiting for the next flush */
+long long last_flush_ms;                  /* When lines were last sent */
+LogBuffer *log_buffer = NULL;             /* Server log, mapped read-only once */
+uint64_t log_cursor;                      /* Offset of the next entry /logs shows */
+int log_cursor_valid = 0;                 /* Set after the first /logs */
+uint64_t last_log_seq = 0;                /* Newest entry shown so far */
+pthread_mutex_t seq_mutex = PTHREAD_MUTEX_INITIALIZER;  /* Both receivers note sequences */
+uint64_t newest_seq = 0;                  /* Newest broadcast sequence seen, or resumed from */
+uint64_t seen_seqs[SEQ_WINDOW / 64];      /* Bit seq % SEQ_WINDOW: seen, for the last SEQ_WINDOW */
+uint64_t resume_seq = 0;                  /* Everything up to here has arrived: next run's resume point */
+uint64_t replay_until = 0;                /* Last message of a resume replay still arriving, or 0 */
+char seq_path[SEQ_PATH_MAX];              /* Where the resume point is kept between runs, or "" */
+pthread_mutex_t welcome_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t welcome_cond = PTHREAD_COND_INITIALIZER;
+int welcomed = 0;                         /* The server has answered our CONNECT */
+int trace_mode = 0;                       /* -t: stamp our lines, time everyone's */
+volatile sig_atomic_t server_traces = 0;  /* The server sent us a traced welcome */
+StatsHistogram trace_hops[NUM_HOPS];
 
 /* Function prototypes */
 int initialize_client(const char *user);
 void cleanup_resources();
 void *message_receiver(void *arg);
+void *ring_receiver(void *arg);
+void display_message(Message *msg);
+int note_seq(uint64_t seq, int seen);
+void note_joined(uint64_t last);
+void note_replayed(uint64_t seq);
+void load_seq();
+void save_seq();
+int send_to_server(Message *msg, int flags);
 void send_message(const char *content);
-void view_logs();
+void queue_message(const char *content);
+void flush_pending();
+int read_line(LineReader *reader, char *line, size_t size, int timeout_ms);
+long long monotonic_ms();
+void view_logs(int last);
 void handle_signal(int sig);
-
-void handle_usr1(int sig); // Signal handler for SIGUSR1
+void wake_receiver();
+void note_welcome();
+void wait_for_welcome(int timeout_ms);
+void note_trace(Message *msg, int64_t received_ns);
+void print_trace();
+int64_t monotonic_ns();
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <username>\n", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t")) != -1) {
+        switch (opt) {
+            case 'f':
+                flush_interval_ms = atoi(optarg);
+                if (flush_interval_ms < 0) {
+                    fprintf(stderr, "Flush interval must be >= 0 ms\n");
+                    return 1;
+                }
+                break;
+            case 't':
+                trace_mode = 1;
+                break;
+            default:
+                printf("Usage: %s [-f flush_ms] [-t] <username>\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        printf("Usage: %s [-f flush_ms] [-t] <username>\n", argv[0]);
         return 1;
     }
+    if (trace_mode) {
+        flush_interval_ms = 0;  /* Only single messages carry stamps */
+    }
     
+
     /* Set up signal handler */
     signal(SIGINT, handle_signal);
-    //CHANGE added signal handler for SIGUSR1
-    signal(SIGUSR1, handle_usr1);
     
     /* Initialize client */
-    if (initialize_client(argv[1]) != 0) {
+    if (initialize_client(argv[optind]) != 0) {
         return 1;
     }
     
@@ -75,47 +146,105 @@ int main(int argc, char *argv[]) {
         cleanup_resources();
         return 1;
     }
+
+    /* Broadcasts arrive through the shared-memory ring when it is available */
+    if (broadcast_ring && pthread_create(&ring_tid, NULL, ring_receiver, NULL) != 0) {
+        perror("Failed to create ring receiver thread");
+        running = 0;
+        wake_receiver();
+        pthread_join(receiver_tid, NULL);
+        cleanup_resources();
+        return 1;
+    }
+
+    /* CONNECT skipped the server queue, so a line sent there now could
+     * overtake it */
+    if (control_queue_id != -1) {
+        wait_for_welcome(WELCOME_WAIT_MS);
+    }
     
     /* Main loop for sending messages */
+    LineReader reader;
+    memset(&reader, 0, sizeof(reader));
     char buffer[MSG_SIZE];
+    batch_init(&pending_batch);
+    last_flush_ms = monotonic_ms() - flush_interval_ms;
     printf("You: ");
     fflush(stdout);
 
     while (running) {
-        if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
+        /* With lines pending, only wait until they are due to be flushed */
+        int timeout = -1;
+        if (pending_batch.count > 0) {
+            long long due = last_flush_ms + flush_interval_ms - monotonic_ms();
+            timeout = due > 0 ? (int)due : 0;
+        }
+
+        int result = read_line(&reader, buffer, sizeof(buffer), timeout);
+        if (result == LINE_TIMEOUT) {
+            flush_pending();
+            continue;
+        } else if (result == LINE_INTR) {
+            continue;
+        } else if (result == LINE_EOF) {
             break;
         }
         
-        /* Remove newline */
-        buffer[strcspn(buffer, "\n")] = '\0';
         //CHANGE
          // CHANGE: Accept commands with or without slash
          if (strcmp(buffer, "/quit") == 0 || strcmp(buffer, "quit") == 0) {
             printf("Exiting...\n");
-            running = 0;
-            
-            // CHANGE: Send signal to wake up message receiver thread
-            pthread_kill(receiver_tid, SIGUSR1);
             
             // CHANGE: Break out of the loop immediately
             break;
         } else if (strcmp(buffer, "/logs") == 0 || strcmp(buffer, "logs") == 0) {
-            view_logs();
+            flush_pending();
+            view_logs(0);
             printf("You: ");
             fflush(stdout);
-        } else {
-            send_message(buffer);
+        } else if (strcmp(buffer, "/trace") == 0) {
+            print_trace();
+            printf("You: ");
+            fflush(stdout);
+        } else if (strncmp(buffer, "/logs ", 6) == 0) {
+            flush_pending();
+            int last = atoi(buffer + 6);
+            if (last > 0) {
+                view_logs(last);
+            } else {
+                printf("Usage: /logs [N]\n");
+            }
             printf("You: ");
             fflush(stdout);
+        } else {
+            queue_message(buffer);
+            /* Skip the prompt while a pasted block is still being read */
+            if (!memchr(reader.data + reader.start, '\n', reader.end - reader.start)) {
+                printf("You: ");
+                fflush(stdout);
+            }
         }
        
     }
+
+    /* Nothing typed before quitting is lost */
+    flush_pending();
+    running = 0;
+
+    /* Wake up message receiver threads */
+    wake_receiver();
     
-    /* Wait for receiver thread to finish */
+    /* Wait for receiver threads to finish */
     pthread_join(receiver_tid, NULL);
+    if (broadcast_ring) {
+        pthread_join(ring_tid, NULL);
+    }
     
     /* Clean up resources */
     cleanup_resources();
+    if (trace_mode) {
+        print_trace();
+    }
     
     return 0;
 }
@@ -148,24 +277,60 @@ int initialize_client(const char *user) {
         perror("ftok client key");
         return -1;
     }
+    /* - Joins have a queue of their own on servers that support it */
+    key_t control_key = ftok("server.key", CONTROL_QUEUE_PROJ);
+    if (control_key != -1) {
+        control_queue_id = msgget(control_key, 0666);
+    }
+
     /* - Create client queue */
     client_queue_id = msgget(client_key, 0666 | IPC_CREAT);
     if (client_queue_id == -1) {
         perror("msgget client queue");
         return -1;
     }
+    /* - Map the broadcast ring if the server created one. The cursor starts
+     *   at the current head, before CONNECT, so no broadcast is missed.
+     *   Ring copies carry no trace stamps, so tracing reads the queue. */
+    key_t ring_key = ftok("log.key", 'B');
+    if (ring_key != -1 && !trace_mode) {
+        broadcast_ring = ring_attach(ring_key);
+        if (broadcast_ring) {
+            ring_reader_init(&ring_reader, broadcast_ring);
+        }
+    }
+
+    /* - Map the server log read-only for /logs; it stays attached until exit */
+    key_t log_key = ftok("log.key", 'L');
+    int log_shm_id = log_key == -1 ? -1 : shmget(log_key, 0, 0666);
+    if (log_shm_id != -1) {
+        void *addr = shmat(log_shm_id, NULL, SHM_RDONLY);
+        if (addr != (void *)-1) {
+            log_buffer = (LogBuffer *)addr;
+        }
+    }
+
+    /* - Pick up where the last run of this user left off */
+    load_seq();
+
     /* - Send connection message */
     Message connect_msg;
     connect_msg.mtype = MSG_TYPE_CONNECT;
     strncpy(connect_msg.username, username, MAX_USERNAME - 1);
     connect_msg.username[MAX_USERNAME - 1] = '\0'; /* Ensure null termination */
-    sprintf(connect_msg.content, "%d %d", client_queue_id, getpid());
+    /* CONNECT itself always uses the fixed format so any server can read it */
+    int len = sprintf(connect_msg.content, "%d %d%s compact history seq%s", client_queue_id,
+                      getpid(), broadcast_ring ? " ring" : "", trace_mode ? " trace" : "");
+    if (resume_seq > 0) {
+        sprintf(connect_msg.content + len, " resume=%llu", (unsigned long long)resume_seq);
+    }
     connect_msg.timestamp = time(NULL);
-    if (msgsnd(server_queue_id, &connect_msg, sizeof(Message) - sizeof(long), 0) == -1) {
+    int connect_queue_id = control_queue_id != -1 ? control_queue_id : server_queue_id;
+    if (msgsnd(connect_queue_id, &connect_msg, FIXED_MSG_BYTES, 0) == -1) {
         perror("msgsnd connect");
         return -1;
     }
-    printf("Connected to server as %s\n", username);
+    printf("Connected to server as %s%s\n", username, broadcast_ring ? " (shared-memory broadcasts)" : "");
     return 0;
 }
 
@@ -175,105 +340,296 @@ void cleanup_resources() {
     /* - Send disconnect message */
     /*improving this function*/
     printf("Cleaning up resources...\n");
-    if (server_queue_id != -1 && running) // checks if server queue is valid
+    if (server_queue_id != -1 && server_alive) // checks if server queue is valid
     { 
         Message disconnect_msg;
         disconnect_msg.mtype = MSG_TYPE_DISCONNECT;
         strcpy(disconnect_msg.username, username);
-        strcpy(disconnect_msg.content, "");
+        /* Our queue tells this session's leave from an earlier one's */
+        sprintf(disconnect_msg.content, "%d", client_queue_id);
         disconnect_msg.timestamp = time(NULL);
+        disconnect_msg.seq = 0;
+        memset(disconnect_msg.trace, 0, sizeof(disconnect_msg.trace));
 
         //adding non blocking send
-        msgsnd(server_queue_id, &disconnect_msg, sizeof(Message) - sizeof(long), IPC_NOWAIT);
+        send_to_server(&disconnect_msg, IPC_NOWAIT);
     }
+    save_seq();
     /* - Remove message queue */
-    /*adding wakeup mechanim to unblock server thread*/
     if (client_queue_id != -1) {
-        Message  wakeup_msg;
-        wakeup_msg.mtype = 999; // arbitrary type to wake up server
-        msgsnd(client_queue_id, &wakeup_msg, sizeof(Message) - sizeof(long), IPC_NOWAIT);
-        usleep(100000);
-
         msgctl(client_queue_id, IPC_RMID, NULL);
     }
+    if (broadcast_ring) {
+        shmdt(broadcast_ring);
+    }
+    if (log_buffer) {
+        shmdt(log_buffer);
+    }
 
     printf("Disconnected from server\n");
 }
 
 
-/* Thread to receive incoming messages */
+/* Thread to receive incoming messages.
+ * Blocks until a message arrives, then drains the queue with IPC_NOWAIT
+ * before blocking again. */
 void *message_receiver(void *arg) {
-    /* TODO: Implement message receiving logic */
+    WireBuffer buf;
     Message received_msg;
-    size_t bytes_received;
-    char timestamp_str[20];
-    struct tm *tm_info;
+    ssize_t bytes_received;
+    int flags = 0;
     printf("Message receiver thread started\n");
     while (running) {
         /*Receive message from client queue*/
-        /*changing from blocking to non blockinf w timeout*/
-
-        bytes_received = msgrcv(client_queue_id, &received_msg, sizeof(Message) - sizeof(long), 0, IPC_NOWAIT);
+        bytes_received = wire_receive(client_queue_id, &buf, 0, flags);
+        int64_t received_ns = trace_mode ? monotonic_ns() : 0;
         if(bytes_received == -1) {
             if (errno == ENOMSG) {
-                usleep(100000); // Sleep for 100ms
+                flags = 0; // Queue drained, block for the next message
                 continue;
             } else if (errno == EINTR) {
                 continue;
+            } else if (errno == E2BIG) {
+                continue;  /* Too big to be from the server; already dropped */
             } else if (errno == EIDRM || errno == EINVAL) {
                 printf("Message queue removed or invalid\n");
                 break;
             } else{
             perror("msgrcv");
+            flags = 0;
+            usleep(100000);  /* Wait a bit before trying again */
             continue; //CHANGE: Continue instead of breaking 
             }
         }
+        flags = IPC_NOWAIT;
 
-        //CHANGE
-        if (received_msg.mtype == 999) {
-            printf("Received wakeup signal, exiting...\n");
-            continue; // Ignore this message
+        if (buf.mtype == MSG_TYPE_SHUTDOWN) {
+            if (!running) break;
+            continue; // Ignore stray wakeups
         }
 
-        /* Format timestamp */
-        tm_info = localtime(&received_msg.timestamp);
-        strftime(timestamp_str, sizeof(timestamp_str), "%H:%M:%S", tm_info);
-
-        /*Process message based on type*/
-        switch(received_msg.mtype){
-            case MSG_TYPE_ACK:
-                printf("\n[%s] [SERVER] %s\n", timestamp_str, received_msg.content);
-                break;
-            
-            case MSG_TYPE_CHAT:
-                if (strcmp(received_msg.username, "SERVER") == 0) {
-                    printf("\n[%s] [SERVER] %s\n", timestamp_str, received_msg.content);
-    
+        if (buf.mtype == MSG_TYPE_BATCH) {
+            /* Several lines in one receive */
+            size_t offset = 0;
+            if (batch_validate(&buf.batch, (size_t)bytes_received) != 0) {
+                printf("\nIgnoring malformed batch (%zd bytes)\n", bytes_received);
+                continue;
+            }
+            while (batch_next(&buf.batch, &offset, &received_msg) == 1) {
+                if (received_msg.mtype == MSG_TYPE_HISTORY) {
+                    note_replayed(received_msg.seq);
                 }
-                else {
-                    printf("\n[%s] [%s] %s\n", timestamp_str, received_msg.username, received_msg.content);
+                if (note_seq(received_msg.seq, 1)) {
+                    display_message(&received_msg);
                 }
-                break;
-            /*CHANGE: Added case for disconnect message*/
-            case MSG_TYPE_DISCONNECT:
-                printf("\n[%s] Server is shutting down. Disconnecting...\n", timestamp_str);
-                running = 0;  /* Set running to false to exit main loop */
-                return NULL;  /* Exit thread immediately */
-                
-            default:
-                printf("\nUnknown message type: %ld\n", received_msg.mtype);
-                break;           
-        }       
-        printf("You:");
-        fflush(stdout); // Ensure prompt is displayed immediately
-    
+            }
+            continue;
+        }
+
+        int format = wire_decode(&buf, (size_t)bytes_received, &received_msg);
+        if (format == -1) {
+            printf("\nIgnoring malformed message (%zd bytes)\n", bytes_received);
+            continue;
+        }
+        if (format == 1) {
+            server_compact = 1; // Server speaks compact, so we can too
+        }
+        if (received_msg.trace[TRACE_CLIENT_SEND] != 0) {
+            note_trace(&received_msg, received_ns);
+        } else if (received_msg.trace[TRACE_FANOUT] != 0) {
+            server_traces = 1;  /* Only the welcome is traced without a sender */
+        }
+
+        if (received_msg.mtype == MSG_TYPE_DISCONNECT) {
+            printf("\n[%s] Server is shutting down. Disconnecting...\n",
+                   format_timestamp(received_msg.timestamp));
+            server_alive = 0;
+            running = 0;  /* Set running to false to exit main loop */
+            note_welcome();
+            if (broadcast_ring) {
+                ring_wake_readers(broadcast_ring);
+            }
+            return NULL;  /* Exit thread immediately */
+        }
+
+        /* The welcome's seq is where we joined, not a message of its own */
+        if (received_msg.mtype == MSG_TYPE_ACK) {
+            note_seq(received_msg.seq, 0);
+            note_joined(received_msg.seq);
+            display_message(&received_msg);
+            note_welcome();
+        } else if (note_seq(received_msg.seq, 1)) {
+            display_message(&received_msg);
+        }
     }   
     /* - Loop to receive messages from client queue */
     /* - Display messages to user */
+    note_welcome();  /* Nothing more is coming */
     printf("Message receiver thread exiting\n");
     return NULL;
 }
 
+/* Thread reading broadcasts from the shared-memory ring */
+void *ring_receiver(void *arg) {
+    WireBuffer buf;
+    Message msg;
+    size_t length;
+    pid_t exclude_pid;
+    uint64_t skipped;
+    pid_t self = getpid();
+
+    while (running) {
+        switch (ring_read(&ring_reader, &buf, sizeof(buf), &length, &exclude_pid, &skipped)) {
+            case RING_OK:
+                /* The ring holds compact messages, mtype included */
+                if (exclude_pid != self && length >= sizeof(long) &&
+                    wire_decode(&buf, length - sizeof(long), &msg) != -1 &&
+                    note_seq(msg.seq, 1)) {
+                    display_message(&msg);
+                }
+                break;
+
+            case RING_LAGGED:
+                printf("\n[WARNING] Fell behind the broadcast ring, %llu message(s) missed\n",
+                       (unsigned long long)skipped);
+                break;
+
+            case RING_EMPTY:
+                ring_wait(&ring_reader);
+                break;
+        }
+    }
+    return NULL;
+}
+
+/* Print one received message with its timestamp */
+void display_message(Message *msg) {
+    /* Format timestamp (cached per thread, see chat_format.h) */
+    const char *timestamp_str = format_timestamp(msg->timestamp);
+
+    /*Process message based on type*/
+    switch(msg->mtype){
+        case MSG_TYPE_ACK:
+            printf("\n[%s] [SERVER] %s\n", timestamp_str, msg->content);
+            break;
+        
+        case MSG_TYPE_CHAT:
+        case MSG_TYPE_HISTORY:  /* Replayed on join, shown like any other line */
+            if (strcmp(msg->username, "SERVER") == 0) {
+                printf("\n[%s] [SERVER] %s\n", timestamp_str, msg->content);
+
+            }
+            else {
+                printf("\n[%s] [%s] %s\n", timestamp_str, msg->username, msg->content);
+            }
+            break;
+            
+        default:
+            printf("\nUnknown message type: %ld\n", msg->mtype);
+            break;           
+    }       
+    printf("You:");
+    fflush(stdout); // Ensure prompt is displayed immediately
+}
+
+/*
+ * Record a broadcast sequence number. Returns 0 if seq was already seen,
+ * which happens when a message is both broadcast and replayed, and 1
+ * otherwise (always for seq 0, from servers that do not number messages).
+ * With seen == 0 the number only moves newest_seq forward, for the welcome
+ * telling us where we joined. Numbers more than SEQ_WINDOW behind the
+ * newest are always treated as new.
+ */
+int note_seq(uint64_t seq, int seen) {
+    if (seq == 0) {
+        return 1;
+    }
+    pthread_mutex_lock(&seq_mutex);
+    int fresh = 1;
+    if (seq > newest_seq) {
+        /* Slide the window: forget the bits the new numbers reuse */
+        if (newest_seq == 0 || seq - newest_seq >= SEQ_WINDOW) {
+            memset(seen_seqs, 0, sizeof(seen_seqs));
+        } else {
+            for (uint64_t s = newest_seq + 1; s <= seq; s++) {
+                seen_seqs[(s % SEQ_WINDOW) / 64] &= ~(1ULL << (s % 64));
+            }
+        }
+        newest_seq = seq;
+    } else if (newest_seq - seq < SEQ_WINDOW &&
+               (seen_seqs[(seq % SEQ_WINDOW) / 64] & (1ULL << (seq % 64)))) {
+        fresh = 0;
+    }
+    if (seen && newest_seq - seq < SEQ_WINDOW) {
+        seen_seqs[(seq % SEQ_WINDOW) / 64] |= 1ULL << (seq % 64);
+    }
+    pthread_mutex_unlock(&seq_mutex);
+    return fresh;
+}
+
+/*
+ * The welcome's seq is the last message from before we joined. Coming back
+ * from resume_seq, the server replays the gap up to it, and until that has
+ * arrived the resume point stays where the replay has got to: a run that
+ * ends mid-replay, or a replay the server drops or gives up on, leaves the
+ * rest of the gap to be asked for again next time.
+ */
+void note_joined(uint64_t last) {
+    pthread_mutex_lock(&seq_mutex);
+    if (resume_seq > 0 && last > resume_seq) {
+        replay_until = last;
+    }
+    pthread_mutex_unlock(&seq_mutex);
+}
+
+/* Move the resume point along a resume replay, which arrives in order */
+void note_replayed(uint64_t seq) {
+    pthread_mutex_lock(&seq_mutex);
+    if (replay_until != 0 && seq > resume_seq && seq <= replay_until) {
+        resume_seq = seq;
+        if (seq == replay_until) {
+            replay_until = 0;  /* Gap filled */
+        }
+    }
+    pthread_mutex_unlock(&seq_mutex);
+}
+
+/* Read the resume point the last run of this user saved, so CONNECT can
+ * ask for just the messages missed since. Kept next to the key files. */
+void load_seq() {
+    seq_path[0] = '\0';
+    if (strchr(username, '/') != NULL) {
+        return;  /* Not usable in a file name */
+    }
+    snprintf(seq_path, sizeof(seq_path), ".chat_client_%s.seq", username);
+    FILE *file = fopen(seq_path, "r");
+    if (file) {
+        unsigned long long seq;
+        if (fscanf(file, "%llu", &seq) == 1) {
+            resume_seq = newest_seq = seq;
+        }
+        fclose(file);
+    }
+}
+
+/* Remember where the next run resumes: the newest sequence seen, unless a
+ * resume replay is still short of it */
+void save_seq() {
+    pthread_mutex_lock(&seq_mutex);
+    uint64_t seq = replay_until != 0 ? resume_seq : newest_seq;
+    pthread_mutex_unlock(&seq_mutex);
+    if (seq_path[0] == '\0' || seq == 0) {
+        return;
+    }
+    FILE *file = fopen(seq_path, "w");
+    if (!file) {
+        perror("fopen sequence file");
+        return;
+    }
+    fprintf(file, "%llu\n", (unsigned long long)seq);
+    fclose(file);
+}
+
 /* Send a chat message to the server */
 void send_message(const char *content) {
     /* TODO: Implement message sending logic */
@@ -286,74 +642,295 @@ void send_message(const char *content) {
     strncpy(chat_msg.content, content, MSG_SIZE - 1);
     chat_msg.content[MSG_SIZE - 1] = '\0'; /* Ensure null termination */
     chat_msg.timestamp = time(NULL);
+    chat_msg.seq = 0;
+    memset(chat_msg.trace, 0, sizeof(chat_msg.trace));
+    if (trace_mode && server_traces) {
+        chat_msg.trace[TRACE_CLIENT_SEND] = monotonic_ns();
+    }
 
     /* - Send to server queue */
-    if (msgsnd(server_queue_id, &chat_msg, sizeof(Message)- sizeof(long), 0) == -1) {
+    if (send_to_server(&chat_msg, 0) == -1) {
         if (errno == EINVAL || errno == EIDRM) {
             printf("Server queue removed or invalid\n");
+            server_alive = 0;
             running = 0; // Set running to false to exit main loop
-            pthread_kill (receiver_tid, SIGUSR1); // Wake up receiver thread
+            wake_receiver(); // Wake up receiver thread
         } else {
             perror("msgsnd chat");
         }
     }
 }
 
-/* View chat logs from shared memory */
-void view_logs() {
-    /* TODO: Implement log viewing logic */
-    key_t shm_key = ftok("log.key", 'L');
-    if(shm_key == -1) {
-        perror("ftok log key");
+/* Queue a chat line. A line is sent at once unless lines are arriving
+ * faster than the flush interval, in which case they are collected and
+ * sent together as one MSG_TYPE_BATCH when the interval runs out. */
+void queue_message(const char *content) {
+    long long now = monotonic_ms();
+
+    /* Old servers cannot read batches */
+    if (!server_compact || flush_interval_ms == 0 ||
+        (pending_batch.count == 0 && now - last_flush_ms >= flush_interval_ms)) {
+        flush_pending();
+        send_message(content);
+        last_flush_ms = now;
         return;
     }
-    /* - Get shared memory segment */
-    int shm_id = shmget(shm_key, 0, 0666);
-    if(shm_id == -1){
-        perror("shmget logs");
+
+    Message chat_msg;
+    chat_msg.mtype = MSG_TYPE_CHAT;
+    strncpy(chat_msg.username, username, MAX_USERNAME - 1);
+    chat_msg.username[MAX_USERNAME - 1] = '\0';
+    strncpy(chat_msg.content, content, MSG_SIZE - 1);
+    chat_msg.content[MSG_SIZE - 1] = '\0';
+    chat_msg.timestamp = time(NULL);
+    chat_msg.seq = 0;
+
+    if (batch_append(&pending_batch, &chat_msg) != 0) {
+        /* Full: send what we have and start the next batch with this line */
+        flush_pending();
+        batch_append(&pending_batch, &chat_msg);
+    }
+}
+
+/* Send any lines collected by queue_message() */
+void flush_pending() {
+    if (pending_batch.count == 0) {
         return;
     }
-    /* - Attach to shared mem */
-     void *shm_addr = shmat(shm_id, NULL, SHM_RDONLY);
-    if(shm_addr == (void *)-1){
-        perror("shmat logs");
+
+    if (pending_batch.count == 1) {
+        /* A lone line goes out as an ordinary chat message */
+        Message line;
+        size_t offset = 0;
+        batch_next(&pending_batch, &offset, &line);
+        send_message(line.content);
+    } else if (msgsnd(server_queue_id, &pending_batch, batch_size(&pending_batch), 0) == -1) {
+        perror("msgsnd batch");
+    }
+
+    batch_init(&pending_batch);
+    last_flush_ms = monotonic_ms();
+}
+
+/* Read one line from stdin without the newline, waiting at most timeout_ms
+ * (-1 waits forever). Long lines are split like fgets() would. */
+int read_line(LineReader *reader, char *line, size_t size, int timeout_ms) {
+    for (;;) {
+        /* A complete line (or a full buffer's worth) is already here */
+        char *newline = memchr(reader->data + reader->start, '\n', reader->end - reader->start);
+        size_t available = reader->end - reader->start;
+        if (newline != NULL || available >= size - 1 || (reader->eof && available > 0)) {
+            size_t len = newline ? (size_t)(newline - (reader->data + reader->start)) : available;
+            size_t copy = len < size - 1 ? len : size - 1;
+            memcpy(line, reader->data + reader->start, copy);
+            line[copy] = '\0';
+            reader->start += copy;
+            if (newline != NULL && copy == len) {
+                reader->start++;  /* Skip the newline itself */
+            }
+            return LINE_OK;
+        }
+        if (reader->eof) {
+            return LINE_EOF;
+        }
+
+        /* Compact the buffer before reading more */
+        memmove(reader->data, reader->data + reader->start, available);
+        reader->start = 0;
+        reader->end = available;
+
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == 0) {
+            return LINE_TIMEOUT;
+        }
+        if (ready == -1) {
+            return errno == EINTR ? LINE_INTR : LINE_EOF;
+        }
+
+        ssize_t got = read(STDIN_FILENO, reader->data + reader->end, sizeof(reader->data) - reader->end);
+        if (got == -1) {
+            if (errno == EINTR) {
+                return LINE_INTR;
+            }
+            return LINE_EOF;
+        }
+        if (got == 0) {
+            reader->eof = 1;
+        }
+        reader->end += (size_t)got;
+    }
+}
+
+/* Milliseconds on the monotonic clock */
+long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Nanoseconds on the monotonic clock, the one trace stamps use */
+int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Time the hops of a traced message that has just arrived */
+void note_trace(Message *msg, int64_t received_ns) {
+    if (received_ns == 0) {
+        return;  /* Not tracing ourselves */
+    }
+    msg->trace[TRACE_CLIENT_RECV] = received_ns;
+    stats_record(&trace_hops[HOP_TO_SERVER],
+                 msg->trace[TRACE_SERVER_RECV] - msg->trace[TRACE_CLIENT_SEND]);
+    stats_record(&trace_hops[HOP_IN_SERVER],
+                 msg->trace[TRACE_FANOUT] - msg->trace[TRACE_SERVER_RECV]);
+    stats_record(&trace_hops[HOP_TO_CLIENT], received_ns - msg->trace[TRACE_FANOUT]);
+    stats_record(&trace_hops[HOP_TOTAL], received_ns - msg->trace[TRACE_CLIENT_SEND]);
+}
+
+/* Per-hop latency of every traced message received so far */
+void print_trace() {
+    if (!trace_mode) {
+        printf("Tracing is off; start the client with -t\n");
+        return;
+    }
+    if (!server_traces) {
+        printf("The server does not trace messages\n");
         return;
     }
-    /* - Read logs from shared memory */
-    LogBuffer *log_buffer = (LogBuffer *)shm_addr;
+    stats_print_header(stdout, "Trace (us)");
+    stats_print_histogram(stdout, "to server", &trace_hops[HOP_TO_SERVER]);
+    stats_print_histogram(stdout, "in server", &trace_hops[HOP_IN_SERVER]);
+    stats_print_histogram(stdout, "to client", &trace_hops[HOP_TO_CLIENT]);
+    stats_print_histogram(stdout, "end to end", &trace_hops[HOP_TOTAL]);
+}
 
-    //CHANGE
-    printf("Log buffer info: total_size=%zu, used_size=%zu, write_position=%d\n", 
-        log_buffer->total_size, log_buffer->used_size, log_buffer->write_position);
-    
-        if (log_buffer->used_size > 0) {
-            printf("\n===== CHAT LOGS =====\n");
-            
-            // CHANGE: Added safety bounds check
-            size_t safe_size = (log_buffer->used_size <= log_buffer->total_size) ? 
-                               log_buffer->used_size : log_buffer->total_size;
-            
-            if (write(STDOUT_FILENO, log_buffer->data, safe_size) == -1) {
-                perror("Failed to write logs");
+/* Send to the server, compact once the server has shown it supports it */
+int send_to_server(Message *msg, int flags) {
+    if (server_compact) {
+        WireMessage wire;
+        size_t size = msg->trace[TRACE_CLIENT_SEND] ? wire_encode_traced(msg, &wire)
+                                                    : wire_encode(msg, &wire);
+        return msgsnd(server_queue_id, &wire, size, flags);
+    }
+    return msgsnd(server_queue_id, msg, FIXED_MSG_BYTES, flags);
+}
+
+/* View chat logs from shared memory */
+/*
+ * Show log entries from the shared log. With last == 0 this prints what
+ * was added since the previous call (everything still in the buffer the
+ * first time); otherwise the last N entries. Reads never take the log
+ * mutex, so a slow terminal cannot hold up the server.
+ */
+void view_logs(int last) {
+    if (!log_buffer) {
+        printf("The server log is not available\n");
+        return;
+    }
+
+    LogEntry entry;
+    int result;
+    if (last > 0) {
+        /* Walk once without copying text, remembering where each of the
+         * last N entries starts */
+        uint64_t *starts = malloc(last * sizeof(*starts));
+        if (!starts) {
+            perror("malloc");
+            return;
+        }
+        uint64_t offset = atomic_load(&log_buffer->head);
+        long count = 0;
+        while ((result = log_read(log_buffer, &offset, &entry, NULL, 0)) != LOG_READ_END) {
+            if (result == LOG_READ_OK) {
+                starts[count++ % last] = entry.offset;
             }
-            
-            printf("\n====================\n");
-        } else {
-            printf("No logs available\n");
-        }  
-    shmdt(shm_addr);
+        }
+        log_cursor = count == 0 ? offset : starts[count > last ? count % last : 0];
+        free(starts);
+    } else if (!log_cursor_valid) {
+        log_cursor = atomic_load(&log_buffer->head);
+    }
+    log_cursor_valid = 1;
+
+    char text[LOG_TEXT_MAX];
+    int shown = 0;
+    int lapped = 0;
+    uint64_t first_seq = 0;
+    while ((result = log_read(log_buffer, &log_cursor, &entry, text, sizeof(text))) != LOG_READ_END) {
+        if (result == LOG_READ_LAPPED) {
+            lapped = 1;
+            continue;
+        }
+        if (shown++ == 0) {
+            printf("\n===== CHAT LOGS =====\n");
+            first_seq = entry.seq;
+        }
+        fwrite(text, 1, entry.text_len, stdout);
+        last_log_seq = entry.seq;
+    }
+
+    if (lapped) {
+        printf("(older entries were overwritten before they could be shown)\n");
+    }
+    if (shown > 0) {
+        printf("===== %d entr%s, #%llu to #%llu =====\n", shown, shown == 1 ? "y" : "ies",
+               (unsigned long long)first_seq, (unsigned long long)last_log_seq);
+    } else if (last_log_seq > 0) {
+        printf("No new log entries since #%llu\n", (unsigned long long)last_log_seq);
+    } else {
+        printf("No logs available\n");
+    }
+}
+
+
+/* Wake the receiver thread blocked in msgrcv() on our own queue, and the
+ * ring reader if it is asleep on the ring's futex */
+void wake_receiver() {
+    Message wakeup_msg;
+    memset(&wakeup_msg, 0, sizeof(wakeup_msg));
+    wakeup_msg.mtype = MSG_TYPE_SHUTDOWN;
+    msgsnd(client_queue_id, &wakeup_msg, FIXED_MSG_BYTES, IPC_NOWAIT);
+    if (broadcast_ring) {
+        ring_wake_readers(broadcast_ring);
+    }
+}
+
+/* The server has answered CONNECT, or never will */
+void note_welcome() {
+    pthread_mutex_lock(&welcome_mutex);
+    welcomed = 1;
+    pthread_cond_broadcast(&welcome_cond);
+    pthread_mutex_unlock(&welcome_mutex);
 }
 
+/* Wait up to timeout_ms for note_welcome(). A server that rejects a name
+ * already in use does not answer, hence the limit. */
+void wait_for_welcome(int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&welcome_mutex);
+    while (!welcomed && running) {
+        if (pthread_cond_timedwait(&welcome_cond, &welcome_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&welcome_mutex);
+}
 
 /* Signal handler */
 void handle_signal(int sig) {
     printf("\nReceived signal %d, disconnecting...\n", sig);
     running = 0;
 
-    //change added wakeup mechanism to unblock server thread
-    pthread_kill(receiver_tid, SIGUSR1);
-}
-
-void handle_usr1(int sig) {
-
+    wake_receiver();
 }
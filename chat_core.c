@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include "chat_core.h"
+#include "chat_format.h"
+
+/* Shared state; chat_server.c sets it up in initialize_server() */
+ClientRegistry registry;
+LogBuffer *log_buffer;
+LogWriter log_writer;
+BroadcastRing *broadcast_ring = NULL;
+pthread_mutex_t ring_publish_mutex = PTHREAD_MUTEX_INITIALIZER;  /* One publisher at a time */
+ChatHistory history;
+HistoryReplayer replayer;
+int history_replay = DEFAULT_HISTORY_REPLAY;
+int history_max_age_s = 0;
+SpoolPool spool_pool;
+size_t spool_bytes = DEFAULT_SPOOL_BYTES;
+int spool_policy = SPOOL_DROP_OLDEST;
+RateLimit rate_limit = {0, DEFAULT_RATE_BURST};
+LivenessWatcher liveness;
+int watching_clients = 0;
+ServerStats *stats;
+
+/* Add a new client; returns its id or a REGISTRY_* error */
+int add_client(const char *username, int queue_id, pid_t pid, const ConnectOptions *opts) {
+    /* Sequence numbers only fit in the compact format, and trace stamps
+     * go after them */
+    int sequenced = opts->compact && opts->sequenced;
+    int traced = sequenced && opts->traced;
+    ClientSpool *spool = spool_create(&spool_pool, spool_bytes, spool_policy);
+    if (spool == NULL) {
+        return REGISTRY_FULL;
+    }
+
+    /* A client killed right after sending CONNECT is reaped on the spot */
+    int pidfd = -1;
+    if (watching_clients) {
+        pidfd = liveness_open(pid);
+        if (pidfd == -1 && errno == ESRCH) {
+            printf("Not adding %s: process %d has already exited\n", username, (int)pid);
+            msgctl(queue_id, IPC_RMID, NULL);
+            spool_destroy(spool);
+            return ADD_CLIENT_EXITED;
+        }
+    }
+
+    pthread_rwlock_wrlock(&registry.lock);
+    int id = registry_add(&registry, username, queue_id, pid);
+    if (id >= 0) {
+        registry.slots[id].pidfd = -1;
+        if (pidfd != -1 &&
+            liveness_add(&liveness, pidfd, ((uint64_t)(uint32_t)pidfd << 32) | (uint32_t)id) == 0) {
+            registry.slots[id].pidfd = pidfd;
+            pidfd = -1;
+        }
+        /* Ring readers only get broadcasts through the ring once it exists */
+        registry.slots[id].ring_reader = opts->ring_reader && broadcast_ring != NULL;
+        registry.slots[id].compact = opts->compact;
+        registry.slots[id].sequenced = sequenced;
+        registry.slots[id].traced = traced;
+        registry.slots[id].spool = spool;
+        ratelimit_init(&registry.slots[id].bucket, &rate_limit, monotonic_ns());
+        stats_client_add(stats, id, queue_id, pid, username);
+    }
+    pthread_rwlock_unlock(&registry.lock);
+
+    if (pidfd != -1) {
+        close(pidfd);  /* Not added, or not watchable */
+    }
+    if (id < 0) {
+        spool_destroy(spool);
+        return id;  /* No slots available or username already taken */
+    }
+    
+    /* Send welcome message. Its seq is the newest message from before
+     * the client joined, so it has somewhere to resume from even if it
+     * leaves before anything else is said. */
+    uint64_t last = history_head(&history);
+    Message welcome_msg;
+    welcome_msg.mtype = MSG_TYPE_ACK;
+    strcpy(welcome_msg.username, "SERVER");
+    sprintf(welcome_msg.content, "Welcome %s! You've joined the chat.", username);
+    welcome_msg.timestamp = time(NULL);
+    welcome_msg.seq = sequenced ? last : 0;
+    memset(welcome_msg.trace, 0, sizeof(welcome_msg.trace));
+
+    if (traced) {
+        /* A traced welcome tells the client we read its stamps */
+        WireMessage wire;
+        welcome_msg.trace[TRACE_FANOUT] = monotonic_ns();
+        if (msgsnd(queue_id, &wire, wire_encode_traced(&welcome_msg, &wire), 0) == 0) {
+            stats_count(stats->msgs_out, MSG_TYPE_ACK, 1);
+        }
+    } else {
+        send_to_client(queue_id, opts->compact, &welcome_msg, 0);
+    }
+
+    /* Context for the newcomer, sent in batches by the replay thread so a
+     * burst of joins never holds up this worker. Only clients that can read
+     * batches ask for it. A client coming back with the last sequence it
+     * saw gets exactly the gap instead, or as much of it as is still kept. */
+    uint64_t first = last + 1;
+    int flags = sequenced ? REPLAY_SEQ : 0;
+    if (sequenced && opts->resume_seq > 0 && opts->resume_seq <= last) {
+        first = opts->resume_seq + 1;
+        flags |= REPLAY_RESUME;
+        uint64_t oldest = history_oldest(&history);
+        if (first < oldest) {
+            first = oldest;
+            flags |= REPLAY_INCOMPLETE;
+        }
+    } else if (history_replay > 0 && opts->compact && opts->wants_history) {
+        int64_t since_ns = 0;
+        if (history_max_age_s > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            since_ns = ((int64_t)ts.tv_sec - history_max_age_s) * 1000000000LL + ts.tv_nsec;
+        }
+        first = history_first(&history, (size_t)history_replay, since_ns);
+    }
+    if (replayer_submit(&replayer, queue_id, first, last, flags) != 0) {
+        printf("Too many replays waiting, %s joins without history\n", username);
+        /* Tell the client too, so a resume knows its gap was not filled */
+        Message notice_msg = welcome_msg;
+        snprintf(notice_msg.content, sizeof(notice_msg.content),
+                 "History replay dropped, too many joins waiting");
+        notice_msg.seq = 0;
+        memset(notice_msg.trace, 0, sizeof(notice_msg.trace));
+        send_to_client(queue_id, opts->compact, &notice_msg, 0);
+    }
+    
+    /* Notify other clients about the new user */
+    Message join_msg;
+    memset(&join_msg, 0, sizeof(join_msg));
+    join_msg.mtype = MSG_TYPE_CHAT;
+    strcpy(join_msg.username, "SERVER");
+    sprintf(join_msg.content, "%s has joined the chat.", username);
+    join_msg.timestamp = time(NULL);
+    
+    add_to_history(&join_msg);
+    broadcast_message(&join_msg, id);
+    add_to_log(&join_msg);
+    
+    printf("Client '%s' connected (id %d)\n", username, id);
+    return id;
+}
+
+/* Remove a client */
+void remove_client(const char *username) {
+    pthread_rwlock_wrlock(&registry.lock);
+    int id = registry_find(&registry, username);
+    if (id == -1) {
+        pthread_rwlock_unlock(&registry.lock);
+        return;  /* Client not found */
+    }
+    release_client_locked(id);
+    pthread_rwlock_unlock(&registry.lock);
+    
+    announce_departure(username);
+}
+
+/* Free a client's slot and what it holds; registry.lock held for writing */
+void release_client_locked(int id) {
+    Client *client = &registry.slots[id];
+    spool_destroy(client->spool);
+    if (client->pidfd != -1) {
+        close(client->pidfd);  /* Also stops watching it */
+    }
+    stats_client_remove(stats, id);
+    registry_remove(&registry, id);
+}
+
+/* Tell everyone a client has gone */
+void announce_departure(const char *username) {
+    Message disconnect_msg;
+    memset(&disconnect_msg, 0, sizeof(disconnect_msg));
+    disconnect_msg.mtype = MSG_TYPE_CHAT;
+    strcpy(disconnect_msg.username, "SERVER");
+    sprintf(disconnect_msg.content, "%s has left the chat.", username);
+    disconnect_msg.timestamp = time(NULL);
+    
+    add_to_history(&disconnect_msg);
+    broadcast_message(&disconnect_msg, -1);  /* Broadcast to all */
+    add_to_log(&disconnect_msg);
+    
+    printf("Client '%s' disconnected\n", username);
+}
+
+/* Send one message to a client queue in the format the client asked for */
+int send_to_client(int queue_id, int compact, Message *msg, int flags) {
+    int result;
+    if (compact) {
+        WireMessage wire;
+        size_t size = wire_encode(msg, &wire);
+        result = msgsnd(queue_id, &wire, size, flags);
+    } else {
+        result = msgsnd(queue_id, msg, FIXED_MSG_BYTES, flags);
+    }
+    if (result == 0) {
+        stats_count(stats->msgs_out, msg->mtype, 1);
+    }
+    return result;
+}
+
+/* Charge lines from sender against its rate limit and return how many of
+ * them may go out. Runs on the sender's dispatch worker, the only thread
+ * that touches its bucket. A sender over the limit is told so once, and
+ * again only after something of its has got through. */
+int admit_lines(const char *sender, int lines) {
+    if (rate_limit.rate == 0) {
+        return lines;
+    }
+
+    Message notice;
+    int notify_queue = -1;
+    int notify_compact = 0;
+    pthread_rwlock_rdlock(&registry.lock);
+    int id = registry_find(&registry, sender);
+    if (id == -1) {
+        pthread_rwlock_unlock(&registry.lock);
+        return lines;  /* Not connected; nothing to charge */
+    }
+    Client *client = &registry.slots[id];
+    int admitted = ratelimit_take(&client->bucket, &rate_limit, monotonic_ns(), lines);
+    if (admitted < lines) {
+        uint64_t dropped = (uint64_t)(lines - admitted);
+        uint64_t total = atomic_fetch_add_explicit(&client->throttled, dropped,
+                                                   memory_order_relaxed) + dropped;
+        atomic_fetch_add_explicit(&stats->throttled, dropped, memory_order_relaxed);
+        if (!client->throttle_noticed) {
+            client->throttle_noticed = 1;
+            notify_queue = client->queue_id;
+            notify_compact = client->compact;
+            notice.mtype = MSG_TYPE_ACK;
+            strcpy(notice.username, "SERVER");
+            snprintf(notice.content, MSG_SIZE,
+                     "Slow down: at most %d message(s) per second, %llu dropped so far.",
+                     rate_limit.rate, (unsigned long long)total);
+            notice.timestamp = time(NULL);
+            notice.seq = 0;
+        }
+    } else {
+        client->throttle_noticed = 0;
+    }
+    pthread_rwlock_unlock(&registry.lock);
+
+    if (notify_queue != -1) {
+        printf("Throttling %s\n", sender);
+        send_to_client(notify_queue, notify_compact, &notice, IPC_NOWAIT);
+    }
+    return admitted;
+}
+
+/* Whether a client's queue is still there; it is removed when the client exits */
+int queue_exists(int queue_id) {
+    struct msqid_ds info;
+    return msgctl(queue_id, IPC_STAT, &info) == 0 || (errno != EINVAL && errno != EIDRM);
+}
+
+/* Broadcast message to all connected clients */
+void broadcast_message(Message *msg, int exclude_id) {
+    pthread_rwlock_rdlock(&registry.lock);
+    broadcast_message_locked(msg, exclude_id);
+    pthread_rwlock_unlock(&registry.lock);
+}
+
+/* Broadcast with registry.lock already held for reading */
+void broadcast_message_locked(Message *msg, int exclude_id) {
+    deliver_locked(msg, NULL, exclude_id);
+}
+
+/* Broadcast every line of a batch, with registry.lock held for reading */
+void broadcast_batch_locked(BatchMessage *batch, int exclude_id) {
+    deliver_locked(NULL, batch, exclude_id);
+}
+
+/* Fan out either one message or a whole batch. Compact clients get a batch
+ * in a single msgsnd; fixed-format clients get its lines one by one.
+ * Sequence numbers are stripped for compact clients that did not ask for
+ * them, from a copy made the first time one is met.
+ * Clients whose queue is gone are only collected here and removed after the
+ * read lock is dropped, so several workers can broadcast at the same time. */
+void deliver_locked(Message *msg, BatchMessage *batch, int exclude_id) {
+    int *dead_ids = NULL;
+    int *dead_queues = NULL;
+    int num_dead = 0;
+    WireMessage wire;
+    size_t wire_size = 0;
+    WireMessage plain_wire;
+    size_t plain_size = 0;
+    BatchMessage plain_batch;
+    int have_plain_batch = 0;
+    Message line;
+    size_t offset;
+    uint64_t sent = 0;           /* msg, or the batch as a whole */
+    uint64_t lines_sent = 0;     /* Batch lines sent one by one */
+    int64_t start = monotonic_ns();
+    int traced = msg && msg->trace[TRACE_CLIENT_SEND] != 0;
+    WireMessage traced_wire;
+    size_t traced_size = 0;
+
+    /* Encode once; compact clients and the ring all share this copy */
+    if (msg) {
+        wire_size = wire_encode(msg, &wire);
+    }
+
+    /* Clients that asked for stamps get a copy of their own */
+    if (traced) {
+        msg->trace[TRACE_FANOUT] = start;
+        stats_record(&stats->trace_to_server,
+                     msg->trace[TRACE_SERVER_RECV] - msg->trace[TRACE_CLIENT_SEND]);
+        stats_record(&stats->trace_in_server, start - msg->trace[TRACE_SERVER_RECV]);
+        traced_size = wire_encode_traced(msg, &traced_wire);
+    }
+
+    /* Ring readers all get each line from a single publish */
+    if (broadcast_ring) {
+        Client *excluded = registry_get(&registry, exclude_id);
+        pid_t exclude_pid = excluded ? excluded->pid : 0;
+        pthread_mutex_lock(&ring_publish_mutex);
+        if (msg) {
+            ring_publish(broadcast_ring, &wire, sizeof(long) + wire_size, exclude_pid);
+        } else {
+            offset = 0;
+            while (batch_next(batch, &offset, &line) == 1) {
+                WireMessage line_wire;
+                size_t line_size = wire_encode(&line, &line_wire);
+                ring_publish(broadcast_ring, &line_wire, sizeof(long) + line_size, exclude_pid);
+            }
+        }
+        pthread_mutex_unlock(&ring_publish_mutex);
+    }
+
+    /* Only connected clients are visited, however large the table has grown */
+    for (int i = 0; i < registry.count; i++) {
+        Client *client = &registry.slots[registry.active_ids[i]];
+        if (client->id == exclude_id || client->ring_reader) {
+            continue;
+        }
+        /* Never blocks: a full queue spools the message instead */
+        ClientSpool *spool = client->spool;
+        int result;
+        if (traced && client->traced) {
+            result = spool_send(spool, client->queue_id, &traced_wire, traced_size);
+        } else if (msg && client->compact && !client->sequenced && msg->seq) {
+            if (plain_size == 0) {
+                line = *msg;
+                line.seq = 0;
+                plain_size = wire_encode(&line, &plain_wire);
+            }
+            result = spool_send(spool, client->queue_id, &plain_wire, plain_size);
+        } else if (msg) {
+            result = client->compact ? spool_send(spool, client->queue_id, &wire, wire_size)
+                                     : spool_send(spool, client->queue_id, msg, FIXED_MSG_BYTES);
+        } else if (client->compact && !client->sequenced) {
+            if (!have_plain_batch) {
+                batch_strip_seq(batch, &plain_batch);
+                have_plain_batch = 1;
+            }
+            result = spool_send(spool, client->queue_id, &plain_batch, batch_size(&plain_batch));
+        } else if (client->compact) {
+            result = spool_send(spool, client->queue_id, batch, batch_size(batch));
+        } else {
+            result = SPOOL_SENT;
+            offset = 0;
+            while (result != SPOOL_GONE && result != SPOOL_OVERFLOW &&
+                   batch_next(batch, &offset, &line) == 1) {
+                result = spool_send(spool, client->queue_id, &line, FIXED_MSG_BYTES);
+                lines_sent += result == SPOOL_SENT || result == SPOOL_QUEUED;
+            }
+        }
+        if (result == SPOOL_SENT || result == SPOOL_QUEUED) {
+            sent += batch == NULL || client->compact;
+        } else if (result == SPOOL_GONE || result == SPOOL_OVERFLOW) {
+            if (result == SPOOL_GONE) {
+                printf("Client %s disconnected, removing from list\n", client->username);
+            } else {
+                printf("Client %s is not keeping up (%zu KB waiting), disconnecting\n",
+                       client->username, spool_bytes / 1024);
+                atomic_fetch_add(&spool_pool.counters->disconnected, 1);
+            }
+            if (dead_ids == NULL) {
+                dead_ids = malloc(registry.count * sizeof(int));
+                dead_queues = malloc(registry.count * sizeof(int));
+                if (dead_ids == NULL || dead_queues == NULL) {
+                    free(dead_ids);
+                    free(dead_queues);
+                    dead_ids = dead_queues = NULL;
+                    continue;
+                }
+            }
+            dead_ids[num_dead] = client->id;
+            dead_queues[num_dead++] = client->queue_id;
+        }
+    }
+
+    /* Counted once per broadcast, not per recipient */
+    stats_count(stats->msgs_out, msg ? msg->mtype : MSG_TYPE_BATCH, sent);
+    if (lines_sent > 0) {
+        stats_count(stats->msgs_out, MSG_TYPE_CHAT, lines_sent);
+    }
+    stats_record(&stats->fanout, monotonic_ns() - start);
+
+    if (num_dead == 0) {
+        return;
+    }
+
+    /* Upgrade: the caller's read lock has to be released first */
+    pthread_rwlock_unlock(&registry.lock);
+    drop_clients(dead_ids, dead_queues, num_dead);
+    pthread_rwlock_rdlock(&registry.lock);
+
+    free(dead_ids);
+    free(dead_queues);
+}
+
+/* Remove clients found dead or hopelessly behind while the registry lock
+ * was only held for reading. Takes the lock for writing; an id is only
+ * removed if nobody reused it in the meantime. */
+void drop_clients(const int *ids, const int *queues, int count) {
+    pthread_rwlock_wrlock(&registry.lock);
+    for (int d = 0; d < count; d++) {
+        Client *client = registry_get(&registry, ids[d]);
+        if (client != NULL && client->queue_id == queues[d]) {
+            release_client_locked(ids[d]);
+        }
+    }
+    pthread_rwlock_unlock(&registry.lock);
+}
+
+/* Handle a batch of chat lines from one client: number and log every line,
+ * then fan the whole batch out with one send per recipient. Numbered
+ * records are larger, so a full batch may go back out as two. */
+void handle_batch(BatchMessage *batch, const char *sender) {
+    Message line;
+    size_t offset = 0;
+
+    /* A client may only batch its own chat lines */
+    while (batch_next(batch, &offset, &line) == 1) {
+        if (line.mtype != MSG_TYPE_CHAT || strcmp(line.username, sender) != 0) {
+            printf("Dropping batch from %s with a foreign or non-chat line\n", sender);
+            return;
+        }
+    }
+
+    /* Lines past the sender's rate limit are dropped from the end */
+    int admitted = admit_lines(sender, batch->count);
+    if (admitted == 0) {
+        return;
+    }
+
+    uint64_t *seqs = malloc(batch->count * sizeof(*seqs));
+    if (seqs == NULL) {
+        perror("malloc batch sequence numbers");
+        return;
+    }
+
+    /* In group commit mode the whole batch shares one wait for the disk */
+    uint64_t log_end = 0;
+    int count = 0;
+    offset = 0;
+    while (count < admitted && batch_next(batch, &offset, &line) == 1) {
+        printf("Chat from %s: %s\n", line.username, line.content);
+        seqs[count++] = add_to_history(&line);
+        uint64_t end = add_to_log(&line);
+        if (end > log_end) {
+            log_end = end;
+        }
+    }
+    log_writer_commit(&log_writer, log_end);
+
+    BatchMessage numbered;
+    batch_init(&numbered);
+    pthread_rwlock_rdlock(&registry.lock);
+    count = 0;
+    offset = 0;
+    while (count < admitted && batch_next(batch, &offset, &line) == 1) {
+        line.seq = seqs[count++];
+        if (batch_append(&numbered, &line) != 0) {
+            /* Looked up each time: a broadcast may drop the lock */
+            broadcast_batch_locked(&numbered, registry_find(&registry, sender));
+            batch_init(&numbered);
+            batch_append(&numbered, &line);
+        }
+    }
+    broadcast_batch_locked(&numbered, registry_find(&registry, sender));
+    pthread_rwlock_unlock(&registry.lock);
+    free(seqs);
+}
+
+/* Handle incoming message based on type */
+void handle_message(Message *msg) {
+    int client_id = -1;
+    
+    /* Check message type */
+    switch (msg->mtype) {
+        case MSG_TYPE_CONNECT: {
+            /* Extract client queue ID from content (assuming it's stored there) */
+            int client_queue_id;
+            pid_t client_pid;
+            int consumed = 0;
+            ConnectOptions opts;
+            memset(&opts, 0, sizeof(opts));
+            /*validation of message format*/
+
+           if (sscanf(msg->content, "%d %d%n", &client_queue_id, &client_pid, &consumed) != 2){
+                printf("Invalid connect message format from %s\n", msg->username);
+                return;  /* Invalid format */
+            }
+
+            /* Optional capabilities follow the pid, e.g. "123 456 ring compact" */
+            char *saveptr = NULL;
+            for (char *opt = strtok_r(msg->content + consumed, " ", &saveptr); opt != NULL;
+                 opt = strtok_r(NULL, " ", &saveptr)) {
+                if (strcmp(opt, "ring") == 0) {
+                    opts.ring_reader = 1;
+                } else if (strcmp(opt, "compact") == 0) {
+                    opts.compact = 1;
+                } else if (strcmp(opt, "history") == 0) {
+                    opts.wants_history = 1;
+                } else if (strcmp(opt, "seq") == 0) {
+                    opts.sequenced = 1;
+                } else if (strcmp(opt, "trace") == 0) {
+                    opts.traced = 1;
+                } else if (strncmp(opt, "resume=", 7) == 0) {
+                    opts.resume_seq = strtoull(opt + 7, NULL, 10);
+                }
+            }
+            
+            /* Check if client is already connected. A join can overtake
+             * the DISCONNECT of this name's last session, which is still
+             * registered then but whose queue is gone. */
+            pthread_rwlock_rdlock(&registry.lock);
+            int existing = registry_find(&registry, msg->username);
+            int stale = existing != -1 && !queue_exists(registry.slots[existing].queue_id);
+            pthread_rwlock_unlock(&registry.lock);
+            if (stale) {
+                remove_client(msg->username);
+                existing = -1;
+            }
+            if (existing != -1) {
+                printf("Client %s is already connected\n", msg->username);
+                return;  /* Already connected */
+            }
+            
+            /* Add the client */
+            int result = add_client(msg->username, client_queue_id, client_pid, &opts);
+            if (result == ADD_CLIENT_EXITED) {
+                break;  /* Nobody left to tell */
+            } else if (result < 0) {
+                printf("Failed to add client %s, no slots available or username taken\n", msg->username);
+                Message error_msg;
+                error_msg.mtype = MSG_TYPE_ACK;
+                strcpy(error_msg.username, "SERVER");
+                sprintf(error_msg.content, "Failed to connect: No slots available or username taken.");
+                error_msg.timestamp = time(NULL);
+                error_msg.seq = 0;
+                
+                send_to_client(client_queue_id, opts.compact, &error_msg, 0);
+            }
+            break;
+        }
+        
+        case MSG_TYPE_DISCONNECT: {
+            /* Clients name their queue, so the leave of an earlier session
+             * that arrives after the name has joined again is ignored */
+            int leaving_queue_id;
+            if (sscanf(msg->content, "%d", &leaving_queue_id) == 1) {
+                pthread_rwlock_rdlock(&registry.lock);
+                int id = registry_find(&registry, msg->username);
+                int current = id == -1 || registry.slots[id].queue_id == leaving_queue_id;
+                pthread_rwlock_unlock(&registry.lock);
+                if (!current) {
+                    printf("Ignoring a late disconnect from an earlier session of %s\n", msg->username);
+                    break;
+                }
+            }
+            /* Handle client disconnection */
+            remove_client(msg->username);
+            break;
+        }
+            
+        case MSG_TYPE_CHAT:
+            if (admit_lines(msg->username, 1) == 0) {
+                break;
+            }
+            /* Handle chat message */
+            printf("Chat from %s: %s\n", msg->username, msg->content);
+            
+            /* Log it first: in group commit mode nobody sees a message
+             * before it is on disk */
+            add_to_history(msg);
+            log_writer_commit(&log_writer, add_to_log(msg));
+            
+            /* Find sender's id to exclude from broadcast (optional) */
+            pthread_rwlock_rdlock(&registry.lock);
+            client_id = registry_find(&registry, msg->username);
+            
+            /* Broadcast under the same read lock so the id stays valid */
+            broadcast_message_locked(msg, client_id);
+            pthread_rwlock_unlock(&registry.lock);
+            break;
+            
+        default:
+            printf("Received message with unknown type: %ld\n", msg->mtype);
+    }
+}
+
+/* Dispatch pool handler: runs on a worker thread */
+void dispatch_message(void *item, void *ctx) {
+    InboundItem *inbound = (InboundItem *)item;
+
+    if (inbound->batch) {
+        handle_batch(inbound->batch, inbound->msg.username);
+        free(inbound->batch);
+    } else {
+        handle_message(&inbound->msg);
+    }
+}
+
+/* Add a message to the log buffer; returns the log offset that has to be
+ * flushed for it to be on disk, or 0 if the log had no room */
+uint64_t add_to_log(Message *msg) {
+    int64_t start = monotonic_ns();
+
+    /* Format message with timestamp */
+    char log_entry[MAX_USERNAME + MSG_SIZE + 64];
+    time_t now = msg->timestamp ? msg->timestamp : time(NULL);
+    size_t len = format_log_entry(log_entry, sizeof(log_entry), now, msg->username, msg->content);
+    
+    /* Add to the log ring; the entry is dropped if the writer is far behind */
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t end = 0;
+    if (log_append(log_buffer, log_entry, len, (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec,
+                   &end) == 0) {
+        atomic_fetch_add_explicit(&stats->log_dropped, 1, memory_order_relaxed);
+    }
+    log_writer_notify(&log_writer);
+    stats_record(&stats->log_append, monotonic_ns() - start);
+    return end;
+}
+
+/* Remember a broadcast message for replay to clients that join later, and
+ * number it; returns the sequence number, which is also stored in msg->seq */
+uint64_t add_to_history(Message *msg) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    msg->seq = history_append(&history, msg, (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+    return msg->seq;
+}
@@ -0,0 +1,100 @@
+#ifndef CHAT_CORE_H
+#define CHAT_CORE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "chat_protocol.h"
+#include "chat_registry.h"
+#include "chat_ring.h"
+#include "chat_log.h"
+#include "chat_logwriter.h"
+#include "chat_history.h"
+#include "chat_spool.h"
+#include "chat_ratelimit.h"
+#include "chat_liveness.h"
+#include "chat_stats.h"
+
+/*
+ * The server's message path: joins and leaves, chat lines and batches,
+ * fan-out to every client, and the log and history appends behind them.
+ *
+ * It works on the server's shared state below and nothing else, so it can
+ * be linked into a benchmark or test without chat_server.c's threads and
+ * queues. Whoever links it sets that state up first: chat_server.c's
+ * initialize_server(), or a harness with a registry, log buffer, history,
+ * spool pool and stats of its own. broadcast_ring stays NULL and
+ * watching_clients 0 unless they are set up as well.
+ */
+
+#define ADD_CLIENT_EXITED -3      /* add_client(): the process is already gone */
+
+/* What the receiver hands to the dispatch pool: a single message, or a
+ * heap copy of a batch (owned by the worker) with msg.username set to the
+ * sender so it shards like the sender's other messages */
+typedef struct {
+    Message msg;
+    BatchMessage *batch;
+} InboundItem;
+
+/* Capabilities a client lists after its pid in CONNECT */
+typedef struct {
+    int ring_reader;             /* "ring": reads broadcasts from shared memory */
+    int compact;                 /* "compact": compact format and batches */
+    int wants_history;           /* "history": replay recent messages on join */
+    int sequenced;               /* "seq": sequence numbers on broadcasts */
+    int traced;                  /* "trace": trace stamps on single messages */
+    uint64_t resume_seq;         /* "resume=N": last message seen before, or 0 */
+} ConnectOptions;
+
+/* Shared state, defined in chat_core.c */
+extern ClientRegistry registry;
+extern LogBuffer *log_buffer;
+extern LogWriter log_writer;
+extern BroadcastRing *broadcast_ring;   /* Only set when started with -b */
+extern pthread_mutex_t ring_publish_mutex;
+extern ChatHistory history;
+extern HistoryReplayer replayer;
+extern int history_replay;              /* Messages replayed on join (-H) */
+extern int history_max_age_s;           /* Only those this recent (-T), 0 for any */
+extern SpoolPool spool_pool;
+extern size_t spool_bytes;              /* Per-client backlog cap (-S) */
+extern int spool_policy;                /* What a full backlog gives up (-P) */
+extern RateLimit rate_limit;            /* Per-client chat lines (-R, -B) */
+extern LivenessWatcher liveness;
+extern int watching_clients;            /* Set once the reaper thread runs */
+extern ServerStats *stats;              /* Shared with chat_stats, see chat_stats.h */
+
+static inline int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Joins and leaves */
+int add_client(const char *username, int queue_id, pid_t pid, const ConnectOptions *opts);
+void remove_client(const char *username);
+void release_client_locked(int id);
+void announce_departure(const char *username);
+void drop_clients(const int *ids, const int *queues, int count);
+int queue_exists(int queue_id);
+
+/* Delivery */
+int send_to_client(int queue_id, int compact, Message *msg, int flags);
+void broadcast_message(Message *msg, int exclude_id);
+void broadcast_message_locked(Message *msg, int exclude_id);
+void broadcast_batch_locked(BatchMessage *batch, int exclude_id);
+void deliver_locked(Message *msg, BatchMessage *batch, int exclude_id);
+
+/* Inbound messages, on a dispatch worker */
+void handle_batch(BatchMessage *batch, const char *sender);
+void handle_message(Message *msg);
+void dispatch_message(void *item, void *ctx);
+int admit_lines(const char *sender, int lines);
+
+/* Log and history */
+uint64_t add_to_log(Message *msg);
+uint64_t add_to_history(Message *msg);
+
+#endif /* CHAT_CORE_H */
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat_dispatch.h"
+
+/* Worker thread: handle items of one shard in FIFO order */
+static void *dispatch_worker(void *arg) {
+    DispatchShard *shard = (DispatchShard *)arg;
+    DispatchPool *pool = shard->pool;
+    char *item = malloc(pool->item_size);
+
+    if (item == NULL) {
+        perror("malloc dispatch item");
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&shard->mutex);
+        while (shard->count == 0 && shard->urgent_count == 0 && !shard->stopping) {
+            pthread_cond_wait(&shard->not_empty, &shard->mutex);
+        }
+
+        /* Copy out so the handler runs without holding the shard lock */
+        if (shard->urgent_count > 0) {
+            memcpy(item, shard->urgent_items + shard->urgent_head * pool->item_size, pool->item_size);
+            shard->urgent_head = (shard->urgent_head + 1) % DISPATCH_URGENT_CAPACITY;
+            shard->urgent_count--;
+            pthread_cond_signal(&shard->urgent_not_full);
+        } else if (shard->count > 0) {
+            memcpy(item, shard->items + shard->head * pool->item_size, pool->item_size);
+            shard->head = (shard->head + 1) % DISPATCH_SHARD_CAPACITY;
+            shard->count--;
+            pthread_cond_signal(&shard->not_full);
+        } else {
+            /* Stopping and fully drained */
+            pthread_mutex_unlock(&shard->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        pool->handler(item, pool->ctx);
+    }
+
+    free(item);
+    return NULL;
+}
+
+int dispatch_pool_init(DispatchPool *pool, int num_workers, size_t item_size,
+                       dispatch_handler_t handler, void *ctx) {
+    if (num_workers < 1) {
+        num_workers = 1;
+    }
+    if (num_workers > DISPATCH_MAX_WORKERS) {
+        num_workers = DISPATCH_MAX_WORKERS;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    pool->num_workers = num_workers;
+    pool->item_size = item_size;
+    pool->handler = handler;
+    pool->ctx = ctx;
+
+    for (int i = 0; i < num_workers; i++) {
+        DispatchShard *shard = &pool->shards[i];
+        shard->pool = pool;
+        shard->items = malloc(DISPATCH_SHARD_CAPACITY * item_size);
+        shard->urgent_items = malloc(DISPATCH_URGENT_CAPACITY * item_size);
+        if (shard->items == NULL || shard->urgent_items == NULL) {
+            perror("malloc dispatch shard");
+            free(shard->items);
+            free(shard->urgent_items);
+            pool->num_workers = i;
+            dispatch_pool_shutdown(pool);
+            return -1;
+        }
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->not_empty, NULL);
+        pthread_cond_init(&shard->not_full, NULL);
+        pthread_cond_init(&shard->urgent_not_full, NULL);
+
+        if (pthread_create(&shard->tid, NULL, dispatch_worker, shard) != 0) {
+            perror("Failed to create dispatch worker");
+            pthread_mutex_destroy(&shard->mutex);
+            pthread_cond_destroy(&shard->not_empty);
+            pthread_cond_destroy(&shard->not_full);
+            pthread_cond_destroy(&shard->urgent_not_full);
+            free(shard->items);
+            free(shard->urgent_items);
+            pool->num_workers = i;
+            dispatch_pool_shutdown(pool);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void dispatch_submit(DispatchPool *pool, unsigned int key, const void *item) {
+    DispatchShard *shard = &pool->shards[key % pool->num_workers];
+
+    pthread_mutex_lock(&shard->mutex);
+    while (shard->count == DISPATCH_SHARD_CAPACITY) {
+        pthread_cond_wait(&shard->not_full, &shard->mutex);
+    }
+    size_t tail = (shard->head + shard->count) % DISPATCH_SHARD_CAPACITY;
+    memcpy(shard->items + tail * pool->item_size, item, pool->item_size);
+    shard->count++;
+    pthread_cond_signal(&shard->not_empty);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void dispatch_submit_urgent(DispatchPool *pool, unsigned int key, const void *item) {
+    DispatchShard *shard = &pool->shards[key % pool->num_workers];
+
+    pthread_mutex_lock(&shard->mutex);
+    while (shard->urgent_count == DISPATCH_URGENT_CAPACITY) {
+        pthread_cond_wait(&shard->urgent_not_full, &shard->mutex);
+    }
+    size_t tail = (shard->urgent_head + shard->urgent_count) % DISPATCH_URGENT_CAPACITY;
+    memcpy(shard->urgent_items + tail * pool->item_size, item, pool->item_size);
+    shard->urgent_count++;
+    pthread_cond_signal(&shard->not_empty);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void dispatch_pool_shutdown(DispatchPool *pool) {
+    /* Flag every shard under its own lock so no worker misses the wakeup */
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_mutex_lock(&pool->shards[i].mutex);
+        pool->shards[i].stopping = 1;
+        pthread_cond_broadcast(&pool->shards[i].not_empty);
+        pthread_mutex_unlock(&pool->shards[i].mutex);
+    }
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        DispatchShard *shard = &pool->shards[i];
+        pthread_join(shard->tid, NULL);
+        pthread_mutex_destroy(&shard->mutex);
+        pthread_cond_destroy(&shard->not_empty);
+        pthread_cond_destroy(&shard->not_full);
+        pthread_cond_destroy(&shard->urgent_not_full);
+        free(shard->items);
+        free(shard->urgent_items);
+        shard->items = NULL;
+        shard->urgent_items = NULL;
+    }
+    pool->num_workers = 0;
+}
+
+unsigned int dispatch_hash(const char *str) {
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,68 @@
+#ifndef CHAT_DISPATCH_H
+#define CHAT_DISPATCH_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Sharded dispatch pool.
+ *
+ * Items are copied into one of N worker shards chosen by a caller supplied
+ * key (the sender's username hash in the server). Every shard is a bounded
+ * FIFO served by exactly one worker thread, so items with the same key are
+ * handled in submission order while different keys run in parallel.
+ *
+ * Each shard also has a small urgent lane that its worker empties before
+ * touching the FIFO, so a few items (joins in the server) never wait behind
+ * a full shard of chat.
+ */
+
+#define DISPATCH_MAX_WORKERS 64
+#define DISPATCH_SHARD_CAPACITY 1024
+#define DISPATCH_URGENT_CAPACITY 64
+
+typedef void (*dispatch_handler_t)(void *item, void *ctx);
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t urgent_not_full;
+    size_t head;       /* Next item to handle */
+    size_t count;      /* Items currently queued */
+    size_t urgent_head;
+    size_t urgent_count;
+    int stopping;      /* Set under mutex by dispatch_pool_shutdown() */
+    char *items;       /* DISPATCH_SHARD_CAPACITY * item_size bytes */
+    char *urgent_items;  /* DISPATCH_URGENT_CAPACITY * item_size bytes */
+    pthread_t tid;
+    struct DispatchPool *pool;
+} DispatchShard;
+
+typedef struct DispatchPool {
+    int num_workers;
+    size_t item_size;
+    dispatch_handler_t handler;
+    void *ctx;
+    DispatchShard shards[DISPATCH_MAX_WORKERS];
+} DispatchPool;
+
+/* Start num_workers threads; returns 0 on success, -1 on failure */
+int dispatch_pool_init(DispatchPool *pool, int num_workers, size_t item_size,
+                       dispatch_handler_t handler, void *ctx);
+
+/* Copy item into the shard for key; blocks while that shard is full */
+void dispatch_submit(DispatchPool *pool, unsigned int key, const void *item);
+
+/* Like dispatch_submit(), but the item is handled ahead of everything the
+ * shard already holds from dispatch_submit(), so it may overtake earlier
+ * items with the same key. Urgent items keep their order among themselves. */
+void dispatch_submit_urgent(DispatchPool *pool, unsigned int key, const void *item);
+
+/* Handle everything still queued, then join and free the workers */
+void dispatch_pool_shutdown(DispatchPool *pool);
+
+/* FNV-1a hash of a NUL terminated string, used to pick a shard */
+unsigned int dispatch_hash(const char *str);
+
+#endif /* CHAT_DISPATCH_H */
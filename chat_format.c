@@ -0,0 +1,66 @@
+#include <string.h>
+#include "chat_format.h"
+
+/* Per-thread cache of the current minute */
+typedef struct {
+    time_t minute_start;        /* First second of the cached minute */
+    int valid;
+    char text[TIMESTAMP_LEN + 1];
+} TimestampCache;
+
+static __thread TimestampCache timestamp_cache;
+
+const char *format_timestamp(time_t t) {
+    TimestampCache *cache = &timestamp_cache;
+
+    if (!cache->valid || t < cache->minute_start || t - cache->minute_start >= 60) {
+        /* New minute: ask the C library, which also covers DST changes */
+        struct tm tm_info;
+        localtime_r(&t, &tm_info);
+        cache->text[0] = '0' + tm_info.tm_hour / 10;
+        cache->text[1] = '0' + tm_info.tm_hour % 10;
+        cache->text[2] = ':';
+        cache->text[3] = '0' + tm_info.tm_min / 10;
+        cache->text[4] = '0' + tm_info.tm_min % 10;
+        cache->text[5] = ':';
+        cache->text[8] = '\0';
+        cache->minute_start = t - tm_info.tm_sec;
+        cache->valid = 1;
+    }
+
+    int sec = (int)(t - cache->minute_start);
+    cache->text[6] = '0' + sec / 10;
+    cache->text[7] = '0' + sec % 10;
+    return cache->text;
+}
+
+/* Append up to len bytes of src at *pos, keeping room for the newline */
+static size_t append(char *buf, size_t pos, size_t limit, const char *src, size_t len) {
+    if (pos + len > limit) {
+        len = limit > pos ? limit - pos : 0;
+    }
+    memcpy(buf + pos, src, len);
+    return pos + len;
+}
+
+size_t format_log_entry(char *buf, size_t size, time_t t,
+                        const char *username, const char *content) {
+    if (size < 2) {
+        if (size == 1) {
+            buf[0] = '\0';
+        }
+        return 0;
+    }
+    size_t limit = size - 2;    /* Room for "\n" and the NUL */
+    size_t pos = 0;
+
+    pos = append(buf, pos, limit, "[", 1);
+    pos = append(buf, pos, limit, format_timestamp(t), TIMESTAMP_LEN);
+    pos = append(buf, pos, limit, "] <", 3);
+    pos = append(buf, pos, limit, username, strlen(username));
+    pos = append(buf, pos, limit, ">: ", 3);
+    pos = append(buf, pos, limit, content, strlen(content));
+    buf[pos++] = '\n';
+    buf[pos] = '\0';
+    return pos;
+}
@@ -0,0 +1,25 @@
+#ifndef CHAT_FORMAT_H
+#define CHAT_FORMAT_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define TIMESTAMP_LEN 8         /* "HH:MM:SS" */
+
+/*
+ * Local "HH:MM:SS" for a time, from a per-thread cache. localtime_r() (and
+ * glibc's timezone lock) only runs when the minute changes; within a minute
+ * just the seconds digits are rewritten. The string stays valid until the
+ * same thread calls this again.
+ */
+const char *format_timestamp(time_t t);
+
+/*
+ * Write "[HH:MM:SS] <username>: content\n" into buf without going through
+ * printf. Output is truncated (still ending in a newline) if buf is too
+ * small. Returns the length written, excluding the terminating NUL.
+ */
+size_t format_log_entry(char *buf, size_t size, time_t t,
+                        const char *username, const char *content);
+
+#endif /* CHAT_FORMAT_H */
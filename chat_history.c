@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include "chat_history.h"
+
+#define REPLAY_RETRY_MS 5    /* Pause when every waiting queue was full */
+
+int history_init(ChatHistory *history, size_t capacity, uint64_t first_seq) {
+    history->slots = calloc(capacity, sizeof(HistorySlot));
+    if (!history->slots) {
+        perror("calloc history");
+        return -1;
+    }
+    history->capacity = capacity;
+    history->start = first_seq;
+    atomic_init(&history->head, first_seq - 1);
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&history->slots[i].seq, 0);
+    }
+    pthread_mutex_init(&history->append_mutex, NULL);
+    return 0;
+}
+
+void history_destroy(ChatHistory *history) {
+    pthread_mutex_destroy(&history->append_mutex);
+    free(history->slots);
+    history->slots = NULL;
+}
+
+uint64_t history_append(ChatHistory *history, const Message *msg, int64_t received_ns) {
+    pthread_mutex_lock(&history->append_mutex);
+    uint64_t seq = atomic_load_explicit(&history->head, memory_order_relaxed) + 1;
+    HistorySlot *slot = &history->slots[(seq - 1) % history->capacity];
+
+    /* Mark the slot as being written before touching its contents */
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->received_ns = received_ns;
+    memcpy(&slot->msg, msg, sizeof(Message));
+    slot->msg.seq = seq;
+
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&history->head, seq, memory_order_release);
+    pthread_mutex_unlock(&history->append_mutex);
+    return seq;
+}
+
+uint64_t history_head(ChatHistory *history) {
+    return atomic_load_explicit(&history->head, memory_order_acquire);
+}
+
+uint64_t history_oldest(ChatHistory *history) {
+    uint64_t head = history_head(history);
+    uint64_t kept = head + 1 - history->start;
+    return kept > history->capacity ? head + 1 - history->capacity : history->start;
+}
+
+int history_read(ChatHistory *history, uint64_t seq, Message *out, int64_t *received_ns) {
+    if (seq < history->start || seq > history_head(history)) {
+        return seq < history->start ? HISTORY_GONE : HISTORY_EMPTY;
+    }
+    HistorySlot *slot = &history->slots[(seq - 1) % history->capacity];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq) {
+        return HISTORY_GONE;
+    }
+    memcpy(out, &slot->msg, sizeof(Message));
+    int64_t received = slot->received_ns;
+
+    /* Still the same message after the copy, so the copy is whole */
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+        return HISTORY_GONE;
+    }
+    if (received_ns) {
+        *received_ns = received;
+    }
+    return HISTORY_OK;
+}
+
+uint64_t history_first(ChatHistory *history, size_t max_count, int64_t since_ns) {
+    uint64_t head = history_head(history);
+    uint64_t first = history_oldest(history);
+    if (head + 1 - first > max_count) {
+        first = head + 1 - max_count;
+    }
+    if (since_ns <= 0) {
+        return first;
+    }
+
+    /* Walk back from the newest until a message is too old */
+    uint64_t seq = head + 1;
+    Message msg;
+    int64_t received_ns;
+    while (seq > first && history_read(history, seq - 1, &msg, &received_ns) == HISTORY_OK &&
+           received_ns >= since_ns) {
+        seq--;
+    }
+    return seq;
+}
+
+static int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Tell a client its replay was given up on; returns 0 once sent */
+static int replay_notice(ReplayJob *job, BatchMessage *batch) {
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.mtype = MSG_TYPE_ACK;
+    strcpy(msg.username, "SERVER");
+    snprintf(msg.content, sizeof(msg.content),
+             "History replay abandoned, %llu message(s) not sent",
+             (unsigned long long)(job->last - job->next + 1));
+    msg.timestamp = time(NULL);
+    batch_init(batch);
+    batch_append(batch, &msg);
+    if (msgsnd(job->queue_id, batch, batch_size(batch), IPC_NOWAIT) == -1) {
+        return errno == EAGAIN ? -1 : 0;  /* A queue that is gone needs no notice */
+    }
+    return 0;
+}
+
+/*
+ * Send the next batch of a job. Returns 1 if the job is finished, 0 if it
+ * still has more to send, -1 if it should be dropped. *sent counts the
+ * history messages that went out.
+ */
+static int replay_step(HistoryReplayer *replayer, ReplayJob *job, BatchMessage *batch,
+                       uint64_t *sent) {
+    ChatHistory *history = replayer->history;
+    Message msg;
+    if (job->abandoned_ns != 0) {
+        /* Keep trying the notice for a while, the queue was full */
+        return replay_notice(job, batch) == 0 ||
+               monotonic_ns() - job->abandoned_ns > REPLAY_STALL_NS ? -1 : 0;
+    }
+    batch_init(batch);
+
+    if (!job->started) {
+        memset(&msg, 0, sizeof(msg));
+        msg.mtype = MSG_TYPE_HISTORY;
+        strcpy(msg.username, "SERVER");
+        unsigned long long count = job->last - job->next + 1;
+        if (!(job->flags & REPLAY_RESUME)) {
+            snprintf(msg.content, sizeof(msg.content), "Last %llu message(s) before you joined:",
+                     count);
+        } else if (job->flags & REPLAY_INCOMPLETE) {
+            snprintf(msg.content, sizeof(msg.content),
+                     "Missed %llu message(s) while away (older ones are gone):", count);
+        } else {
+            snprintf(msg.content, sizeof(msg.content), "Missed %llu message(s) while away:",
+                     count);
+        }
+        msg.timestamp = time(NULL);
+        batch_append(batch, &msg);
+    }
+
+    uint64_t seq = job->next;
+    int messages = 0;
+    while (seq <= job->last) {
+        int result = history_read(history, seq, &msg, NULL);
+        if (result == HISTORY_OK) {
+            msg.mtype = MSG_TYPE_HISTORY;
+            if (!(job->flags & REPLAY_SEQ)) {
+                msg.seq = 0;
+            }
+            if (batch_append(batch, &msg) != 0) {
+                break;
+            }
+            messages++;
+            seq++;
+        } else {
+            /* Overwritten while we waited: carry on from the oldest left */
+            uint64_t oldest = history_oldest(history);
+            seq = seq + 1 > oldest ? seq + 1 : oldest;
+        }
+    }
+    if (batch->count == 0) {
+        return 1;
+    }
+
+    if (msgsnd(job->queue_id, batch, batch_size(batch), IPC_NOWAIT) == -1) {
+        if (errno != EAGAIN) {
+            return -1;  /* Client is gone */
+        }
+        int64_t now = monotonic_ns();
+        if (job->stalled_ns == 0) {
+            job->stalled_ns = now;
+        }
+        if (now - job->stalled_ns <= REPLAY_STALL_NS) {
+            return 0;
+        }
+        job->abandoned_ns = now;
+        return replay_notice(job, batch) == 0 ? -1 : 0;
+    }
+    job->started = 1;
+    job->stalled_ns = 0;
+    job->next = seq;
+    *sent += messages;
+    return seq > job->last;
+}
+
+static void *replayer_thread(void *arg) {
+    HistoryReplayer *replayer = (HistoryReplayer *)arg;
+    BatchMessage batch;
+
+    pthread_mutex_lock(&replayer->mutex);
+    while (!replayer->stopping) {
+        if (replayer->count == 0) {
+            pthread_cond_wait(&replayer->cond, &replayer->mutex);
+            continue;
+        }
+
+        /* Jobs below count only move under the mutex, which we hold again
+         * before compacting, so they can be worked on unlocked */
+        int count = replayer->count;
+        pthread_mutex_unlock(&replayer->mutex);
+
+        int done[REPLAY_MAX_JOBS];
+        int progress = 0;
+        uint64_t messages = 0, sends = 0;
+        for (int i = 0; i < count; i++) {
+            uint64_t before = replayer->jobs[i].next;
+            int started = replayer->jobs[i].started;
+            done[i] = replay_step(replayer, &replayer->jobs[i], &batch, &messages);
+            if (replayer->jobs[i].next != before || replayer->jobs[i].started != started) {
+                progress = 1;
+                sends++;
+            }
+        }
+
+        pthread_mutex_lock(&replayer->mutex);
+        int kept = 0;
+        for (int i = 0; i < replayer->count; i++) {
+            if (i < count && done[i] != 0) {
+                if (done[i] > 0) {
+                    replayer->replays++;
+                } else {
+                    replayer->abandoned++;
+                }
+                continue;
+            }
+            replayer->jobs[kept++] = replayer->jobs[i];
+        }
+        replayer->count = kept;
+        replayer->messages += messages;
+        replayer->sends += sends;
+
+        if (!progress && kept > 0 && !replayer->stopping) {
+            /* Every waiting queue is full: give the clients time to read */
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += REPLAY_RETRY_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&replayer->cond, &replayer->mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&replayer->mutex);
+    return NULL;
+}
+
+int replayer_start(HistoryReplayer *replayer, ChatHistory *history) {
+    memset(replayer, 0, sizeof(*replayer));
+    replayer->history = history;
+    pthread_mutex_init(&replayer->mutex, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&replayer->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    if (pthread_create(&replayer->tid, NULL, replayer_thread, replayer) != 0) {
+        perror("Failed to create history replay thread");
+        pthread_cond_destroy(&replayer->cond);
+        pthread_mutex_destroy(&replayer->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+int replayer_submit(HistoryReplayer *replayer, int queue_id, uint64_t first, uint64_t last,
+                    int flags) {
+    if (first > last) {
+        return 0;  /* Nothing to replay */
+    }
+    pthread_mutex_lock(&replayer->mutex);
+    if (replayer->count == REPLAY_MAX_JOBS) {
+        replayer->abandoned++;
+        pthread_mutex_unlock(&replayer->mutex);
+        return -1;
+    }
+    ReplayJob *job = &replayer->jobs[replayer->count++];
+    memset(job, 0, sizeof(*job));
+    job->queue_id = queue_id;
+    job->flags = flags;
+    job->next = first;
+    job->last = last;
+    pthread_cond_signal(&replayer->cond);
+    pthread_mutex_unlock(&replayer->mutex);
+    return 0;
+}
+
+void replayer_stop(HistoryReplayer *replayer) {
+    pthread_mutex_lock(&replayer->mutex);
+    replayer->stopping = 1;
+    pthread_cond_signal(&replayer->cond);
+    pthread_mutex_unlock(&replayer->mutex);
+    pthread_join(replayer->tid, NULL);
+    pthread_cond_destroy(&replayer->cond);
+    pthread_mutex_destroy(&replayer->mutex);
+}
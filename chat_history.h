@@ -0,0 +1,124 @@
+#ifndef CHAT_HISTORY_H
+#define CHAT_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "chat_protocol.h"
+
+/*
+ * In-memory history of broadcast messages, for replaying context to
+ * clients that have just joined and the gap to clients that come back.
+ *
+ * A ring of capacity slots holding the most recent messages. Sequence
+ * numbers start where history_init() is told to, and message n lives in
+ * slot (n - 1) % capacity. They double as the sequence numbers broadcasts
+ * carry, so the server starts them from its start time: a client resuming
+ * with a number from an earlier run can never mistake it for a new message.
+ * Appends take a short
+ * mutex to order themselves; reads take no lock at all: a slot's seq is
+ * cleared while it is rewritten, so a reader copies the message and then
+ * checks the seq is still the one it wanted, as with the broadcast ring.
+ */
+
+#define DEFAULT_HISTORY_SLOTS 4096
+#define DEFAULT_HISTORY_REPLAY 20        /* Messages replayed on join (-H) */
+#define REPLAY_MAX_JOBS 1024             /* Joins waiting for their replay */
+#define REPLAY_STALL_NS (5 * 1000000000LL)  /* Give up on a queue full this long */
+
+/* history_read() results */
+#define HISTORY_OK 0
+#define HISTORY_EMPTY 1          /* Not appended yet */
+#define HISTORY_GONE 2           /* Overwritten by newer messages */
+
+typedef struct {
+    _Atomic uint64_t seq;        /* Message stored here, 0 while writing */
+    int64_t received_ns;         /* CLOCK_REALTIME when appended */
+    Message msg;
+} HistorySlot;
+
+typedef struct {
+    size_t capacity;
+    uint64_t start;              /* First sequence this history hands out */
+    _Atomic uint64_t head;       /* Last appended sequence */
+    pthread_mutex_t append_mutex;
+    HistorySlot *slots;
+} ChatHistory;
+
+/* Sequences start at first_seq, which must not be 0 */
+int history_init(ChatHistory *history, size_t capacity, uint64_t first_seq);
+void history_destroy(ChatHistory *history);
+
+/* Append a copy of msg; returns its sequence number, which the copy
+ * carries in its seq field */
+uint64_t history_append(ChatHistory *history, const Message *msg, int64_t received_ns);
+
+/* Copy message seq into out */
+int history_read(ChatHistory *history, uint64_t seq, Message *out, int64_t *received_ns);
+
+/* Last appended sequence, start - 1 if none */
+uint64_t history_head(ChatHistory *history);
+
+/* Oldest sequence that can still be read, or history_head() + 1 if none */
+uint64_t history_oldest(ChatHistory *history);
+
+/* First sequence worth replaying: at most max_count messages back from the
+ * head, none received before since_ns (0 for no time limit). Returns
+ * history_head() + 1 if there is nothing to replay. */
+uint64_t history_first(ChatHistory *history, size_t max_count, int64_t since_ns);
+
+/* replayer_submit() flags */
+#define REPLAY_SEQ 1             /* Client wants sequence numbers */
+#define REPLAY_RESUME 2          /* Filling the gap for a returning client */
+#define REPLAY_INCOMPLETE 4      /* Part of that gap is no longer kept */
+
+/* One pending replay */
+typedef struct {
+    int queue_id;
+    int flags;                   /* REPLAY_* */
+    uint64_t next;               /* Next sequence to send */
+    uint64_t last;               /* Last sequence to send */
+    int started;                 /* Header line sent */
+    int64_t stalled_ns;          /* When the queue was first found full, or 0 */
+    int64_t abandoned_ns;        /* When given up on, or 0; only the notice is left to send */
+} ReplayJob;
+
+/*
+ * Background sender for join replays.
+ *
+ * Workers only queue a job (never blocking), and one thread packs the
+ * messages into MSG_TYPE_BATCH envelopes of MSG_TYPE_HISTORY records and
+ * sends them with IPC_NOWAIT. Jobs take turns one batch at a time, so a
+ * connect storm shares the thread fairly, and a client whose queue is full
+ * is retried later instead of holding anyone up. Live broadcasts never wait
+ * for a replay. A replay given up on ends with an ACK telling the client,
+ * so it knows the gap was not filled.
+ */
+typedef struct {
+    ChatHistory *history;
+    pthread_mutex_t mutex;       /* Protects everything below */
+    pthread_cond_t cond;
+    ReplayJob jobs[REPLAY_MAX_JOBS];
+    int count;
+    int stopping;
+    pthread_t tid;
+
+    /* Statistics */
+    uint64_t replays;            /* Jobs finished */
+    uint64_t messages;           /* History messages sent */
+    uint64_t sends;              /* msgsnd() calls that carried them */
+    uint64_t abandoned;          /* Jobs given up: queue gone, full too long, or no room */
+} HistoryReplayer;
+
+int replayer_start(HistoryReplayer *replayer, ChatHistory *history);
+
+/* Queue a replay of messages first..last to a compact client's queue.
+ * Returns 0, or -1 if too many replays are already waiting. */
+int replayer_submit(HistoryReplayer *replayer, int queue_id, uint64_t first, uint64_t last,
+                    int flags);
+
+/* Stop the thread; replays still waiting are dropped */
+void replayer_stop(HistoryReplayer *replayer);
+
+#endif /* CHAT_HISTORY_H */
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "chat_liveness.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434       /* Same number on every architecture */
+#endif
+
+#define WAKE_TAG UINT64_MAX
+
+int liveness_init(LivenessWatcher *watcher) {
+    watcher->epoll_fd = -1;
+    watcher->wake_fd = -1;
+
+    /* Probe with our own pid so a kernel without pidfds disables us up front */
+    int probe = liveness_open(getpid());
+    if (probe == -1) {
+        perror("pidfd_open");
+        return -1;
+    }
+    close(probe);
+
+    watcher->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    watcher->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (watcher->epoll_fd == -1 || watcher->wake_fd == -1) {
+        perror("epoll/eventfd");
+        liveness_destroy(watcher);
+        return -1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_TAG;
+    if (epoll_ctl(watcher->epoll_fd, EPOLL_CTL_ADD, watcher->wake_fd, &event) == -1) {
+        perror("epoll_ctl wake");
+        liveness_destroy(watcher);
+        return -1;
+    }
+    return 0;
+}
+
+void liveness_destroy(LivenessWatcher *watcher) {
+    if (watcher->epoll_fd != -1) {
+        close(watcher->epoll_fd);
+    }
+    if (watcher->wake_fd != -1) {
+        close(watcher->wake_fd);
+    }
+    watcher->epoll_fd = -1;
+    watcher->wake_fd = -1;
+}
+
+int liveness_open(pid_t pid) {
+    if (pid <= 0) {
+        errno = ESRCH;
+        return -1;
+    }
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+int liveness_add(LivenessWatcher *watcher, int pidfd, uint64_t tag) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+    return epoll_ctl(watcher->epoll_fd, EPOLL_CTL_ADD, pidfd, &event);
+}
+
+int liveness_exited(int pidfd) {
+    struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 1;
+}
+
+int liveness_wait(LivenessWatcher *watcher, uint64_t *tags, int max) {
+    struct epoll_event events[LIVENESS_MAX_EVENTS];
+    if (max > LIVENESS_MAX_EVENTS) {
+        max = LIVENESS_MAX_EVENTS;
+    }
+
+    int ready;
+    do {
+        ready = epoll_wait(watcher->epoll_fd, events, max, -1);
+    } while (ready == -1 && errno == EINTR);
+    if (ready == -1) {
+        return -1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < ready; i++) {
+        if (events[i].data.u64 == WAKE_TAG) {
+            uint64_t ignored;
+            if (read(watcher->wake_fd, &ignored, sizeof(ignored)) == -1) {
+                /* Already drained by an earlier wakeup */
+            }
+        } else {
+            tags[count++] = events[i].data.u64;
+        }
+    }
+    return count;
+}
+
+void liveness_wake(LivenessWatcher *watcher) {
+    uint64_t one = 1;
+    if (write(watcher->wake_fd, &one, sizeof(one)) == -1) {
+        perror("liveness wake");
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef CHAT_LIVENESS_H
+#define CHAT_LIVENESS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Client process liveness.
+ *
+ * Every connected client's pid is opened as a pidfd (pidfd_open(2), Linux
+ * 5.3+) and added to one epoll set. A pidfd turns readable when its process
+ * exits, so a thread blocked in liveness_wait() hears of a dead client the
+ * moment it dies, kill -9 included, without polling anything. Each watched
+ * pidfd carries a caller supplied tag that comes back when it fires.
+ *
+ * Where pidfds are not available the watcher stays disabled and clients
+ * are only found dead when a send to their queue fails, as before.
+ */
+
+#define LIVENESS_MAX_EVENTS 64
+
+typedef struct {
+    int epoll_fd;                /* -1 when disabled */
+    int wake_fd;                 /* eventfd for liveness_wake() */
+} LivenessWatcher;
+
+/* Returns 0, or -1 with the watcher disabled */
+int liveness_init(LivenessWatcher *watcher);
+void liveness_destroy(LivenessWatcher *watcher);
+
+/* Open a pidfd for pid. Returns it, or -1 with errno set: ESRCH if the
+ * process is already gone, ENOSYS if the kernel has no pidfds. */
+int liveness_open(pid_t pid);
+
+/* Start watching an open pidfd; closing it stops the watch */
+int liveness_add(LivenessWatcher *watcher, int pidfd, uint64_t tag);
+
+/* Whether the process behind pidfd has exited, without blocking */
+int liveness_exited(int pidfd);
+
+/* Block until watched processes exit or liveness_wake() is called. Returns
+ * how many tags were stored in tags (at most max), 0 for a wakeup, -1 on
+ * error. A process that exited stays reported until its pidfd is closed. */
+int liveness_wait(LivenessWatcher *watcher, uint64_t *tags, int max);
+void liveness_wake(LivenessWatcher *watcher);
+
+#endif /* CHAT_LIVENESS_H */
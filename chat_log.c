@@ -0,0 +1,202 @@
+#include <string.h>
+#include "chat_log.h"
+
+void log_init(LogBuffer *log, size_t size, int process_shared) {
+    log->total_size = size & ~(size_t)(LOG_ALIGN - 1);
+    atomic_init(&log->head, 0);
+    atomic_init(&log->tail, 0);
+    atomic_init(&log->flushed, 0);
+    atomic_init(&log->next_seq, 1);
+    atomic_init(&log->dropped, 0);
+
+    /* Initialize mutex for log buffer */
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    if (process_shared) {
+        pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&log->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+}
+
+LogRecord *log_record_at(LogBuffer *log, uint64_t *offset) {
+    size_t pos = *offset % log->total_size;
+    if (log->total_size - pos < sizeof(LogRecord)) {
+        /* Short tail with no room for a header: the record is at the start */
+        *offset += log->total_size - pos;
+        pos = 0;
+    }
+    return (LogRecord *)(log->data + pos);
+}
+
+int log_record_status(LogRecord *rec, uint64_t offset) {
+    uint64_t state = atomic_load_explicit(&rec->state, memory_order_acquire);
+    if (state == LOG_STATE_COMMITTED(offset)) {
+        return LOG_RECORD_COMMITTED;
+    }
+    if (state == LOG_STATE_CLAIMED(offset)) {
+        return LOG_RECORD_WRITING;
+    }
+    return LOG_RECORD_UNCLAIMED;
+}
+
+LogRecord *log_next(LogBuffer *log, uint64_t *offset, uint64_t limit, int skip_writing) {
+    uint64_t pos = *offset;
+    while (pos < limit) {
+        uint64_t start = pos;
+        LogRecord *rec = log_record_at(log, &start);
+        if (start >= limit) {
+            break;
+        }
+        int status = log_record_status(rec, start);
+        if (status == LOG_RECORD_UNCLAIMED || (status == LOG_RECORD_WRITING && !skip_writing)) {
+            *offset = start;
+            return NULL;
+        }
+        if (status == LOG_RECORD_COMMITTED && rec->type == LOG_REC_TEXT) {
+            *offset = start;
+            return rec;
+        }
+        pos = start + rec->length;
+    }
+    *offset = pos < limit ? pos : limit;
+    return NULL;
+}
+
+int log_read(LogBuffer *log, uint64_t *offset, LogEntry *entry, char *text, size_t size) {
+    for (;;) {
+        uint64_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+        if (*offset < head) {
+            *offset = head;
+            return LOG_READ_LAPPED;
+        }
+        uint64_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+        uint64_t start = *offset;
+        LogRecord *rec = log_record_at(log, &start);
+        if (start >= tail || log_record_status(rec, start) != LOG_RECORD_COMMITTED) {
+            return LOG_READ_END;
+        }
+
+        /* The state matched, so the record was complete. Copy it, but only
+         * trust bytes that are still in range if a writer is reusing them. */
+        uint32_t length = rec->length;
+        uint16_t type = rec->type;
+        size_t text_len = rec->text_len;
+        uint64_t seq = rec->seq;
+        int64_t timestamp_ns = rec->timestamp_ns;
+        size_t room = log->total_size - start % log->total_size;
+        int sane = length >= sizeof(LogRecord) && length <= room &&
+                   text_len <= length - sizeof(LogRecord);
+        if (sane && type == LOG_REC_TEXT && text && size > 0) {
+            if (text_len > size - 1) {
+                text_len = size - 1;
+            }
+            memcpy(text, log_record_text(rec), text_len);
+            text[text_len] = '\0';
+        }
+
+        /* Writers move head past a record before reusing its space, so an
+         * unchanged head means nothing above was overwritten */
+        atomic_thread_fence(memory_order_acquire);
+        head = atomic_load_explicit(&log->head, memory_order_relaxed);
+        if (head > start) {
+            *offset = head;
+            return LOG_READ_LAPPED;
+        }
+        if (!sane) {
+            return LOG_READ_END;  /* Cannot happen while head holds; be safe */
+        }
+        *offset = start + length;
+        if (type == LOG_REC_TEXT) {
+            entry->offset = start;
+            entry->seq = seq;
+            entry->timestamp_ns = timestamp_ns;
+            entry->text_len = text && size > 0 ? text_len : 0;
+            return LOG_READ_OK;
+        }
+    }
+}
+
+/*
+ * Move head past one already-flushed record. Flushed records are never
+ * written to until head has passed them, so their headers are stable; a
+ * writer racing us to the same record just makes our compare-and-swap fail.
+ * Returns 0 if head has caught up with flushed and nothing can be reused.
+ */
+static int reclaim_oldest(LogBuffer *log, uint64_t head) {
+    uint64_t flushed = atomic_load_explicit(&log->flushed, memory_order_acquire);
+    if (head >= flushed) {
+        return 0;
+    }
+    uint64_t offset = head;
+    LogRecord *rec = log_record_at(log, &offset);
+    uint64_t next = offset + rec->length;
+    if (rec->length < LOG_ALIGN || next > flushed) {
+        return 1;  /* Head moved on while we looked; caller retries */
+    }
+    atomic_compare_exchange_strong_explicit(&log->head, &head, next,
+                                            memory_order_release, memory_order_relaxed);
+    return 1;
+}
+
+uint64_t log_append(LogBuffer *log, const char *text, size_t len, int64_t timestamp_ns,
+                    uint64_t *end) {
+    if (len > UINT16_MAX) {
+        len = UINT16_MAX;
+    }
+    uint32_t size = log_record_size(len);
+    if (size > log->total_size / 2) {
+        return 0;  /* Would not leave room for anything else */
+    }
+
+    /* Reserve [start, start + size), plus a skipped tail if it does not fit
+     * before the end of the buffer */
+    uint64_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    uint64_t start;
+    for (;;) {
+        size_t pos = tail % log->total_size;
+        size_t contiguous = log->total_size - pos;
+        start = contiguous < size ? tail + contiguous : tail;
+
+        uint64_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+        if (start + size - head > log->total_size) {
+            if (!reclaim_oldest(log, head)) {
+                atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+                return 0;
+            }
+            tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&log->tail, &tail, start + size,
+                                                  memory_order_acq_rel, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    if (start - tail >= sizeof(LogRecord)) {
+        LogRecord *pad = (LogRecord *)(log->data + tail % log->total_size);
+        pad->length = (uint32_t)(start - tail);
+        pad->type = LOG_REC_PAD;
+        pad->text_len = 0;
+        pad->seq = 0;
+        pad->timestamp_ns = 0;
+        atomic_store_explicit(&pad->state, LOG_STATE_COMMITTED(tail), memory_order_release);
+    }
+
+    /* Publish the length first so readers can step over us while we copy */
+    LogRecord *rec = (LogRecord *)(log->data + start % log->total_size);
+    rec->length = size;
+    rec->type = LOG_REC_TEXT;
+    atomic_store_explicit(&rec->state, LOG_STATE_CLAIMED(start), memory_order_release);
+
+    uint64_t seq = atomic_fetch_add_explicit(&log->next_seq, 1, memory_order_relaxed);
+    rec->text_len = (uint16_t)len;
+    rec->seq = seq;
+    rec->timestamp_ns = timestamp_ns;
+    memcpy(rec + 1, text, len);
+    atomic_store_explicit(&rec->state, LOG_STATE_COMMITTED(start), memory_order_release);
+    if (end) {
+        *end = start + size;
+    }
+    return seq;
+}
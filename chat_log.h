@@ -0,0 +1,129 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define LOG_SIZE (1024 * 1024)  /* 1MB for logs */
+#define LOG_ALIGN 8
+
+/* Record types */
+#define LOG_REC_TEXT 1
+#define LOG_REC_PAD 2           /* Fills the end of the buffer before a wrap */
+
+/* Record states, derived from the record's logical offset so that stale
+ * bytes left over from an earlier lap never look like a live header */
+#define LOG_STATE_CLAIMED(offset) (((uint64_t)(offset) + 1) << 1)
+#define LOG_STATE_COMMITTED(offset) (LOG_STATE_CLAIMED(offset) | 1)
+
+/* log_record_status() results */
+#define LOG_RECORD_COMMITTED 0  /* Complete, safe to read */
+#define LOG_RECORD_WRITING 1    /* Length is valid but the text is still being written */
+#define LOG_RECORD_UNCLAIMED 2  /* Space reserved, header not written yet */
+
+/* log_read() results */
+#define LOG_READ_OK 0           /* An entry was copied out */
+#define LOG_READ_END 1          /* Nothing committed at the cursor yet */
+#define LOG_READ_LAPPED 2       /* Entries were overwritten; the cursor moved to head */
+
+/*
+ * Record framing. Every entry in the log buffer starts with this header and
+ * is padded to LOG_ALIGN, so readers can walk from one entry to the next.
+ * A record is never split across the end of the buffer: the writer fills
+ * the rest with a LOG_REC_PAD record and starts again at offset 0. If fewer
+ * than sizeof(LogRecord) bytes are left there is no room for a pad header,
+ * and readers skip that short tail implicitly.
+ */
+typedef struct {
+    _Atomic uint64_t state;     /* LOG_STATE_CLAIMED, then LOG_STATE_COMMITTED */
+    uint32_t length;            /* Whole record including header, multiple of LOG_ALIGN */
+    uint16_t type;
+    uint16_t text_len;          /* Bytes of formatted text after the header */
+    uint64_t seq;               /* Unique, increasing; concurrent appends may commit out of order */
+    int64_t timestamp_ns;       /* CLOCK_REALTIME when appended */
+} LogRecord;
+
+/*
+ * Log buffer structure: a wrap-around ring in shared memory.
+ *
+ * Positions are logical byte offsets that only ever grow; the physical
+ * position is offset % total_size. Records live in [head, tail) and
+ * everything before flushed has been written to disk.
+ *
+ * Appends are lock-free. A writer reserves space by advancing tail with a
+ * compare-and-swap, fills in its record, and then marks it committed, so
+ * any number of threads can append at once. Writers only reuse space that
+ * has already been flushed, moving head past those records themselves.
+ * When the unflushed backlog fills the whole buffer, the new entry is
+ * dropped and counted instead. Readers walk from head and skip records
+ * that are still being written.
+ */
+typedef struct {
+    size_t total_size;          /* Bytes in data[], a multiple of LOG_ALIGN */
+    _Atomic uint64_t head;      /* Oldest record still in the buffer */
+    _Atomic uint64_t tail;      /* Where the next record goes */
+    _Atomic uint64_t flushed;   /* Records before this are on disk (flusher only) */
+    _Atomic uint64_t next_seq;  /* Sequence number of the next record */
+    _Atomic uint64_t dropped;   /* Entries rejected because the flusher fell behind */
+    pthread_mutex_t mutex;      /* Held while a flusher claims or publishes a region; appends never take it */
+    char data[];                /* Flexible array member */
+} LogBuffer;
+
+/* Initialize an empty log in memory of sizeof(LogBuffer) + size bytes */
+void log_init(LogBuffer *log, size_t size, int process_shared);
+
+/* Append one entry; returns its sequence number, or 0 if it was dropped.
+ * If end is not NULL it receives the offset just past the record, which is
+ * what has to be flushed for the entry to be on disk. */
+uint64_t log_append(LogBuffer *log, const char *text, size_t len, int64_t timestamp_ns,
+                    uint64_t *end);
+
+/* Record at a logical offset, after skipping a short tail; *offset is
+ * updated to where the record actually starts */
+LogRecord *log_record_at(LogBuffer *log, uint64_t *offset);
+
+/* Where a record at this offset is in its life */
+int log_record_status(LogRecord *rec, uint64_t offset);
+
+/*
+ * Next committed text record at or after *offset and before limit. Pads are
+ * stepped over, and so are records still being written if skip_writing is
+ * set. Returns NULL when there is nothing more to read, leaving *offset at
+ * the first record that could not be passed (or at limit).
+ */
+LogRecord *log_next(LogBuffer *log, uint64_t *offset, uint64_t limit, int skip_writing);
+
+/* An entry copied out of the log by log_read() */
+typedef struct {
+    uint64_t offset;            /* Where the record starts */
+    uint64_t seq;
+    int64_t timestamp_ns;
+    size_t text_len;            /* Bytes copied, without the NUL */
+} LogEntry;
+
+/*
+ * Copy the next text entry at or after *offset into entry and text (NUL
+ * terminated, cut to size - 1 bytes; text may be NULL to skip the copy)
+ * and move *offset past it. Safe against
+ * concurrent writers without taking any lock, including from a process that
+ * maps the log read-only: the copy is taken seqlock style, by checking the
+ * record's state before and head after copying, and thrown away if the
+ * space was reclaimed meanwhile. Stops at a record still being written, so
+ * a cursor that is called again later sees every entry exactly once unless
+ * it falls a whole buffer behind.
+ */
+int log_read(LogBuffer *log, uint64_t *offset, LogEntry *entry, char *text, size_t size);
+
+/* Text of a record */
+static inline const char *log_record_text(const LogRecord *rec) {
+    return (const char *)(rec + 1);
+}
+
+/* Space a record with len bytes of text takes in the buffer */
+static inline uint32_t log_record_size(size_t len) {
+    return (uint32_t)((sizeof(LogRecord) + len + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1));
+}
+
+#endif /* CHAT_LOG_H */
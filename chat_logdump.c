@@ -0,0 +1,125 @@
+/**
+ * chat_logdump - print a binary chat log (chat_server -l binary) as text
+ *
+ * Output matches chat_server.log line for line. A sequence or time range
+ * is located through the index file with a binary search, so only the
+ * records in range (plus at most two index intervals) are read.
+ *
+ * Usage: chat_logdump [-s first_seq] [-S last_seq] [-t from] [-T to] [-v] [file]
+ *
+ * Times are seconds since the epoch or HH:MM[:SS] today (local time).
+ * -v prefixes each line with its sequence number and nanosecond timestamp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include "chat_binlog.h"
+
+/* Parse "1712345678[.5]" or "HH:MM[:SS]" (today, local time) into ns */
+static int parse_time(const char *text, int64_t *ns) {
+    if (strchr(text, ':')) {
+        int hour = 0, min = 0, sec = 0;
+        if (sscanf(text, "%d:%d:%d", &hour, &min, &sec) < 2) {
+            return -1;
+        }
+        time_t now = time(NULL);
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        tm_info.tm_hour = hour;
+        tm_info.tm_min = min;
+        tm_info.tm_sec = sec;
+        tm_info.tm_isdst = -1;
+        *ns = (int64_t)mktime(&tm_info) * 1000000000LL;
+        return 0;
+    }
+    char *end;
+    double seconds = strtod(text, &end);
+    if (end == text || *end != '\0') {
+        return -1;
+    }
+    *ns = (int64_t)(seconds * 1e9);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t first_seq = 0, last_seq = UINT64_MAX;
+    int64_t from_ns = INT64_MIN, to_ns = INT64_MAX;
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:S:t:T:v")) != -1) {
+        switch (opt) {
+            case 's':
+                first_seq = strtoull(optarg, NULL, 10);
+                break;
+            case 'S':
+                last_seq = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+            case 'T':
+                if (parse_time(optarg, opt == 't' ? &from_ns : &to_ns) != 0) {
+                    fprintf(stderr, "Bad time '%s': use epoch seconds or HH:MM[:SS]\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s first_seq] [-S last_seq] [-t from] [-T to] [-v] [file]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    const char *path = optind < argc ? argv[optind] : BINLOG_FILE;
+
+    BinlogReader reader;
+    if (binlog_reader_open(&reader, path) != 0) {
+        perror(path);
+        return 1;
+    }
+
+    /* Use whichever bound narrows the start more */
+    if (first_seq > 0) {
+        binlog_seek_seq(&reader, first_seq);
+    } else if (from_ns != INT64_MIN) {
+        binlog_seek_time(&reader, from_ns);
+    }
+
+    BinlogRecord rec;
+    static char text[BINLOG_MAX_TEXT + 1];
+    int result;
+    while ((result = binlog_read(&reader, &rec, text)) == 1) {
+        if (rec.seq > last_seq) {
+            break;
+        }
+        if (rec.seq < first_seq || rec.timestamp_ns < from_ns) {
+            continue;
+        }
+        if (rec.timestamp_ns > to_ns) {
+            /* Concurrent writers can leave timestamps slightly out of
+             * order; only stop once clearly past the range */
+            if (rec.timestamp_ns > to_ns + 1000000000LL) {
+                break;
+            }
+            continue;
+        }
+        if (verbose) {
+            printf("#%llu %lld.%09lld ", (unsigned long long)rec.seq,
+                   (long long)(rec.timestamp_ns / 1000000000LL),
+                   (long long)(rec.timestamp_ns % 1000000000LL));
+        }
+        fwrite(text, 1, rec.text_len, stdout);
+    }
+    if (result == -1) {
+        fprintf(stderr, "%s: damaged record at offset %llu\n", path,
+                (unsigned long long)reader.offset);
+    }
+
+    binlog_reader_close(&reader);
+    return result == -1;
+}
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sched.h>
+#include <zlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "chat_logrotate.h"
+#include "chat_binlog.h"
+
+#define COMPRESS_CHUNK (64 * 1024)
+
+/* ioprio_set() has no glibc wrapper */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+static void segment_path(const LogArchiver *archiver, uint32_t segment, const char *suffix,
+                         char *out, size_t size) {
+    /* log_archiver_start() made sure every name fits */
+    if (snprintf(out, size, "%s.%06u%s", archiver->path, segment, suffix) >= (int)size) {
+        out[0] = '\0';
+    }
+}
+
+uint32_t log_archiver_next(LogArchiver *archiver, char *out, size_t size) {
+    uint32_t segment = archiver->next_segment++;
+    segment_path(archiver, segment, "", out, size);
+    return segment;
+}
+
+typedef struct {
+    uint32_t number;
+    int plain;                      /* An uncompressed copy exists */
+} Segment;
+
+static int compare_segments(const void *a, const void *b) {
+    uint32_t x = ((const Segment *)a)->number, y = ((const Segment *)b)->number;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * List the closed segments on disk, oldest first, each once whether or not
+ * it is compressed. Leftover temporary files are removed on the way.
+ * Returns the count, or -1; *out must be freed by the caller.
+ */
+static int scan_segments(LogArchiver *archiver, Segment **out) {
+    char dir_buf[LOG_PATH_MAX], base_buf[LOG_PATH_MAX];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", archiver->path);
+    snprintf(base_buf, sizeof(base_buf), "%s", archiver->path);
+    const char *dir_name = dirname(dir_buf);
+    const char *base = basename(base_buf);
+    size_t base_len = strlen(base);
+
+    DIR *dir = opendir(dir_name);
+    if (!dir) {
+        return -1;
+    }
+    Segment *segments = NULL;
+    int count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strncmp(name, base, base_len) != 0 || name[base_len] != '.') {
+            continue;
+        }
+        char *suffix;
+        unsigned long number = strtoul(name + base_len + 1, &suffix, 10);
+        if (suffix == name + base_len + 1 || number == 0 || number > UINT32_MAX) {
+            continue;
+        }
+        int plain;
+        if (*suffix == '\0') {
+            plain = 1;
+        } else if (strcmp(suffix, ".gz") == 0) {
+            plain = 0;
+        } else {
+            if (strcmp(suffix, ".gz.tmp") == 0) {
+                char tmp[LOG_PATH_MAX];
+                segment_path(archiver, (uint32_t)number, ".gz.tmp", tmp, sizeof(tmp));
+                unlink(tmp);
+            }
+            continue;  /* Index files and anything else */
+        }
+
+        int i;
+        for (i = 0; i < count && segments[i].number != number; i++) {
+        }
+        if (i == count) {
+            if (count == capacity) {
+                int grown_capacity = capacity ? capacity * 2 : 32;
+                Segment *grown = realloc(segments, grown_capacity * sizeof(*segments));
+                if (!grown) {
+                    break;
+                }
+                segments = grown;
+                capacity = grown_capacity;
+            }
+            segments[count].number = (uint32_t)number;
+            segments[count].plain = 0;
+            count++;
+        }
+        segments[i].plain |= plain;
+    }
+    closedir(dir);
+
+    if (count > 0) {
+        qsort(segments, count, sizeof(*segments), compare_segments);
+    }
+    *out = segments;
+    return count;
+}
+
+static int archiver_stopping(LogArchiver *archiver) {
+    pthread_mutex_lock(&archiver->mutex);
+    int result = archiver->stopping;
+    pthread_mutex_unlock(&archiver->mutex);
+    return result;
+}
+
+/*
+ * Compress path.N to path.N.gz.tmp, make it durable, rename it into place
+ * and only then remove the original, so a crash at any point leaves at
+ * least one complete copy. Returns 0 or -1.
+ */
+static int compress_segment(LogArchiver *archiver, uint32_t segment) {
+    char path[LOG_PATH_MAX], tmp[LOG_PATH_MAX], gz[LOG_PATH_MAX];
+    segment_path(archiver, segment, "", path, sizeof(path));
+    segment_path(archiver, segment, ".gz.tmp", tmp, sizeof(tmp));
+    segment_path(archiver, segment, ".gz", gz, sizeof(gz));
+
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        return errno == ENOENT ? 0 : -1;  /* Already compressed or deleted */
+    }
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int gz_fd = out == -1 ? -1 : dup(out);
+    gzFile file = gz_fd == -1 ? NULL : gzdopen(gz_fd, "wb6");
+    if (!file) {
+        perror("Failed to create compressed log segment");
+        if (gz_fd != -1) {
+            close(gz_fd);
+        }
+        if (out != -1) {
+            close(out);
+            unlink(tmp);
+        }
+        close(in);
+        return -1;
+    }
+
+    char *buf = malloc(COMPRESS_CHUNK);
+    uint64_t bytes_in = 0;
+    int result = buf ? 0 : -1;
+    while (result == 0) {
+        ssize_t got = read(in, buf, COMPRESS_CHUNK);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            result = got < 0 ? -1 : 0;
+            break;
+        }
+        if (gzwrite(file, buf, (unsigned)got) != (int)got || archiver_stopping(archiver)) {
+            result = -1;
+        }
+        bytes_in += got;
+    }
+    free(buf);
+    close(in);
+    if (gzclose(file) != Z_OK) {
+        result = -1;
+    }
+    if (result == 0 && fsync(out) != 0) {
+        result = -1;
+    }
+    off_t bytes_out = lseek(out, 0, SEEK_END);
+    close(out);
+    if (result != 0 || rename(tmp, gz) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    unlink(path);
+
+    pthread_mutex_lock(&archiver->mutex);
+    archiver->compressed++;
+    archiver->bytes_in += bytes_in;
+    archiver->bytes_out += bytes_out > 0 ? (uint64_t)bytes_out : 0;
+    pthread_mutex_unlock(&archiver->mutex);
+    return 0;
+}
+
+/*
+ * One pass over the closed segments: delete the oldest beyond the
+ * retention limit first, so no time goes into compressing them, then
+ * compress the rest oldest first.
+ */
+static void archive_segments(LogArchiver *archiver) {
+    Segment *segments;
+    int count = scan_segments(archiver, &segments);
+    if (count < 0) {
+        return;
+    }
+    int first = archiver->keep > 0 && count > archiver->keep ? count - archiver->keep : 0;
+    for (int i = 0; i < first; i++) {
+        char path[LOG_PATH_MAX], index_path[LOG_PATH_MAX];
+        segment_path(archiver, segments[i].number, "", path, sizeof(path));
+        binlog_index_path(path, index_path, sizeof(index_path));
+        unlink(path);
+        unlink(index_path);
+        segment_path(archiver, segments[i].number, ".gz", path, sizeof(path));
+        unlink(path);
+    }
+    pthread_mutex_lock(&archiver->mutex);
+    archiver->deleted += first;
+    pthread_mutex_unlock(&archiver->mutex);
+
+    for (int i = first; archiver->compress && i < count && !archiver_stopping(archiver); i++) {
+        if (segments[i].plain && compress_segment(archiver, segments[i].number) != 0 &&
+            !archiver_stopping(archiver)) {
+            fprintf(stderr, "Failed to compress log segment %s.%06u\n", archiver->path,
+                    segments[i].number);
+        }
+    }
+    free(segments);
+}
+
+static void *log_archiver_thread(void *arg) {
+    LogArchiver *archiver = (LogArchiver *)arg;
+
+    /* Only use CPU and disk time nobody else wants. Each step is best
+     * effort: SCHED_IDLE first, a high nice value if that is refused. */
+    struct sched_param param = { 0 };
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    }
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+    pthread_mutex_lock(&archiver->mutex);
+    for (;;) {
+        while (!archiver->stopping && !archiver->pending) {
+            pthread_cond_wait(&archiver->cond, &archiver->mutex);
+        }
+        if (archiver->stopping) {
+            break;
+        }
+        archiver->pending = 0;
+        pthread_mutex_unlock(&archiver->mutex);
+
+        archive_segments(archiver);
+
+        pthread_mutex_lock(&archiver->mutex);
+    }
+    pthread_mutex_unlock(&archiver->mutex);
+    return NULL;
+}
+
+void log_archiver_notify(LogArchiver *archiver) {
+    pthread_mutex_lock(&archiver->mutex);
+    archiver->pending = 1;
+    pthread_cond_signal(&archiver->cond);
+    pthread_mutex_unlock(&archiver->mutex);
+}
+
+int log_archiver_start(LogArchiver *archiver, const char *path, int keep, int compress) {
+    memset(archiver, 0, sizeof(*archiver));
+    if (strlen(path) + sizeof(".000000.gz.tmp") > LOG_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(archiver->path, sizeof(archiver->path), "%s", path);
+    archiver->keep = keep;
+    archiver->compress = compress;
+    archiver->pending = 1;  /* Finish whatever the last run left */
+    pthread_mutex_init(&archiver->mutex, NULL);
+    pthread_cond_init(&archiver->cond, NULL);
+
+    /* Carry on numbering after the newest segment */
+    Segment *segments;
+    int count = scan_segments(archiver, &segments);
+    archiver->next_segment = count > 0 ? segments[count - 1].number + 1 : 1;
+    if (count >= 0) {
+        free(segments);
+    }
+
+    if (pthread_create(&archiver->tid, NULL, log_archiver_thread, archiver) != 0) {
+        perror("Failed to create log archiver thread");
+        pthread_cond_destroy(&archiver->cond);
+        pthread_mutex_destroy(&archiver->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+void log_archiver_report(LogArchiver *archiver) {
+    pthread_mutex_lock(&archiver->mutex);
+    printf(", %llu compressed (%.1f KB -> %.1f KB), %llu deleted\n",
+           (unsigned long long)archiver->compressed,
+           archiver->bytes_in / 1024.0, archiver->bytes_out / 1024.0,
+           (unsigned long long)archiver->deleted);
+    pthread_mutex_unlock(&archiver->mutex);
+}
+
+void log_archiver_stop(LogArchiver *archiver) {
+    pthread_mutex_lock(&archiver->mutex);
+    archiver->stopping = 1;
+    pthread_cond_signal(&archiver->cond);
+    pthread_mutex_unlock(&archiver->mutex);
+    pthread_join(archiver->tid, NULL);
+}
@@ -0,0 +1,57 @@
+#ifndef CHAT_LOGROTATE_H
+#define CHAT_LOGROTATE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Archiver for closed log segments.
+ *
+ * The log writer renames a full log file to path.NNNNNN and pokes the
+ * archiver, whose idle-priority thread then deletes the oldest segments
+ * beyond the retention limit (together with their .idx files) and
+ * gzip-compresses the rest to path.NNNNNN.gz. Each pass works from a scan
+ * of the directory rather than a queue, so poking never blocks, a burst of
+ * rotations costs one pass, and anything a previous run left behind is
+ * picked up at start.
+ */
+
+#define LOG_PATH_MAX 256
+#define DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)  /* Rotate at this size (-r) */
+#define DEFAULT_SEGMENT_KEEP 16                   /* Closed segments kept (-k) */
+
+typedef struct {
+    char path[LOG_PATH_MAX];        /* Live log file; segments are named after it */
+    int keep;                       /* Closed segments to keep, 0 for all */
+    int compress;
+    uint32_t next_segment;          /* Number for the next closed segment */
+    pthread_mutex_t mutex;          /* Protects everything below */
+    pthread_cond_t cond;
+    int pending;                    /* A segment was closed since the last pass */
+    int stopping;
+    pthread_t tid;
+
+    /* Statistics */
+    uint64_t compressed;
+    uint64_t deleted;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} LogArchiver;
+
+/* Start the thread, which first tidies up existing segments. Returns 0 or -1. */
+int log_archiver_start(LogArchiver *archiver, const char *path, int keep, int compress);
+
+/* Name the next closed segment; only the log writer thread calls this */
+uint32_t log_archiver_next(LogArchiver *archiver, char *out, size_t size);
+
+/* Have the thread make a pass over the closed segments; never blocks */
+void log_archiver_notify(LogArchiver *archiver);
+
+/* Print what has been compressed and deleted so far */
+void log_archiver_report(LogArchiver *archiver);
+
+/* Stop the thread; a compression in progress is abandoned and redone on the
+ * next start */
+void log_archiver_stop(LogArchiver *archiver);
+
+#endif /* CHAT_LOGROTATE_H */
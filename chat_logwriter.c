@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "chat_logwriter.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static const char *durability_names[] = { "none", "periodic", "group" };
+
+int log_durability_parse(const char *name) {
+    for (int i = 0; i < (int)(sizeof(durability_names) / sizeof(durability_names[0])); i++) {
+        if (strcmp(name, durability_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *log_durability_name(int durability) {
+    return durability_names[durability];
+}
+
+int log_format_parse(const char *name) {
+    if (strcmp(name, "text") == 0) {
+        return LOG_FORMAT_TEXT;
+    }
+    if (strcmp(name, "binary") == 0) {
+        return LOG_FORMAT_BINARY;
+    }
+    return -1;
+}
+
+void log_writer_default_config(LogWriterConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->path = LOG_FILE;
+    config->interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+    config->batch_bytes = DEFAULT_FLUSH_BATCH;
+    config->durability = LOG_DURABILITY_NONE;
+    config->format = LOG_FORMAT_TEXT;
+    config->index_interval = DEFAULT_INDEX_INTERVAL;
+    config->segment_bytes = DEFAULT_SEGMENT_SIZE;
+    config->keep_segments = DEFAULT_SEGMENT_KEEP;
+    config->compress = 1;
+}
+
+static int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* writev() the whole vector, retrying after short writes and signals */
+static int write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/* Open writer->path for appending and note how much it already holds */
+static int open_log_file(LogWriter *writer, int *fd, int *index_fd, uint64_t *file_offset) {
+    *index_fd = -1;
+    if (writer->format == LOG_FORMAT_BINARY) {
+        uint64_t next_seq;
+        if (binlog_open_append(writer->path, fd, index_fd, writer->index_interval,
+                               writer->next_file_seq, &next_seq, file_offset) != 0) {
+            return -1;
+        }
+        writer->next_file_seq = next_seq;
+        return 0;
+    }
+    *fd = open(writer->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (*fd == -1) {
+        return -1;
+    }
+    off_t end = lseek(*fd, 0, SEEK_END);
+    *file_offset = end > 0 ? (uint64_t)end : 0;
+    return 0;
+}
+
+static int rotation_due(LogWriter *writer) {
+    if (!writer->rotating || writer->file_offset <= (writer->format == LOG_FORMAT_BINARY ?
+                                                       sizeof(BinlogFileHeader) : 0)) {
+        return 0;  /* Never rotate an empty file */
+    }
+    return (writer->segment_bytes > 0 && writer->file_offset >= writer->segment_bytes) ||
+           (writer->segment_age_ns > 0 &&
+            monotonic_ns() - writer->segment_opened_ns >= writer->segment_age_ns);
+}
+
+/*
+ * Close the current file as the next numbered segment and carry on in a
+ * fresh one. Everything up to file_offset has been written (and synced, if
+ * the mode syncs), so the segment is complete. Compression happens later on
+ * the archiver's thread.
+ */
+static void rotate(LogWriter *writer) {
+    char segment_path[LOG_PATH_MAX], index_path[LOG_PATH_MAX], segment_index[LOG_PATH_MAX];
+    log_archiver_next(&writer->archiver, segment_path, sizeof(segment_path));
+    int binary = writer->format == LOG_FORMAT_BINARY;
+    if (binary) {
+        binlog_index_path(writer->path, index_path, sizeof(index_path));
+        binlog_index_path(segment_path, segment_index, sizeof(segment_index));
+    }
+
+    if (rename(writer->path, segment_path) != 0) {
+        perror("Failed to rotate log file; rotation disabled");
+        writer->segment_bytes = 0;
+        writer->segment_age_ns = 0;
+        return;
+    }
+    if (binary && rename(index_path, segment_index) != 0) {
+        unlink(index_path);  /* The segment is still readable by scanning */
+    }
+
+    int fd, index_fd;
+    uint64_t file_offset;
+    if (open_log_file(writer, &fd, &index_fd, &file_offset) != 0) {
+        /* Put the old file back and keep writing to it */
+        perror("Failed to open new log segment; rotation disabled");
+        rename(segment_path, writer->path);
+        if (binary) {
+            rename(segment_index, index_path);
+        }
+        writer->segment_bytes = 0;
+        writer->segment_age_ns = 0;
+        return;
+    }
+    close(writer->fd);
+    if (writer->index_fd != -1) {
+        close(writer->index_fd);
+    }
+    writer->fd = fd;
+    writer->index_fd = index_fd;
+    writer->file_offset = file_offset;
+    writer->segment_opened_ns = monotonic_ns();
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->rotations++;
+    pthread_mutex_unlock(&writer->mutex);
+
+    log_archiver_notify(&writer->archiver);
+}
+
+size_t log_writer_flush(LogWriter *writer) {
+    LogBuffer *log = writer->log;
+    struct iovec iov[IOV_MAX];
+    size_t total = 0;
+    uint64_t records = 0;
+    int64_t pass_start = monotonic_ns();
+
+    /* Claim the region: two loads under the lock, no I/O */
+    pthread_mutex_lock(&log->mutex);
+    uint64_t offset = atomic_load_explicit(&log->flushed, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+    pthread_mutex_unlock(&log->mutex);
+
+    uint64_t flushed_to = offset;
+    int binary = writer->format == LOG_FORMAT_BINARY;
+    int per_record = binary ? 2 : 1;
+    for (;;) {
+        /* Point straight at the committed text in the ring. Those records
+         * cannot be reused until flushed moves past them. */
+        BinlogRecord headers[IOV_MAX / 2];
+        BinlogIndexEntry index[IOV_MAX / 2];
+        int count = 0;
+        int indexed = 0;
+        int iovcnt = 0;
+        size_t bytes = 0;
+        LogRecord *rec;
+        while (iovcnt + per_record <= IOV_MAX && (rec = log_next(log, &offset, tail, 0)) != NULL) {
+            if (binary) {
+                BinlogRecord *header = &headers[count];
+                memset(header, 0, sizeof(*header));
+                header->magic = BINLOG_RECORD_MAGIC;
+                header->length = sizeof(*header) + rec->text_len;
+                header->seq = writer->next_file_seq + count;
+                header->timestamp_ns = rec->timestamp_ns;
+                header->type = rec->type;
+                header->text_len = rec->text_len;
+                /* Every segment indexes its first record too */
+                if ((header->seq - 1) % writer->index_interval == 0 ||
+                    writer->file_offset + bytes == sizeof(BinlogFileHeader)) {
+                    index[indexed].seq = header->seq;
+                    index[indexed].timestamp_ns = header->timestamp_ns;
+                    index[indexed].offset = writer->file_offset + bytes;
+                    indexed++;
+                }
+                iov[iovcnt].iov_base = header;
+                iov[iovcnt].iov_len = sizeof(*header);
+                bytes += sizeof(*header);
+                iovcnt++;
+            }
+            iov[iovcnt].iov_base = (void *)log_record_text(rec);
+            iov[iovcnt].iov_len = rec->text_len;
+            bytes += rec->text_len;
+            iovcnt++;
+            count++;
+            offset += rec->length;
+        }
+        if (count == 0) {
+            break;
+        }
+        if (write_all(writer->fd, iov, iovcnt) != 0) {
+            perror("Failed to write log file");
+            /* Cut off any partial record: binary offsets stay right, and
+             * the retry does not leave half a line in a text log */
+            if (ftruncate(writer->fd, (off_t)writer->file_offset) != 0) {
+                perror("Failed to truncate log file");
+            }
+            lseek(writer->fd, (off_t)writer->file_offset, SEEK_SET);
+            break;  /* Keep the records; the next pass retries them */
+        }
+        if (binary) {
+            /* The index only points at records already written */
+            struct iovec index_iov = { index, indexed * sizeof(index[0]) };
+            if (indexed > 0 && write_all(writer->index_fd, &index_iov, 1) != 0) {
+                perror("Failed to write log index");
+            }
+            writer->next_file_seq += count;
+        }
+        writer->file_offset += bytes;
+        records += count;
+        total += bytes;
+        flushed_to = offset;
+        if (iovcnt + per_record <= IOV_MAX) {
+            break;  /* Ran out of records rather than iovecs */
+        }
+    }
+
+    uint64_t previous = atomic_load_explicit(&log->flushed, memory_order_relaxed);
+    if (flushed_to != previous) {
+        pthread_mutex_lock(&log->mutex);
+        atomic_store_explicit(&log->flushed, flushed_to, memory_order_release);
+        pthread_mutex_unlock(&log->mutex);
+    }
+
+    /* Everything written so far, by this pass or an earlier one whose sync
+     * failed, shares one fdatasync() */
+    int64_t sync_ns = -1;
+    if (writer->durability != LOG_DURABILITY_NONE && flushed_to != writer->durable) {
+        int64_t start = monotonic_ns();
+        if (fdatasync(writer->fd) == 0) {
+            sync_ns = monotonic_ns() - start;
+        } else {
+            perror("Failed to sync log file");
+        }
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+    if (flushed_to != previous) {
+        writer->flushes++;
+        writer->records_written += records;
+        writer->bytes_written += total;
+    }
+    if (writer->durability == LOG_DURABILITY_NONE || sync_ns >= 0) {
+        writer->durable = flushed_to;
+        pthread_cond_broadcast(&writer->synced);
+    }
+    if (sync_ns >= 0) {
+        writer->syncs++;
+        writer->sync_ns_total += sync_ns;
+        if ((uint64_t)sync_ns > writer->sync_ns_max) {
+            writer->sync_ns_max = sync_ns;
+        }
+    }
+    pthread_mutex_unlock(&writer->mutex);
+
+    /* Idle passes would only bury the ones that did the work */
+    if (writer->flush_stats && flushed_to != previous) {
+        stats_record(writer->flush_stats, monotonic_ns() - pass_start);
+    }
+
+    if (rotation_due(writer)) {
+        rotate(writer);
+    }
+    return total;
+}
+
+void log_writer_commit(LogWriter *writer, uint64_t end) {
+    if (writer->durability != LOG_DURABILITY_GROUP || end == 0) {
+        return;
+    }
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->durable < end && !writer->stopping) {
+        atomic_store(&writer->flush_requested, 1);
+        pthread_cond_signal(&writer->cond);
+        pthread_cond_wait(&writer->synced, &writer->mutex);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+void log_writer_notify(LogWriter *writer) {
+    LogBuffer *log = writer->log;
+    uint64_t pending = atomic_load_explicit(&log->tail, memory_order_relaxed) -
+                       atomic_load_explicit(&log->flushed, memory_order_relaxed);
+    if (pending < writer->batch_bytes || atomic_exchange(&writer->flush_requested, 1)) {
+        return;  /* Not enough yet, or someone already woke the writer */
+    }
+    pthread_mutex_lock(&writer->mutex);
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+static void *log_writer_thread(void *arg) {
+    LogWriter *writer = (LogWriter *)arg;
+
+    pthread_mutex_lock(&writer->mutex);
+    while (!writer->stopping) {
+        if (!atomic_load(&writer->flush_requested)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += writer->interval_ms / 1000;
+            deadline.tv_nsec += (long)(writer->interval_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&writer->cond, &writer->mutex, &deadline);
+            if (writer->stopping) {
+                break;
+            }
+        }
+        atomic_store(&writer->flush_requested, 0);
+        pthread_mutex_unlock(&writer->mutex);
+
+        log_writer_flush(writer);
+
+        pthread_mutex_lock(&writer->mutex);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+int log_writer_start(LogWriter *writer, LogBuffer *log, const LogWriterConfig *config) {
+    memset(writer, 0, sizeof(*writer));
+    writer->log = log;
+    writer->interval_ms = config->interval_ms;
+    writer->batch_bytes = config->batch_bytes;
+    writer->durability = config->durability;
+    writer->format = config->format;
+    writer->index_interval = config->index_interval ? config->index_interval : DEFAULT_INDEX_INTERVAL;
+    writer->index_fd = -1;
+    writer->durable = atomic_load(&log->flushed);
+    writer->started_ns = monotonic_ns();
+    writer->segment_bytes = config->segment_bytes;
+    writer->segment_age_ns = (int64_t)config->segment_age_s * 1000000000LL;
+    writer->segment_opened_ns = writer->started_ns;
+    writer->next_file_seq = 1;
+    writer->flush_stats = config->flush_stats;
+    atomic_init(&writer->flush_requested, 0);
+    if (strlen(config->path) >= sizeof(writer->path)) {
+        fprintf(stderr, "Log file name too long: %s\n", config->path);
+        writer->fd = -1;
+        return -1;
+    }
+    strcpy(writer->path, config->path);
+
+    if (open_log_file(writer, &writer->fd, &writer->index_fd, &writer->file_offset) != 0) {
+        perror("Failed to open log file");
+        writer->fd = -1;
+        return -1;
+    }
+
+    if (writer->segment_bytes > 0 || writer->segment_age_ns > 0) {
+        if (log_archiver_start(&writer->archiver, writer->path, config->keep_segments,
+                               config->compress) != 0) {
+            perror("Failed to start log archiver; rotation disabled");
+        } else {
+            writer->rotating = 1;
+        }
+    }
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writer->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_cond_init(&writer->synced, NULL);
+    pthread_mutex_init(&writer->mutex, NULL);
+
+    if (pthread_create(&writer->tid, NULL, log_writer_thread, writer) != 0) {
+        perror("Failed to create log sync thread");
+        pthread_cond_destroy(&writer->cond);
+        pthread_cond_destroy(&writer->synced);
+        pthread_mutex_destroy(&writer->mutex);
+        close(writer->fd);
+        writer->fd = -1;
+        if (writer->index_fd != -1) {
+            close(writer->index_fd);
+        }
+        if (writer->rotating) {
+            log_archiver_stop(&writer->archiver);
+            writer->rotating = 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void log_writer_stop(LogWriter *writer) {
+    if (writer->fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&writer->mutex);
+    writer->stopping = 1;
+    pthread_cond_signal(&writer->cond);
+    pthread_cond_broadcast(&writer->synced);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->tid, NULL);
+
+    /* Whatever was appended before shutdown still reaches the file */
+    log_writer_flush(writer);
+
+    /* The mutex and conditions stay usable for log_writer_report() */
+    close(writer->fd);
+    writer->fd = -1;
+    if (writer->index_fd != -1) {
+        close(writer->index_fd);
+        writer->index_fd = -1;
+    }
+    if (writer->rotating) {
+        log_archiver_stop(&writer->archiver);
+    }
+}
+
+void log_writer_report(LogWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+    double elapsed = (monotonic_ns() - writer->started_ns) / 1e9;
+    printf("Log writer (%s): %llu record(s), %.1f KB in %.1f s = %.0f records/s, %.1f KB/s\n",
+           log_durability_name(writer->durability),
+           (unsigned long long)writer->records_written, writer->bytes_written / 1024.0, elapsed,
+           elapsed > 0 ? writer->records_written / elapsed : 0.0,
+           elapsed > 0 ? writer->bytes_written / 1024.0 / elapsed : 0.0);
+    printf("  %llu flush pass(es), %llu fdatasync(s)", (unsigned long long)writer->flushes,
+           (unsigned long long)writer->syncs);
+    if (writer->syncs > 0) {
+        printf(", latency avg %.3f ms, max %.3f ms, %.1f records per sync",
+               writer->sync_ns_total / 1e6 / writer->syncs, writer->sync_ns_max / 1e6,
+               (double)writer->records_written / writer->syncs);
+    }
+    printf("\n");
+    uint64_t rotations = writer->rotations;
+    pthread_mutex_unlock(&writer->mutex);
+    if (writer->rotating) {
+        printf("  %llu rotation(s)", (unsigned long long)rotations);
+        log_archiver_report(&writer->archiver);
+    }
+}
@@ -0,0 +1,137 @@
+#ifndef CHAT_LOGWRITER_H
+#define CHAT_LOGWRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "chat_log.h"
+#include "chat_binlog.h"
+#include "chat_logrotate.h"
+#include "chat_stats.h"
+
+#define LOG_FILE "chat_server.log"
+#define DEFAULT_FLUSH_INTERVAL_MS 5000  /* Flush at least this often (-i) */
+#define DEFAULT_FLUSH_BATCH (64 * 1024) /* Flush early once this much is pending (-s) */
+
+/* Durability modes (-d) */
+#define LOG_DURABILITY_NONE 0       /* write() only; the kernel decides when it hits disk */
+#define LOG_DURABILITY_PERIODIC 1   /* fdatasync() after every flush pass */
+#define LOG_DURABILITY_GROUP 2      /* Chat messages wait until they are synced */
+
+/* File formats (-l) */
+#define LOG_FORMAT_TEXT 0           /* chat_server.log, one line per entry */
+#define LOG_FORMAT_BINARY 1         /* chat_server.blog plus index, see chat_binlog.h */
+
+/* Writer settings; log_writer_default_config() fills in the defaults */
+typedef struct {
+    const char *path;
+    int interval_ms;
+    size_t batch_bytes;
+    int durability;
+    int format;
+    uint32_t index_interval;        /* Binary format: records per index entry */
+    uint64_t segment_bytes;         /* Rotate once the file reaches this size, 0 never */
+    int segment_age_s;              /* Rotate a non-empty file this old, 0 never */
+    int keep_segments;              /* Closed segments kept, 0 for all */
+    int compress;                   /* gzip closed segments */
+    StatsHistogram *flush_stats;    /* Also record pass durations here, or NULL */
+} LogWriterConfig;
+
+/*
+ * Background writer that moves committed records from the shared log ring
+ * to the log file.
+ *
+ * The file stays open for the life of the writer. A flush pass takes the
+ * log mutex only long enough to read where the last pass stopped and where
+ * the ring ends, then writes the committed text straight out of shared
+ * memory with writev() and publishes the new flushed offset. Writers keep
+ * appending to the rest of the ring meanwhile, so the ring itself is the
+ * second buffer and nothing is copied.
+ *
+ * A pass runs every interval_ms, or sooner once batch_bytes are waiting.
+ * There must be one LogWriter per log.
+ *
+ * In group commit mode a caller that needs its entry on disk calls
+ * log_writer_commit(), which wakes the writer and sleeps until a pass has
+ * synced past the entry. Passes run back to back while anyone is waiting,
+ * so every entry that arrives during one fdatasync() shares the next.
+ *
+ * In the binary format each entry gets a BinlogRecord header (written from
+ * a small array alongside the text in the same writev()) and every
+ * index_interval-th record also gets an index entry.
+ *
+ * Once the file reaches segment_bytes, or segment_age_s after it was
+ * opened, the pass that notices renames it to path.NNNNNN (after any
+ * log_writer_commit() callers have been released),
+ * opens a fresh file and passes the old one to the LogArchiver for
+ * compression and retention. Appenders never see any of this: they only
+ * ever touch the ring.
+ */
+typedef struct {
+    LogBuffer *log;
+    int fd;
+    int interval_ms;
+    size_t batch_bytes;
+    int durability;
+    int format;
+    int index_fd;                   /* Binary format only */
+    uint32_t index_interval;
+    uint64_t next_file_seq;         /* Binary format: seq of the next record written */
+    uint64_t file_offset;           /* Where the next record goes */
+    char path[LOG_PATH_MAX];
+    uint64_t segment_bytes;
+    int64_t segment_age_ns;
+    int64_t segment_opened_ns;
+    int rotating;                   /* An archiver is running */
+    LogArchiver archiver;
+    pthread_mutex_t mutex;          /* Protects everything below */
+    pthread_cond_t cond;            /* Wakes the writer thread */
+    pthread_cond_t synced;          /* Wakes log_writer_commit() callers */
+    int stopping;
+    atomic_int flush_requested;     /* Set by the first appender to cross batch_bytes */
+    uint64_t durable;               /* Log offset known to be on disk */
+    pthread_t tid;
+
+    /* Statistics, updated after every flush pass */
+    int64_t started_ns;
+    uint64_t flushes;
+    uint64_t records_written;
+    uint64_t bytes_written;
+    uint64_t rotations;
+    uint64_t syncs;
+    uint64_t sync_ns_total;
+    uint64_t sync_ns_max;
+    StatsHistogram *flush_stats;
+} LogWriter;
+
+/* Mode from its name ("none", "periodic", "group"), or -1 */
+int log_durability_parse(const char *name);
+const char *log_durability_name(int durability);
+
+/* Format from its name ("text", "binary"), or -1 */
+int log_format_parse(const char *name);
+
+void log_writer_default_config(LogWriterConfig *config);
+
+/* Open the log file for appending and start the writer thread. Returns 0 or -1. */
+int log_writer_start(LogWriter *writer, LogBuffer *log, const LogWriterConfig *config);
+
+/* Call after appending: wakes the writer early once a batch is pending */
+void log_writer_notify(LogWriter *writer);
+
+/* In group commit mode, wait until the log is on disk up to end (as
+ * returned by log_append()); returns at once in the other modes */
+void log_writer_commit(LogWriter *writer, uint64_t end);
+
+/* Print throughput and fdatasync latency so far */
+void log_writer_report(LogWriter *writer);
+
+/* Write out everything committed so far, rotating the file if it is due;
+ * returns the bytes written */
+size_t log_writer_flush(LogWriter *writer);
+
+/* Stop the thread, flush (and sync) what is left and close the file */
+void log_writer_stop(LogWriter *writer);
+
+#endif /* CHAT_LOGWRITER_H */
@@ -0,0 +1,191 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include "chat_protocol.h"
+
+static size_t encode(const Message *msg, WireMessage *wire, int traced) {
+    size_t username_len = strnlen(msg->username, MAX_USERNAME - 1);
+    size_t content_len = strnlen(msg->content, MSG_SIZE - 1);
+
+    size_t seq_len = msg->seq ? sizeof(msg->seq) : 0;
+    size_t trace_len = traced ? TRACE_WIRE_BYTES : 0;
+
+    wire->mtype = msg->mtype;
+    wire->magic[0] = WIRE_MAGIC0;
+    wire->magic[1] = WIRE_MAGIC1;
+    wire->username_len = (unsigned char)username_len;
+    wire->flags = (msg->seq ? WIRE_FLAG_SEQ : 0) | (traced ? WIRE_FLAG_TRACE : 0);
+    wire->content_len = (uint16_t)content_len;
+    wire->reserved = 0;
+    wire->timestamp = (int64_t)msg->timestamp;
+    char *text = wire->text;
+    memcpy(text, &msg->seq, seq_len);
+    memcpy(text + seq_len, msg->trace, trace_len);
+    text += seq_len + trace_len;
+    memcpy(text, msg->username, username_len);
+    memcpy(text + username_len, msg->content, content_len);
+
+    return WIRE_HEADER_BYTES + seq_len + trace_len + username_len + content_len;
+}
+
+size_t wire_encode(const Message *msg, WireMessage *wire) {
+    return encode(msg, wire, 0);
+}
+
+size_t wire_encode_traced(const Message *msg, WireMessage *wire) {
+    return encode(msg, wire, 1);
+}
+
+int wire_decode(const WireBuffer *buf, size_t msgsz, Message *msg) {
+    const WireMessage *wire = &buf->compact;
+
+    if (msgsz >= WIRE_HEADER_BYTES &&
+        wire->magic[0] == WIRE_MAGIC0 && wire->magic[1] == WIRE_MAGIC1) {
+        size_t seq_len = (wire->flags & WIRE_FLAG_SEQ) ? sizeof(msg->seq) : 0;
+        size_t trace_len = (wire->flags & WIRE_FLAG_TRACE) ? TRACE_WIRE_BYTES : 0;
+        if (wire->username_len > MAX_USERNAME - 1 || wire->content_len > MSG_SIZE - 1 ||
+            msgsz != WIRE_HEADER_BYTES + seq_len + trace_len + wire->username_len +
+                     wire->content_len) {
+            return -1;
+        }
+        const char *text = wire->text + seq_len + trace_len;
+        msg->mtype = wire->mtype;
+        msg->seq = 0;
+        memcpy(&msg->seq, wire->text, seq_len);
+        memset(msg->trace, 0, sizeof(msg->trace));
+        memcpy(msg->trace, wire->text + seq_len, trace_len);
+        memcpy(msg->username, text, wire->username_len);
+        msg->username[wire->username_len] = '\0';
+        memcpy(msg->content, text + wire->username_len, wire->content_len);
+        msg->content[wire->content_len] = '\0';
+        msg->timestamp = (time_t)wire->timestamp;
+        return 1;
+    }
+
+    if (msgsz != FIXED_MSG_BYTES) {
+        return -1;
+    }
+    memcpy(msg, &buf->fixed, sizeof(long) + FIXED_MSG_BYTES);
+    msg->seq = 0;
+    memset(msg->trace, 0, sizeof(msg->trace));
+    /* Never trust the sender to terminate its strings */
+    msg->username[MAX_USERNAME - 1] = '\0';
+    msg->content[MSG_SIZE - 1] = '\0';
+    return 0;
+}
+
+ssize_t wire_receive(int queue_id, WireBuffer *buf, long mtype, int flags) {
+    ssize_t size = msgrcv(queue_id, buf, WIRE_MAX_BYTES + 1, mtype, flags | MSG_NOERROR);
+    if (size > (ssize_t)WIRE_MAX_BYTES) {
+        errno = E2BIG;  /* Truncated by MSG_NOERROR, so already gone */
+        return -1;
+    }
+    return size;
+}
+
+void batch_init(BatchMessage *batch) {
+    batch->mtype = MSG_TYPE_BATCH;
+    batch->magic[0] = WIRE_MAGIC0;
+    batch->magic[1] = WIRE_MAGIC1;
+    batch->count = 0;
+    batch->payload_len = 0;
+}
+
+int batch_append(BatchMessage *batch, const Message *msg) {
+    size_t username_len = strnlen(msg->username, MAX_USERNAME - 1);
+    size_t content_len = strnlen(msg->content, MSG_SIZE - 1);
+    size_t seq_len = msg->seq ? sizeof(msg->seq) : 0;
+    size_t needed = BATCH_RECORD_HEADER + seq_len + username_len + content_len;
+
+    if (batch->payload_len + needed > BATCH_MAX_BYTES || batch->count == UINT16_MAX) {
+        return -1;
+    }
+
+    /* Records are packed, so multi-byte fields go through memcpy */
+    char *rec = batch->payload + batch->payload_len;
+    uint16_t clen = (uint16_t)content_len;
+    int64_t timestamp = (int64_t)msg->timestamp;
+    rec[0] = (char)(msg->mtype | (seq_len ? BATCH_RECORD_SEQ : 0));
+    rec[1] = (char)username_len;
+    memcpy(rec + 2, &clen, sizeof(clen));
+    memcpy(rec + 4, &timestamp, sizeof(timestamp));
+    memcpy(rec + BATCH_RECORD_HEADER, &msg->seq, seq_len);
+    rec += BATCH_RECORD_HEADER + seq_len;
+    memcpy(rec, msg->username, username_len);
+    memcpy(rec + username_len, msg->content, content_len);
+
+    batch->payload_len += needed;
+    batch->count++;
+    return 0;
+}
+
+size_t batch_size(const BatchMessage *batch) {
+    return BATCH_HEADER_BYTES + batch->payload_len;
+}
+
+int batch_next(const BatchMessage *batch, size_t *offset, Message *msg) {
+    if (*offset >= batch->payload_len) {
+        return 0;
+    }
+    if (*offset + BATCH_RECORD_HEADER > batch->payload_len) {
+        return -1;
+    }
+
+    const char *rec = batch->payload + *offset;
+    unsigned char type = (unsigned char)rec[0];
+    size_t seq_len = (type & BATCH_RECORD_SEQ) ? sizeof(msg->seq) : 0;
+    size_t username_len = (unsigned char)rec[1];
+    uint16_t content_len;
+    int64_t timestamp;
+    memcpy(&content_len, rec + 2, sizeof(content_len));
+    memcpy(&timestamp, rec + 4, sizeof(timestamp));
+
+    size_t record_len = BATCH_RECORD_HEADER + seq_len + username_len + content_len;
+    if (username_len > MAX_USERNAME - 1 || content_len > MSG_SIZE - 1 ||
+        *offset + record_len > batch->payload_len) {
+        return -1;
+    }
+
+    msg->mtype = type & ~BATCH_RECORD_SEQ;
+    msg->seq = 0;
+    memset(msg->trace, 0, sizeof(msg->trace));
+    memcpy(&msg->seq, rec + BATCH_RECORD_HEADER, seq_len);
+    rec += BATCH_RECORD_HEADER + seq_len;
+    memcpy(msg->username, rec, username_len);
+    msg->username[username_len] = '\0';
+    memcpy(msg->content, rec + username_len, content_len);
+    msg->content[content_len] = '\0';
+    msg->timestamp = (time_t)timestamp;
+
+    *offset += record_len;
+    return 1;
+}
+
+void batch_strip_seq(const BatchMessage *batch, BatchMessage *out) {
+    Message line;
+    size_t offset = 0;
+    batch_init(out);
+    while (batch_next(batch, &offset, &line) == 1) {
+        line.seq = 0;
+        batch_append(out, &line);
+    }
+}
+
+int batch_validate(const BatchMessage *batch, size_t msgsz) {
+    if (msgsz < BATCH_HEADER_BYTES || batch->mtype != MSG_TYPE_BATCH ||
+        batch->magic[0] != WIRE_MAGIC0 || batch->magic[1] != WIRE_MAGIC1 ||
+        batch->payload_len > BATCH_MAX_BYTES || msgsz != batch_size(batch)) {
+        return -1;
+    }
+
+    /* Walk every record once so handlers can trust the framing */
+    Message msg;
+    size_t offset = 0;
+    int count = 0;
+    int result;
+    while ((result = batch_next(batch, &offset, &msg)) == 1) {
+        count++;
+    }
+    return (result == 0 && count == batch->count) ? 0 : -1;
+}
@@ -0,0 +1,163 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define MAX_USERNAME 32
+#define MSG_SIZE 256
+
+/* Message types */
+#define MSG_TYPE_CONNECT 1
+#define MSG_TYPE_DISCONNECT 2
+#define MSG_TYPE_CHAT 3
+#define MSG_TYPE_ACK 4
+#define MSG_TYPE_SHUTDOWN 5  /* Sent to a receiver's own queue to wake it */
+#define MSG_TYPE_BATCH 6     /* Several lines in one BatchMessage */
+#define MSG_TYPE_HISTORY 7   /* Batch record: an earlier message replayed on join */
+
+/* CONNECT goes to a control queue of its own, ftok("server.key",
+ * CONTROL_QUEUE_PROJ), so a join never waits for room behind a chat flood
+ * on the server queue. Servers without one take CONNECT on the server queue
+ * as before. DISCONNECT stays on the server queue, behind the leaving
+ * client's last lines. */
+#define CONTROL_QUEUE_PROJ 'C'
+
+/* Trace stamps: CLOCK_MONOTONIC ns at each hop of a traced message. The
+ * clock is shared by every process on the host, so hops can be compared
+ * across them. The last one never leaves the recipient. */
+#define TRACE_CLIENT_SEND 0
+#define TRACE_SERVER_RECV 1
+#define TRACE_FANOUT 2
+#define TRACE_CLIENT_RECV 3
+#define TRACE_STAMPS 4
+#define TRACE_WIRE_STAMPS 3
+
+/* Message structure. Up to seq this is also the fixed wire format: every
+ * one of those fields is sent, so a fixed message always costs
+ * FIXED_MSG_BYTES. seq and trace never go out in the fixed format. */
+typedef struct {
+    long mtype;
+    char username[MAX_USERNAME];
+    char content[MSG_SIZE];
+    time_t timestamp;
+    uint64_t seq;                /* Broadcast sequence number, 0 if none */
+    int64_t trace[TRACE_STAMPS]; /* Only meaningful if trace[TRACE_CLIENT_SEND] is set */
+} Message;
+
+#define FIXED_MSG_BYTES (offsetof(Message, seq) - sizeof(long))
+
+/*
+ * Compact wire format: a small header followed by only the bytes actually
+ * used by the username and content, with no NUL terminators. The magic
+ * bytes sit where a fixed message has the first bytes of its username and
+ * can never start a valid UTF-8 name, so both formats can share one queue.
+ *
+ * Clients announce "compact" in CONNECT. The server then sends them compact
+ * messages, and a client only starts sending compact messages once it has
+ * received one, so old servers and old clients keep the fixed format.
+ * MSG_TYPE_BATCH arrived in the same protocol revision, so a peer that
+ * speaks compact also accepts batches.
+ *
+ * Clients that also announce "seq" get the server's sequence number on
+ * every broadcast: WIRE_FLAG_SEQ is set and the text starts with it as a
+ * uint64. Everyone else only ever sees flags == 0.
+ *
+ * Clients that announce "trace" as well get traced messages with
+ * WIRE_FLAG_TRACE: TRACE_WIRE_STAMPS int64 stamps follow the seq. The
+ * server's welcome to them is traced too, which tells the client it may
+ * send traced lines of its own. Only single messages carry stamps.
+ */
+#define WIRE_MAGIC0 0xFF
+#define WIRE_MAGIC1 0xC7
+#define WIRE_FLAG_SEQ 0x01
+#define WIRE_FLAG_TRACE 0x02
+#define TRACE_WIRE_BYTES (TRACE_WIRE_STAMPS * sizeof(int64_t))
+
+typedef struct {
+    long mtype;
+    unsigned char magic[2];
+    unsigned char username_len;
+    unsigned char flags;         /* WIRE_FLAG_* */
+    uint16_t content_len;
+    uint16_t reserved;
+    int64_t timestamp;
+    char text[sizeof(uint64_t) + TRACE_WIRE_BYTES + MAX_USERNAME + MSG_SIZE];  /* [seq], [trace], username, content */
+} WireMessage;
+
+#define WIRE_HEADER_BYTES (offsetof(WireMessage, text) - sizeof(long))
+
+/*
+ * Batch envelope: many lines in one IPC message. Each record is
+ *   uint8 type, uint8 username_len, uint16 content_len, int64 timestamp,
+ * followed by the username and content bytes, packed without padding.
+ * Records carry their own username so one batch can hold several senders.
+ * A record whose type has BATCH_RECORD_SEQ set has a uint64 sequence
+ * number between the header and the username.
+ */
+#define BATCH_MAX_BYTES 4096
+#define BATCH_RECORD_HEADER 12
+#define BATCH_RECORD_SEQ 0x80
+
+typedef struct {
+    long mtype;                  /* MSG_TYPE_BATCH */
+    unsigned char magic[2];
+    uint16_t count;              /* Records in payload */
+    uint32_t payload_len;        /* Bytes of payload used */
+    char payload[BATCH_MAX_BYTES];
+} BatchMessage;
+
+#define BATCH_HEADER_BYTES (offsetof(BatchMessage, payload) - sizeof(long))
+
+/* Largest msgsz any format can have, for sizing receive buffers */
+#define WIRE_MAX_BYTES (sizeof(BatchMessage) - sizeof(long))
+
+/* Receive buffer big enough for every format */
+typedef union {
+    long mtype;
+    Message fixed;
+    WireMessage compact;
+    BatchMessage batch;
+    char bytes[sizeof(long) + WIRE_MAX_BYTES + 1];  /* One spare byte shows a message was too big */
+} WireBuffer;
+
+/* Encode msg in the compact format; returns the msgsz to pass to msgsnd */
+size_t wire_encode(const Message *msg, WireMessage *wire);
+
+/* The same with msg's trace stamps, for peers that asked for them */
+size_t wire_encode_traced(const Message *msg, WireMessage *wire);
+
+/* Decode a received message of msgsz bytes in either format into msg
+ * (seq and the trace stamps are 0 unless the sender included them).
+ * Returns 1 if it was compact, 0 if fixed, -1 if malformed. */
+int wire_decode(const WireBuffer *buf, size_t msgsz, Message *msg);
+
+/* msgrcv() of any format into buf. A message too big for every format is
+ * taken off the queue and dropped, returning -1 with errno E2BIG; left at
+ * the head of the queue it would fail every msgrcv() after it. */
+ssize_t wire_receive(int queue_id, WireBuffer *buf, long mtype, int flags);
+
+/* Start an empty batch */
+void batch_init(BatchMessage *batch);
+
+/* Append msg as a record, with its seq if it has one; returns -1 (batch
+ * unchanged) if it does not fit */
+int batch_append(BatchMessage *batch, const Message *msg);
+
+/* msgsz to pass to msgsnd for this batch */
+size_t batch_size(const BatchMessage *batch);
+
+/* Check a received batch of msgsz bytes; returns 0 if well formed */
+int batch_validate(const BatchMessage *batch, size_t msgsz);
+
+/* Copy batch into out with every sequence number left out, for peers that
+ * did not ask for them. The copy is never larger, so it always fits. */
+void batch_strip_seq(const BatchMessage *batch, BatchMessage *out);
+
+/* Decode the record at *offset into msg and advance *offset.
+ * Returns 1 for a record, 0 at the end of the batch, -1 if malformed. */
+int batch_next(const BatchMessage *batch, size_t *offset, Message *msg);
+
+#endif /* CHAT_PROTOCOL_H */
@@ -0,0 +1,35 @@
+#include "chat_ratelimit.h"
+
+#define TOKEN 1000000000LL               /* One message, in the units of TokenBucket.tokens */
+
+void ratelimit_init(TokenBucket *bucket, const RateLimit *limit, int64_t now_ns) {
+    bucket->tokens = (int64_t)limit->burst * TOKEN;
+    bucket->updated_ns = now_ns;
+}
+
+int ratelimit_take(TokenBucket *bucket, const RateLimit *limit, int64_t now_ns, int wanted) {
+    if (limit->rate <= 0) {
+        return wanted;
+    }
+
+    /* Refill. Past the time an empty bucket takes to fill, more makes no
+     * difference, and capping it first keeps the product in range. */
+    int64_t capacity = (int64_t)limit->burst * TOKEN;
+    int64_t elapsed = now_ns - bucket->updated_ns;
+    if (elapsed > 0) {
+        int64_t fill_ns = capacity / limit->rate + 1;
+        if (elapsed > fill_ns) {
+            elapsed = fill_ns;
+        }
+        bucket->tokens += elapsed * limit->rate;
+        if (bucket->tokens > capacity) {
+            bucket->tokens = capacity;
+        }
+        bucket->updated_ns = now_ns;
+    }
+
+    int64_t available = bucket->tokens / TOKEN;
+    int granted = wanted < available ? wanted : (int)available;
+    bucket->tokens -= (int64_t)granted * TOKEN;
+    return granted;
+}
@@ -0,0 +1,34 @@
+#ifndef CHAT_RATELIMIT_H
+#define CHAT_RATELIMIT_H
+
+#include <stdint.h>
+
+/*
+ * Per-client token buckets.
+ *
+ * A bucket holds up to 'burst' messages and refills at 'rate' messages per
+ * second; every chat line a client sends takes one. Tokens are counted in
+ * billionths of a message so the refill is exact at any rate without
+ * floating point, and a check is a few integer operations.
+ */
+
+#define DEFAULT_RATE_BURST 20            /* Burst when -R is given without -B */
+
+typedef struct {
+    int rate;                            /* Messages per second, 0 for no limit */
+    int burst;                           /* Most messages sent back to back */
+} RateLimit;
+
+typedef struct {
+    int64_t tokens;                      /* Billionths of a message */
+    int64_t updated_ns;                  /* When tokens was last brought up to date */
+} TokenBucket;
+
+/* Start with a full bucket */
+void ratelimit_init(TokenBucket *bucket, const RateLimit *limit, int64_t now_ns);
+
+/* Take up to 'wanted' messages at now_ns (CLOCK_MONOTONIC). Returns how
+ * many may go out; the rest are over the limit. */
+int ratelimit_take(TokenBucket *bucket, const RateLimit *limit, int64_t now_ns, int wanted);
+
+#endif /* CHAT_RATELIMIT_H */
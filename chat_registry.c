@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat_registry.h"
+#include "chat_dispatch.h"
+
+#define REGISTRY_MIN_BUCKETS 16
+
+/* Bucket for a username; num_buckets is a power of two */
+static int bucket_of(ClientRegistry *reg, const char *username) {
+    return (int)(dispatch_hash(username) & (unsigned int)(reg->num_buckets - 1));
+}
+
+/* Double the slot arrays, keeping ids (slot indices) unchanged */
+static int grow_slots(ClientRegistry *reg) {
+    int new_capacity = reg->capacity * 2;
+    if (new_capacity > reg->max_clients) {
+        new_capacity = reg->max_clients;
+    }
+
+    Client *slots = realloc(reg->slots, new_capacity * sizeof(Client));
+    if (slots == NULL) {
+        return -1;
+    }
+    reg->slots = slots;
+
+    int *active_ids = realloc(reg->active_ids, new_capacity * sizeof(int));
+    if (active_ids == NULL) {
+        return -1;
+    }
+    reg->active_ids = active_ids;
+
+    int *free_ids = realloc(reg->free_ids, new_capacity * sizeof(int));
+    if (free_ids == NULL) {
+        return -1;
+    }
+    reg->free_ids = free_ids;
+
+    reg->capacity = new_capacity;
+    return 0;
+}
+
+/* Double the bucket array and relink every connected client */
+static int grow_buckets(ClientRegistry *reg) {
+    int new_count = reg->num_buckets * 2;
+    int *buckets = malloc(new_count * sizeof(int));
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    free(reg->buckets);
+    reg->buckets = buckets;
+    reg->num_buckets = new_count;
+    for (int b = 0; b < new_count; b++) {
+        reg->buckets[b] = -1;
+    }
+
+    for (int i = 0; i < reg->count; i++) {
+        Client *client = &reg->slots[reg->active_ids[i]];
+        int b = bucket_of(reg, client->username);
+        client->hash_next = reg->buckets[b];
+        reg->buckets[b] = client->id;
+    }
+    return 0;
+}
+
+int registry_init(ClientRegistry *reg, int initial_capacity, int max_clients) {
+    memset(reg, 0, sizeof(*reg));
+    pthread_rwlock_init(&reg->lock, NULL);
+    if (max_clients < 1) {
+        max_clients = 1;
+    }
+    if (initial_capacity < 1) {
+        initial_capacity = 1;
+    }
+    if (initial_capacity > max_clients) {
+        initial_capacity = max_clients;
+    }
+
+    reg->max_clients = max_clients;
+    reg->capacity = initial_capacity;
+    reg->slots = calloc(initial_capacity, sizeof(Client));
+    reg->active_ids = malloc(initial_capacity * sizeof(int));
+    reg->free_ids = malloc(initial_capacity * sizeof(int));
+
+    reg->num_buckets = REGISTRY_MIN_BUCKETS;
+    while (reg->num_buckets < initial_capacity) {
+        reg->num_buckets *= 2;
+    }
+    reg->buckets = malloc(reg->num_buckets * sizeof(int));
+
+    if (!reg->slots || !reg->active_ids || !reg->free_ids || !reg->buckets) {
+        perror("malloc client registry");
+        registry_destroy(reg);
+        return -1;
+    }
+    for (int b = 0; b < reg->num_buckets; b++) {
+        reg->buckets[b] = -1;
+    }
+    return 0;
+}
+
+void registry_destroy(ClientRegistry *reg) {
+    free(reg->slots);
+    free(reg->active_ids);
+    free(reg->free_ids);
+    free(reg->buckets);
+    pthread_rwlock_destroy(&reg->lock);
+    memset(reg, 0, sizeof(*reg));
+}
+
+int registry_find(ClientRegistry *reg, const char *username) {
+    for (int id = reg->buckets[bucket_of(reg, username)]; id != -1; id = reg->slots[id].hash_next) {
+        if (strcmp(reg->slots[id].username, username) == 0) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+Client *registry_get(ClientRegistry *reg, int id) {
+    if (id < 0 || id >= reg->high_water || !reg->slots[id].active) {
+        return NULL;
+    }
+    return &reg->slots[id];
+}
+
+int registry_add(ClientRegistry *reg, const char *username, int queue_id, pid_t pid) {
+    if (registry_find(reg, username) != -1) {
+        return REGISTRY_DUPLICATE;
+    }
+    if (reg->count >= reg->max_clients) {
+        return REGISTRY_FULL;
+    }
+
+    /* Reuse a freed id if there is one, otherwise take a fresh slot */
+    int id;
+    if (reg->num_free > 0) {
+        id = reg->free_ids[--reg->num_free];
+    } else {
+        if (reg->high_water == reg->capacity && grow_slots(reg) != 0) {
+            perror("realloc client registry");
+            return REGISTRY_FULL;
+        }
+        id = reg->high_water++;
+    }
+
+    /* Keep the load factor at or below 1 */
+    if (reg->count + 1 > reg->num_buckets && grow_buckets(reg) != 0) {
+        perror("malloc registry buckets");
+    }
+
+    Client *client = &reg->slots[id];
+    memset(client, 0, sizeof(*client));
+    client->active = CLIENT_ACTIVE;
+    client->id = id;
+    strncpy(client->username, username, MAX_USERNAME - 1);
+    client->username[MAX_USERNAME - 1] = '\0';  /* Ensure null termination */
+    client->queue_id = queue_id;
+    client->pid = pid;
+
+    int b = bucket_of(reg, client->username);
+    client->hash_next = reg->buckets[b];
+    reg->buckets[b] = id;
+
+    client->active_pos = reg->count;
+    reg->active_ids[reg->count++] = id;
+    return id;
+}
+
+int registry_remove(ClientRegistry *reg, int id) {
+    Client *client = registry_get(reg, id);
+    if (client == NULL) {
+        return -1;
+    }
+
+    /* Unlink from the hash chain */
+    int *link = &reg->buckets[bucket_of(reg, client->username)];
+    while (*link != id) {
+        link = &reg->slots[*link].hash_next;
+    }
+    *link = client->hash_next;
+
+    /* Swap the last active id into this one's place */
+    int last = reg->active_ids[--reg->count];
+    reg->active_ids[client->active_pos] = last;
+    reg->slots[last].active_pos = client->active_pos;
+
+    client->active = CLIENT_INACTIVE;
+    reg->free_ids[reg->num_free++] = id;
+    return 0;
+}
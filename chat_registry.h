@@ -0,0 +1,79 @@
+#ifndef CHAT_REGISTRY_H
+#define CHAT_REGISTRY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "chat_protocol.h"
+#include "chat_ratelimit.h"
+
+/* Client status */
+#define CLIENT_INACTIVE 0
+#define CLIENT_ACTIVE 1
+
+/* registry_add() failures */
+#define REGISTRY_FULL -1
+#define REGISTRY_DUPLICATE -2
+
+/* Client structure */
+typedef struct {
+    int active;
+    int id;                  /* Stable for as long as the client is connected */
+    char username[MAX_USERNAME];
+    int queue_id;
+    pid_t pid;
+    int ring_reader;         /* Gets broadcasts from the shared-memory ring */
+    int compact;             /* Understands the compact wire format */
+    int sequenced;           /* Wants sequence numbers on broadcasts */
+    int traced;              /* Wants trace stamps on traced messages */
+    struct ClientSpool *spool;  /* Messages waiting for room in the queue, see chat_spool.h */
+    int pidfd;               /* Watched for the process exiting, -1 if not */
+    TokenBucket bucket;      /* Rate limit; only the sender's dispatch worker touches it */
+    int throttle_noticed;    /* Told it is over the limit since it last got through */
+    _Atomic uint64_t throttled;  /* Lines dropped by the rate limit */
+    int hash_next;           /* Next id in the same hash bucket, -1 ends the chain */
+    int active_pos;          /* Position in active_ids, for O(1) removal */
+} Client;
+
+/*
+ * Growable client table.
+ *
+ * Clients live in slots[] indexed by their id; freed ids are reused. A
+ * chained hash index on username gives O(1) lookup, and active_ids[] is a
+ * dense list of connected ids so a broadcast only visits live clients.
+ *
+ * None of the functions lock: callers hold lock for reading around lookups
+ * and iteration, and for writing around registry_add()/registry_remove().
+ * slots[] can move when the table grows, so Client pointers are only valid
+ * while the lock is held.
+ */
+typedef struct {
+    pthread_rwlock_t lock;
+    Client *slots;
+    int capacity;            /* Allocated slots */
+    int max_clients;         /* Hard cap on connected clients */
+    int count;               /* Connected clients */
+    int *active_ids;         /* count ids of connected clients */
+    int *free_ids;           /* Stack of ids below high_water that are free */
+    int num_free;
+    int high_water;          /* Ids >= high_water have never been used */
+    int *buckets;            /* Hash bucket heads, -1 when empty */
+    int num_buckets;         /* Always a power of two */
+} ClientRegistry;
+
+int registry_init(ClientRegistry *reg, int initial_capacity, int max_clients);
+void registry_destroy(ClientRegistry *reg);
+
+/* Returns the new client id, REGISTRY_FULL or REGISTRY_DUPLICATE */
+int registry_add(ClientRegistry *reg, const char *username, int queue_id, pid_t pid);
+
+/* Returns the id of the connected client with this username, or -1 */
+int registry_find(ClientRegistry *reg, const char *username);
+
+/* Returns the connected client with this id, or NULL */
+Client *registry_get(ClientRegistry *reg, int id);
+
+/* Returns 0 if the client was removed, -1 if the id was not connected */
+int registry_remove(ClientRegistry *reg, int id);
+
+#endif /* CHAT_REGISTRY_H */
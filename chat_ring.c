@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "chat_ring.h"
+
+/* Shared (not process private) futex, since readers live in other processes */
+static long futex(_Atomic uint32_t *word, int op, uint32_t val) {
+    return syscall(SYS_futex, (uint32_t *)word, op, val, NULL, NULL, 0);
+}
+
+BroadcastRing *ring_create(key_t key, int *shm_id_out) {
+    shmctl(shmget(key, 0, 0666), IPC_RMID, NULL);  /* Remove stale segment */
+
+    int shm_id = shmget(key, sizeof(BroadcastRing), IPC_CREAT | 0666);
+    if (shm_id == -1) {
+        perror("shmget broadcast ring");
+        return NULL;
+    }
+
+    BroadcastRing *ring = (BroadcastRing *)shmat(shm_id, NULL, 0);
+    if (ring == (void *)-1) {
+        perror("shmat broadcast ring");
+        shmctl(shm_id, IPC_RMID, NULL);
+        return NULL;
+    }
+
+    /* New segments are zero filled, so every slot starts with seq 0 */
+    ring->num_slots = RING_SLOTS;
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->wake_word, 0);
+    atomic_store(&ring->waiters, 0);
+    atomic_store(&ring->lag_events, 0);
+    atomic_store(&ring->messages_lost, 0);
+    atomic_thread_fence(memory_order_release);
+    ring->magic = RING_MAGIC;
+
+    *shm_id_out = shm_id;
+    return ring;
+}
+
+BroadcastRing *ring_attach(key_t key) {
+    int shm_id = shmget(key, 0, 0666);
+    if (shm_id == -1) {
+        return NULL;
+    }
+
+    BroadcastRing *ring = (BroadcastRing *)shmat(shm_id, NULL, 0);
+    if (ring == (void *)-1) {
+        return NULL;
+    }
+    if (ring->magic != RING_MAGIC || ring->num_slots != RING_SLOTS) {
+        shmdt(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+uint64_t ring_publish(BroadcastRing *ring, const void *data, size_t length, pid_t exclude_pid) {
+    uint64_t seq = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+    RingSlot *slot = &ring->slots[(seq - 1) % RING_SLOTS];
+
+    if (length > RING_SLOT_DATA) {
+        length = RING_SLOT_DATA;
+    }
+
+    /* Mark the slot as being written before touching its contents */
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->exclude_pid = exclude_pid;
+    slot->length = (uint32_t)length;
+    memcpy(slot->data, data, length);
+
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&ring->head, seq, memory_order_release);
+
+    /* One wake syscall per publish, and only when somebody is asleep */
+    atomic_fetch_add(&ring->wake_word, 1);
+    if (atomic_load(&ring->waiters) > 0) {
+        futex(&ring->wake_word, FUTEX_WAKE, INT_MAX);
+    }
+    return seq;
+}
+
+void ring_reader_init(RingReader *reader, BroadcastRing *ring) {
+    reader->ring = ring;
+    reader->cursor = atomic_load_explicit(&ring->head, memory_order_acquire) + 1;
+    reader->lost = 0;
+}
+
+/* Move a lagging reader to the oldest message that can still be read */
+static uint64_t skip_to_oldest(RingReader *reader) {
+    uint64_t head = atomic_load_explicit(&reader->ring->head, memory_order_acquire);
+    uint64_t oldest = head >= RING_SLOTS ? head - RING_SLOTS + 2 : 1;  /* +1 spare for the slot being written */
+    uint64_t skipped = oldest > reader->cursor ? oldest - reader->cursor : 1;
+
+    reader->cursor += skipped;
+    reader->lost += skipped;
+    atomic_fetch_add(&reader->ring->lag_events, 1);
+    atomic_fetch_add(&reader->ring->messages_lost, skipped);
+    return skipped;
+}
+
+int ring_read(RingReader *reader, void *buf, size_t buf_size, size_t *length,
+              pid_t *exclude_pid, uint64_t *skipped) {
+    BroadcastRing *ring = reader->ring;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (reader->cursor > head) {
+        return RING_EMPTY;
+    }
+    if (head - reader->cursor >= RING_SLOTS) {
+        *skipped = skip_to_oldest(reader);
+        return RING_LAGGED;
+    }
+
+    RingSlot *slot = &ring->slots[(reader->cursor - 1) % RING_SLOTS];
+    uint64_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (before != reader->cursor) {
+        /* Overwritten by a newer lap, or being rewritten right now */
+        *skipped = skip_to_oldest(reader);
+        return RING_LAGGED;
+    }
+
+    size_t len = slot->length < buf_size ? slot->length : buf_size;
+    pid_t pid = slot->exclude_pid;
+    memcpy(buf, slot->data, len);
+
+    /* Seqlock check: the slot must not have changed while we copied it */
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != before) {
+        *skipped = skip_to_oldest(reader);
+        return RING_LAGGED;
+    }
+
+    *length = len;
+    *exclude_pid = pid;
+    reader->cursor++;
+    return RING_OK;
+}
+
+void ring_wait(RingReader *reader) {
+    BroadcastRing *ring = reader->ring;
+    uint32_t word = atomic_load(&ring->wake_word);
+
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) >= reader->cursor) {
+        return;  /* Something arrived since the last read */
+    }
+
+    atomic_fetch_add(&ring->waiters, 1);
+    /* Returns at once with EAGAIN if wake_word moved after we sampled it */
+    if (futex(&ring->wake_word, FUTEX_WAIT, word) == -1 && errno != EAGAIN && errno != EINTR) {
+        perror("futex wait");
+    }
+    atomic_fetch_sub(&ring->waiters, 1);
+}
+
+void ring_wake_readers(BroadcastRing *ring) {
+    atomic_fetch_add(&ring->wake_word, 1);
+    futex(&ring->wake_word, FUTEX_WAKE, INT_MAX);
+}
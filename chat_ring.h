@@ -0,0 +1,85 @@
+#ifndef CHAT_RING_H
+#define CHAT_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Shared-memory broadcast ring.
+ *
+ * The server publishes every broadcast once into a ring of fixed size slots
+ * in a System V segment next to the log buffer. Each client keeps its own
+ * cursor (the next sequence number it expects) and copies messages out, so a
+ * broadcast costs one copy no matter how many clients read it.
+ *
+ * The messages are in the compact format with their broadcast sequence number
+ * (WIRE_FLAG_SEQ) included. Clients built before that cannot read them; the
+ * magic changed with it, so such clients find no ring and use their queue.
+ *
+ * Sequence numbers start at 1; message n lives in slot (n - 1) % RING_SLOTS.
+ * A slot's seq is cleared while it is being rewritten, which lets a reader
+ * detect both overwritten (lagged) and torn copies without taking a lock.
+ */
+
+#define RING_SLOTS 4096
+#define RING_SLOT_DATA 384       /* Large enough for one Message */
+#define RING_MAGIC 0x524e4733u   /* "RNG3": sequence numbers, slots sized for trace stamps */
+
+typedef struct {
+    _Atomic uint64_t seq;        /* Sequence stored here, 0 while writing */
+    pid_t exclude_pid;           /* Reader that should skip this one, or 0 */
+    uint32_t length;
+    char data[RING_SLOT_DATA];
+} RingSlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_slots;
+    _Atomic uint64_t head;             /* Last published sequence */
+    _Atomic uint32_t wake_word;        /* Futex word bumped on every publish */
+    _Atomic uint32_t waiters;          /* Readers sleeping on wake_word */
+    _Atomic uint64_t lag_events;       /* Reported by readers that fell behind */
+    _Atomic uint64_t messages_lost;    /* Messages those readers skipped */
+    RingSlot slots[RING_SLOTS];
+} BroadcastRing;
+
+/* Result of ring_read() */
+#define RING_OK 0
+#define RING_EMPTY 1
+#define RING_LAGGED 2
+
+/* Process-local reader state */
+typedef struct {
+    BroadcastRing *ring;
+    uint64_t cursor;             /* Next sequence to read */
+    uint64_t lost;               /* Messages skipped because we lagged */
+} RingReader;
+
+/* Server side: create (replacing any stale segment) and map the ring */
+BroadcastRing *ring_create(key_t key, int *shm_id_out);
+
+/* Client side: map an existing ring, or NULL if the server has none */
+BroadcastRing *ring_attach(key_t key);
+
+/* Publish one message. Only one thread may publish at a time. */
+uint64_t ring_publish(BroadcastRing *ring, const void *data, size_t length, pid_t exclude_pid);
+
+/* Start a reader at the current head so only new messages are seen */
+void ring_reader_init(RingReader *reader, BroadcastRing *ring);
+
+/* Copy the next message into buf. On RING_LAGGED the cursor has already
+ * been moved to the oldest message still available and *skipped is set. */
+int ring_read(RingReader *reader, void *buf, size_t buf_size, size_t *length,
+              pid_t *exclude_pid, uint64_t *skipped);
+
+/* Sleep until something is published after the reader's cursor, or until
+ * ring_wake_readers() is called */
+void ring_wait(RingReader *reader);
+
+/* Wake every sleeping reader, e.g. so a thread can notice it should exit */
+void ring_wake_readers(BroadcastRing *ring);
+
+#endif /* CHAT_RING_H */
@@ -10,99 +10,309 @@
 #include <sys/shm.h>
 #include <errno.h>
 #include <time.h>
-
-#define MAX_CLIENTS 10
-#define MAX_USERNAME 32
-#define MSG_SIZE 256
-#define LOG_SIZE (1024 * 1024)  /* 1MB for logs */
-
-/* Message types */
-#define MSG_TYPE_CONNECT 1
-#define MSG_TYPE_DISCONNECT 2
-#define MSG_TYPE_CHAT 3
-#define MSG_TYPE_ACK 4
-
-/* Client status */
-#define CLIENT_INACTIVE 0
-#define CLIENT_ACTIVE 1
-
-/* Message structure */
-typedef struct {
-    long mtype;
-    char username[MAX_USERNAME];
-    char content[MSG_SIZE];
-    time_t timestamp;
-} Message;
-
-/* Client structure */
-typedef struct {
-    int active;
-    char username[MAX_USERNAME];
-    int queue_id;
-    pid_t pid;
-} Client;
-
-/* Log buffer structure */
-typedef struct {
-    size_t total_size;
-    size_t used_size;
-    int write_position;
-    pthread_mutex_t mutex;
-    char data[];  /* Flexible array member */
-} LogBuffer;
-
-/* Global variables */
-Client clients[MAX_CLIENTS];
+#include "chat_protocol.h"
+#include "chat_dispatch.h"
+#include "chat_registry.h"
+#include "chat_ring.h"
+#include "chat_log.h"
+#include "chat_logwriter.h"
+#include "chat_history.h"
+#include "chat_spool.h"
+#include "chat_ratelimit.h"
+#include "chat_liveness.h"
+#include "chat_stats.h"
+#include "chat_core.h"
+
+#define DEFAULT_MAX_CLIENTS 4096  /* Default cap on connected clients (-c) */
+#define INITIAL_CLIENTS 16        /* Registry starts this small and grows */
+#define DEFAULT_MAX_WORKERS 8   /* Default pool size cap when -w is not given */
+
+/* Global variables; the message path's own are in chat_core.c */
+int max_clients = DEFAULT_MAX_CLIENTS;
+DispatchPool dispatch_pool;
+int num_workers;
 int server_queue_id;
-LogBuffer *log_buffer;
+int control_queue_id = -1;             /* Joins only, see CONTROL_QUEUE_PROJ */
 int shm_id;
-int running = 1;
-pthread_t receiver_tid, log_sync_tid;
+int ring_shm_id = -1;
+int use_ring = 0;
+volatile sig_atomic_t running = 1;
+LogWriterConfig log_config;
+pthread_t drainer_tid;
+atomic_int drainer_stopping = 0;
+pthread_t reaper_tid;
+atomic_int reaper_stopping = 0;
+int stats_shm_id = -1;
+pthread_t receiver_tid;
+pthread_t control_tid;
 
 
 /* Function prototypes */
 void initialize_server();
 void cleanup_resources();
-int add_client(const char *username, int queue_id, pid_t pid);
-void remove_client(const char *username);
-void broadcast_message(Message *msg, int exclude_index);
-void handle_message(Message *msg);
-void add_to_log(Message *msg);
 void *message_receiver(void *arg);
-void *log_sync_thread(void *arg);
+void *control_receiver(void *arg);
+void *spool_drainer(void *arg);
+void stop_spool_drainer();
+void *client_reaper(void *arg);
+void stop_client_reaper();
 void handle_signal(int sig);
-//CHANGE New fun added
-void handle_alarm(int sig);
 void force_server_shutdown();
+void wake_queue(int queue_id);
+
+int main(int argc, char *argv[]) {
+    /* Worker count defaults to the online CPUs, capped */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = (cpus > 0 && cpus < DEFAULT_MAX_WORKERS) ? (int)cpus : DEFAULT_MAX_WORKERS;
+
+    log_writer_default_config(&log_config);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:c:bi:s:d:l:n:r:a:k:H:T:S:P:R:B:")) != -1) {
+        switch (opt) {
+            case 'w':
+                num_workers = atoi(optarg);
+                if (num_workers < 1 || num_workers > DISPATCH_MAX_WORKERS) {
+                    fprintf(stderr, "Worker count must be between 1 and %d\n", DISPATCH_MAX_WORKERS);
+                    return 1;
+                }
+                break;
+            case 'c':
+                max_clients = atoi(optarg);
+                if (max_clients < 1) {
+                    fprintf(stderr, "Client limit must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 'b':
+                use_ring = 1;
+                break;
+            case 'i':
+                log_config.interval_ms = atoi(optarg);
+                if (log_config.interval_ms < 1) {
+                    fprintf(stderr, "Log flush interval must be at least 1 ms\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                log_config.batch_bytes = (size_t)atol(optarg) * 1024;
+                if (log_config.batch_bytes < 1 || log_config.batch_bytes > LOG_SIZE / 2) {
+                    fprintf(stderr, "Log flush batch must be between 1 and %d KB\n", LOG_SIZE / 2048);
+                    return 1;
+                }
+                break;
+            case 'd':
+                log_config.durability = log_durability_parse(optarg);
+                if (log_config.durability < 0) {
+                    fprintf(stderr, "Log durability must be none, periodic or group\n");
+                    return 1;
+                }
+                break;
+            case 'l':
+                log_config.format = log_format_parse(optarg);
+                if (log_config.format < 0) {
+                    fprintf(stderr, "Log format must be text or binary\n");
+                    return 1;
+                }
+                log_config.path = log_config.format == LOG_FORMAT_BINARY ? BINLOG_FILE : LOG_FILE;
+                break;
+            case 'n':
+                log_config.index_interval = (uint32_t)atoi(optarg);
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "Index interval must be at least 1 record\n");
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "Segment size must be 0 (never rotate) or more KB\n");
+                    return 1;
+                }
+                log_config.segment_bytes = (uint64_t)atol(optarg) * 1024;
+                break;
+            case 'a':
+                log_config.segment_age_s = atoi(optarg);
+                if (log_config.segment_age_s < 0) {
+                    fprintf(stderr, "Segment age must be 0 (no limit) or more seconds\n");
+                    return 1;
+                }
+                break;
+            case 'k':
+                log_config.keep_segments = atoi(optarg);
+                if (log_config.keep_segments < 0) {
+                    fprintf(stderr, "Segments kept must be 0 (all) or more\n");
+                    return 1;
+                }
+                break;
+            case 'H':
+                history_replay = atoi(optarg);
+                if (history_replay < 0 || history_replay > DEFAULT_HISTORY_SLOTS) {
+                    fprintf(stderr, "History replay must be between 0 and %d messages\n",
+                            DEFAULT_HISTORY_SLOTS);
+                    return 1;
+                }
+                break;
+            case 'T':
+                history_max_age_s = atoi(optarg);
+                if (history_max_age_s < 0) {
+                    fprintf(stderr, "History age must be 0 (no limit) or more seconds\n");
+                    return 1;
+                }
+                break;
+            case 'S':
+                if (atol(optarg) < 1) {
+                    fprintf(stderr, "Client backlog cap must be at least 1 KB\n");
+                    return 1;
+                }
+                spool_bytes = (size_t)atol(optarg) * 1024;
+                break;
+            case 'P':
+                spool_policy = spool_policy_parse(optarg);
+                if (spool_policy < 0) {
+                    fprintf(stderr, "Backlog policy must be drop-oldest, drop-newest or disconnect\n");
+                    return 1;
+                }
+                break;
+            case 'R':
+                rate_limit.rate = atoi(optarg);
+                if (rate_limit.rate < 0 || rate_limit.rate > 1000000) {
+                    fprintf(stderr, "Rate limit must be between 0 (none) and 1000000 messages/s\n");
+                    return 1;
+                }
+                break;
+            case 'B':
+                rate_limit.burst = atoi(optarg);
+                if (rate_limit.burst < 1 || rate_limit.burst > 1000000) {
+                    fprintf(stderr, "Rate limit burst must be between 1 and 1000000 messages\n");
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-c max_clients] [-b] [-i flush_ms] [-s flush_kb]"
+                        " [-d none|periodic|group] [-l text|binary] [-n index_interval]"
+                        " [-r segment_kb] [-a segment_s] [-k keep] [-H replay_count] [-T replay_s]"
+                        " [-S backlog_kb] [-P drop-oldest|drop-newest|disconnect]"
+                        " [-R msgs_per_s] [-B burst]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
 
-int main() {
     printf("Starting chat server V2...\n");
     
-    /* Set up signal handler */
-    signal(SIGINT, handle_signal);
-
-    //CHANGE adding alarm sig handler
-
-    signal(SIGALRM, handle_alarm);
+    /* Set up signal handler without SA_RESTART so a blocked fgets() returns */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* Worker threads inherit this mask, so SIGINT/SIGTERM always hit main */
+    sigset_t shutdown_signals, old_mask;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &old_mask);
     
     /* Initialize server resources */
     initialize_server();
+
+    /* Start the log writer before anything can append to the log */
+    if (log_writer_start(&log_writer, log_buffer, &log_config) != 0) {
+        cleanup_resources();
+        exit(1);
+    }
+
+    /* Joins hand their history replay to this thread */
+    if (replayer_start(&replayer, &history) != 0) {
+        log_writer_stop(&log_writer);
+        cleanup_resources();
+        exit(1);
+    }
+
+    /* Clients that fall behind are caught up by this thread */
+    if (pthread_create(&drainer_tid, NULL, spool_drainer, NULL) != 0) {
+        perror("Failed to create backlog drain thread");
+        replayer_stop(&replayer);
+        log_writer_stop(&log_writer);
+        cleanup_resources();
+        exit(1);
+    }
+
+    /* Clients that die without saying goodbye are removed by this thread.
+     * Without pidfds they are only found when a send to them fails. */
+    if (liveness_init(&liveness) == 0) {
+        if (pthread_create(&reaper_tid, NULL, client_reaper, NULL) == 0) {
+            watching_clients = 1;
+        } else {
+            perror("Failed to create client reaper thread");
+            liveness_destroy(&liveness);
+        }
+    }
+    if (!watching_clients) {
+        printf("Not watching client processes; dead clients are dropped when a send to them fails\n");
+    }
+
+    /* Start the dispatch workers before anything can feed them */
+    if (dispatch_pool_init(&dispatch_pool, num_workers, sizeof(InboundItem), dispatch_message, NULL) != 0) {
+        stop_client_reaper();
+        stop_spool_drainer();
+        replayer_stop(&replayer);
+        log_writer_stop(&log_writer);
+        cleanup_resources();
+        exit(1);
+    }
+    printf("Dispatching messages on %d worker thread(s)\n", num_workers);
+    printf("Flushing %s every %d ms or every %zu KB, durability: %s\n", log_config.path,
+           log_config.interval_ms, log_config.batch_bytes / 1024,
+           log_durability_name(log_config.durability));
+    if (history_replay > 0) {
+        printf("Replaying the last %d message(s)", history_replay);
+        if (history_max_age_s > 0) {
+            printf(" from the last %d s", history_max_age_s);
+        }
+        printf(" to joining clients\n");
+    }
+    printf("Holding up to %zu KB for each client that falls behind, then %s\n", spool_bytes / 1024,
+           spool_policy_name(spool_policy));
+    if (rate_limit.rate > 0) {
+        printf("Limiting each client to %d message(s) per second, in bursts of up to %d\n",
+               rate_limit.rate, rate_limit.burst);
+    }
+    if (log_config.segment_bytes > 0 || log_config.segment_age_s > 0) {
+        printf("Rotating %s at %llu KB or %d s, keeping %d compressed segment(s)\n", log_config.path,
+               (unsigned long long)(log_config.segment_bytes / 1024), log_config.segment_age_s,
+               log_config.keep_segments);
+    }
     
     /* Start message receiver thread */
     if (pthread_create(&receiver_tid, NULL, message_receiver, NULL) != 0) {
         perror("Failed to create message receiver thread");
+        dispatch_pool_shutdown(&dispatch_pool);
+        stop_client_reaper();
+        stop_spool_drainer();
+        replayer_stop(&replayer);
+        log_writer_stop(&log_writer);
         cleanup_resources();
         exit(1);
     }
-    
-    /* Start log synchronization thread */
-    if (pthread_create(&log_sync_tid, NULL, log_sync_thread, NULL) != 0) {
-        perror("Failed to create log sync thread");
-        running = 0;
+
+    /* Joins are read on their own thread, off the chat path */
+    if (pthread_create(&control_tid, NULL, control_receiver, NULL) != 0) {
+        perror("Failed to create control receiver thread");
+        force_server_shutdown();
         pthread_join(receiver_tid, NULL);
+        dispatch_pool_shutdown(&dispatch_pool);
+        stop_client_reaper();
+        stop_spool_drainer();
+        replayer_stop(&replayer);
+        log_writer_stop(&log_writer);
         cleanup_resources();
         exit(1);
     }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
     
     /* Main server loop - can be used for server commands */
     char command[64];
@@ -117,23 +327,93 @@ int main() {
         /* Process server commands here if needed */
         if (strncmp(command, "quit", 4) == 0) {
             printf("Shutting down server...\n");
-            running = 0;
-            //CHANGE
-            force_server_shutdown();
+            break;
+        } else if (strncmp(command, "log", 3) == 0) {
+            /* Log writer throughput and sync latency so far */
+            log_writer_report(&log_writer);
+            printf("Log ring: %llu entries, %llu dropped while the writer was behind\n",
+                   (unsigned long long)(atomic_load(&log_buffer->next_seq) - 1),
+                   (unsigned long long)atomic_load(&log_buffer->dropped));
+        } else if (strncmp(command, "stats", 5) == 0) {
+            /* The same report chat_stats prints from outside */
+            stats_report(stats, stdout);
         } else if (strncmp(command, "list", 4) == 0) {
             /* List connected clients */
             printf("Connected clients:\n");
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (clients[i].active) {
-                    printf("  %s\n", clients[i].username);
+            int throttled_clients = 0;
+            pthread_rwlock_rdlock(&registry.lock);
+            for (int i = 0; i < registry.count; i++) {
+                Client *client = &registry.slots[registry.active_ids[i]];
+                ClientSpool *spool = client->spool;
+                uint64_t throttled = atomic_load_explicit(&client->throttled, memory_order_relaxed);
+                printf("  [%d] %s", client->id, client->username);
+                pthread_mutex_lock(&spool->mutex);
+                uint64_t queued = spool->queued;  /* Spooling moves it on once unlocked */
+                if (queued > 0) {
+                    printf(" - backlog %zu KB (peak %zu KB), %llu held back, %llu dropped",
+                           spool->bytes / 1024, spool->peak_bytes / 1024,
+                           (unsigned long long)queued, (unsigned long long)spool->dropped);
                 }
+                pthread_mutex_unlock(&spool->mutex);
+                if (throttled > 0) {
+                    printf("%s %llu throttled", queued > 0 ? "," : " -",
+                           (unsigned long long)throttled);
+                    throttled_clients++;
+                }
+                printf("\n");
+            }
+            pthread_rwlock_unlock(&registry.lock);
+            if (rate_limit.rate > 0) {
+                printf("Rate limit: %d/s, burst %d; %d connected client(s) throttled, "
+                       "%llu message(s) dropped in all\n", rate_limit.rate, rate_limit.burst,
+                       throttled_clients, (unsigned long long)atomic_load(&stats->throttled));
+            }
+            if (watching_clients) {
+                printf("Reaped %llu client(s) that exited without disconnecting\n",
+                       (unsigned long long)atomic_load(&stats->reaped));
+            }
+            printf("Backlogs: %d client(s) behind, %llu message(s) held back, %llu dropped, "
+                   "%llu client(s) disconnected; %llu buffer(s) allocated, %llu reused\n",
+                   atomic_load(&spool_pool.backlogged),
+                   (unsigned long long)atomic_load(&spool_pool.counters->queued),
+                   (unsigned long long)atomic_load(&spool_pool.counters->dropped),
+                   (unsigned long long)atomic_load(&spool_pool.counters->disconnected),
+                   (unsigned long long)atomic_load(&spool_pool.counters->allocated),
+                   (unsigned long long)atomic_load(&spool_pool.counters->reused));
+
+            pthread_mutex_lock(&replayer.mutex);
+            uint64_t head = history_head(&history);
+            printf("History: %llu message(s) up to seq %llu, %llu replay(s) sent as %llu message(s) "
+                   "in %llu send(s), %d waiting, %llu abandoned\n",
+                   (unsigned long long)(head + 1 - history.start), (unsigned long long)head,
+                   (unsigned long long)replayer.replays,
+                   (unsigned long long)replayer.messages, (unsigned long long)replayer.sends,
+                   replayer.count, (unsigned long long)replayer.abandoned);
+            pthread_mutex_unlock(&replayer.mutex);
+
+            if (broadcast_ring) {
+                printf("Broadcast ring: seq %llu, %llu lag event(s), %llu message(s) lost by readers\n",
+                       (unsigned long long)atomic_load(&broadcast_ring->head),
+                       (unsigned long long)atomic_load(&broadcast_ring->lag_events),
+                       (unsigned long long)atomic_load(&broadcast_ring->messages_lost));
             }
         }
     }
     
-    /* Wait for threads to finish */
+    /* Wake the receiver threads and wait for them to finish */
+    force_server_shutdown();
     pthread_join(receiver_tid, NULL);
-    pthread_join(log_sync_tid, NULL);
+    pthread_join(control_tid, NULL);
+
+    /* Let the workers finish everything the receiver already handed over */
+    dispatch_pool_shutdown(&dispatch_pool);
+    stop_client_reaper();
+    stop_spool_drainer();
+    replayer_stop(&replayer);
+
+    /* Stop the log writer; it flushes whatever is still pending */
+    log_writer_stop(&log_writer);
+    log_writer_report(&log_writer);
     
     /* Clean up resources */
     cleanup_resources();
@@ -142,11 +422,32 @@ int main() {
     return 0;
 }
 
-/* Initialize server resources */
 void initialize_server() {
-    /* Initialize client array */
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        clients[i].active = CLIENT_INACTIVE;
+    /* Initialize client registry */
+    if (registry_init(&registry, INITIAL_CLIENTS, max_clients) != 0) {
+        exit(1);
+    }
+
+    /* Statistics come first so everything after can record into them */
+    key_t stats_key = ftok("log.key", STATS_PROJ);
+    if (stats_key == -1) {
+        perror("ftok stats key");
+        exit(1);
+    }
+    stats = stats_create(stats_key, &stats_shm_id);
+    if (stats == NULL) {
+        exit(1);
+    }
+    spool_pool_init(&spool_pool, &stats->spool);
+    log_config.flush_stats = &stats->log_flush;
+
+    /* Broadcast sequence numbers count on from our start time in ns, so
+     * they never repeat across restarts */
+    struct timespec started;
+    clock_gettime(CLOCK_REALTIME, &started);
+    if (history_init(&history, DEFAULT_HISTORY_SLOTS,
+                     (uint64_t)started.tv_sec * 1000000000ULL + started.tv_nsec) != 0) {
+        exit(1);
     }
     
     /* Create server message queue */
@@ -163,6 +464,20 @@ void initialize_server() {
         perror("msgget server queue");
         exit(1);
     }
+
+    key_t control_key = ftok("server.key", CONTROL_QUEUE_PROJ);
+    if (control_key == -1) {
+        perror("ftok control key");
+        exit(1);
+    }
+
+    msgctl(msgget(control_key, 0666), IPC_RMID, NULL);
+
+    control_queue_id = msgget(control_key, 0666 | IPC_CREAT);
+    if (control_queue_id == -1) {
+        perror("msgget control queue");
+        exit(1);
+    }
     
     /* Create shared memory for logs */
     key_t shm_key = ftok("log.key", 'L');
@@ -187,44 +502,58 @@ void initialize_server() {
     }
     
     /* Initialize log buffer */
-    log_buffer->total_size = LOG_SIZE;
-    log_buffer->used_size = 0;
-    log_buffer->write_position = 0;
-    
-    /* Initialize mutex for log buffer */
-    pthread_mutexattr_t mutex_attr;
-    pthread_mutexattr_init(&mutex_attr);
-    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&log_buffer->mutex, &mutex_attr);
-    pthread_mutexattr_destroy(&mutex_attr);
+    log_init(log_buffer, LOG_SIZE, 1);
+
+    /* Optional broadcast ring, in its own segment next to the log buffer */
+    if (use_ring) {
+        key_t ring_key = ftok("log.key", 'B');
+        if (ring_key == -1) {
+            perror("ftok ring key");
+            exit(1);
+        }
+        broadcast_ring = ring_create(ring_key, &ring_shm_id);
+        if (broadcast_ring == NULL) {
+            exit(1);
+        }
+        printf("Broadcast ring enabled (%d slots)\n", RING_SLOTS);
+    }
     
     printf("Server initialized successfully\n");
 }
 
-//DEFINING FORCE SERVER SHUT DOWN
-void force_server_shutdown(){
-    printf("Forcefully shutting down server...\n");
-    /*First attempt to wakeup receiver thread*/
-    Message wake_msg;
-    wake_msg.mtype = 999; // Arbitrary type to wake up receiver because it is blocked in msgrcv
-    strcpy(wake_msg.username, "SERVER");
-    strcpy(wake_msg.content, "Server is shutting down");
-    msgsnd(server_queue_id, &wake_msg, sizeof(Message) - sizeof(long), IPC_NOWAIT);
-    struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = 0;
+/* Stop the server threads. The receivers block in msgrcv(), so each is woken
+ * by a MSG_TYPE_SHUTDOWN message on its own queue; unlike a signal this cannot
+ * be lost if it arrives before the thread enters msgrcv(). */
+void force_server_shutdown() {
+    running = 0;
 
-    /*set alaram as fallback*/
-    alarm(5);
+    wake_queue(server_queue_id);
+    if (control_queue_id != -1) {
+        wake_queue(control_queue_id);
+    }
 
-    /* Wait for receiver thread to finish */
-    printf("Waiting for receiver thread to finish...\n");
-    
+    printf("Waiting for receiver threads to finish...\n");
 }
 
-void handle_alarm(int sig) {
-    printf("Alarm triggered, shutting down...\n");
-    exit(1);
+/* Send MSG_TYPE_SHUTDOWN to one of our own queues */
+void wake_queue(int queue_id) {
+    Message wake_msg;
+    memset(&wake_msg, 0, sizeof(wake_msg));
+    wake_msg.mtype = MSG_TYPE_SHUTDOWN;
+    strcpy(wake_msg.username, "SERVER");
+    wake_msg.timestamp = time(NULL);
+
+    /* A full queue needs no wakeup: the receiver is not blocked, and sees
+     * running cleared before its next message. Waiting for room instead
+     * could hang, as it may already have stopped reading. */
+    while (msgsnd(queue_id, &wake_msg, FIXED_MSG_BYTES, IPC_NOWAIT) == -1) {
+        if (errno != EINTR) {
+            if (errno != EAGAIN) {
+                perror("msgsnd shutdown");
+            }
+            break;
+        }
+    }
 }
 
 /* Clean up server resources */
@@ -235,18 +564,28 @@ void cleanup_resources() {
     strcpy(shutdown_msg.username, "SERVER");
     strcpy(shutdown_msg.content, "Server is shutting down");
     shutdown_msg.timestamp = time(NULL);
-    
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active) {
-            msgsnd(clients[i].queue_id, &shutdown_msg, sizeof(Message) - sizeof(long), IPC_NOWAIT); //changed to non blocking send check IPC_NOWAIT definition for more details
+    shutdown_msg.seq = 0;
+    
+    for (int i = 0; i < registry.count; i++) {
+        Client *client = &registry.slots[registry.active_ids[i]];
+        send_to_client(client->queue_id, client->compact, &shutdown_msg, IPC_NOWAIT); //changed to non blocking send check IPC_NOWAIT definition for more details
+        spool_destroy(client->spool);
+        if (client->pidfd != -1) {
+            close(client->pidfd);
         }
     }
+    registry_destroy(&registry);
+    spool_pool_destroy(&spool_pool);
+    history_destroy(&history);
     
     usleep(500000);
 
     if (server_queue_id != -1) {
         msgctl(server_queue_id, IPC_RMID, NULL);
     }
+    if (control_queue_id != -1) {
+        msgctl(control_queue_id, IPC_RMID, NULL);
+    }
 
     /* Destroy mutex and detach from shared memory */
     if (log_buffer != (void *)-1) {
@@ -258,299 +597,256 @@ void cleanup_resources() {
     if (shm_id != -1) {
         shmctl(shm_id, IPC_RMID, NULL);
     }
-    
-    printf("Resources cleaned up\n");
-}
 
-/* Add a new client */
-int add_client(const char *username, int queue_id, pid_t pid) {
-    int index = -1;
-    
-    /* Find empty slot in clients array */
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (!clients[i].active) {
-            index = i;
-            break;
-        }
-    }
-    
-    if (index == -1) {
-        return -1;  /* No slots available */
+    /* Readers keep their mapping until they detach, so this is safe */
+    if (broadcast_ring) {
+        shmdt(broadcast_ring);
+        shmctl(ring_shm_id, IPC_RMID, NULL);
     }
-    
-    /* Check if username already exists */
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active && strcmp(clients[i].username, username) == 0) {
-            return -1;  /* Username already taken */
-        }
+    if (stats) {
+        shmdt(stats);
+        shmctl(stats_shm_id, IPC_RMID, NULL);
+        stats = NULL;
     }
     
-    /* Initialize client info */
-    clients[index].active = CLIENT_ACTIVE;
-    strncpy(clients[index].username, username, MAX_USERNAME - 1);
-    clients[index].username[MAX_USERNAME - 1] = '\0';  /* Ensure null termination */
-    clients[index].queue_id = queue_id;
-    clients[index].pid = pid;
-    
-    /* Send welcome message */
-    Message welcome_msg;
-    welcome_msg.mtype = MSG_TYPE_ACK;
-    strcpy(welcome_msg.username, "SERVER");
-    sprintf(welcome_msg.content, "Welcome %s! You've joined the chat.", username);
-    welcome_msg.timestamp = time(NULL);
-    
-    msgsnd(queue_id, &welcome_msg, sizeof(Message) - sizeof(long), 0);
-    
-    /* Notify other clients about the new user */
-    Message join_msg;
-    join_msg.mtype = MSG_TYPE_CHAT;
-    strcpy(join_msg.username, "SERVER");
-    sprintf(join_msg.content, "%s has joined the chat.", username);
-    join_msg.timestamp = time(NULL);
-    
-    broadcast_message(&join_msg, index);
-    add_to_log(&join_msg);
-    
-    printf("Client '%s' connected\n", username);
-    return index;
+    printf("Resources cleaned up\n");
 }
 
-/* Remove a client */
-void remove_client(const char *username) {
-    int index = -1;
-    
-    /* Find client in array */
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active && strcmp(clients[i].username, username) == 0) {
-            index = i;
-            break;
+/* Drain thread: moves spooled messages into client queues as the clients
+ * read, and sleeps while nobody is behind */
+void *spool_drainer(void *arg) {
+    while (!atomic_load(&drainer_stopping)) {
+        spool_pool_wait(&spool_pool);
+        if (atomic_load(&spool_pool.backlogged) == 0) {
+            continue;
         }
-    }
-    
-    if (index == -1) {
-        return;  /* Client not found */
-    }
-    
-    /* Mark as inactive */
-    clients[index].active = CLIENT_INACTIVE;
-    
-    /* Broadcast disconnect message */
-    Message disconnect_msg;
-    disconnect_msg.mtype = MSG_TYPE_CHAT;
-    strcpy(disconnect_msg.username, "SERVER");
-    sprintf(disconnect_msg.content, "%s has left the chat.", username);
-    disconnect_msg.timestamp = time(NULL);
-    
-    broadcast_message(&disconnect_msg, -1);  /* Broadcast to all */
-    add_to_log(&disconnect_msg);
-    
-    printf("Client '%s' disconnected\n", username);
-}
 
-/* Broadcast message to all connected clients */
-void broadcast_message(Message *msg, int exclude_index) {
-    /* Iterate through clients array */
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        /* Send message to each active client except exclude_index */
-        if (clients[i].active && i != exclude_index) {
-            /*changed to non blocking */
-            if (msgsnd(clients[i].queue_id, msg, sizeof(Message) - sizeof(long), IPC_NOWAIT) == -1) {
-                if (errno == EINVAL || errno == EIDRM) {
-                    printf("Client %s disconnected, removing from list\n", clients[i].username);
-                    clients[i].active = CLIENT_INACTIVE;  /* Mark as inactive */
-                } else {
-                perror("msgsnd broadcast");
-             }
+        int *dead_ids = NULL;
+        int *dead_queues = NULL;
+        int num_dead = 0;
+        pthread_rwlock_rdlock(&registry.lock);
+        for (int i = 0; i < registry.count; i++) {
+            Client *client = &registry.slots[registry.active_ids[i]];
+            if (atomic_load_explicit(&client->spool->count, memory_order_relaxed) == 0 ||
+                spool_drain(client->spool, client->queue_id) != SPOOL_GONE) {
+                continue;
+            }
+            printf("Client %s disconnected, removing from list\n", client->username);
+            if (dead_ids == NULL) {
+                dead_ids = malloc(registry.count * sizeof(int));
+                dead_queues = malloc(registry.count * sizeof(int));
+                if (dead_ids == NULL || dead_queues == NULL) {
+                    free(dead_ids);
+                    free(dead_queues);
+                    dead_ids = dead_queues = NULL;
+                    continue;
+                }
             }
+            dead_ids[num_dead] = client->id;
+            dead_queues[num_dead++] = client->queue_id;
         }
+        pthread_rwlock_unlock(&registry.lock);
+
+        if (num_dead > 0) {
+            drop_clients(dead_ids, dead_queues, num_dead);
+        }
+        free(dead_ids);
+        free(dead_queues);
     }
+    return NULL;
 }
 
-/* Handle incoming message based on type */
-void handle_message(Message *msg) {
-    int client_index = -1;
-    
-    /* Check message type */
-    switch (msg->mtype) {
-        case MSG_TYPE_CONNECT: {
-            /* Extract client queue ID from content (assuming it's stored there) */
-            int client_queue_id;
-            pid_t client_pid;
-            /*validation of message format*/
-
-           if (sscanf(msg->content, "%d %d", &client_queue_id, &client_pid) != 2){
-                printf("Invalid connect message format from %s\n", msg->username);
-                return;  /* Invalid format */
-            }
-            
-            /* Check if client is already connected */
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (clients[i].active && strcmp(clients[i].username, msg->username) == 0) {
-                    printf("Client %s is already connected\n", msg->username);
-                    return;  /* Already connected */
-                }
-           }
-            
-            /* Add the client */
-            int result = add_client(msg->username, client_queue_id, client_pid);
-            if(result == -1) {
-                printf("Failed to add client %s, no slots available or username taken\n", msg->username);
-                Message error_msg;
-                error_msg.mtype = MSG_TYPE_ACK;
-                strcpy(error_msg.username, "SERVER");
-                sprintf(error_msg.content, "Failed to connect: No slots available or username taken.");
-                error_msg.timestamp = time(NULL);
-                
-                msgsnd(client_queue_id, &error_msg, sizeof(Message) - sizeof(long), 0);
-            }
+/* Stop the drain thread; backlogs still waiting are dropped at cleanup */
+void stop_spool_drainer() {
+    atomic_store(&drainer_stopping, 1);
+    spool_pool_wake(&spool_pool);
+    pthread_join(drainer_tid, NULL);
+}
+
+/* Reaper thread: removes clients whose process has exited, as soon as the
+ * kernel reports it, and removes the queue they left behind */
+void *client_reaper(void *arg) {
+    uint64_t tags[LIVENESS_MAX_EVENTS];
+    char username[MAX_USERNAME];
+
+    while (!atomic_load(&reaper_stopping)) {
+        int count = liveness_wait(&liveness, tags, LIVENESS_MAX_EVENTS);
+        if (count == -1) {
+            perror("epoll_wait");
             break;
         }
-        
-        case MSG_TYPE_DISCONNECT:
-            /* Handle client disconnection */
-            remove_client(msg->username);
-            break;
-            
-        case MSG_TYPE_CHAT:
-            /* Handle chat message */
-            printf("Chat from %s: %s\n", msg->username, msg->content);
-            
-            /* Find sender's index to exclude from broadcast (optional) */
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (clients[i].active && strcmp(clients[i].username, msg->username) == 0) {
-                    client_index = i;
-                    break;
-                }
+
+        for (int i = 0; i < count; i++) {
+            int id = (int)(uint32_t)tags[i];
+            int pidfd = (int)(tags[i] >> 32);
+            int queue_id = -1;
+
+            /* The slot and the fd number may both have been reused since
+             * the event fired, so only a pidfd that has really exited counts */
+            pthread_rwlock_wrlock(&registry.lock);
+            Client *client = registry_get(&registry, id);
+            if (client != NULL && client->pidfd == pidfd && liveness_exited(pidfd)) {
+                strcpy(username, client->username);
+                queue_id = client->queue_id;
+                release_client_locked(id);
             }
-            
-            /* Broadcast message to all other clients */
-            broadcast_message(msg, client_index);  /* Send to all clients */
-            
-            /* Add message to log */
-            add_to_log(msg);
-            break;
-            
-        default:
-            printf("Received message with unknown type: %ld\n", msg->mtype);
+            pthread_rwlock_unlock(&registry.lock);
+
+            if (queue_id != -1) {
+                msgctl(queue_id, IPC_RMID, NULL);
+                atomic_fetch_add(&stats->reaped, 1);
+                printf("Client '%s' exited without disconnecting\n", username);
+                announce_departure(username);
+            }
+        }
     }
+    return NULL;
 }
 
-/* Add a message to the log buffer */
-void add_to_log(Message *msg) {
-    /* Format message with timestamp */
-    char log_entry[MAX_USERNAME + MSG_SIZE + 64];
-    time_t now = msg->timestamp ? msg->timestamp : time(NULL);
-    struct tm *timeinfo = localtime(&now);
-    
-    int len = sprintf(log_entry, "[%02d:%02d:%02d] <%s>: %s\n",
-                     timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec,
-                     msg->username, msg->content);
-    
-    /* Add to log buffer in thread-safe manner */
-    pthread_mutex_lock(&log_buffer->mutex);
-    
-    /* Check if we need to wrap around (circular buffer) */
-    if (log_buffer->used_size + len > log_buffer->total_size) {
-        /* Simple approach: clear the buffer if it's full */
-        /*CHANGE Improved Circular buffer*/
-        size_t half_size = log_buffer->total_size /2;
-        memmove(log_buffer->data, log_buffer->data + half_size, log_buffer->used_size - half_size);
-        log_buffer->used_size -= half_size;
-        log_buffer->write_position = log_buffer->used_size;
+/* Stop the reaper thread, if it was started */
+void stop_client_reaper() {
+    if (!watching_clients) {
+        return;
     }
-    
-    /* Copy log entry to buffer */
-    memcpy(&log_buffer->data[log_buffer->write_position], log_entry, len);
-    log_buffer->write_position += len;
-    log_buffer->used_size += len;
-    
-    pthread_mutex_unlock(&log_buffer->mutex);
+    atomic_store(&reaper_stopping, 1);
+    liveness_wake(&liveness);
+    pthread_join(reaper_tid, NULL);
+    liveness_destroy(&liveness);
+    watching_clients = 0;
 }
 
-/* Thread to receive incoming messages */
+/* Thread to receive incoming messages.
+ * Blocks in msgrcv() until a message arrives, then drains everything already
+ * queued with IPC_NOWAIT before blocking again. Messages are handed to the
+ * dispatch pool rather than handled here. */
 void *message_receiver(void *arg) {
-    Message msg;
+    WireBuffer buf;
+    InboundItem item;
+    int flags = 0;
     
     while (running) {
-        ssize_t result = msgrcv(server_queue_id, &msg, sizeof(Message) - sizeof(long), 0, IPC_NOWAIT);
+        ssize_t result = wire_receive(server_queue_id, &buf, 0, flags);
         
         if (result == -1) {
             if (errno == ENOMSG) {
-                /* No message available, sleep a bit and check running flag */
-                usleep(100000);  /* 100ms */
+                flags = 0;  /* Queue drained, go back to blocking */
                 continue;
             } else if (errno == EINTR) {
                 continue;  /* Interrupted by signal */
+            } else if (errno == E2BIG) {
+                printf("Dropping oversized message\n");
+                atomic_fetch_add_explicit(&stats->malformed, 1, memory_order_relaxed);
+                continue;
+            } else if (errno == EIDRM || errno == EINVAL) {
+                printf("Server queue removed\n");
+                break;
             } else {
                 perror("msgrcv");
-                if (!running) break;  /* Exit if we're shutting down */
+                flags = 0;
                 usleep(100000);  /* Wait a bit before trying again */
                 continue;
             }
-        } else {
-            // CHANGE: Added handling for special shutdown message
-            if (msg.mtype == 999) {
-                if (!running) break;  /* Exit if we're shutting down */
+        }
+
+        flags = IPC_NOWAIT;
+
+        /* Only honour the wakeup once shutdown has actually been requested */
+        if (buf.mtype == MSG_TYPE_SHUTDOWN) {
+            if (!running) break;
+            continue;
+        }
+
+        item.batch = NULL;
+        if (buf.mtype == MSG_TYPE_BATCH) {
+            /* The first record names the sender; handle_batch checks the rest */
+            size_t offset = 0;
+            if (batch_validate(&buf.batch, (size_t)result) != 0 ||
+                batch_next(&buf.batch, &offset, &item.msg) != 1) {
+                printf("Dropping malformed batch (%zd bytes)\n", result);
+                atomic_fetch_add_explicit(&stats->malformed, 1, memory_order_relaxed);
+                continue;
+            }
+            item.batch = malloc(sizeof(long) + (size_t)result);
+            if (item.batch == NULL) {
+                perror("malloc batch");
                 continue;
             }
-            
-            /* Process the message */
-            handle_message(&msg);
+            memcpy(item.batch, &buf.batch, sizeof(long) + (size_t)result);
+        } else if (wire_decode(&buf, (size_t)result, &item.msg) == -1) {
+            /* Accepts both the fixed and the compact format */
+            printf("Dropping malformed message (%zd bytes, type %ld)\n", result, buf.mtype);
+            atomic_fetch_add_explicit(&stats->malformed, 1, memory_order_relaxed);
+            continue;
+        }
+        if (item.batch == NULL && item.msg.trace[TRACE_CLIENT_SEND] != 0) {
+            item.msg.trace[TRACE_SERVER_RECV] = monotonic_ns();
         }
-       
+        stats_count(stats->msgs_in, buf.mtype, 1);
+        if (buf.mtype == MSG_TYPE_BATCH || buf.mtype == MSG_TYPE_CHAT) {
+            atomic_fetch_add_explicit(&stats->lines_in, item.batch ? item.batch->count : 1,
+                                      memory_order_relaxed);
+        }
+
+        /* Shard by sender so each user's messages stay in order */
+        dispatch_submit(&dispatch_pool, dispatch_hash(item.msg.username), &item);
     }
     
     return NULL;
 }
 
-/* Thread to periodically sync logs */
-void *log_sync_thread(void *arg) {
-    FILE *log_file = NULL;
-    
+/* Thread to receive joins from the control queue.
+ * Only CONNECT is taken there, so a join is read as soon as it is sent,
+ * however far behind the server queue is, and goes into the urgent lane of
+ * its shard so it does not wait behind chat already dispatched either. */
+void *control_receiver(void *arg) {
+    WireBuffer buf;
+    InboundItem item;
+
     while (running) {
-        if (!running) break;
-        /* Open log file for appending */
-        log_file = fopen("chat_server.log", "a");
-        if (!log_file) {
-            perror("Failed to open log file");
-            //CHANGE /* Try again after delay */
-            for(int i=0; i<10 && running; i++){
-                usleep(100000);  /* 100ms */
+        ssize_t result = wire_receive(control_queue_id, &buf, 0, 0);
+
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == E2BIG) {
+                printf("Dropping oversized message on the control queue\n");
+                atomic_fetch_add_explicit(&stats->malformed, 1, memory_order_relaxed);
+                continue;
+            } else if (errno == EIDRM || errno == EINVAL) {
+                printf("Control queue removed\n");
+                break;
             }
+            perror("msgrcv control");
+            usleep(100000);  /* Wait a bit before trying again */
             continue;
         }
-        
-        
-        /* Lock the mutex to access log buffer */
-        pthread_mutex_lock(&log_buffer->mutex);
-        
-        /* Write logs to file */
-        if (log_buffer->used_size > 0) {
-            fwrite(log_buffer->data, 1, log_buffer->used_size, log_file);
-            //CHANGE
-            fflush(log_file);
-            /* Dont Clear the buffer after writing */
-            log_buffer->used_size = 0;
-            log_buffer->write_position = 0;
+
+        if (buf.mtype == MSG_TYPE_SHUTDOWN) {
+            if (!running) break;
+            continue;
         }
-        
-        pthread_mutex_unlock(&log_buffer->mutex);
-        
-        /* Close the file */
-        fclose(log_file);
-        for (int i = 0; i<10 && running; i++){
-            usleep(500000);
+
+        item.batch = NULL;
+        if (buf.mtype != MSG_TYPE_CONNECT || wire_decode(&buf, (size_t)result, &item.msg) == -1) {
+            printf("Dropping unexpected message on the control queue (%zd bytes, type %ld)\n",
+                   result, buf.mtype);
+            atomic_fetch_add_explicit(&stats->malformed, 1, memory_order_relaxed);
+            continue;
         }
+        stats_count(stats->msgs_in, buf.mtype, 1);
+
+        /* Same shard as the client's later messages */
+        dispatch_submit_urgent(&dispatch_pool, dispatch_hash(item.msg.username), &item);
     }
-    printf("Log sync thread exiting...\n");
+
     return NULL;
 }
 
-/* Signal handler */
+/* Signal handler: only flags shutdown, main() wakes the threads */
 void handle_signal(int sig) {
-    printf("\nReceived signal %d, shutting down...\n", sig);
+    static const char note[] = "\nReceived signal, shutting down...\n";
     running = 0;
-
-    //CHANGE
-    force_server_shutdown();
-}
\ No newline at end of file
+    if (write(STDOUT_FILENO, note, sizeof(note) - 1) == -1) {
+        /* Nothing useful to do inside a signal handler */
+    }
+}
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include "chat_spool.h"
+
+#define SMALL_BYTES sizeof(WireMessage)   /* Any single message, fixed or compact */
+#define LARGE_BYTES sizeof(BatchMessage)
+
+int spool_pool_init(SpoolPool *pool, SpoolCounters *counters) {
+    memset(pool, 0, sizeof(*pool));
+    pool->counters = counters ? counters : &pool->own;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_mutex_init(&pool->wait_mutex, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->wait_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    atomic_init(&pool->backlogged, 0);
+    return 0;
+}
+
+static void free_list(SpoolBuffer *buf) {
+    while (buf) {
+        SpoolBuffer *next = buf->next;
+        free(buf);
+        buf = next;
+    }
+}
+
+void spool_pool_destroy(SpoolPool *pool) {
+    free_list(pool->free_small);
+    free_list(pool->free_large);
+    pool->free_small = pool->free_large = NULL;
+    pthread_cond_destroy(&pool->wait_cond);
+    pthread_mutex_destroy(&pool->wait_mutex);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+int spool_policy_parse(const char *name) {
+    if (strcmp(name, "drop-oldest") == 0) {
+        return SPOOL_DROP_OLDEST;
+    } else if (strcmp(name, "drop-newest") == 0) {
+        return SPOOL_DROP_NEWEST;
+    } else if (strcmp(name, "disconnect") == 0) {
+        return SPOOL_DISCONNECT;
+    }
+    return -1;
+}
+
+const char *spool_policy_name(int policy) {
+    switch (policy) {
+        case SPOOL_DROP_OLDEST: return "drop-oldest";
+        case SPOOL_DROP_NEWEST: return "drop-newest";
+        case SPOOL_DISCONNECT: return "disconnect";
+        default: return "unknown";
+    }
+}
+
+void spool_pool_wait(SpoolPool *pool) {
+    pthread_mutex_lock(&pool->wait_mutex);
+    if (atomic_load(&pool->backlogged) == 0) {
+        pthread_cond_wait(&pool->wait_cond, &pool->wait_mutex);
+    } else {
+        /* Give the clients time to read before the next pass */
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += SPOOL_RETRY_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pool->wait_cond, &pool->wait_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&pool->wait_mutex);
+}
+
+void spool_pool_wake(SpoolPool *pool) {
+    pthread_mutex_lock(&pool->wait_mutex);
+    pthread_cond_signal(&pool->wait_cond);
+    pthread_mutex_unlock(&pool->wait_mutex);
+}
+
+static SpoolBuffer *buffer_get(SpoolPool *pool, size_t msgsz) {
+    int large = msgsz > SMALL_BYTES - sizeof(long);
+    SpoolBuffer **list = large ? &pool->free_large : &pool->free_small;
+
+    pthread_mutex_lock(&pool->mutex);
+    SpoolBuffer *buf = *list;
+    if (buf) {
+        *list = buf->next;
+        if (large) {
+            pool->num_free_large--;
+        } else {
+            pool->num_free_small--;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (buf) {
+        atomic_fetch_add_explicit(&pool->counters->reused, 1, memory_order_relaxed);
+    } else {
+        buf = malloc(sizeof(SpoolBuffer) + (large ? LARGE_BYTES : SMALL_BYTES));
+        if (!buf) {
+            return NULL;
+        }
+        buf->large = large;
+        atomic_fetch_add_explicit(&pool->counters->allocated, 1, memory_order_relaxed);
+    }
+    buf->next = NULL;
+    buf->msgsz = msgsz;
+    return buf;
+}
+
+static void buffer_put(SpoolPool *pool, SpoolBuffer *buf) {
+    pthread_mutex_lock(&pool->mutex);
+    int *num_free = buf->large ? &pool->num_free_large : &pool->num_free_small;
+    if (*num_free < SPOOL_MAX_CACHED) {
+        SpoolBuffer **list = buf->large ? &pool->free_large : &pool->free_small;
+        buf->next = *list;
+        *list = buf;
+        (*num_free)++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    free(buf);
+}
+
+ClientSpool *spool_create(SpoolPool *pool, size_t max_bytes, int policy) {
+    ClientSpool *spool = calloc(1, sizeof(ClientSpool));
+    if (!spool) {
+        return NULL;
+    }
+    spool->pool = pool;
+    pthread_mutex_init(&spool->mutex, NULL);
+    atomic_init(&spool->count, 0);
+    spool->max_bytes = max_bytes;
+    spool->policy = policy;
+    return spool;
+}
+
+/* Unlink and recycle the oldest message; caller holds the mutex */
+static void pop_head(ClientSpool *spool) {
+    SpoolBuffer *buf = spool->head;
+    spool->head = buf->next;
+    if (!spool->head) {
+        spool->tail = NULL;
+        atomic_fetch_sub(&spool->pool->backlogged, 1);
+    }
+    spool->bytes -= buf->msgsz;
+    atomic_fetch_sub_explicit(&spool->count, 1, memory_order_release);
+    buffer_put(spool->pool, buf);
+}
+
+void spool_destroy(ClientSpool *spool) {
+    if (!spool) {
+        return;
+    }
+    pthread_mutex_lock(&spool->mutex);
+    while (spool->head) {
+        pop_head(spool);
+    }
+    pthread_mutex_unlock(&spool->mutex);
+    pthread_mutex_destroy(&spool->mutex);
+    free(spool);
+}
+
+int spool_send(ClientSpool *spool, int queue_id, const void *msg, size_t msgsz) {
+    /* Fast path: nothing waiting, so the queue gets it directly */
+    if (atomic_load_explicit(&spool->count, memory_order_acquire) == 0) {
+        if (msgsnd(queue_id, msg, msgsz, IPC_NOWAIT) == 0) {
+            return SPOOL_SENT;
+        }
+        if (errno == EINVAL || errno == EIDRM) {
+            return SPOOL_GONE;
+        }
+    }
+
+    SpoolPool *pool = spool->pool;
+    pthread_mutex_lock(&spool->mutex);
+    if (spool->bytes + msgsz > spool->max_bytes) {
+        if (spool->policy == SPOOL_DISCONNECT) {
+            pthread_mutex_unlock(&spool->mutex);
+            return SPOOL_OVERFLOW;
+        }
+        if (spool->policy == SPOOL_DROP_NEWEST || msgsz > spool->max_bytes) {
+            spool->dropped++;
+            pthread_mutex_unlock(&spool->mutex);
+            atomic_fetch_add_explicit(&pool->counters->dropped, 1, memory_order_relaxed);
+            return SPOOL_DROPPED;
+        }
+        uint64_t made_room = 0;
+        while (spool->bytes + msgsz > spool->max_bytes) {
+            pop_head(spool);
+            made_room++;
+        }
+        spool->dropped += made_room;
+        atomic_fetch_add_explicit(&pool->counters->dropped, made_room, memory_order_relaxed);
+    }
+
+    SpoolBuffer *buf = buffer_get(pool, msgsz);
+    if (!buf) {
+        spool->dropped++;
+        pthread_mutex_unlock(&spool->mutex);
+        atomic_fetch_add_explicit(&pool->counters->dropped, 1, memory_order_relaxed);
+        return SPOOL_DROPPED;
+    }
+    memcpy(buf->message, msg, sizeof(long) + msgsz);
+    if (spool->tail) {
+        spool->tail->next = buf;
+    } else {
+        spool->head = buf;
+        atomic_fetch_add(&pool->backlogged, 1);
+    }
+    spool->tail = buf;
+    spool->bytes += msgsz;
+    if (spool->bytes > spool->peak_bytes) {
+        spool->peak_bytes = spool->bytes;
+    }
+    spool->queued++;
+    atomic_fetch_add_explicit(&spool->count, 1, memory_order_release);
+    int first = spool->head == buf;
+    pthread_mutex_unlock(&spool->mutex);
+
+    atomic_fetch_add_explicit(&pool->counters->queued, 1, memory_order_relaxed);
+    if (first) {
+        spool_pool_wake(pool);
+    }
+    return SPOOL_QUEUED;
+}
+
+long spool_drain(ClientSpool *spool, int queue_id) {
+    pthread_mutex_lock(&spool->mutex);
+    while (spool->head) {
+        if (msgsnd(queue_id, spool->head->message, spool->head->msgsz, IPC_NOWAIT) == -1) {
+            if (errno != EINVAL && errno != EIDRM) {
+                break;  /* Full; try again next pass */
+            }
+            pthread_mutex_unlock(&spool->mutex);
+            return SPOOL_GONE;
+        }
+        pop_head(spool);
+    }
+    long left = (long)atomic_load_explicit(&spool->count, memory_order_relaxed);
+    pthread_mutex_unlock(&spool->mutex);
+    return left;
+}
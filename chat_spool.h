@@ -0,0 +1,118 @@
+#ifndef CHAT_SPOOL_H
+#define CHAT_SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "chat_protocol.h"
+
+/*
+ * Outbound spools for clients that cannot keep up.
+ *
+ * A broadcast to a client whose queue is full no longer drops the message:
+ * it is copied into that client's spool, and a drain thread moves spooled
+ * messages into the queue as the client reads. A client with a backlog gets
+ * new messages appended behind it, so it still sees them in order. Each
+ * spool is capped in bytes, and the overflow policy decides what happens
+ * when a message does not fit.
+ *
+ * Copies live in buffers of two sizes, one for single messages and one for
+ * batches, recycled through free lists so a burst does not hit malloc for
+ * every message.
+ */
+
+#define DEFAULT_SPOOL_BYTES (256 * 1024)  /* Per-client cap (-S) */
+#define SPOOL_MAX_CACHED 1024            /* Free buffers kept per size */
+#define SPOOL_RETRY_MS 5                 /* Drain pass interval while any spool is backed up */
+
+/* Overflow policies (-P) */
+#define SPOOL_DROP_OLDEST 0              /* Make room by dropping the oldest spooled messages */
+#define SPOOL_DROP_NEWEST 1              /* Drop the message that does not fit */
+#define SPOOL_DISCONNECT 2               /* Disconnect the client */
+
+/* spool_send() results */
+#define SPOOL_SENT 0                     /* Went straight into the queue */
+#define SPOOL_QUEUED 1                   /* Spooled for the drain thread */
+#define SPOOL_DROPPED 2                  /* Lost to the overflow policy */
+#define SPOOL_OVERFLOW 3                 /* Over the cap with SPOOL_DISCONNECT */
+#define SPOOL_GONE -1                    /* The queue no longer exists */
+
+typedef struct SpoolBuffer {
+    struct SpoolBuffer *next;
+    size_t msgsz;                        /* Bytes after mtype, as passed to msgsnd */
+    int large;                           /* Size class it came from */
+    long message[];                      /* mtype, then msgsz bytes */
+} SpoolBuffer;
+
+/* Statistics, over every client that has ever connected */
+typedef struct {
+    _Atomic uint64_t allocated;          /* Buffers that came from malloc */
+    _Atomic uint64_t reused;             /* Buffers that came from a free list */
+    _Atomic uint64_t queued;             /* Messages that had to be spooled */
+    _Atomic uint64_t dropped;            /* Messages lost to the overflow policy */
+    _Atomic uint64_t disconnected;       /* Clients dropped by SPOOL_DISCONNECT */
+} SpoolCounters;
+
+typedef struct {
+    pthread_mutex_t mutex;               /* Protects the free lists */
+    SpoolBuffer *free_small;
+    SpoolBuffer *free_large;
+    int num_free_small;
+    int num_free_large;
+
+    /* Drain thread wake-up */
+    pthread_mutex_t wait_mutex;
+    pthread_cond_t wait_cond;
+    _Atomic int backlogged;              /* Spools holding at least one message */
+
+    SpoolCounters *counters;             /* own, or wherever spool_pool_init() was told */
+    SpoolCounters own;
+} SpoolPool;
+
+/* One client's spool */
+typedef struct ClientSpool {
+    SpoolPool *pool;
+    pthread_mutex_t mutex;               /* Protects the list and byte count */
+    SpoolBuffer *head;                   /* Oldest spooled message */
+    SpoolBuffer *tail;
+    _Atomic size_t count;                /* Read without the mutex on the fast path */
+    size_t bytes;
+    size_t max_bytes;
+    int policy;
+
+    /* Statistics */
+    size_t peak_bytes;
+    uint64_t queued;
+    uint64_t dropped;
+} ClientSpool;
+
+/* counters may point at shared memory for outside readers; NULL keeps
+ * them in the pool */
+int spool_pool_init(SpoolPool *pool, SpoolCounters *counters);
+void spool_pool_destroy(SpoolPool *pool);
+
+/* Parse "drop-oldest", "drop-newest" or "disconnect"; -1 if unknown */
+int spool_policy_parse(const char *name);
+const char *spool_policy_name(int policy);
+
+/* Sleep until some spool has a backlog, then for at most SPOOL_RETRY_MS,
+ * or until spool_pool_wake() */
+void spool_pool_wait(SpoolPool *pool);
+void spool_pool_wake(SpoolPool *pool);
+
+ClientSpool *spool_create(SpoolPool *pool, size_t max_bytes, int policy);
+
+/* Free the spool; whatever is still in it is discarded */
+void spool_destroy(ClientSpool *spool);
+
+/* Deliver one message of msgsz bytes (after mtype) to queue_id: straight
+ * into the queue if nothing is waiting ahead of it and there is room,
+ * otherwise into the spool. Returns SPOOL_* */
+int spool_send(ClientSpool *spool, int queue_id, const void *msg, size_t msgsz);
+
+/* Move spooled messages into the queue until it is full. Returns the number
+ * still spooled, or SPOOL_GONE. */
+long spool_drain(ClientSpool *spool, int queue_id);
+
+#endif /* CHAT_SPOOL_H */
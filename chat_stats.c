@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include "chat_stats.h"
+
+static const char *type_names[STATS_MSG_TYPES] = {
+    "other", "connect", "disconnect", "chat", "ack", "shutdown", "batch", "history"
+};
+
+ServerStats *stats_create(key_t key, int *shm_id_out) {
+    shmctl(shmget(key, 0, 0666), IPC_RMID, NULL);  /* Remove stale segment */
+
+    int shm_id = shmget(key, sizeof(ServerStats), IPC_CREAT | 0666);
+    if (shm_id == -1) {
+        perror("shmget stats");
+        return NULL;
+    }
+
+    ServerStats *stats = (ServerStats *)shmat(shm_id, NULL, 0);
+    if (stats == (void *)-1) {
+        perror("shmat stats");
+        shmctl(shm_id, IPC_RMID, NULL);
+        return NULL;
+    }
+
+    /* New segments are zero filled; only the client list needs marking */
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    stats->size = sizeof(ServerStats);
+    stats->server_pid = getpid();
+    stats->started_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    for (int i = 0; i < STATS_MAX_CLIENTS; i++) {
+        stats->clients[i].queue_id = -1;
+    }
+    atomic_thread_fence(memory_order_release);
+    stats->magic = STATS_MAGIC;
+
+    *shm_id_out = shm_id;
+    return stats;
+}
+
+const ServerStats *stats_attach(key_t key) {
+    int shm_id = shmget(key, 0, 0);
+    if (shm_id == -1) {
+        return NULL;
+    }
+
+    ServerStats *stats = (ServerStats *)shmat(shm_id, NULL, SHM_RDONLY);
+    if (stats == (void *)-1) {
+        return NULL;
+    }
+    if (stats->magic != STATS_MAGIC || stats->size != sizeof(ServerStats)) {
+        shmdt(stats);
+        return NULL;
+    }
+    return stats;
+}
+
+void stats_client_add(ServerStats *stats, int id, int queue_id, pid_t pid, const char *username) {
+    atomic_fetch_add_explicit(&stats->connected, 1, memory_order_relaxed);
+    if (id < 0 || id >= STATS_MAX_CLIENTS) {
+        return;
+    }
+    StatsClient *entry = &stats->clients[id];
+    atomic_fetch_add_explicit(&entry->version, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->queue_id = queue_id;
+    entry->pid = pid;
+    snprintf(entry->username, sizeof(entry->username), "%s", username);
+    atomic_fetch_add_explicit(&entry->version, 1, memory_order_release);
+
+    if (id >= atomic_load_explicit(&stats->client_slots, memory_order_relaxed)) {
+        atomic_store_explicit(&stats->client_slots, id + 1, memory_order_release);
+    }
+}
+
+void stats_client_remove(ServerStats *stats, int id) {
+    atomic_fetch_sub_explicit(&stats->connected, 1, memory_order_relaxed);
+    if (id < 0 || id >= STATS_MAX_CLIENTS) {
+        return;
+    }
+    StatsClient *entry = &stats->clients[id];
+    atomic_fetch_add_explicit(&entry->version, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->queue_id = -1;
+    atomic_fetch_add_explicit(&entry->version, 1, memory_order_release);
+}
+
+uint64_t stats_percentile(const StatsHistogram *hist, double q) {
+    uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t wanted = (uint64_t)(q * count);
+    if (wanted < q * count || wanted < 1) {
+        wanted++;  /* Round up: p99 of 4 samples is the largest */
+    }
+
+    /* Buckets may run slightly ahead of count while others record */
+    uint64_t max = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += atomic_load_explicit(&hist->buckets[b], memory_order_relaxed);
+        if (seen >= wanted) {
+            uint64_t bound = b == 0 ? 1 : 1ULL << b;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+/* Copy a client entry that is not being rewritten; 0 if it is free */
+static int read_client(const StatsClient *entry, StatsClient *copy) {
+    for (int attempt = 0; attempt < 100; attempt++) {
+        uint32_t before = atomic_load_explicit(&entry->version, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        copy->queue_id = entry->queue_id;
+        copy->pid = entry->pid;
+        memcpy(copy->username, entry->username, sizeof(copy->username));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&entry->version, memory_order_relaxed) == before) {
+            copy->username[MAX_USERNAME - 1] = '\0';
+            return copy->queue_id != -1;
+        }
+    }
+    return 0;  /* Changing too fast to catch; skip it this time */
+}
+
+static void print_counts(FILE *out, const char *label, const _Atomic uint64_t *by_type) {
+    fprintf(out, "%s", label);
+    int printed = 0;
+    for (int t = 1; t <= STATS_MSG_TYPES; t++) {
+        int index = t % STATS_MSG_TYPES;  /* "other" last */
+        uint64_t n = atomic_load_explicit(&by_type[index], memory_order_relaxed);
+        if (n > 0) {
+            fprintf(out, "%s %llu %s", printed++ ? "," : "", (unsigned long long)n, type_names[index]);
+        }
+    }
+    fprintf(out, "%s\n", printed ? "" : " none");
+}
+
+void stats_print_header(FILE *out, const char *title) {
+    fprintf(out, "%-14s %10s %10s %10s %10s %10s %10s\n", title, "count", "mean", "p50", "p99",
+            "p999", "max");
+}
+
+void stats_print_histogram(FILE *out, const char *label, const StatsHistogram *hist) {
+    uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+    fprintf(out, "  %-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", label,
+            (unsigned long long)count, count ? sum / 1e3 / count : 0.0,
+            stats_percentile(hist, 0.5) / 1e3, stats_percentile(hist, 0.99) / 1e3,
+            stats_percentile(hist, 0.999) / 1e3,
+            atomic_load_explicit(&hist->max_ns, memory_order_relaxed) / 1e3);
+}
+
+void stats_report(const ServerStats *stats, FILE *out) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t up_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec - stats->started_ns;
+    fprintf(out, "Server pid %d, up %.1f s\n", (int)stats->server_pid, up_ns / 1e9);
+
+    print_counts(out, "Messages in:", stats->msgs_in);
+    fprintf(out, "  %llu chat line(s), %llu malformed, %llu throttled\n",
+            (unsigned long long)atomic_load(&stats->lines_in),
+            (unsigned long long)atomic_load(&stats->malformed),
+            (unsigned long long)atomic_load(&stats->throttled));
+    print_counts(out, "Messages out:", stats->msgs_out);
+    fprintf(out, "Drops: %llu log entr(ies), %llu backlogged message(s); "
+            "%llu client(s) disconnected for falling behind, %llu reaped\n",
+            (unsigned long long)atomic_load(&stats->log_dropped),
+            (unsigned long long)atomic_load(&stats->spool.dropped),
+            (unsigned long long)atomic_load(&stats->spool.disconnected),
+            (unsigned long long)atomic_load(&stats->reaped));
+
+    stats_print_header(out, "Latency (us)");
+    stats_print_histogram(out, "fan-out", &stats->fanout);
+    stats_print_histogram(out, "log append", &stats->log_append);
+    stats_print_histogram(out, "log flush", &stats->log_flush);
+    if (atomic_load(&stats->trace_to_server.count) > 0) {
+        /* Only clients started with -t send traced messages */
+        stats_print_histogram(out, "to server", &stats->trace_to_server);
+        stats_print_histogram(out, "in server", &stats->trace_in_server);
+    }
+
+    /* Depths come straight from the kernel, not from the server */
+    int connected = atomic_load(&stats->connected);
+    int slots = atomic_load_explicit(&stats->client_slots, memory_order_acquire);
+    int listed = 0;
+    fprintf(out, "Connected clients: %d\n", connected);
+    for (int id = 0; id < slots && id < STATS_MAX_CLIENTS; id++) {
+        StatsClient client;
+        if (!read_client(&stats->clients[id], &client)) {
+            continue;
+        }
+        listed++;
+        struct msqid_ds info;
+        if (msgctl(client.queue_id, IPC_STAT, &info) == -1) {
+            fprintf(out, "  [%d] %s (pid %d): queue %d gone\n", id, client.username,
+                    (int)client.pid, client.queue_id);
+            continue;
+        }
+        fprintf(out, "  [%d] %s (pid %d): %lu message(s), %lu of %lu bytes queued\n", id,
+                client.username, (int)client.pid, (unsigned long)info.msg_qnum,
+                (unsigned long)info.__msg_cbytes, (unsigned long)info.msg_qbytes);
+    }
+    if (connected > listed) {
+        fprintf(out, "  (%d more not listed)\n", connected - listed);
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef CHAT_STATS_H
+#define CHAT_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "chat_protocol.h"
+#include "chat_spool.h"
+
+/*
+ * Server statistics in shared memory.
+ *
+ * The server keeps its counters and latency histograms in a System V
+ * segment of their own, ftok("log.key", STATS_PROJ), so the `stats` command
+ * and the standalone chat_stats reader see the same numbers and reading
+ * them never touches a server lock. Recording is a relaxed atomic add or
+ * two; nothing on the hot path waits for a reader.
+ *
+ * Histograms have power of two buckets: bucket b counts durations of less
+ * than 2^b ns and at least 2^(b-1) ns, so percentiles come out as bucket
+ * upper bounds, within a factor of two.
+ *
+ * Connected clients are listed by id with their queue, so a reader can ask
+ * the kernel for each queue's depth (msgctl IPC_STAT) at the moment it
+ * looks. An entry's version is odd while the server rewrites it.
+ */
+
+#define STATS_PROJ 'M'
+#define STATS_MAGIC 0x53544154u          /* "STAT" */
+#define STATS_BUCKETS 40                 /* Up to 2^39 ns, about 9 minutes */
+#define STATS_MSG_TYPES 8                /* Counted by mtype; 0 takes anything unknown */
+#define STATS_MAX_CLIENTS 1024           /* Clients with higher ids are counted, not listed */
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t buckets[STATS_BUCKETS];
+} StatsHistogram;
+
+typedef struct {
+    _Atomic uint32_t version;            /* Odd while being changed */
+    int queue_id;                        /* -1 when the slot is free */
+    pid_t pid;
+    char username[MAX_USERNAME];
+} StatsClient;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                       /* sizeof(ServerStats), so a stale reader notices */
+    pid_t server_pid;
+    int64_t started_ns;                  /* CLOCK_REALTIME */
+
+    _Atomic uint64_t msgs_in[STATS_MSG_TYPES];   /* Read from the server and control queues */
+    _Atomic uint64_t lines_in;                   /* Chat lines in them, batched or not */
+    _Atomic uint64_t msgs_out[STATS_MSG_TYPES];  /* msgsnd()s and spools to client queues */
+    _Atomic uint64_t malformed;                  /* Messages dropped unread */
+    _Atomic uint64_t throttled;                  /* Lines over a rate limit */
+    _Atomic uint64_t log_dropped;                /* Log entries the ring had no room for */
+    _Atomic uint64_t reaped;                     /* Clients that exited without leaving */
+    SpoolCounters spool;                         /* Backlog counters, see chat_spool.h */
+
+    StatsHistogram fanout;               /* One broadcast to every recipient */
+    StatsHistogram log_append;           /* add_to_log(): formatting and claiming ring space */
+    StatsHistogram log_flush;            /* Log writer passes that wrote something */
+    StatsHistogram trace_to_server;      /* Traced messages: client send to server receive */
+    StatsHistogram trace_in_server;      /* Traced messages: server receive to fan-out */
+
+    _Atomic int connected;
+    _Atomic int client_slots;            /* Entries below this may be in use */
+    StatsClient clients[STATS_MAX_CLIENTS];
+} ServerStats;
+
+/* Add one duration; safe from any thread */
+static inline void stats_record(StatsHistogram *hist, int64_t ns) {
+    uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&hist->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum_ns, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&hist->max_ns, &max, value,
+                                                                 memory_order_relaxed,
+                                                                 memory_order_relaxed)) {
+    }
+}
+
+/* Count one message of type mtype */
+static inline void stats_count(_Atomic uint64_t *by_type, long mtype, uint64_t n) {
+    int index = mtype > 0 && mtype < STATS_MSG_TYPES ? (int)mtype : 0;
+    atomic_fetch_add_explicit(&by_type[index], n, memory_order_relaxed);
+}
+
+/* Server side: create (replacing any stale segment) and map the stats */
+ServerStats *stats_create(key_t key, int *shm_id_out);
+
+/* Reader side: map the server's stats read-only, or NULL if there are none */
+const ServerStats *stats_attach(key_t key);
+
+/* List or unlist a client; the caller serialises calls for one id */
+void stats_client_add(ServerStats *stats, int id, int queue_id, pid_t pid, const char *username);
+void stats_client_remove(ServerStats *stats, int id);
+
+/* Duration in ns below which a fraction q (0..1) of the samples fell, as a
+ * bucket upper bound, or 0 without samples */
+uint64_t stats_percentile(const StatsHistogram *hist, double q);
+
+/* Print everything, including each listed client's queue depth */
+void stats_report(const ServerStats *stats, FILE *out);
+
+/* One latency row, in the report's columns, and the header above them */
+void stats_print_header(FILE *out, const char *title);
+void stats_print_histogram(FILE *out, const char *label, const StatsHistogram *hist);
+
+#endif /* CHAT_STATS_H */
@@ -0,0 +1,79 @@
+/**
+ * chat_stats - print a running chat server's statistics
+ *
+ * Maps the server's stats segment read-only and prints the same report as
+ * the server's `stats` command: message counts by type, drops, latency
+ * percentiles and the depth of every client's queue. The server takes no
+ * lock and does no work for it, so it is safe to run against a busy server.
+ *
+ * Usage: chat_stats [-i seconds] [-n count]
+ *
+ * -i repeats the report every so many seconds, -n stops after that many.
+ * Run from the directory holding log.key.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include "chat_stats.h"
+
+int main(int argc, char *argv[]) {
+    double interval_s = 0;
+    long count = 0;                 /* 0 until -n gives one */
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval_s = atof(optarg);
+                if (interval_s <= 0) {
+                    fprintf(stderr, "Interval must be more than 0 seconds\n");
+                    return 1;
+                }
+                break;
+            case 'n':
+                count = atol(optarg);
+                if (count < 1) {
+                    fprintf(stderr, "Count must be at least 1\n");
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i seconds] [-n count]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (count == 0) {
+        /* Once, or with -i until interrupted, whatever order the options came in */
+        count = interval_s > 0 ? -1 : 1;
+    }
+
+    key_t key = ftok("log.key", STATS_PROJ);
+    if (key == -1) {
+        perror("ftok log.key (run make setup)");
+        return 1;
+    }
+    const ServerStats *stats = stats_attach(key);
+    if (stats == NULL) {
+        fprintf(stderr, "No server statistics found; is chat_server running here?\n");
+        return 1;
+    }
+
+    /* A server that exits removes the segment, but our mapping stays valid
+     * and simply stops changing */
+    for (long n = 1; ; n++) {
+        stats_report(stats, stdout);
+        fflush(stdout);
+        if (n == count || interval_s <= 0) {
+            break;
+        }
+        usleep((useconds_t)(interval_s * 1e6));
+        printf("\n");
+    }
+
+    shmdt((const void *)stats);
+    return 0;
+}
@@ -9,43 +9,32 @@
  #include <stdlib.h>
  #include <string.h>
  #include <unistd.h>
+ #include <fcntl.h>
  #include <signal.h>
  #include <pthread.h>
  #include <sys/types.h>
  #include <sys/ipc.h>
  #include <sys/msg.h>
  #include <sys/shm.h>
+ #include <sys/wait.h>
+ #include <dirent.h>
+ #include <limits.h>
  #include <errno.h>
  #include <time.h>
  #include <assert.h>
- 
- /* Define the same structures as the main program */
- #define MAX_USERNAME 32
- #define MSG_SIZE 256
- #define LOG_SIZE (1024 * 1024)  /* 1MB for logs */
- 
- /* Message types */
- #define MSG_TYPE_CONNECT 1
- #define MSG_TYPE_DISCONNECT 2
- #define MSG_TYPE_CHAT 3
- #define MSG_TYPE_ACK 4
- 
- /* Message structure */
- typedef struct {
-     long mtype;
-     char username[MAX_USERNAME];
-     char content[MSG_SIZE];
-     time_t timestamp;
- } Message;
- 
- /* Log buffer structure */
- typedef struct {
-     size_t total_size;
-     size_t used_size;
-     int write_position;
-     pthread_mutex_t mutex;
-     char data[];
- } LogBuffer;
+ #include "chat_protocol.h"
+ #include "chat_dispatch.h"
+ #include "chat_registry.h"
+ #include "chat_ring.h"
+ #include "chat_log.h"
+ #include "chat_logwriter.h"
+ #include "chat_format.h"
+ #include "chat_history.h"
+ #include "chat_spool.h"
+ #include "chat_ratelimit.h"
+ #include "chat_liveness.h"
+ #include "chat_stats.h"
+ #include "chat_core.h"
  
  /* Global variables for tests */
  int num_tests = 0;
@@ -192,21 +181,21 @@
      ASSERT_TRUE(log_buffer != (void *)-1);
      
      /* Initialize log buffer */
-     log_buffer->total_size = LOG_SIZE;
-     log_buffer->used_size = 0;
-     log_buffer->write_position = 0;
+     log_init(log_buffer, LOG_SIZE, 1);
      
      /* Test writing to shared memory */
      const char test_data[] = "Test log entry";
-     memcpy(log_buffer->data, test_data, strlen(test_data));
-     log_buffer->used_size = strlen(test_data);
-     log_buffer->write_position = strlen(test_data);
+     log_append(log_buffer, test_data, strlen(test_data), 0, NULL);
      
      /* Verify data in shared memory */
+     uint64_t offset = log_buffer->head;
+     LogRecord *rec = log_record_at(log_buffer, &offset);
      char verify_buffer[sizeof(test_data)];
-     memcpy(verify_buffer, log_buffer->data, strlen(test_data));
-     verify_buffer[strlen(test_data)] = '\0';
+     ASSERT_EQ((int)strlen(test_data), rec->text_len);
+     memcpy(verify_buffer, log_record_text(rec), rec->text_len);
+     verify_buffer[rec->text_len] = '\0';
      ASSERT_STR_EQ(test_data, verify_buffer);
+     pthread_mutex_destroy(&log_buffer->mutex);
      
      /* Detach from shared memory */
      int detach_result = shmdt(log_buffer);
@@ -266,113 +255,2073 @@
  }
  
  /* Test circular buffer implementation */
-/* Test circular buffer implementation */
 void test_circular_buffer() {
     TEST("Circular buffer implementation");
     
-    /* Create a circular buffer in memory */
+    /* Create a small log ring in memory so it wraps many times */
     size_t buffer_size = 1024;
     LogBuffer *log_buffer = malloc(sizeof(LogBuffer) + buffer_size);
     ASSERT_TRUE(log_buffer != NULL);
+    log_init(log_buffer, buffer_size, 0);
     
-    log_buffer->total_size = buffer_size;
-    log_buffer->used_size = 0;
-    log_buffer->write_position = 0;
-    pthread_mutex_init(&log_buffer->mutex, NULL);
-    
-    /* Add data until buffer is partially full */
+    /* Entries of varying length so records land at every alignment,
+     * including ones that leave a tail too short for a pad header. Marking
+     * each one flushed lets the writer reuse its space. */
     const char *test_string = "Test log entry";
-    size_t string_len = strlen(test_string);
-    size_t total_written = 0;
-    
-    for (int i = 0; i < 10 && total_written < buffer_size / 2; i++) {
-        /* Format a log entry with an index */
+    uint64_t last_seq = 0;
+    for (int i = 0; i < 500; i++) {
         char log_entry[256];
-        int len = sprintf(log_entry, "[%d] %s", i, test_string);
-        
-        /* Make sure we don't exceed buffer */
-        if (total_written + len > buffer_size / 2) {
-            break;
+        int len = sprintf(log_entry, "[%d] %s %.*s", i, test_string, i % 37, 
+                          "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX");
+        last_seq = log_append(log_buffer, log_entry, len, i, NULL);
+        ASSERT_TRUE(atomic_load(&log_buffer->tail) - atomic_load(&log_buffer->head) <= buffer_size);
+        atomic_store(&log_buffer->flushed, atomic_load(&log_buffer->tail));
+    }
+    ASSERT_EQ(500, (int)last_seq);
+    ASSERT_EQ(0, (int)atomic_load(&log_buffer->dropped));
+    
+    uint64_t head = atomic_load(&log_buffer->head);
+    uint64_t tail = atomic_load(&log_buffer->tail);
+    ASSERT_TRUE(tail > buffer_size);
+    
+    /* Walk the surviving records: complete, consecutive, ending with the last */
+    uint64_t offset = head;
+    uint64_t expected_seq = 0;
+    LogRecord *rec;
+    while ((rec = log_next(log_buffer, &offset, tail, 0)) != NULL) {
+        ASSERT_TRUE(offset % buffer_size + rec->length <= buffer_size);
+        if (expected_seq) {
+            ASSERT_EQ((long long)expected_seq, (long long)rec->seq);
+        }
+        char expected[256];
+        int i = (int)rec->timestamp_ns;
+        int len = sprintf(expected, "[%d] %s %.*s", i, test_string, i % 37,
+                          "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX");
+        ASSERT_EQ(len, rec->text_len);
+        ASSERT_TRUE(memcmp(expected, log_record_text(rec), len) == 0);
+        expected_seq = rec->seq + 1;
+        offset += rec->length;
+    }
+    ASSERT_EQ((long long)tail, (long long)offset);
+    ASSERT_EQ(501, (int)expected_seq);
+    
+    /* Without a flush nothing can be reused: once the buffer is full, new
+     * entries are dropped and the unflushed ones are left alone */
+    int appended = 0;
+    for (int i = 0; i < 100; i++) {
+        if (log_append(log_buffer, test_string, strlen(test_string), i, NULL) != 0) {
+            appended++;
+        }
+    }
+    ASSERT_TRUE(appended > 0 && appended < 100);
+    ASSERT_EQ(100 - appended, (int)atomic_load(&log_buffer->dropped));
+    ASSERT_TRUE(atomic_load(&log_buffer->head) <= atomic_load(&log_buffer->flushed));
+    
+    pthread_mutex_destroy(&log_buffer->mutex);
+    free(log_buffer);
+    
+    PASS();
+}
+
+/* Writer thread used by test_log_concurrent_append */
+typedef struct {
+    LogBuffer *log;
+    int id;
+    int count;
+} LogWriterArgs;
+
+static void *log_append_thread(void *arg) {
+    LogWriterArgs *args = (LogWriterArgs *)arg;
+    for (int i = 0; i < args->count; i++) {
+        char entry[64];
+        int len = sprintf(entry, "writer %d entry %d", args->id, i);
+        /* Retry while the flusher catches up, so nothing is dropped */
+        while (log_append(args->log, entry, len, ((int64_t)args->id << 32) | i, NULL) == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* Test lock-free appends from several threads against a concurrent flusher */
+void test_log_concurrent_append() {
+    TEST("Concurrent lock-free log appends");
+    
+    enum { WRITERS = 4, PER_WRITER = 5000 };
+    size_t buffer_size = 16 * 1024;
+    LogBuffer *log_buffer = malloc(sizeof(LogBuffer) + buffer_size);
+    ASSERT_TRUE(log_buffer != NULL);
+    log_init(log_buffer, buffer_size, 0);
+    
+    pthread_t threads[WRITERS];
+    LogWriterArgs args[WRITERS];
+    for (int w = 0; w < WRITERS; w++) {
+        args[w].log = log_buffer;
+        args[w].id = w;
+        args[w].count = PER_WRITER;
+        ASSERT_EQ(0, pthread_create(&threads[w], NULL, log_append_thread, &args[w]));
+    }
+    
+    /* Play the flusher: consume committed records in order and check that
+     * each writer's entries come out complete and in the order written */
+    int next_entry[WRITERS] = {0};
+    int total = 0;
+    int bad = 0;
+    uint64_t offset = 0;
+    while (total < WRITERS * PER_WRITER && !bad) {
+        uint64_t tail = atomic_load(&log_buffer->tail);
+        LogRecord *rec;
+        while ((rec = log_next(log_buffer, &offset, tail, 0)) != NULL) {
+            int w = (int)(rec->timestamp_ns >> 32);
+            int i = (int)(rec->timestamp_ns & 0xffffffff);
+            char expected[64];
+            int len = sprintf(expected, "writer %d entry %d", w, i);
+            if (w < 0 || w >= WRITERS || i != next_entry[w] || len != rec->text_len ||
+                memcmp(expected, log_record_text(rec), len) != 0) {
+                bad = 1;
+                break;
+            }
+            next_entry[w]++;
+            total++;
+            offset += rec->length;
+        }
+        atomic_store(&log_buffer->flushed, offset);
+        sched_yield();
+    }
+    
+    for (int w = 0; w < WRITERS; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    
+    ASSERT_EQ(0, bad);
+    ASSERT_EQ(WRITERS * PER_WRITER, total);
+    ASSERT_EQ(WRITERS * PER_WRITER + 1, (int)atomic_load(&log_buffer->next_seq));
+    
+    pthread_mutex_destroy(&log_buffer->mutex);
+    free(log_buffer);
+    
+    PASS();
+}
+ 
+/* Writer used by test_log_tailing: long entries of one repeated letter,
+ * so a copy mixing two entries is easy to spot */
+static void *log_filler(void *arg) {
+    LogWriterArgs *args = (LogWriterArgs *)arg;
+    char entry[200];
+    for (int i = 0; i < args->count; i++) {
+        memset(entry, 'a' + (args->id * 7 + i) % 26, sizeof(entry));
+        while (log_append(args->log, entry, sizeof(entry), ((int64_t)args->id << 32) | i, NULL) == 0) {
+            sched_yield();
         }
-        
-        /* Copy to buffer */
-        memcpy(&log_buffer->data[log_buffer->write_position], log_entry, len);
-        log_buffer->write_position += len;
-        log_buffer->used_size += len;
-        total_written += len;
     }
+    return NULL;
+}
+
+/* Tailing reader used by test_log_tailing */
+typedef struct {
+    LogBuffer *log;
+    atomic_int stop;
+    int read;
+    int lapped;
+    int torn;
+} LogTailArgs;
+
+static void *log_tailer(void *arg) {
+    LogTailArgs *args = (LogTailArgs *)arg;
+    uint64_t offset = 0;
+    LogEntry entry;
+    char text[256];
+    while (!atomic_load(&args->stop)) {
+        int result = log_read(args->log, &offset, &entry, text, sizeof(text));
+        if (result == LOG_READ_LAPPED) {
+            args->lapped++;
+        } else if (result == LOG_READ_OK) {
+            int w = (int)(entry.timestamp_ns >> 32);
+            int i = (int)(entry.timestamp_ns & 0xffffffff);
+            char letter = 'a' + (w * 7 + i) % 26;
+            int intact = entry.text_len == 200;
+            for (size_t j = 0; j < entry.text_len && intact; j++) {
+                intact = text[j] == letter;
+            }
+            if (!intact) {
+                args->torn++;
+            }
+            args->read++;
+        }
+    }
+    return NULL;
+}
+
+/* Test lock-free tailing: new entries only, lap detection, and no torn
+ * copies while writers reuse the space under the reader */
+void test_log_tailing() {
+    TEST("Lock-free log tailing");
+    
+    size_t buffer_size = 1024;
+    LogBuffer *log_buffer = malloc(sizeof(LogBuffer) + buffer_size);
+    ASSERT_TRUE(log_buffer != NULL);
+    log_init(log_buffer, buffer_size, 0);
+    
+    LogEntry entry;
+    char text[64];
+    uint64_t cursor = 0;
+    ASSERT_EQ(LOG_READ_END, log_read(log_buffer, &cursor, &entry, text, sizeof(text)));
+    
+    /* Each call picks up where the last one stopped */
+    for (int i = 0; i < 5; i++) {
+        int len = sprintf(text, "entry %d\n", i);
+        ASSERT_TRUE(log_append(log_buffer, text, len, i, NULL) != 0);
+    }
+    for (int i = 0; i < 5; i++) {
+        ASSERT_EQ(LOG_READ_OK, log_read(log_buffer, &cursor, &entry, text, sizeof(text)));
+        ASSERT_EQ((uint64_t)(i + 1), entry.seq);
+        ASSERT_EQ((int64_t)i, entry.timestamp_ns);
+    }
+    ASSERT_STR_EQ("entry 4\n", text);
+    ASSERT_EQ(LOG_READ_END, log_read(log_buffer, &cursor, &entry, text, sizeof(text)));
+    ASSERT_TRUE(log_append(log_buffer, "late\n", 5, 5, NULL) != 0);
+    ASSERT_EQ(LOG_READ_OK, log_read(log_buffer, &cursor, &entry, text, sizeof(text)));
+    ASSERT_STR_EQ("late\n", text);
+    ASSERT_EQ(6, (int)entry.seq);
+    
+    /* Long text is cut to the buffer */
+    ASSERT_TRUE(log_append(log_buffer, "0123456789", 10, 6, NULL) != 0);
+    ASSERT_EQ(LOG_READ_OK, log_read(log_buffer, &cursor, &entry, text, 5));
+    ASSERT_STR_EQ("0123", text);
+    ASSERT_EQ(4, (int)entry.text_len);
+    
+    /* A reader left behind a whole buffer is told so and resumes at head */
+    uint64_t stale = cursor;
+    for (int i = 0; i < 100; i++) {
+        atomic_store(&log_buffer->flushed, atomic_load(&log_buffer->tail));
+        ASSERT_TRUE(log_append(log_buffer, "filler\n", 7, 0, NULL) != 0);
+    }
+    ASSERT_EQ(LOG_READ_LAPPED, log_read(log_buffer, &stale, &entry, text, sizeof(text)));
+    ASSERT_EQ(atomic_load(&log_buffer->head), stale);
+    ASSERT_EQ(LOG_READ_OK, log_read(log_buffer, &stale, &entry, text, sizeof(text)));
+    ASSERT_STR_EQ("filler\n", text);
+    pthread_mutex_destroy(&log_buffer->mutex);
+    free(log_buffer);
+    
+    /* Writers and a flusher churn a small ring while a reader tails it */
+    enum { WRITERS = 2, PER_WRITER = 20000 };
+    buffer_size = 4096;
+    log_buffer = malloc(sizeof(LogBuffer) + buffer_size);
+    ASSERT_TRUE(log_buffer != NULL);
+    log_init(log_buffer, buffer_size, 0);
+    
+    LogTailArgs tail_args = { .log = log_buffer };
+    atomic_init(&tail_args.stop, 0);
+    pthread_t tailer;
+    ASSERT_EQ(0, pthread_create(&tailer, NULL, log_tailer, &tail_args));
+    pthread_t threads[WRITERS];
+    LogWriterArgs args[WRITERS];
+    for (int w = 0; w < WRITERS; w++) {
+        args[w].log = log_buffer;
+        args[w].id = w;
+        args[w].count = PER_WRITER;
+        ASSERT_EQ(0, pthread_create(&threads[w], NULL, log_filler, &args[w]));
+    }
+    uint64_t offset = 0;
+    int flushed = 0;
+    while (flushed < WRITERS * PER_WRITER) {
+        uint64_t tail = atomic_load(&log_buffer->tail);
+        LogRecord *rec;
+        while ((rec = log_next(log_buffer, &offset, tail, 0)) != NULL) {
+            flushed++;
+            offset += rec->length;
+        }
+        atomic_store(&log_buffer->flushed, offset);
+        sched_yield();
+    }
+    for (int w = 0; w < WRITERS; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    atomic_store(&tail_args.stop, 1);
+    pthread_join(tailer, NULL);
+    
+    ASSERT_TRUE(tail_args.read > 0);
+    ASSERT_EQ(0, tail_args.torn);
+    
+    pthread_mutex_destroy(&log_buffer->mutex);
+    free(log_buffer);
+    
+    PASS();
+}
+ 
+ /* Test the background log writer: batch-triggered flushes and the final
+ * flush on stop */
+void test_log_writer() {
+    TEST("Log writer flushing to file");
+    
+    const char *path = "test_chat_log.tmp";
+    unlink(path);
+    
+    size_t buffer_size = 64 * 1024;
+    LogBuffer *log_buffer = malloc(sizeof(LogBuffer) + buffer_size);
+    ASSERT_TRUE(log_buffer != NULL);
+    log_init(log_buffer, buffer_size, 0);
+    
+    /* A long interval, so only the batch threshold can trigger a flush */
+    LogWriter writer;
+    LogWriterConfig config;
+    log_writer_default_config(&config);
+    config.path = path;
+    config.interval_ms = 60000;
+    config.batch_bytes = 1024;
+    ASSERT_EQ(0, log_writer_start(&writer, log_buffer, &config));
+    
+    char entry[64];
+    int expected_bytes = 0;
+    for (int i = 0; i < 100; i++) {
+        int len = sprintf(entry, "line %d\n", i);
+        ASSERT_TRUE(log_append(log_buffer, entry, len, 0, NULL) != 0);
+        log_writer_notify(&writer);
+        expected_bytes += len;
+    }
+    
+    /* Past the 1 KB batch, so the writer should wake up well before 60 s */
+    for (int i = 0; i < 200 && atomic_load(&log_buffer->flushed) == 0; i++) {
+        usleep(10000);
+    }
+    ASSERT_TRUE(atomic_load(&log_buffer->flushed) > 0);
+    
+    /* Whatever is below the threshold goes out when the writer stops */
+    ASSERT_TRUE(log_append(log_buffer, "last\n", 5, 0, NULL) != 0);
+    expected_bytes += 5;
+    log_writer_stop(&writer);
+    ASSERT_EQ((long long)atomic_load(&log_buffer->tail), (long long)atomic_load(&log_buffer->flushed));
+    ASSERT_EQ(expected_bytes, (int)writer.bytes_written);
+    
+    /* The file holds exactly the text, in order */
+    FILE *file = fopen(path, "r");
+    ASSERT_TRUE(file != NULL);
+    char line[64];
+    int lines = 0;
+    int in_order = 1;
+    while (fgets(line, sizeof(line), file)) {
+        sprintf(entry, lines < 100 ? "line %d\n" : "last\n", lines);
+        if (strcmp(line, entry) != 0) {
+            in_order = 0;
+        }
+        lines++;
+    }
+    fclose(file);
+    unlink(path);
+    ASSERT_EQ(101, lines);
+    ASSERT_TRUE(in_order);
+    
+    pthread_mutex_destroy(&log_buffer->mutex);
+    free(log_buffer);
+    
+    PASS();
+}
+ 
+/* Committer thread used by test_log_group_commit */
+typedef struct {
+    LogWriter *writer;
+    int count;
+    int early;      /* Times log_writer_commit() returned before the entry was synced */
+} CommitArgs;
+
+static void *log_committer(void *arg) {
+    CommitArgs *args = (CommitArgs *)arg;
+    for (int i = 0; i < args->count; i++) {
+        uint64_t end = 0;
+        log_append(args->writer->log, "group commit entry\n", 19, 0, &end);
+        log_writer_commit(args->writer, end);
+        pthread_mutex_lock(&args->writer->mutex);
+        if (args->writer->durable < end) {
+            args->early++;
+        }
+        pthread_mutex_unlock(&args->writer->mutex);
+    }
+    return NULL;
+}
+
+/* Test group commit: every committed entry is synced, and concurrent
+ * committers share fdatasync() calls */
+void test_log_group_commit() {
+    TEST("Log group commit");
+    
+    enum { COMMITTERS = 4, PER_COMMITTER = 50 };
+    const char *path = "test_chat_log.tmp";
+    unlink(path);
+    
+    size_t buffer_size = 64 * 1024;
+    LogBuffer *log_buffer = malloc(sizeof(LogBuffer) + buffer_size);
+    ASSERT_TRUE(log_buffer != NULL);
+    log_init(log_buffer, buffer_size, 0);
+    
+    LogWriter writer;
+    LogWriterConfig config;
+    log_writer_default_config(&config);
+    config.path = path;
+    config.interval_ms = 60000;
+    config.batch_bytes = buffer_size;
+    config.durability = LOG_DURABILITY_GROUP;
+    ASSERT_EQ(0, log_writer_start(&writer, log_buffer, &config));
+    
+    pthread_t threads[COMMITTERS];
+    CommitArgs args[COMMITTERS];
+    for (int c = 0; c < COMMITTERS; c++) {
+        args[c].writer = &writer;
+        args[c].count = PER_COMMITTER;
+        args[c].early = 0;
+        ASSERT_EQ(0, pthread_create(&threads[c], NULL, log_committer, &args[c]));
+    }
+    for (int c = 0; c < COMMITTERS; c++) {
+        pthread_join(threads[c], NULL);
+    }
+    log_writer_stop(&writer);
     
-    /* Print debug info */
-    printf("\n  [DEBUG] Initial buffer state: total=%zu, used=%zu\n", 
-           log_buffer->total_size, log_buffer->used_size);
-    
-    /* Check buffer state */
-    ASSERT_TRUE(log_buffer->used_size > 0);
-    ASSERT_TRUE(log_buffer->used_size < buffer_size);
-    
-    /* Calculate size for large entry - make sure it will fit */
-    size_t remaining_space = buffer_size - log_buffer->used_size;
-    size_t large_entry_size = buffer_size / 3; /* Use 1/3 of buffer size */
-    
-    /* Create large entry */
-    char *large_entry = malloc(large_entry_size + 1);
-    memset(large_entry, 'X', large_entry_size);
-    large_entry[large_entry_size] = '\0';
-    
-    printf("  [DEBUG] Large entry size: %zu, remaining space: %zu\n", 
-           large_entry_size, remaining_space);
-    
-    /* Save original used_size */
-    size_t original_used_size = log_buffer->used_size;
-    
-    /* Check if we need to make room */
-    if (log_buffer->used_size + large_entry_size > log_buffer->total_size) {
-        printf("  [DEBUG] Need to make room in buffer\n");
-        
-        /* Move content to make room */
-        size_t half_size = log_buffer->used_size / 2;
-        memmove(log_buffer->data, log_buffer->data + half_size, log_buffer->used_size - half_size);
-        log_buffer->used_size -= half_size;
-        log_buffer->write_position = log_buffer->used_size;
-        
-        printf("  [DEBUG] After making room: used=%zu, position=%d\n", 
-               log_buffer->used_size, log_buffer->write_position);
+    for (int c = 0; c < COMMITTERS; c++) {
+        ASSERT_EQ(0, args[c].early);
     }
+    ASSERT_EQ(COMMITTERS * PER_COMMITTER, (int)writer.records_written);
+    ASSERT_TRUE(writer.syncs > 0);
+    ASSERT_TRUE(writer.syncs <= COMMITTERS * PER_COMMITTER);
+    
+    unlink(path);
+    pthread_mutex_destroy(&log_buffer->mutex);
+    free(log_buffer);
+    
+    PASS();
+}
+ 
+/* Test the cached timestamp and hand-written log formatter against
+ * localtime() and sprintf() */
+void test_log_formatting() {
+    TEST("Cached timestamp and log entry formatting");
     
-    /* Double-check there's enough room now */
-    if (log_buffer->used_size + large_entry_size <= log_buffer->total_size) {
-        /* Add large entry to buffer */
-        memcpy(&log_buffer->data[log_buffer->write_position], large_entry, large_entry_size);
-        log_buffer->write_position += large_entry_size;
-        log_buffer->used_size += large_entry_size;
-        
-        printf("  [DEBUG] Final buffer state: total=%zu, used=%zu\n", 
-               log_buffer->total_size, log_buffer->used_size);
-        
-        /* Verify large entry fits */
-        ASSERT_TRUE(log_buffer->used_size <= buffer_size);
-    } else {
-        printf("  [DEBUG] Still not enough room: need %zu, have %zu\n", 
-               large_entry_size, buffer_size - log_buffer->used_size);
-        FAIL("Could not fit entry in buffer even after making room");
-        goto cleanup;
+    /* Walk forwards across minute and hour boundaries, then jump back */
+    time_t base = time(NULL) - 7200;
+    time_t samples[] = { base, base + 1, base + 59, base + 60, base + 61, base + 3599,
+                         base + 3600, base + 3661, base + 30, base - 86400, 0 };
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        char expected[MAX_USERNAME + MSG_SIZE + 64];
+        char actual[MAX_USERNAME + MSG_SIZE + 64];
+        struct tm tm_info;
+        localtime_r(&samples[i], &tm_info);
+        int expected_len = sprintf(expected, "[%02d:%02d:%02d] <%s>: %s\n",
+                                   tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec,
+                                   "alice", "hello world");
+        size_t len = format_log_entry(actual, sizeof(actual), samples[i], "alice", "hello world");
+        ASSERT_EQ((size_t)expected_len, len);
+        ASSERT_STR_EQ(expected, actual);
     }
     
-    /* Success! */
+    /* Too small a buffer truncates but still ends the line */
+    char small[16];
+    size_t len = format_log_entry(small, sizeof(small), base, "alice", "hello world");
+    ASSERT_EQ(sizeof(small) - 1, len);
+    ASSERT_EQ('\n', small[len - 1]);
+    ASSERT_EQ('[', small[0]);
     
-cleanup:
-    /* Clean up */
+    PASS();
+}
+ 
+/* Write n entries with timestamps base_ns + i seconds through a binary
+ * log writer; returns 0 on success */
+static int write_binary_log(const char *path, int first, int n, int64_t base_ns) {
+    size_t buffer_size = 256 * 1024;
+    LogBuffer *log_buffer = malloc(sizeof(LogBuffer) + buffer_size);
+    if (!log_buffer) {
+        return -1;
+    }
+    log_init(log_buffer, buffer_size, 0);
+    
+    LogWriter writer;
+    LogWriterConfig config;
+    log_writer_default_config(&config);
+    config.path = path;
+    config.interval_ms = 60000;
+    config.format = LOG_FORMAT_BINARY;
+    config.index_interval = 10;
+    if (log_writer_start(&writer, log_buffer, &config) != 0) {
+        free(log_buffer);
+        return -1;
+    }
+    for (int i = first; i < first + n; i++) {
+        char entry[64];
+        int len = sprintf(entry, "entry %d\n", i);
+        log_append(log_buffer, entry, len, base_ns + (int64_t)i * 1000000000LL, NULL);
+    }
+    log_writer_stop(&writer);
     pthread_mutex_destroy(&log_buffer->mutex);
-    free(large_entry);
     free(log_buffer);
+    return 0;
+}
+ 
+/* Test the binary log: sequence numbers, index seeks, restart and
+ * torn-tail recovery */
+void test_binary_log() {
+    TEST("Binary log with seekable index");
+    
+    const char *path = "test_chat_log.blog";
+    char index_path[256];
+    binlog_index_path(path, index_path, sizeof(index_path));
+    unlink(path);
+    unlink(index_path);
+    
+    int64_t base_ns = 1700000000LL * 1000000000LL;
+    ASSERT_EQ(0, write_binary_log(path, 0, 500, base_ns));
+    
+    /* Simulate a crash halfway through a record, then restart and append */
+    FILE *file = fopen(path, "ab");
+    ASSERT_TRUE(file != NULL);
+    fwrite("\x43\x4c\x52\x31torn", 1, 8, file);
+    fclose(file);
+    ASSERT_EQ(0, write_binary_log(path, 500, 500, base_ns));
     
-    if (num_tests == num_passed + 1) {
-        PASS();
+    BinlogReader reader;
+    ASSERT_EQ(0, binlog_reader_open(&reader, path));
+    ASSERT_EQ(100, (int)reader.index_count);
+    
+    /* Every record in order, numbered 1..1000 across the restart */
+    BinlogRecord rec;
+    char text[BINLOG_MAX_TEXT + 1];
+    char expected[64];
+    int count = 0;
+    int result;
+    while ((result = binlog_read(&reader, &rec, text)) == 1) {
+        sprintf(expected, "entry %d\n", count);
+        ASSERT_STR_EQ(expected, text);
+        ASSERT_EQ((uint64_t)(count + 1), rec.seq);
+        ASSERT_EQ(base_ns + (int64_t)count * 1000000000LL, rec.timestamp_ns);
+        count++;
     }
+    ASSERT_EQ(0, result);
+    ASSERT_EQ(1000, count);
+    
+    /* A sequence seek lands within one index interval of the target */
+    binlog_seek_seq(&reader, 777);
+    ASSERT_EQ(1, binlog_read(&reader, &rec, text));
+    ASSERT_TRUE(rec.seq <= 777 && rec.seq > 777 - 10);
+    
+    /* A time seek lands at most two intervals early, never late */
+    binlog_seek_time(&reader, base_ns + 333LL * 1000000000LL);
+    ASSERT_EQ(1, binlog_read(&reader, &rec, text));
+    ASSERT_TRUE(rec.seq <= 334 && rec.seq > 334 - 20);
+    
+    /* Before the first record: back to the start */
+    binlog_seek_time(&reader, 0);
+    ASSERT_EQ(1, binlog_read(&reader, &rec, text));
+    ASSERT_EQ(1, (int)rec.seq);
+    
+    binlog_reader_close(&reader);
+    unlink(path);
+    unlink(index_path);
+    
+    PASS();
 }
  
+/* Remove a log file and any segments, indexes and archives next to it */
+static void remove_log_segments(const char *path) {
+    char name[256], index_path[256];
+    for (int i = 0; i <= 100; i++) {
+        if (i == 0) {
+            snprintf(name, sizeof(name), "%s", path);
+        } else {
+            snprintf(name, sizeof(name), "%s.%06d", path, i);
+        }
+        binlog_index_path(name, index_path, sizeof(index_path));
+        unlink(name);
+        unlink(index_path);
+        strcat(name, ".gz");
+        unlink(name);
+    }
+}
+ 
+/* Test segment rotation: the live file rolls over at the size limit,
+ * closed segments are compressed in the background, only the newest are
+ * kept, and sequence numbers run on across them */
+void test_log_rotation() {
+    TEST("Log rotation, compression and retention");
+    
+    const char *path = "test_chat_log.blog";
+    remove_log_segments(path);
+    
+    size_t buffer_size = 64 * 1024;
+    LogBuffer *log_buffer = malloc(sizeof(LogBuffer) + buffer_size);
+    ASSERT_TRUE(log_buffer != NULL);
+    log_init(log_buffer, buffer_size, 0);
+    
+    LogWriter writer;
+    LogWriterConfig config;
+    log_writer_default_config(&config);
+    config.path = path;
+    config.interval_ms = 60000;
+    config.format = LOG_FORMAT_BINARY;
+    config.index_interval = 10;
+    config.segment_bytes = 4096;
+    config.keep_segments = 3;
+    ASSERT_EQ(0, log_writer_start(&writer, log_buffer, &config));
+    
+    /* About 2 KB per pass, so a new segment every second pass */
+    for (int i = 0; i < 1000; i++) {
+        char entry[64];
+        int len = sprintf(entry, "entry %d\n", i);
+        ASSERT_TRUE(log_append(log_buffer, entry, len, 0, NULL) != 0);
+        if (i % 50 == 49) {
+            log_writer_flush(&writer);
+        }
+    }
+    int rotations = (int)writer.rotations;
+    ASSERT_TRUE(rotations >= 5);
+    
+    /* Wait for the archiver to settle: the newest three segments
+     * compressed, everything older deleted */
+    char name[256];
+    int settled = 0;
+    for (int tries = 0; tries < 500 && !settled; tries++) {
+        settled = 1;
+        for (int i = 1; i <= rotations; i++) {
+            snprintf(name, sizeof(name), "%s.%06d", path, i);
+            int plain = access(name, F_OK) == 0;
+            strcat(name, ".gz");
+            int compressed = access(name, F_OK) == 0;
+            if (plain || compressed != (i > rotations - 3)) {
+                settled = 0;
+            }
+        }
+        if (!settled) {
+            usleep(10000);
+        }
+    }
+    ASSERT_TRUE(settled);
+    log_writer_stop(&writer);
+    ASSERT_EQ(rotations, (int)writer.rotations);
+    
+    /* The kept segments and the live file read back as one unbroken run,
+     * each with its first record indexed */
+    BinlogReader reader;
+    BinlogRecord rec;
+    char text[BINLOG_MAX_TEXT + 1];
+    uint64_t expected_seq = 0;
+    for (int i = rotations - 2; i <= rotations + 1; i++) {
+        if (i <= rotations) {
+            snprintf(name, sizeof(name), "%s.%06d.gz", path, i);
+        } else {
+            snprintf(name, sizeof(name), "%s", path);
+        }
+        ASSERT_EQ(0, binlog_reader_open(&reader, name));
+        int first = 1;
+        while (binlog_read(&reader, &rec, text) == 1) {
+            if (first) {
+                ASSERT_TRUE(reader.index_count > 0);
+                ASSERT_EQ(rec.seq, reader.index[0].seq);
+                if (expected_seq == 0) {
+                    expected_seq = rec.seq;
+                }
+                first = 0;
+            }
+            char expected[64];
+            sprintf(expected, "entry %d\n", (int)rec.seq - 1);
+            ASSERT_STR_EQ(expected, text);
+            ASSERT_EQ(expected_seq, rec.seq);
+            expected_seq++;
+        }
+        binlog_reader_close(&reader);
+    }
+    ASSERT_TRUE(expected_seq > 500);  /* Older segments really are gone */
+    ASSERT_EQ(1001, (int)expected_seq);
+    
+    remove_log_segments(path);
+    pthread_mutex_destroy(&log_buffer->mutex);
+    free(log_buffer);
+    
+    PASS();
+}
+ 
+/* Start ./chat_server in dir with its commands on a pipe, as bench_load
+  * does. Its key files, queues and log are dir's, not the ones a server
+  * running here uses. */
+ static pid_t start_test_server(const char *dir, int *command_fd) {
+     char server_path[PATH_MAX];
+     int command_pipe[2];
+     if (realpath("./chat_server", server_path) == NULL || pipe(command_pipe) == -1) {
+         return -1;
+     }
+     pid_t pid = fork();
+     if (pid == 0) {
+         if (chdir(dir) != 0) {
+             _exit(127);
+         }
+         int devnull = open("/dev/null", O_WRONLY);
+         dup2(command_pipe[0], STDIN_FILENO);
+         dup2(devnull, STDOUT_FILENO);
+         dup2(devnull, STDERR_FILENO);
+         close(command_pipe[0]);
+         close(command_pipe[1]);
+         execl(server_path, "chat_server", "-H", "0", (char *)NULL);
+         _exit(127);
+     }
+     close(command_pipe[0]);
+     *command_fd = command_pipe[1];
+     return pid;
+ }
+ 
+ /* Remove a directory made for a test server and everything in it */
+ static void remove_test_dir(const char *dir) {
+     DIR *d = opendir(dir);
+     if (d != NULL) {
+         struct dirent *entry;
+         char path[PATH_MAX];
+         while ((entry = readdir(d)) != NULL) {
+             if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                 snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+                 unlink(path);
+             }
+         }
+         closedir(d);
+     }
+     rmdir(dir);
+ }
+ 
+ /* Wait up to timeout_ms for a child to exit; returns its status or -1 */
+ static int wait_exit(pid_t pid, int timeout_ms) {
+     int status;
+     for (int waited = 0; waited <= timeout_ms; waited += 10) {
+         if (waitpid(pid, &status, WNOHANG) == pid) {
+             return status;
+         }
+         usleep(10000);
+     }
+     return -1;
+ }
+ 
+ /* Wait up to timeout_ms for the server to have read count chat messages */
+ static int wait_chat_in(const ServerStats *server_stats, uint64_t count, int timeout_ms) {
+     for (int waited = 0; waited <= timeout_ms; waited += 10) {
+         if (atomic_load(&server_stats->msgs_in[MSG_TYPE_CHAT]) >= count) {
+             return 1;
+         }
+         usleep(10000);
+     }
+     return 0;
+ }
+ 
+ /* Test the server's message_receiver: a burst is read to the end, a stray
+  * shutdown message is ignored while the server runs, and the one sent by
+  * quit stops the receiver so the server can exit */
+ void test_server_receiver() {
+     TEST("Server receiver drains a burst and stops on shutdown");
+ 
+     if (access("./chat_server", X_OK) != 0) {
+         printf("(no ./chat_server, skipped) ");
+         PASS();
+         return;
+     }
+     char dir[] = "/tmp/chat_test_XXXXXX";
+     ASSERT_TRUE(mkdtemp(dir) != NULL);
+     char server_key_path[PATH_MAX], log_key_path[PATH_MAX];
+     snprintf(server_key_path, sizeof(server_key_path), "%s/server.key", dir);
+     snprintf(log_key_path, sizeof(log_key_path), "%s/log.key", dir);
+     close(open(server_key_path, O_WRONLY | O_CREAT, 0644));
+     close(open(log_key_path, O_WRONLY | O_CREAT, 0644));
+     key_t server_key = ftok(server_key_path, 'S');
+     key_t control_key = ftok(server_key_path, CONTROL_QUEUE_PROJ);
+     if (server_key == -1 || control_key == -1) {
+         remove_test_dir(dir);
+         ASSERT_TRUE(server_key != -1 && control_key != -1);
+     }
+ 
+     /* A crashed run can leave queues under the same keys; the poll below
+      * must only find the new server's */
+     msgctl(msgget(server_key, 0666), IPC_RMID, NULL);
+     msgctl(msgget(control_key, 0666), IPC_RMID, NULL);
+ 
+     int command_fd;
+     pid_t pid = start_test_server(dir, &command_fd);
+     if (pid <= 0) {
+         remove_test_dir(dir);
+         ASSERT_TRUE(pid > 0);
+     }
+ 
+     /* The stats segment is created before the queue, so both are ours */
+     int qid = -1;
+     for (int waited = 0; qid == -1 && waited < 2000; waited += 10) {
+         usleep(10000);
+         qid = msgget(server_key, 0666);
+     }
+     const ServerStats *server_stats =
+         qid == -1 ? NULL : stats_attach(ftok(log_key_path, STATS_PROJ));
+     if (server_stats == NULL) {
+         kill(pid, SIGKILL);
+         waitpid(pid, NULL, 0);
+         close(command_fd);
+         msgctl(msgget(server_key, 0666), IPC_RMID, NULL);
+         msgctl(msgget(control_key, 0666), IPC_RMID, NULL);
+         remove_test_dir(dir);
+         ASSERT_TRUE(server_stats != NULL);
+     }
+ 
+     /* A burst with a stray wakeup in the middle, from a sender that never
+      * connected: the receiver counts every message before dispatching it */
+     Message msg;
+     WireMessage wire;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "burst");
+     int sent = 0;
+     for (int i = 0; i < 200; i++) {
+         sprintf(msg.content, "line %d", i);
+         msg.timestamp = time(NULL);
+         sent += msgsnd(qid, &wire, wire_encode(&msg, &wire), 0) == 0;
+         if (i == 100) {
+             Message wake_msg;
+             memset(&wake_msg, 0, sizeof(wake_msg));
+             wake_msg.mtype = MSG_TYPE_SHUTDOWN;
+             msgsnd(qid, &wake_msg, FIXED_MSG_BYTES, 0);
+         }
+     }
+     int drained = wait_chat_in(server_stats, 200, 2000);
+ 
+     /* Still running after the stray wakeup, and still reading */
+     usleep(50000);
+     int alive = waitpid(pid, NULL, WNOHANG) == 0;
+     sprintf(msg.content, "after the wakeup");
+     sent += msgsnd(qid, &wire, wire_encode(&msg, &wire), 0) == 0;
+     int still_reading = wait_chat_in(server_stats, 201, 2000);
+ 
+     /* quit clears running before the wakeup, which then ends the receiver */
+     ssize_t written = write(command_fd, "quit\n", 5);
+     int status = wait_exit(pid, 5000);
+     if (status == -1) {
+         kill(pid, SIGKILL);
+         waitpid(pid, NULL, 0);
+         msgctl(msgget(server_key, 0666), IPC_RMID, NULL);
+         msgctl(msgget(control_key, 0666), IPC_RMID, NULL);
+     }
+     close(command_fd);
+     shmdt((const void *)server_stats);
+     remove_test_dir(dir);
+ 
+     ASSERT_EQ(201, sent);
+     ASSERT_TRUE(drained);
+     ASSERT_TRUE(alive);
+     ASSERT_TRUE(still_reading);
+     ASSERT_EQ(5, (int)written);
+     ASSERT_TRUE(status != -1 && WIFEXITED(status));
+     ASSERT_EQ(0, WEXITSTATUS(status));
+     PASS();
+ }
+ 
+ /* Per-key ordering state for test_dispatch_ordering */
+ typedef struct {
+     int key;
+     int seq;
+ } DispatchItem;
+ 
+ static int dispatch_last_seq[8];
+ static int dispatch_errors;
+ static int dispatch_handled;
+ static pthread_mutex_t dispatch_test_mutex = PTHREAD_MUTEX_INITIALIZER;
+ 
+ static void dispatch_test_handler(void *item, void *ctx) {
+     DispatchItem *it = (DispatchItem *)item;
+     pthread_mutex_lock(&dispatch_test_mutex);
+     if (it->seq != dispatch_last_seq[it->key] + 1) {
+         dispatch_errors++;
+     }
+     dispatch_last_seq[it->key] = it->seq;
+     dispatch_handled++;
+     pthread_mutex_unlock(&dispatch_test_mutex);
+ }
+ 
+ /* Test that the dispatch pool handles every item and keeps per-key order */
+ void test_dispatch_ordering() {
+     TEST("Dispatch pool per-key ordering");
+     
+     DispatchPool pool;
+     ASSERT_EQ(0, dispatch_pool_init(&pool, 4, sizeof(DispatchItem), dispatch_test_handler, NULL));
+     
+     int next_seq[8] = {0};
+     for (int i = 0; i < 8000; i++) {
+         DispatchItem it;
+         it.key = i % 8;
+         it.seq = ++next_seq[it.key];
+         dispatch_submit(&pool, (unsigned int)it.key, &it);
+     }
+     dispatch_pool_shutdown(&pool);
+     
+     ASSERT_EQ(8000, dispatch_handled);
+     ASSERT_EQ(0, dispatch_errors);
+     PASS();
+ }
+ 
+ /* Handling order for test_dispatch_urgent; seq 0 holds the worker until released */
+ static int urgent_order[16];
+ static int urgent_handled;
+ static int urgent_gate_reached;
+ static int urgent_gate_open;
+ static pthread_cond_t urgent_gate_cond = PTHREAD_COND_INITIALIZER;
+ 
+ static void urgent_test_handler(void *item, void *ctx) {
+     DispatchItem *it = (DispatchItem *)item;
+     pthread_mutex_lock(&dispatch_test_mutex);
+     if (it->seq == 0) {
+         urgent_gate_reached = 1;
+         pthread_cond_broadcast(&urgent_gate_cond);
+     }
+     while (it->seq == 0 && !urgent_gate_open) {
+         pthread_cond_wait(&urgent_gate_cond, &dispatch_test_mutex);
+     }
+     if (urgent_handled < 16) {
+         urgent_order[urgent_handled] = it->seq;
+     }
+     urgent_handled++;
+     pthread_mutex_unlock(&dispatch_test_mutex);
+ }
+ 
+ /* Test that urgent items overtake queued ones and keep their own order */
+ void test_dispatch_urgent() {
+     TEST("Dispatch pool urgent lane");
+ 
+     DispatchPool pool;
+     ASSERT_EQ(0, dispatch_pool_init(&pool, 1, sizeof(DispatchItem), urgent_test_handler, NULL));
+ 
+     /* The worker takes the gate item and holds there while the rest queue up */
+     DispatchItem it = {0, 0};
+     dispatch_submit(&pool, 0, &it);
+     pthread_mutex_lock(&dispatch_test_mutex);
+     while (!urgent_gate_reached) {
+         pthread_cond_wait(&urgent_gate_cond, &dispatch_test_mutex);
+     }
+     pthread_mutex_unlock(&dispatch_test_mutex);
+     for (int i = 1; i <= 5; i++) {
+         it.seq = i;
+         dispatch_submit(&pool, 0, &it);
+     }
+     for (int i = 101; i <= 103; i++) {
+         it.seq = i;
+         dispatch_submit_urgent(&pool, 0, &it);
+     }
+ 
+     pthread_mutex_lock(&dispatch_test_mutex);
+     urgent_gate_open = 1;
+     pthread_cond_broadcast(&urgent_gate_cond);
+     pthread_mutex_unlock(&dispatch_test_mutex);
+     dispatch_pool_shutdown(&pool);
+ 
+     int expected[] = {0, 101, 102, 103, 1, 2, 3, 4, 5};
+     ASSERT_EQ(9, urgent_handled);
+     for (int i = 0; i < 9; i++) {
+         ASSERT_EQ(expected[i], urgent_order[i]);
+     }
+     PASS();
+ }
+ 
+ /* Test the client registry at a size the old fixed array could not hold */
+ void test_client_registry() {
+     TEST("Client registry growth and lookup");
+     
+     ClientRegistry reg;
+     ASSERT_EQ(0, registry_init(&reg, 4, 10000));
+     
+     char name[MAX_USERNAME];
+     for (int i = 0; i < 10000; i++) {
+         snprintf(name, sizeof(name), "user%d", i);
+         ASSERT_EQ(i, registry_add(&reg, name, 1000 + i, 0));
+     }
+     ASSERT_EQ(10000, reg.count);
+     ASSERT_EQ(REGISTRY_FULL, registry_add(&reg, "one_too_many", 1, 0));
+     ASSERT_EQ(REGISTRY_DUPLICATE, registry_add(&reg, "user42", 1, 0));
+     
+     /* Lookups survive growth and removals leave other ids untouched */
+     ASSERT_EQ(9999, registry_find(&reg, "user9999"));
+     ASSERT_EQ(0, registry_remove(&reg, 42));
+     ASSERT_EQ(-1, registry_find(&reg, "user42"));
+     ASSERT_TRUE(registry_get(&reg, 42) == NULL);
+     ASSERT_EQ(43, registry_find(&reg, "user43"));
+     ASSERT_EQ(1043, registry_get(&reg, 43)->queue_id);
+     ASSERT_EQ(9999, reg.count);
+     
+     /* A freed id is reused by the next client */
+     ASSERT_EQ(42, registry_add(&reg, "newcomer", 7, 0));
+     ASSERT_EQ(42, registry_find(&reg, "newcomer"));
+     
+     registry_destroy(&reg);
+     PASS();
+ }
+ 
+ /* Test broadcast ring delivery, exclusion and lag detection */
+ void test_broadcast_ring() {
+     TEST("Broadcast ring publish, read and lag detection");
+     
+     key_t test_key = ftok("test_shm.key", 'R');
+     ASSERT_TRUE(test_key != -1);
+     int ring_shm;
+     BroadcastRing *ring = ring_create(test_key, &ring_shm);
+     ASSERT_TRUE(ring != NULL);
+     
+     BroadcastRing *mapped = ring_attach(test_key);
+     ASSERT_TRUE(mapped != NULL);
+     RingReader reader;
+     ring_reader_init(&reader, mapped);
+     
+     Message msg, out;
+     size_t length;
+     pid_t exclude_pid;
+     uint64_t skipped = 0;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "Sender");
+     strcpy(msg.content, "ring message");
+     
+     ASSERT_EQ(RING_EMPTY, ring_read(&reader, &out, sizeof(out), &length, &exclude_pid, &skipped));
+     ASSERT_EQ(1, (int)ring_publish(ring, &msg, sizeof(msg), 1234));
+     ASSERT_EQ(RING_OK, ring_read(&reader, &out, sizeof(out), &length, &exclude_pid, &skipped));
+     ASSERT_EQ(sizeof(Message), length);
+     ASSERT_EQ(1234, exclude_pid);
+     ASSERT_STR_EQ("ring message", out.content);
+     
+     /* Lap the reader: it must notice and resume at the oldest live slot */
+     for (int i = 0; i < RING_SLOTS + 10; i++) {
+         ring_publish(ring, &msg, sizeof(msg), 0);
+     }
+     ASSERT_EQ(RING_LAGGED, ring_read(&reader, &out, sizeof(out), &length, &exclude_pid, &skipped));
+     ASSERT_TRUE(skipped >= 10);
+     ASSERT_EQ(RING_OK, ring_read(&reader, &out, sizeof(out), &length, &exclude_pid, &skipped));
+     ASSERT_EQ(1, (int)atomic_load(&ring->lag_events));
+     
+     shmdt(mapped);
+     shmdt(ring);
+     shmctl(ring_shm, IPC_RMID, NULL);
+     PASS();
+ }
+ 
+ /* Test that compact messages round trip through a queue at their real size,
+  * and that fixed-size messages from older clients still decode */
+ void test_wire_format() {
+     TEST("Compact and fixed wire formats");
+     
+     key_t test_key = ftok("test_queue.key", 'T');
+     ASSERT_TRUE(test_key != -1);
+     msgctl(msgget(test_key, 0666), IPC_RMID, NULL);
+     int qid = msgget(test_key, 0666 | IPC_CREAT);
+     ASSERT_TRUE(qid != -1);
+     
+     Message msg, decoded;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     strcpy(msg.content, "hello");
+     msg.timestamp = 1700000000;
+     
+     WireMessage wire;
+     size_t size = wire_encode(&msg, &wire);
+     ASSERT_EQ(WIRE_HEADER_BYTES + 10, size);
+     ASSERT_TRUE(size < FIXED_MSG_BYTES / 10);
+     ASSERT_EQ(0, msgsnd(qid, &wire, size, 0));
+     ASSERT_EQ(0, msgsnd(qid, &msg, FIXED_MSG_BYTES, 0));
+     
+     WireBuffer buf;
+     ssize_t got = msgrcv(qid, &buf, WIRE_MAX_BYTES, 0, IPC_NOWAIT);
+     ASSERT_EQ((ssize_t)size, got);
+     ASSERT_EQ(1, wire_decode(&buf, (size_t)got, &decoded));
+     ASSERT_EQ(MSG_TYPE_CHAT, decoded.mtype);
+     ASSERT_STR_EQ("alice", decoded.username);
+     ASSERT_STR_EQ("hello", decoded.content);
+     ASSERT_TRUE(decoded.timestamp == msg.timestamp);
+     
+     got = msgrcv(qid, &buf, WIRE_MAX_BYTES, 0, IPC_NOWAIT);
+     ASSERT_EQ((ssize_t)FIXED_MSG_BYTES, got);
+     ASSERT_EQ(0, wire_decode(&buf, (size_t)got, &decoded));
+     ASSERT_STR_EQ("hello", decoded.content);
+     
+     /* A truncated compact message is rejected */
+     ASSERT_EQ(-1, wire_decode((WireBuffer *)&wire, size - 1, &decoded));
+     
+     /* An oversized message is dropped, not left to block the queue */
+     static WireBuffer oversized[2];
+     memset(oversized, 0, sizeof(oversized));
+     oversized[0].mtype = MSG_TYPE_CHAT;
+     ASSERT_EQ(0, msgsnd(qid, oversized, WIRE_MAX_BYTES + 100, 0));
+     ASSERT_EQ(0, msgsnd(qid, &wire, size, 0));
+     ASSERT_EQ(-1, (int)wire_receive(qid, &buf, 0, IPC_NOWAIT));
+     ASSERT_EQ(E2BIG, errno);
+     ASSERT_EQ((int)size, (int)wire_receive(qid, &buf, 0, IPC_NOWAIT));
+     
+     msgctl(qid, IPC_RMID, NULL);
+     PASS();
+ }
+  
+ /* Test that trace stamps survive the compact format, and only when asked for */
+ void test_trace_stamps() {
+     TEST("Trace stamps on the compact format");
+ 
+     Message msg, decoded;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     strcpy(msg.content, "hello");
+     msg.seq = 42;
+     msg.trace[TRACE_CLIENT_SEND] = 1000;
+     msg.trace[TRACE_SERVER_RECV] = 2500;
+     msg.trace[TRACE_FANOUT] = 4000;
+     msg.trace[TRACE_CLIENT_RECV] = 9999;  /* Never sent */
+ 
+     WireMessage wire;
+     size_t size = wire_encode_traced(&msg, &wire);
+     ASSERT_EQ(WIRE_HEADER_BYTES + sizeof(uint64_t) + TRACE_WIRE_BYTES + 10, size);
+     ASSERT_EQ(WIRE_FLAG_SEQ | WIRE_FLAG_TRACE, wire.flags);
+     ASSERT_EQ(1, wire_decode((WireBuffer *)&wire, size, &decoded));
+     ASSERT_TRUE(decoded.seq == 42);
+     ASSERT_TRUE(decoded.trace[TRACE_CLIENT_SEND] == 1000);
+     ASSERT_TRUE(decoded.trace[TRACE_SERVER_RECV] == 2500);
+     ASSERT_TRUE(decoded.trace[TRACE_FANOUT] == 4000);
+     ASSERT_TRUE(decoded.trace[TRACE_CLIENT_RECV] == 0);
+     ASSERT_STR_EQ("alice", decoded.username);
+     ASSERT_STR_EQ("hello", decoded.content);
+ 
+     /* The plain encoding leaves them out, and decoding clears them */
+     size = wire_encode(&msg, &wire);
+     ASSERT_EQ(WIRE_HEADER_BYTES + sizeof(uint64_t) + 10, size);
+     memset(decoded.trace, 0x55, sizeof(decoded.trace));
+     ASSERT_EQ(1, wire_decode((WireBuffer *)&wire, size, &decoded));
+     ASSERT_TRUE(decoded.trace[TRACE_CLIENT_SEND] == 0 && decoded.trace[TRACE_FANOUT] == 0);
+ 
+     /* A traced message cut short is rejected */
+     size = wire_encode_traced(&msg, &wire);
+     ASSERT_EQ(-1, wire_decode((WireBuffer *)&wire, size - 1, &decoded));
+     PASS();
+ }
+ 
+ /* Test packing many lines into one batch and reading them back */
+ void test_batch_envelope() {
+     TEST("Batch envelope packing and framing");
+     
+     BatchMessage batch;
+     batch_init(&batch);
+     
+     Message msg, out;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "bot");
+     msg.timestamp = 1700000000;
+     
+     int appended = 0;
+     for (int i = 0; i < 1000; i++) {
+         snprintf(msg.content, MSG_SIZE, "scripted line %d", i);
+         if (batch_append(&batch, &msg) != 0) {
+             break;
+         }
+         appended++;
+     }
+     /* Stops cleanly at BATCH_MAX_BYTES instead of overflowing */
+     ASSERT_TRUE(appended > 100 && appended < 1000);
+     ASSERT_EQ(appended, batch.count);
+     ASSERT_TRUE(batch_size(&batch) <= WIRE_MAX_BYTES);
+     ASSERT_EQ(0, batch_validate(&batch, batch_size(&batch)));
+     
+     size_t offset = 0;
+     int seen = 0;
+     while (batch_next(&batch, &offset, &out) == 1) {
+         char expected[MSG_SIZE];
+         snprintf(expected, sizeof(expected), "scripted line %d", seen);
+         ASSERT_STR_EQ(expected, out.content);
+         ASSERT_STR_EQ("bot", out.username);
+         seen++;
+     }
+     ASSERT_EQ(appended, seen);
+     
+     /* Framing errors are caught before anyone walks the records */
+     ASSERT_EQ(-1, batch_validate(&batch, batch_size(&batch) - 1));
+     batch.count++;
+     ASSERT_EQ(-1, batch_validate(&batch, batch_size(&batch)));
+     PASS();
+ }
+ 
+ /* Test the history ring and replaying part of it to a queue in batches */
+ void test_history_replay() {
+     TEST("History ring and join replay");
+     
+     ChatHistory history;
+     ASSERT_EQ(0, history_init(&history, 8, 1));
+     Message msg, out;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     ASSERT_EQ(HISTORY_EMPTY, history_read(&history, 1, &out, NULL));
+     for (int i = 0; i < 20; i++) {
+         sprintf(msg.content, "line %d", i);
+         ASSERT_EQ((uint64_t)(i + 1), history_append(&history, &msg, (int64_t)i * 1000000000LL));
+     }
+     
+     /* Only the newest capacity messages are kept */
+     int64_t received_ns;
+     ASSERT_EQ(HISTORY_OK, history_read(&history, 13, &out, &received_ns));
+     ASSERT_STR_EQ("line 12", out.content);
+     ASSERT_EQ(12000000000LL, received_ns);
+     ASSERT_EQ(HISTORY_GONE, history_read(&history, 12, &out, NULL));
+     ASSERT_EQ(HISTORY_EMPTY, history_read(&history, 21, &out, NULL));
+     
+     /* Replay start by count, capped by what is kept, and by age */
+     ASSERT_EQ(16, (int)history_first(&history, 5, 0));
+     ASSERT_EQ(13, (int)history_first(&history, 100, 0));
+     ASSERT_EQ(19, (int)history_first(&history, 100, 18000000000LL));
+     ASSERT_EQ(21, (int)history_first(&history, 100, 99000000000LL));
+     history_destroy(&history);
+     
+     /* Replay 250 messages to a real queue */
+     ASSERT_EQ(0, history_init(&history, 1024, 1));
+     for (int i = 0; i < 300; i++) {
+         sprintf(msg.content, "history line %d", i);
+         history_append(&history, &msg, 0);
+     }
+     key_t test_key = ftok("test_queue.key", 'T');
+     ASSERT_TRUE(test_key != -1);
+     msgctl(msgget(test_key, 0666), IPC_RMID, NULL);
+     int qid = msgget(test_key, 0666 | IPC_CREAT);
+     ASSERT_TRUE(qid != -1);
+     
+     HistoryReplayer replayer;
+     ASSERT_EQ(0, replayer_start(&replayer, &history));
+     ASSERT_EQ(0, replayer_submit(&replayer, qid, history_first(&history, 250, 0),
+                                  history_head(&history), 0));
+     ASSERT_EQ(0, replayer_submit(&replayer, -1, 1, 10, 0));  /* No such queue */
+     
+     /* Batches arrive in order: a header line, then the messages */
+     WireBuffer buf;
+     int batches = 0;
+     int seen = -1;
+     int in_order = 1;
+     while (seen < 250) {
+         ssize_t got = msgrcv(qid, &buf, WIRE_MAX_BYTES, 0, 0);
+         ASSERT_TRUE(got > 0);
+         ASSERT_EQ(MSG_TYPE_BATCH, buf.mtype);
+         ASSERT_EQ(0, batch_validate(&buf.batch, (size_t)got));
+         batches++;
+         size_t offset = 0;
+         while (batch_next(&buf.batch, &offset, &out) == 1) {
+             char expected[MSG_SIZE];
+             if (seen == -1) {
+                 strcpy(expected, "Last 250 message(s) before you joined:");
+             } else {
+                 sprintf(expected, "history line %d", 50 + seen);
+             }
+             if (out.mtype != MSG_TYPE_HISTORY || out.seq != 0 ||
+                 strcmp(expected, out.content) != 0) {
+                 in_order = 0;
+             }
+             seen++;
+         }
+     }
+     ASSERT_TRUE(in_order);
+     ASSERT_EQ(250, seen);
+     ASSERT_TRUE(batches > 1 && batches < 25);
+     
+     for (int i = 0; i < 200; i++) {
+         pthread_mutex_lock(&replayer.mutex);
+         int waiting = replayer.count;
+         pthread_mutex_unlock(&replayer.mutex);
+         if (waiting == 0) {
+             break;
+         }
+         usleep(10000);
+     }
+     ASSERT_EQ(1, (int)replayer.replays);
+     ASSERT_EQ(1, (int)replayer.abandoned);
+     ASSERT_EQ(250, (int)replayer.messages);
+     ASSERT_EQ(batches, (int)replayer.sends);
+     
+     replayer_stop(&replayer);
+     history_destroy(&history);
+     msgctl(qid, IPC_RMID, NULL);
+     PASS();
+ }
+ 
+ /* Test sequence numbers on the wire and replaying the gap on resume */
+ void test_sequence_resume() {
+     TEST("Sequence numbers and resume");
+     
+     Message msg, out;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     strcpy(msg.content, "numbered");
+     msg.timestamp = 1700000000;
+     
+     /* Unnumbered messages are byte for byte what they always were */
+     WireBuffer buf;
+     size_t plain_size = wire_encode(&msg, &buf.compact);
+     ASSERT_EQ(0, buf.compact.flags);
+     msg.seq = 1234567890123ULL;
+     size_t size = wire_encode(&msg, &buf.compact);
+     ASSERT_EQ(plain_size + sizeof(uint64_t), size);
+     ASSERT_EQ(WIRE_FLAG_SEQ, buf.compact.flags);
+     ASSERT_EQ(1, wire_decode(&buf, size, &out));
+     ASSERT_TRUE(out.seq == msg.seq);
+     ASSERT_STR_EQ("numbered", out.content);
+     ASSERT_EQ(-1, wire_decode(&buf, plain_size, &out));
+     
+     /* The fixed format never carries it */
+     memcpy(&buf.fixed, &msg, sizeof(msg));
+     ASSERT_EQ(0, wire_decode(&buf, FIXED_MSG_BYTES, &out));
+     ASSERT_TRUE(out.seq == 0);
+     
+     /* Batches mix numbered and unnumbered records, and strip cleanly */
+     BatchMessage batch, stripped;
+     batch_init(&batch);
+     ASSERT_EQ(0, batch_append(&batch, &msg));
+     msg.seq = 0;
+     ASSERT_EQ(0, batch_append(&batch, &msg));
+     ASSERT_EQ(0, batch_validate(&batch, batch_size(&batch)));
+     size_t offset = 0;
+     ASSERT_EQ(1, batch_next(&batch, &offset, &out));
+     ASSERT_TRUE(out.seq == 1234567890123ULL);
+     ASSERT_EQ(MSG_TYPE_CHAT, out.mtype);
+     ASSERT_EQ(1, batch_next(&batch, &offset, &out));
+     ASSERT_TRUE(out.seq == 0);
+     batch_strip_seq(&batch, &stripped);
+     ASSERT_EQ(2, stripped.count);
+     ASSERT_EQ(batch_size(&batch) - sizeof(uint64_t), batch_size(&stripped));
+     offset = 0;
+     ASSERT_EQ(1, batch_next(&stripped, &offset, &out));
+     ASSERT_TRUE(out.seq == 0);
+     ASSERT_STR_EQ("numbered", out.content);
+     
+     /* Numbering starts where it is told to and is stamped on the copies */
+     ChatHistory history;
+     ASSERT_EQ(0, history_init(&history, 16, 1000));
+     ASSERT_EQ(999, (int)history_head(&history));
+     ASSERT_EQ(1000, (int)history_oldest(&history));
+     for (int i = 0; i < 40; i++) {
+         sprintf(msg.content, "line %d", i);
+         ASSERT_EQ(1000 + i, (int)history_append(&history, &msg, 0));
+     }
+     ASSERT_EQ(1024, (int)history_oldest(&history));
+     ASSERT_EQ(HISTORY_GONE, history_read(&history, 999, &out, NULL));
+     ASSERT_EQ(HISTORY_OK, history_read(&history, 1030, &out, NULL));
+     ASSERT_EQ(1030, (int)out.seq);
+     
+     /* A client that last saw 1010 gets what is left of the gap, numbered */
+     key_t test_key = ftok("test_queue.key", 'T');
+     ASSERT_TRUE(test_key != -1);
+     msgctl(msgget(test_key, 0666), IPC_RMID, NULL);
+     int qid = msgget(test_key, 0666 | IPC_CREAT);
+     ASSERT_TRUE(qid != -1);
+     HistoryReplayer replayer;
+     ASSERT_EQ(0, replayer_start(&replayer, &history));
+     ASSERT_EQ(0, replayer_submit(&replayer, qid, history_oldest(&history), history_head(&history),
+                                  REPLAY_SEQ | REPLAY_RESUME | REPLAY_INCOMPLETE));
+     ssize_t got = msgrcv(qid, &buf, WIRE_MAX_BYTES, 0, 0);
+     ASSERT_TRUE(got > 0);
+     ASSERT_EQ(0, batch_validate(&buf.batch, (size_t)got));
+     offset = 0;
+     ASSERT_EQ(1, batch_next(&buf.batch, &offset, &out));
+     ASSERT_STR_EQ("Missed 16 message(s) while away (older ones are gone):", out.content);
+     ASSERT_TRUE(out.seq == 0);
+     uint64_t expected = 1024;
+     while (batch_next(&buf.batch, &offset, &out) == 1) {
+         ASSERT_EQ(MSG_TYPE_HISTORY, out.mtype);
+         ASSERT_TRUE(out.seq == expected);
+         expected++;
+     }
+     ASSERT_EQ(1040, (int)expected);
+     
+     replayer_stop(&replayer);
+     history_destroy(&history);
+     msgctl(qid, IPC_RMID, NULL);
+     PASS();
+ }
+ 
+ /* Read everything back as a client would, with the spool drained into the
+  * queue as it empties; returns how many lines arrived, in order, in lines */
+ static int read_spooled(int qid, ClientSpool *spool, int *lines, int max) {
+     Message msg;
+     int count = 0;
+     int got;
+     do {
+         spool_drain(spool, qid);
+         got = 0;
+         while (count < max && msgrcv(qid, &msg, FIXED_MSG_BYTES, 0, IPC_NOWAIT) != -1) {
+             lines[count++] = atoi(msg.content);
+             got++;
+         }
+     } while (got > 0);
+     return count;
+ }
+ 
+ /* Test spooling for a client whose queue is full, under each policy */
+ void test_client_spool() {
+     TEST("Per-client backlog spools");
+     
+     SpoolPool pool;
+     ASSERT_EQ(0, spool_pool_init(&pool, NULL));
+     int qid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+     ASSERT_TRUE(qid != -1);
+     
+     /* Room for 3 fixed messages in the queue */
+     struct msqid_ds ds;
+     ASSERT_EQ(0, msgctl(qid, IPC_STAT, &ds));
+     ds.msg_qbytes = 3 * FIXED_MSG_BYTES;
+     ASSERT_EQ(0, msgctl(qid, IPC_SET, &ds));
+     
+     Message msg;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     int lines[32];
+     int expected_oldest[] = { 0, 1, 2, 14, 15, 16, 17, 18, 19 };
+     int expected_newest[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+     
+     for (int policy = SPOOL_DROP_OLDEST; policy <= SPOOL_DISCONNECT; policy++) {
+         /* Room for 6 more in the spool */
+         ClientSpool *spool = spool_create(&pool, 6 * FIXED_MSG_BYTES, policy);
+         ASSERT_TRUE(spool != NULL);
+         int sent = 0, queued = 0, dropped = 0, overflow = 0;
+         for (int i = 0; i < 20; i++) {
+             sprintf(msg.content, "%d", i);
+             switch (spool_send(spool, qid, &msg, FIXED_MSG_BYTES)) {
+                 case SPOOL_SENT: sent++; break;
+                 case SPOOL_QUEUED: queued++; break;
+                 case SPOOL_DROPPED: dropped++; break;
+                 case SPOOL_OVERFLOW: overflow++; break;
+             }
+         }
+         ASSERT_EQ(3, sent);
+         ASSERT_EQ(6, (int)atomic_load(&spool->count));
+         ASSERT_EQ(1, atomic_load(&pool.backlogged));
+         
+         if (policy == SPOOL_DISCONNECT) {
+             ASSERT_EQ(6, queued);
+             ASSERT_EQ(11, overflow);
+             spool_destroy(spool);
+             ASSERT_EQ(0, atomic_load(&pool.backlogged));
+             while (msgrcv(qid, &msg, FIXED_MSG_BYTES, 0, IPC_NOWAIT) != -1) {
+             }
+             continue;
+         }
+         
+         /* Everything kept comes out in order as the client reads */
+         int *expected = policy == SPOOL_DROP_OLDEST ? expected_oldest : expected_newest;
+         ASSERT_EQ(policy == SPOOL_DROP_OLDEST ? 17 : 6, queued);
+         ASSERT_EQ(policy == SPOOL_DROP_OLDEST ? 0 : 11, dropped);
+         ASSERT_EQ(11, (int)spool->dropped);
+         ASSERT_EQ(9, read_spooled(qid, spool, lines, 32));
+         int in_order = 1;
+         for (int i = 0; i < 9; i++) {
+             in_order &= lines[i] == expected[i];
+         }
+         ASSERT_TRUE(in_order);
+         ASSERT_EQ(0, atomic_load(&pool.backlogged));
+         
+         /* An empty spool sends straight to the queue again */
+         ASSERT_EQ(SPOOL_SENT, spool_send(spool, qid, &msg, FIXED_MSG_BYTES));
+         msgrcv(qid, &msg, FIXED_MSG_BYTES, 0, IPC_NOWAIT);
+         spool_destroy(spool);
+     }
+     
+     /* Buffers went back to the pool and were used again */
+     ASSERT_TRUE(atomic_load(&pool.counters->reused) > 0);
+     ASSERT_TRUE(atomic_load(&pool.counters->allocated) <= 17);
+     
+     /* A removed queue is reported, never spooled */
+     ClientSpool *spool = spool_create(&pool, 1024, SPOOL_DROP_OLDEST);
+     msgctl(qid, IPC_RMID, NULL);
+     ASSERT_EQ(SPOOL_GONE, spool_send(spool, qid, &msg, FIXED_MSG_BYTES));
+     spool_destroy(spool);
+     spool_pool_destroy(&pool);
+     PASS();
+ }
+ 
+ /* Test the token bucket: bursts, refill, partial grants and the idle cap */
+ void test_rate_limit() {
+     TEST("Per-client token bucket");
+ 
+     RateLimit limit = {10, 5};  /* 10/s, bursts of 5 */
+     TokenBucket bucket;
+     int64_t t = 1000000000LL;
+     ratelimit_init(&bucket, &limit, t);
+ 
+     /* A full bucket lets a burst through, then nothing */
+     ASSERT_EQ(5, ratelimit_take(&bucket, &limit, t, 5));
+     ASSERT_EQ(0, ratelimit_take(&bucket, &limit, t, 1));
+ 
+     /* One message every 100 ms; 99 ms is not quite enough */
+     ASSERT_EQ(0, ratelimit_take(&bucket, &limit, t + 99000000LL, 1));
+     ASSERT_EQ(1, ratelimit_take(&bucket, &limit, t + 100000000LL, 1));
+ 
+     /* A batch gets what is there and no more */
+     t += 100000000LL;
+     ASSERT_EQ(3, ratelimit_take(&bucket, &limit, t + 300000000LL, 8));
+     ASSERT_EQ(0, ratelimit_take(&bucket, &limit, t + 300000000LL, 8));
+ 
+     /* However long it sat idle, the bucket only refills to the burst */
+     t += 300000000LL;
+     ASSERT_EQ(5, ratelimit_take(&bucket, &limit, t + 3600LL * 1000000000LL, 100));
+ 
+     /* No rate means no limit */
+     RateLimit none = {0, 1};
+     ratelimit_init(&bucket, &none, t);
+     ASSERT_EQ(1000, ratelimit_take(&bucket, &none, t, 1000));
+     PASS();
+ }
+ 
+ /* Test that a killed process is reported by its tag, and only it */
+ void test_client_liveness() {
+     TEST("Client liveness through pidfds");
+ 
+     LivenessWatcher watcher;
+     if (liveness_init(&watcher) != 0) {
+         printf("(no pidfd support, skipped) ");
+         PASS();
+         return;
+     }
+ 
+     pid_t doomed = fork();
+     if (doomed == 0) {
+         pause();
+         _exit(0);
+     }
+     pid_t survivor = fork();
+     if (survivor == 0) {
+         pause();
+         _exit(0);
+     }
+     int doomed_fd = liveness_open(doomed);
+     int survivor_fd = liveness_open(survivor);
+     ASSERT_TRUE(doomed_fd != -1 && survivor_fd != -1);
+     ASSERT_EQ(0, liveness_add(&watcher, doomed_fd, 42));
+     ASSERT_EQ(0, liveness_add(&watcher, survivor_fd, 7));
+     ASSERT_EQ(0, liveness_exited(doomed_fd));
+ 
+     /* A wakeup alone reports nothing */
+     uint64_t tags[4];
+     liveness_wake(&watcher);
+     ASSERT_EQ(0, liveness_wait(&watcher, tags, 4));
+ 
+     kill(doomed, SIGKILL);
+     ASSERT_EQ(1, liveness_wait(&watcher, tags, 4));
+     ASSERT_EQ(42, (int)tags[0]);
+     ASSERT_EQ(1, liveness_exited(doomed_fd));
+     ASSERT_EQ(0, liveness_exited(survivor_fd));
+ 
+     /* Closing the pidfd ends the watch */
+     close(doomed_fd);
+     waitpid(doomed, NULL, 0);
+     kill(survivor, SIGKILL);
+     ASSERT_EQ(1, liveness_wait(&watcher, tags, 4));
+     ASSERT_EQ(7, (int)tags[0]);
+ 
+     /* Gone before anyone looked */
+     waitpid(survivor, NULL, 0);
+     close(survivor_fd);
+     errno = 0;
+     ASSERT_EQ(-1, liveness_open(survivor));
+     ASSERT_EQ(ESRCH, errno);
+     liveness_destroy(&watcher);
+     PASS();
+ }
+  
+ /* Test the shared statistics: histogram percentiles, typed counters and
+  * the client list a reader uses for queue depths */
+ void test_server_stats() {
+     TEST("Shared-memory server statistics");
+ 
+     key_t test_key = ftok("test_shm.key", STATS_PROJ);
+     ASSERT_TRUE(test_key != -1);
+     int shm_id;
+     ServerStats *stats = stats_create(test_key, &shm_id);
+     ASSERT_TRUE(stats != NULL);
+ 
+     /* 90 fast samples and 10 slow ones */
+     for (int i = 0; i < 90; i++) {
+         stats_record(&stats->fanout, 1000);      /* Bucket up to 1024 ns */
+     }
+     for (int i = 0; i < 10; i++) {
+         stats_record(&stats->fanout, 1000000);   /* Up to 2^20 ns */
+     }
+     ASSERT_EQ(100, (int)atomic_load(&stats->fanout.count));
+     ASSERT_EQ(1024, (int)stats_percentile(&stats->fanout, 0.5));
+     ASSERT_EQ(1024, (int)stats_percentile(&stats->fanout, 0.9));
+     ASSERT_EQ(1000000, (int)stats_percentile(&stats->fanout, 0.99));  /* Capped at the max */
+     ASSERT_EQ(0, (int)stats_percentile(&stats->log_flush, 0.5));
+ 
+     stats_count(stats->msgs_in, MSG_TYPE_CHAT, 3);
+     stats_count(stats->msgs_in, 99, 1);
+     ASSERT_EQ(3, (int)atomic_load(&stats->msgs_in[MSG_TYPE_CHAT]));
+     ASSERT_EQ(1, (int)atomic_load(&stats->msgs_in[0]));
+ 
+     /* A reader sees the listed client's queue depth from the kernel */
+     int qid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+     ASSERT_TRUE(qid != -1);
+     Message msg;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     ASSERT_EQ(0, msgsnd(qid, &msg, FIXED_MSG_BYTES, IPC_NOWAIT));
+     ASSERT_EQ(0, msgsnd(qid, &msg, FIXED_MSG_BYTES, IPC_NOWAIT));
+     stats_client_add(stats, 3, qid, getpid(), "carol");
+     stats_client_add(stats, STATS_MAX_CLIENTS + 5, qid, getpid(), "unlisted");
+ 
+     const ServerStats *reader = stats_attach(test_key);
+     ASSERT_TRUE(reader != NULL);
+     char report[4096];
+     FILE *out = fmemopen(report, sizeof(report), "w");
+     stats_report(reader, out);
+     fclose(out);
+     ASSERT_TRUE(strstr(report, "[3] carol") != NULL);
+     ASSERT_TRUE(strstr(report, ": 2 message(s)") != NULL);
+     ASSERT_TRUE(strstr(report, "(1 more not listed)") != NULL);
+ 
+     stats_client_remove(stats, 3);
+     stats_client_remove(stats, STATS_MAX_CLIENTS + 5);
+     out = fmemopen(report, sizeof(report), "w");
+     stats_report(reader, out);
+     fclose(out);
+     ASSERT_TRUE(strstr(report, "carol") == NULL);
+     ASSERT_TRUE(strstr(report, "Connected clients: 0") != NULL);
+ 
+     msgctl(qid, IPC_RMID, NULL);
+     shmdt((const void *)reader);
+     shmdt(stats);
+     shmctl(shm_id, IPC_RMID, NULL);
+     PASS();
+ }
+ 
+ /* What initialize_server() sets up for chat_core.c, minus the server's
+  * own queues; the log ring is in memory and has no writer */
+ static int core_state_init(size_t log_bytes) {
+     stats = calloc(1, sizeof(ServerStats));
+     log_buffer = malloc(sizeof(LogBuffer) + log_bytes);
+     if (stats == NULL || log_buffer == NULL || registry_init(&registry, 4, 64) != 0) {
+         return -1;
+     }
+     if (history_init(&history, 64, 1) != 0) {
+         registry_destroy(&registry);
+         return -1;
+     }
+     spool_pool_init(&spool_pool, &stats->spool);
+     log_init(log_buffer, log_bytes, 0);
+     memset(&log_writer, 0, sizeof(log_writer));
+     log_writer.log = log_buffer;
+     log_writer.batch_bytes = SIZE_MAX;
+     return 0;
+ }
+ 
+ static void core_state_destroy() {
+     while (registry.count > 0) {
+         release_client_locked(registry.active_ids[0]);
+     }
+     registry_destroy(&registry);
+     history_destroy(&history);
+     spool_pool_destroy(&spool_pool);
+     free(log_buffer);
+     free(stats);
+     log_buffer = NULL;
+     stats = NULL;
+ }
+ 
+ /* Send the server's running commentary to /dev/null; returns the real stdout */
+ static int quiet_stdout() {
+     fflush(stdout);
+     int saved = dup(STDOUT_FILENO);
+     int devnull = open("/dev/null", O_WRONLY);
+     dup2(devnull, STDOUT_FILENO);
+     close(devnull);
+     return saved;
+ }
+ 
+ static void restore_stdout(int saved) {
+     fflush(stdout);
+     dup2(saved, STDOUT_FILENO);
+     close(saved);
+ }
+ 
+ /* Join through handle_message(), as a CONNECT from this process */
+ static void connect_as(const char *username, int qid, const char *options) {
+     Message msg;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CONNECT;
+     snprintf(msg.username, MAX_USERNAME, "%s", username);
+     snprintf(msg.content, MSG_SIZE, "%d %d%s", qid, getpid(), options);
+     handle_message(&msg);
+ }
+ 
+ /* Read everything waiting on a client queue, in either format; fixed
+  * counts the messages that came in the fixed format */
+ static int read_client_queue(int qid, Message *msgs, int max, int *fixed) {
+     WireBuffer buf;
+     ssize_t size;
+     int count = 0;
+     *fixed = 0;
+     while (count < max && (size = msgrcv(qid, &buf, WIRE_MAX_BYTES, 0, IPC_NOWAIT)) != -1) {
+         int format = wire_decode(&buf, (size_t)size, &msgs[count]);
+         if (format != -1) {
+             *fixed += format == 0;
+             count++;
+         }
+     }
+     return count;
+ }
+ 
+ /* Test the server's message path in this process: joins, a chat line
+  * fanned out in each client's format without going back to its sender,
+  * and a leave */
+ void test_message_path() {
+     TEST("Server message path");
+ 
+     ASSERT_EQ(0, core_state_init(64 * 1024));
+ 
+     /* alice and bob are compact, only alice numbered; carol is fixed */
+     const char *names[3] = { "alice", "bob", "carol" };
+     const char *options[3] = { " compact seq", " compact", "" };
+     int qids[3];
+     for (int i = 0; i < 3; i++) {
+         qids[i] = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+         ASSERT_TRUE(qids[i] != -1);
+     }
+ 
+     int saved_stdout = quiet_stdout();
+     for (int i = 0; i < 3; i++) {
+         connect_as(names[i], qids[i], options[i]);
+     }
+     Message msg;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     strcpy(msg.content, "hello");
+     msg.timestamp = time(NULL);
+     handle_message(&msg);
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_DISCONNECT;
+     strcpy(msg.username, "carol");
+     sprintf(msg.content, "%d", qids[2]);
+     handle_message(&msg);
+ 
+     restore_stdout(saved_stdout);
+ 
+     ASSERT_EQ(2, registry.count);
+     ASSERT_EQ(-1, registry_find(&registry, "carol"));
+     ASSERT_EQ(5, (int)(atomic_load(&log_buffer->next_seq) - 1));  /* 3 joins, a line, a leave */
+ 
+     /* alice: welcome, two joins and carol leaving, all numbered */
+     Message got[8];
+     int fixed;
+     ASSERT_EQ(4, read_client_queue(qids[0], got, 8, &fixed));
+     ASSERT_EQ(0, fixed);
+     ASSERT_EQ(MSG_TYPE_ACK, (int)got[0].mtype);
+     ASSERT_STR_EQ("carol has left the chat.", got[3].content);
+     ASSERT_TRUE(got[3].seq > got[2].seq && got[2].seq > 0);
+ 
+     /* bob: welcome, carol joining, alice's line and carol leaving, unnumbered */
+     ASSERT_EQ(4, read_client_queue(qids[1], got, 8, &fixed));
+     ASSERT_EQ(0, fixed);
+     ASSERT_STR_EQ("alice", got[2].username);
+     ASSERT_STR_EQ("hello", got[2].content);
+     ASSERT_EQ(0, (int)got[2].seq);
+ 
+     /* carol: welcome and alice's line, in the fixed format */
+     ASSERT_EQ(2, read_client_queue(qids[2], got, 8, &fixed));
+     ASSERT_EQ(2, fixed);
+     ASSERT_STR_EQ("hello", got[1].content);
+ 
+     for (int i = 0; i < 3; i++) {
+         msgctl(qids[i], IPC_RMID, NULL);
+     }
+     core_state_destroy();
+     PASS();
+ }
+ 
+ /*
+  * Performance regression checks: test_chat_sys --perf [baseline]
+  *
+  * Each check times one hot operation and takes the best of PERF_TRIALS
+  * runs, the one least disturbed by whatever else the machine is doing. It
+  * fails if that is more than the check's tolerance over the figure in the
+  * baseline file. Baselines are scaled up by how much slower a plain CPU
+  * loop runs here than where they were recorded, so a slower machine does
+  * not fail every check; a faster one is held to the recorded figures.
+  *
+  * --perf-record [baseline] rewrites the file from this machine's numbers,
+  * keeping each check's tolerance.
+  */
+ #define PERF_BASELINE_FILE "perf_baseline.txt"
+ #define PERF_TRIALS 5
+ #define PERF_CLIENTS 16
+ #define PERF_ROUND 16               /* Broadcasts between drains; fits in a client queue */
+ #define PERF_CPU_TOLERANCE 100      /* Percent over the baseline that still passes */
+ #define PERF_SYSCALL_TOLERANCE 150   /* Wider for checks timed mostly in the kernel */
+ 
+ typedef struct {
+     const char *name;               /* Key in the baseline file */
+     const char *description;
+     double (*run)(long ops);        /* ns per op, or -1 on error */
+     long ops;
+     double baseline_ns;             /* 0 if the file has none */
+     int tolerance_pct;
+ } PerfCheck;
+ 
+ static int perf_queues[PERF_CLIENTS];
+ 
+ static double perf_elapsed_ns(const struct timespec *start) {
+     struct timespec end;
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+ }
+ 
+ /* Plain arithmetic, for comparing this machine with the baseline's */
+ static double perf_calibrate(long ops) {
+     volatile uint64_t sink;
+     uint64_t x = 1;
+     struct timespec start;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (long i = 0; i < ops; i++) {
+         x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+     }
+     sink = x;
+     (void)sink;
+     return perf_elapsed_ns(&start) / ops;
+ }
+ 
+ /* One fixed-format message into a queue and back out */
+ static double perf_queue_round_trip(long ops) {
+     int qid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+     if (qid == -1) {
+         return -1;
+     }
+     Message msg;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     strcpy(msg.content, "the quick brown fox jumps over the lazy dog");
+ 
+     struct timespec start;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (long i = 0; i < ops; i++) {
+         if (msgsnd(qid, &msg, FIXED_MSG_BYTES, 0) == -1 ||
+             msgrcv(qid, &msg, FIXED_MSG_BYTES, 0, 0) == -1) {
+             msgctl(qid, IPC_RMID, NULL);
+             return -1;
+         }
+     }
+     double ns = perf_elapsed_ns(&start) / ops;
+     msgctl(qid, IPC_RMID, NULL);
+     return ns;
+ }
+ 
+ /* add_to_log() into a shared-memory ring, with the writer keeping up */
+ static double perf_log_append(long ops) {
+     int shm_id = shmget(IPC_PRIVATE, sizeof(LogBuffer) + LOG_SIZE, IPC_CREAT | 0600);
+     if (shm_id == -1) {
+         return -1;
+     }
+     LogBuffer *ring = (LogBuffer *)shmat(shm_id, NULL, 0);
+     shmctl(shm_id, IPC_RMID, NULL);  /* Gone once detached */
+     if (ring == (void *)-1) {
+         return -1;
+     }
+     log_init(ring, LOG_SIZE, 1);
+     LogBuffer *saved = log_buffer;
+     log_buffer = ring;
+     log_writer.log = ring;
+ 
+     Message msg;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     strcpy(msg.content, "the quick brown fox jumps over the lazy dog");
+     msg.timestamp = time(NULL);
+ 
+     struct timespec start;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (long i = 0; i < ops; i++) {
+         add_to_log(&msg);
+         atomic_store(&ring->flushed, atomic_load(&ring->tail));
+     }
+     double ns = perf_elapsed_ns(&start) / ops;
+     uint64_t dropped = atomic_load(&ring->dropped);
+ 
+     log_buffer = saved;
+     log_writer.log = saved;
+     pthread_mutex_destroy(&ring->mutex);
+     shmdt(ring);
+     return dropped == 0 ? ns : -1;
+ }
+ 
+ /* broadcast_message() to PERF_CLIENTS compact clients; their queues are
+  * emptied between rounds, outside the timing */
+ static double perf_broadcast(long ops) {
+     WireBuffer buf;
+     Message msg;
+     memset(&msg, 0, sizeof(msg));
+     msg.mtype = MSG_TYPE_CHAT;
+     strcpy(msg.username, "alice");
+     strcpy(msg.content, "the quick brown fox jumps over the lazy dog");
+     msg.timestamp = time(NULL);
+ 
+     double ns = 0;
+     long done = 0;
+     while (done < ops) {
+         struct timespec start;
+         clock_gettime(CLOCK_MONOTONIC, &start);
+         for (int i = 0; i < PERF_ROUND && done < ops; i++, done++) {
+             msg.seq = (uint64_t)done + 1;
+             broadcast_message(&msg, -1);
+         }
+         ns += perf_elapsed_ns(&start);
+         for (int c = 0; c < PERF_CLIENTS; c++) {
+             while (msgrcv(perf_queues[c], &buf, WIRE_MAX_BYTES, 0, IPC_NOWAIT) != -1) {
+             }
+         }
+     }
+     return atomic_load(&stats->spool.queued) == 0 ? ns / ops : -1;
+ }
+ 
+ static double perf_best_of(double (*run)(long), long ops) {
+     double best = -1;
+     for (int t = 0; t < PERF_TRIALS; t++) {
+         double ns = run(ops);
+         if (ns < 0) {
+             return -1;
+         }
+         if (best < 0 || ns < best) {
+             best = ns;
+         }
+     }
+     return best;
+ }
+ 
+ /* Fill in baselines from "name ns_per_op tolerance_pct" lines; returns
+  * the calibration figure, 0 if there is none, or -1 without a file */
+ static double perf_load_baseline(const char *path, PerfCheck *checks, int count) {
+     FILE *file = fopen(path, "r");
+     if (file == NULL) {
+         return -1;
+     }
+     char line[256], name[64];
+     double ns, calibration = 0;
+     int tolerance;
+     while (fgets(line, sizeof(line), file) != NULL) {
+         if (line[0] == '#' || sscanf(line, "%63s %lf %d", name, &ns, &tolerance) != 3) {
+             continue;
+         }
+         if (strcmp(name, "calibration") == 0) {
+             calibration = ns;
+         }
+         for (int i = 0; i < count; i++) {
+             if (strcmp(name, checks[i].name) == 0) {
+                 checks[i].baseline_ns = ns;
+                 checks[i].tolerance_pct = tolerance;
+             }
+         }
+     }
+     fclose(file);
+     return calibration;
+ }
+ 
+ static int perf_save_baseline(const char *path, const PerfCheck *checks, int count,
+                               const double *measured, double calibration) {
+     FILE *file = fopen(path, "w");
+     if (file == NULL) {
+         perror(path);
+         return -1;
+     }
+     fprintf(file, "# test_chat_sys --perf baseline: name, ns per op (best of %d), tolerance %%\n",
+             PERF_TRIALS);
+     fprintf(file, "# Rewrite with make perf_baseline after a deliberate change\n");
+     fprintf(file, "calibration %.2f 0\n", calibration);
+     for (int i = 0; i < count; i++) {
+         fprintf(file, "%s %.1f %d\n", checks[i].name, measured[i], checks[i].tolerance_pct);
+     }
+     fclose(file);
+     return 0;
+ }
+ 
+ static int run_perf(const char *path, int record) {
+     PerfCheck checks[] = {
+         { "queue_round_trip", "Perf: queue round trip", perf_queue_round_trip, 20000, 0,
+           PERF_SYSCALL_TOLERANCE },
+         { "log_append", "Perf: shared-memory log append", perf_log_append, 100000, 0,
+           PERF_CPU_TOLERANCE },
+         { "broadcast_16", "Perf: broadcast to 16 clients", perf_broadcast, 2000, 0,
+           PERF_SYSCALL_TOLERANCE },
+     };
+     int count = (int)(sizeof(checks) / sizeof(checks[0]));
+     double measured[sizeof(checks) / sizeof(checks[0])];
+ 
+     printf("=== ChatterBox Performance Checks ===\n\n");
+     double base_calibration = perf_load_baseline(path, checks, count);
+     if (base_calibration < 0 && !record) {
+         printf("No baseline in %s; record one with --perf-record\n", path);
+         return 1;
+     }
+ 
+     /* Clients for the broadcast check join the way real ones do */
+     if (core_state_init(LOG_SIZE) != 0) {
+         printf("Could not set up the message path\n");
+         return 1;
+     }
+     int saved_stdout = quiet_stdout();
+     for (int c = 0; c < PERF_CLIENTS; c++) {
+         char username[MAX_USERNAME];
+         snprintf(username, sizeof(username), "perf%d", c);
+         perf_queues[c] = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+         connect_as(username, perf_queues[c], " compact seq");
+     }
+     restore_stdout(saved_stdout);
+ 
+     double calibration = perf_best_of(perf_calibrate, 10000000);
+     double scale = base_calibration > 0 && calibration > base_calibration
+                        ? calibration / base_calibration : 1.0;
+     printf("CPU calibration: %.2f ns/op here", calibration);
+     if (base_calibration > 0) {
+         printf(", %.2f in the baseline; limits scaled by %.2f", base_calibration, scale);
+     }
+     printf("\n");
+ 
+     for (int i = 0; i < count; i++) {
+         TEST(checks[i].description);
+         measured[i] = perf_best_of(checks[i].run, checks[i].ops);
+         if (measured[i] < 0) {
+             FAIL("could not run");
+         } else if (record) {
+             printf("%.1f ns/op ", measured[i]);
+             PASS();
+         } else if (checks[i].baseline_ns <= 0) {
+             printf("%.1f ns/op ", measured[i]);
+             FAIL("no baseline");
+         } else {
+             double limit = checks[i].baseline_ns * scale * (1 + checks[i].tolerance_pct / 100.0);
+             printf("%.1f ns/op (baseline %.1f, limit %.1f) ", measured[i],
+                    checks[i].baseline_ns, limit);
+             if (measured[i] <= limit) {
+                 PASS();
+             } else {
+                 FAIL("slower than the baseline allows");
+             }
+         }
+     }
+ 
+     for (int c = 0; c < PERF_CLIENTS; c++) {
+         msgctl(perf_queues[c], IPC_RMID, NULL);
+     }
+     core_state_destroy();
+ 
+     if (record && num_passed == num_tests) {
+         if (perf_save_baseline(path, checks, count, measured, calibration) != 0) {
+             return 1;
+         }
+         printf("\nBaseline written to %s\n", path);
+     }
+     printf("\nPerf Summary: %d of %d checks passed\n", num_passed, num_tests);
+     return (num_passed == num_tests) ? 0 : 1;
+ }
+ 
  /* Main test function */
- int main() {
+ int main(int argc, char *argv[]) {
+     if (argc > 1) {
+         int record = strcmp(argv[1], "--perf-record") == 0;
+         if (!record && strcmp(argv[1], "--perf") != 0) {
+             fprintf(stderr, "Usage: %s [--perf | --perf-record [baseline]]\n", argv[0]);
+             return 1;
+         }
+         return run_perf(argc > 2 ? argv[2] : PERF_BASELINE_FILE, record);
+     }
+ 
      printf("=== ChatterBox Chat System Tests ===\n\n");
      
      /* Run tests */
@@ -382,6 +2331,28 @@ cleanup:
      test_shared_memory();
      test_mutex_init();
      test_circular_buffer();
+     test_log_concurrent_append();
+     test_log_tailing();
+     test_log_writer();
+     test_log_group_commit();
+     test_log_formatting();
+     test_binary_log();
+     test_log_rotation();
+     test_server_receiver();
+     test_dispatch_ordering();
+     test_dispatch_urgent();
+     test_client_registry();
+     test_broadcast_ring();
+     test_wire_format();
+     test_trace_stamps();
+     test_batch_envelope();
+     test_history_replay();
+     test_sequence_resume();
+     test_client_spool();
+     test_rate_limit();
+     test_client_liveness();
+     test_server_stats();
+     test_message_path();
      
      /* Print summary */
      printf("\nTest Summary: %d of %d tests passed\n", num_passed, num_tests);